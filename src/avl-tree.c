@@ -0,0 +1,239 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+
+// Intrusive AVL tree. The nodes are embedded in the structures being indexed,
+// and the caller does the searching itself, so that the tree doesn't need to know
+// anything about keys. If update is set, it gets called on every node whose
+// subtree has changed, bottom-up, which lets callers keep augmented data
+// (e.g. the largest value in a subtree) up to date.
+
+void avl_init(avl_tree* t, avl_update_func update) {
+    t->root = NULL;
+    t->update = update;
+}
+
+static __inline int avl_height(avl_node* n) {
+    return n ? n->height : 0;
+}
+
+static void avl_recalc(avl_tree* t, avl_node* n) {
+    int hl = avl_height(n->left);
+    int hr = avl_height(n->right);
+
+    n->height = (hl > hr ? hl : hr) + 1;
+
+    if (t->update)
+        t->update(n);
+}
+
+static void avl_replace_child(avl_tree* t, avl_node* parent, avl_node* old, avl_node* new) {
+    if (!parent)
+        t->root = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+
+    if (new)
+        new->parent = parent;
+}
+
+static avl_node* avl_rotate_left(avl_tree* t, avl_node* n) {
+    avl_node* r = n->right;
+
+    avl_replace_child(t, n->parent, n, r);
+
+    n->right = r->left;
+    if (r->left)
+        r->left->parent = n;
+
+    r->left = n;
+    n->parent = r;
+
+    avl_recalc(t, n);
+    avl_recalc(t, r);
+
+    return r;
+}
+
+static avl_node* avl_rotate_right(avl_tree* t, avl_node* n) {
+    avl_node* l = n->left;
+
+    avl_replace_child(t, n->parent, n, l);
+
+    n->left = l->right;
+    if (l->right)
+        l->right->parent = n;
+
+    l->right = n;
+    n->parent = l;
+
+    avl_recalc(t, n);
+    avl_recalc(t, l);
+
+    return l;
+}
+
+// We always go all the way up to the root, as augmented data may need to change
+// even when the heights don't.
+static void avl_rebalance(avl_tree* t, avl_node* n) {
+    while (n) {
+        int balance;
+
+        avl_recalc(t, n);
+
+        balance = avl_height(n->left) - avl_height(n->right);
+
+        if (balance > 1) {
+            if (avl_height(n->left->left) < avl_height(n->left->right))
+                avl_rotate_left(t, n->left);
+
+            n = avl_rotate_right(t, n);
+        } else if (balance < -1) {
+            if (avl_height(n->right->right) < avl_height(n->right->left))
+                avl_rotate_right(t, n->right);
+
+            n = avl_rotate_left(t, n);
+        }
+
+        n = n->parent;
+    }
+}
+
+// link is the (empty) child pointer of parent which the caller's search ended on,
+// or &t->root if the tree is empty.
+void avl_insert(avl_tree* t, avl_node* n, avl_node* parent, avl_node** link) {
+    n->parent = parent;
+    n->left = n->right = NULL;
+    n->height = 1;
+
+    *link = n;
+
+    avl_rebalance(t, n);
+}
+
+void avl_remove(avl_tree* t, avl_node* n) {
+    avl_node* start;
+
+    if (n->left && n->right) {
+        avl_node* succ = n->right;
+
+        while (succ->left) {
+            succ = succ->left;
+        }
+
+        if (succ->parent == n)
+            start = succ;
+        else {
+            start = succ->parent;
+
+            start->left = succ->right;
+            if (succ->right)
+                succ->right->parent = start;
+
+            succ->right = n->right;
+            n->right->parent = succ;
+        }
+
+        succ->left = n->left;
+        n->left->parent = succ;
+
+        avl_replace_child(t, n->parent, n, succ);
+    } else {
+        start = n->parent;
+
+        avl_replace_child(t, n->parent, n, n->left ? n->left : n->right);
+    }
+
+    avl_rebalance(t, start);
+}
+
+// Call this after changing a node in a way that affects the augmented data,
+// but not its position in the tree.
+void avl_fixup(avl_tree* t, avl_node* n) {
+    if (!t->update)
+        return;
+
+    while (n) {
+        t->update(n);
+        n = n->parent;
+    }
+}
+
+avl_node* avl_first(avl_tree* t) {
+    avl_node* n = t->root;
+
+    if (!n)
+        return NULL;
+
+    while (n->left) {
+        n = n->left;
+    }
+
+    return n;
+}
+
+avl_node* avl_last(avl_tree* t) {
+    avl_node* n = t->root;
+
+    if (!n)
+        return NULL;
+
+    while (n->right) {
+        n = n->right;
+    }
+
+    return n;
+}
+
+avl_node* avl_next(avl_node* n) {
+    if (n->right) {
+        n = n->right;
+
+        while (n->left) {
+            n = n->left;
+        }
+
+        return n;
+    }
+
+    while (n->parent && n == n->parent->right) {
+        n = n->parent;
+    }
+
+    return n->parent;
+}
+
+avl_node* avl_prev(avl_node* n) {
+    if (n->left) {
+        n = n->left;
+
+        while (n->right) {
+            n = n->right;
+        }
+
+        return n;
+    }
+
+    while (n->parent && n == n->parent->left) {
+        n = n->parent;
+    }
+
+    return n->parent;
+}
@@ -2780,6 +2780,8 @@ static NTSTATUS finish_removing_device(_Requires_exclusive_lock_held_(_Curr_->tr
         ExFreePool(s);
     }
 
+    wait_for_write_queue(dev);
+
     ExFreePool(dev);
 
     if (Vcb->trim) {
@@ -80,6 +80,13 @@ uint32_t mount_clear_cache = 0;
 uint32_t mount_allow_degraded = 0;
 uint32_t mount_readonly = 0;
 uint32_t mount_no_root_dir = 0;
+uint32_t mount_alloc_clusters = 0;
+uint32_t mount_autodefrag = 0;
+uint32_t mount_read_policy = 0;
+uint32_t mount_stripe_align = 1;
+uint32_t mount_delalloc = 1;
+uint32_t mount_dirty_limit = 0;
+uint32_t mount_tree_log = 1;
 uint32_t no_pnp = 0;
 bool log_started = false;
 UNICODE_STRING log_device, log_file, registry_path;
@@ -119,8 +126,10 @@ static void init_serial(bool first_time);
 
 static NTSTATUS close_file(_In_ PFILE_OBJECT FileObject, _In_ PIRP Irp);
 static void __stdcall do_xor_basic(uint8_t* buf1, uint8_t* buf2, uint32_t len);
+static void __stdcall do_xor_multi_basic(uint8_t* dest, uint8_t** srcs, uint32_t num_srcs, uint32_t len);
 
 xor_func do_xor = do_xor_basic;
+xor_multi_func do_xor_multi = do_xor_multi_basic;
 
 typedef struct {
     KEVENT Event;
@@ -323,6 +332,70 @@ static void __stdcall do_xor_basic(uint8_t* buf1, uint8_t* buf2, uint32_t len) {
     }
 }
 
+static void __stdcall do_xor_multi_basic(uint8_t* dest, uint8_t** srcs, uint32_t num_srcs, uint32_t len) {
+    uint32_t off = 0, j;
+
+#if defined(_ARM_) || defined(_ARM64_)
+    while (len - off >= 32) {
+        uint64x2_t x1 = vld1q_u64((const uint64_t*)(dest + off));
+        uint64x2_t x2 = vld1q_u64((const uint64_t*)(dest + off + 16));
+
+        for (j = 0; j < num_srcs; j++) {
+            x1 = veorq_u64(x1, vld1q_u64((const uint64_t*)(srcs[j] + off)));
+            x2 = veorq_u64(x2, vld1q_u64((const uint64_t*)(srcs[j] + off + 16)));
+        }
+
+        vst1q_u64((uint64_t*)(dest + off), x1);
+        vst1q_u64((uint64_t*)(dest + off + 16), x2);
+
+        off += 32;
+    }
+#elif defined(_AMD64_)
+    while (len - off >= 8) {
+        uint64_t v = *(uint64_t*)(dest + off);
+
+        for (j = 0; j < num_srcs; j++) {
+            v ^= *(uint64_t*)(srcs[j] + off);
+        }
+
+        *(uint64_t*)(dest + off) = v;
+        off += 8;
+    }
+#endif
+
+    while (len - off >= 4) {
+        uint32_t v = *(uint32_t*)(dest + off);
+
+        for (j = 0; j < num_srcs; j++) {
+            v ^= *(uint32_t*)(srcs[j] + off);
+        }
+
+        *(uint32_t*)(dest + off) = v;
+        off += 4;
+    }
+
+    while (off < len) {
+        for (j = 0; j < num_srcs; j++) {
+            dest[off] ^= srcs[j][off];
+        }
+
+        off++;
+    }
+}
+
+// Adds src to the list of buffers to be XORed into dest, and does the XOR in one pass once there
+// are XOR_MULTI_MAX of them. Call with src NULL at the end to do the rest. This saves callers
+// from having to allocate an array for every source.
+void xor_multi_queue(uint8_t* dest, uint8_t** srcs, uint32_t* num_srcs, uint8_t* src, uint32_t len) {
+    if (src)
+        srcs[(*num_srcs)++] = src;
+
+    if (*num_srcs > 0 && (!src || *num_srcs == XOR_MULTI_MAX)) {
+        do_xor_multi(dest, srcs, *num_srcs, len);
+        *num_srcs = 0;
+    }
+}
+
 _Function_class_(DRIVER_UNLOAD)
 static void __stdcall DriverUnload(_In_ PDRIVER_OBJECT DriverObject) {
     UNICODE_STRING dosdevice_nameW;
@@ -597,6 +670,16 @@ static NTSTATUS __stdcall drv_flush_buffers(_In_ PDEVICE_OBJECT DeviceObject, _I
         }
 
         Status = Irp->IoStatus.Status;
+
+        if (NT_SUCCESS(Status) && Vcb->options.tree_log && !Vcb->readonly) {
+            ccb* ccb = FileObject->FsContext2;
+
+            Status = tree_log_fsync(fcb, ccb ? ccb->fileref : NULL, Irp);
+            if (!NT_SUCCESS(Status))
+                ERR("tree_log_fsync returned %08lx\n", Status);
+
+            Irp->IoStatus.Status = Status;
+        }
     }
 
 end:
@@ -1698,6 +1781,8 @@ void free_fcb(_Inout_ fcb* fcb) {
 void reap_fcb(fcb* fcb) {
     uint8_t c = fcb->hash >> 24;
 
+    free_fcb_extent_windows(fcb);
+
     if (fcb->subvol && fcb->subvol->fcbs_ptrs[c] == &fcb->list_entry) {
         if (fcb->list_entry.Flink != &fcb->subvol->fcbs && (CONTAINING_RECORD(fcb->list_entry.Flink, struct _fcb, list_entry)->hash >> 24) == c)
             fcb->subvol->fcbs_ptrs[c] = fcb->list_entry.Flink;
@@ -1749,6 +1834,8 @@ void reap_fcb(fcb* fcb) {
         ExFreePool(ext);
     }
 
+    delalloc_free_fcb(fcb);
+
     while (!IsListEmpty(&fcb->hardlinks)) {
         LIST_ENTRY* le = RemoveHeadList(&fcb->hardlinks);
         hardlink* hl = CONTAINING_RECORD(le, hardlink, list_entry);
@@ -1993,6 +2080,8 @@ void uninit(_In_ device_extension* Vcb) {
         KeWaitForSingleObject(&Vcb->scrub.finished, Executive, KernelMode, false, NULL);
     }
 
+    stop_cache_preload(Vcb);
+
     if (Vcb->running_sends != 0) {
         bool send_cancelled = false;
 
@@ -2044,6 +2133,8 @@ void uninit(_In_ device_extension* Vcb) {
     KeSetTimer(&Vcb->flush_thread_timer, time, NULL); // trigger the timer early
     KeWaitForSingleObject(&Vcb->flush_thread_finished, Executive, KernelMode, false, NULL);
 
+    free_autodefrag(Vcb);
+
     reap_fcb(Vcb->volume_fcb);
     reap_fcb(Vcb->dummy_fcb);
 
@@ -2085,9 +2176,13 @@ void uninit(_In_ device_extension* Vcb) {
         ExFreePool(r);
     }
 
+    free_chunk_maps(Vcb);
+
     while (!IsListEmpty(&Vcb->chunks)) {
         chunk* c = CONTAINING_RECORD(RemoveHeadList(&Vcb->chunks), chunk, list_entry);
 
+        add_range_lock_stats(Vcb, c);
+
         while (!IsListEmpty(&c->space)) {
             LIST_ENTRY* le2 = RemoveHeadList(&c->space);
             space* s = CONTAINING_RECORD(le2, space, list_entry);
@@ -2108,7 +2203,6 @@ void uninit(_In_ device_extension* Vcb) {
         if (c->cache)
             reap_fcb(c->cache);
 
-        ExDeleteResourceLite(&c->range_locks_lock);
         ExDeleteResourceLite(&c->partial_stripes_lock);
         ExDeleteResourceLite(&c->lock);
         ExDeleteResourceLite(&c->changed_extents_lock);
@@ -2117,6 +2211,9 @@ void uninit(_In_ device_extension* Vcb) {
         ExFreePool(c);
     }
 
+    TRACE("range locks: %I64u acquired, %I64u contended, %I64u ms spent waiting\n", Vcb->range_lock_stats.acquisitions,
+          Vcb->range_lock_stats.contentions, Vcb->range_lock_stats.wait_time / 10000);
+
     while (!IsListEmpty(&Vcb->devices)) {
         device* dev = CONTAINING_RECORD(RemoveHeadList(&Vcb->devices), device, list_entry);
 
@@ -2127,6 +2224,8 @@ void uninit(_In_ device_extension* Vcb) {
             ExFreePool(s);
         }
 
+        wait_for_write_queue(dev);
+
         ExFreePool(dev);
     }
 
@@ -2149,6 +2248,11 @@ void uninit(_In_ device_extension* Vcb) {
     ExDeleteResourceLite(&Vcb->scrub.stats_lock);
     ExDeleteResourceLite(&Vcb->send_load_lock);
 
+    free_csum_cache(Vcb);
+    free_stripe_cache(Vcb);
+    free_tree_log(Vcb);
+    free_extent_windows(Vcb);
+
     ExDeletePagedLookasideList(&Vcb->tree_data_lookaside);
     ExDeletePagedLookasideList(&Vcb->traverse_ptr_lookaside);
     ExDeletePagedLookasideList(&Vcb->batch_item_lookaside);
@@ -3310,6 +3414,7 @@ device* find_device_from_uuid(_In_ device_extension* Vcb, _In_ BTRFS_UUID* uuid)
                 dev->part_num = vc->part_num;
                 dev->num_trim_entries = 0;
                 InitializeListHead(&dev->trim_list);
+                init_write_queue(dev);
 
                 add_device_to_list(Vcb, dev);
                 Vcb->devices_loaded++;
@@ -3399,6 +3504,9 @@ void init_device(_In_ device_extension* Vcb, _Inout_ device* dev, _In_ bool get_
     dev->num_trim_entries = 0;
     dev->stats_changed = false;
     InitializeListHead(&dev->trim_list);
+    init_write_queue(dev);
+    dev->reads_in_flight = 0;
+    dev->read_latency = 0;
 
     if (!dev->readonly) {
         Status = dev_ioctl(dev->devobj, IOCTL_DISK_IS_WRITABLE, NULL, 0,
@@ -3582,6 +3690,7 @@ static NTSTATUS load_chunk_root(_In_ _Requires_lock_held_(_Curr_->tree_lock) dev
                                 // Missing device, so we keep dev->devobj as NULL
                                 RtlCopyMemory(&dev->devitem, di, min(tp.item->size, sizeof(DEV_ITEM)));
                                 InitializeListHead(&dev->trim_list);
+                                init_write_queue(dev);
 
                                 add_device_to_list(Vcb, dev);
                                 Vcb->devices_loaded++;
@@ -3681,18 +3790,17 @@ static NTSTATUS load_chunk_root(_In_ _Requires_lock_held_(_Curr_->tree_lock) dev
                 ExInitializeResourceLite(&c->lock);
                 ExInitializeResourceLite(&c->changed_extents_lock);
 
-                InitializeListHead(&c->space);
-                InitializeListHead(&c->space_size);
+                init_space_index(c);
                 InitializeListHead(&c->deleting);
                 InitializeListHead(&c->changed_extents);
 
-                InitializeListHead(&c->range_locks);
-                ExInitializeResourceLite(&c->range_locks_lock);
-                KeInitializeEvent(&c->range_locks_event, NotificationEvent, false);
+                init_range_locks(c);
 
                 InitializeListHead(&c->partial_stripes);
                 ExInitializeResourceLite(&c->partial_stripes_lock);
 
+                InitializeListHead(&c->clusters);
+
                 c->last_alloc_set = false;
 
                 c->last_stripe = 0;
@@ -3709,6 +3817,8 @@ static NTSTATUS load_chunk_root(_In_ _Requires_lock_held_(_Curr_->tree_lock) dev
             tp = next_tp;
     } while (b);
 
+    update_chunk_map(Vcb);
+
     Vcb->log_to_phys_loaded = true;
 
     if (Vcb->data_flags == 0)
@@ -4531,6 +4641,11 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     ExInitializeResourceLite(&Vcb->scrub.stats_lock);
 
     ExInitializeResourceLite(&Vcb->load_lock);
+    init_csum_cache(Vcb);
+    init_stripe_cache(Vcb);
+    init_autodefrag(Vcb);
+    init_tree_log(Vcb);
+    init_extent_windows(Vcb);
     ExAcquireResourceExclusiveLite(&Vcb->load_lock, true);
 
     ExAcquireResourceExclusiveLite(&Vcb->tree_lock, true);
@@ -4559,6 +4674,8 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
         goto exit;
     }
 
+    init_throttle(Vcb);
+
     if (pdode && RtlCompareMemory(&boot_uuid, &pdode->uuid, sizeof(BTRFS_UUID)) == sizeof(BTRFS_UUID) && boot_subvol != 0)
         Vcb->options.subvol_id = boot_subvol;
 
@@ -4594,14 +4711,12 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
 
     calculate_sector_shift(Vcb);
 
+    // superblocks written by the tree log are based on the one on disk, until we next commit
+    RtlCopyMemory(&Vcb->tree_log_sb, &Vcb->superblock, sizeof(superblock));
+
     Vcb->superblock.generation++;
     Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_MIXED_BACKREF;
 
-    if (Vcb->superblock.log_tree_addr != 0) {
-        FIXME("FIXME - replay transaction log (clearing for now)\n");
-        Vcb->superblock.log_tree_addr = 0;
-    }
-
     switch (Vcb->superblock.csum_type) {
         case CSUM_TYPE_CRC32C:
             Vcb->csum_size = sizeof(uint32_t);
@@ -4680,8 +4795,10 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     }
 
     InitializeListHead(&Vcb->chunks);
+    InitializeListHead(&Vcb->old_chunk_maps);
     InitializeListHead(&Vcb->trees);
     InitializeListHead(&Vcb->trees_hash);
+    avl_init(&Vcb->delayed_refs, NULL);
     InitializeListHead(&Vcb->all_fcbs);
     InitializeListHead(&Vcb->dirty_fcbs);
     InitializeListHead(&Vcb->dirty_filerefs);
@@ -4689,6 +4806,7 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     InitializeListHead(&Vcb->send_ops);
 
     ExInitializeFastMutex(&Vcb->trees_list_mutex);
+    ExInitializeFastMutex(&Vcb->chunk_map_mutex);
 
     InitializeListHead(&Vcb->DirNotifyList);
     InitializeListHead(&Vcb->scrub.errors);
@@ -4982,6 +5100,18 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
         goto exit;
     }
 
+    if (Vcb->superblock.log_tree_addr != 0) {
+        if (Vcb->readonly)
+            WARN("not replaying tree log on read-only volume\n");
+        else {
+            Status = replay_tree_log(Vcb, Irp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("replay_tree_log returned %08lx, mounting read-only\n", Status);
+                Vcb->readonly = true;
+            }
+        }
+    }
+
     Status = registry_mark_volume_mounted(&Vcb->superblock.uuid);
     if (!NT_SUCCESS(Status))
         WARN("registry_mark_volume_mounted returned %08lx\n", Status);
@@ -4990,6 +5120,12 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     if (!NT_SUCCESS(Status) && Status != STATUS_NOT_FOUND)
         WARN("look_for_balance_item returned %08lx\n", Status);
 
+    if (!Vcb->readonly) {
+        Status = start_cache_preload(Vcb);
+        if (!NT_SUCCESS(Status))
+            WARN("start_cache_preload returned %08lx\n", Status);
+    }
+
     Status = STATUS_SUCCESS;
 
     if (vde)
@@ -5045,10 +5181,19 @@ exit2:
             ExDeleteResourceLite(&Vcb->dirty_subvols_lock);
             ExDeleteResourceLite(&Vcb->scrub.stats_lock);
 
+            free_chunk_maps(Vcb);
+            free_csum_cache(Vcb);
+            free_stripe_cache(Vcb);
+            free_autodefrag(Vcb);
+            free_tree_log(Vcb);
+            free_extent_windows(Vcb);
+
             if (Vcb->devices.Flink) {
                 while (!IsListEmpty(&Vcb->devices)) {
                     device* dev2 = CONTAINING_RECORD(RemoveHeadList(&Vcb->devices), device, list_entry);
 
+                    wait_for_write_queue(dev2);
+
                     ExFreePool(dev2);
                 }
             }
@@ -5794,10 +5939,90 @@ NTSTATUS check_file_name_valid(_In_ PUNICODE_STRING us, _In_ bool posix, _In_ bo
     return STATUS_SUCCESS;
 }
 
+static void range_lock_update(avl_node* n) {
+    range_lock* rl = CONTAINING_RECORD(n, range_lock, tree_node);
+
+    rl->max_end = rl->start + rl->length;
+
+    if (n->left) {
+        range_lock* rl2 = CONTAINING_RECORD(n->left, range_lock, tree_node);
+
+        if (rl2->max_end > rl->max_end)
+            rl->max_end = rl2->max_end;
+    }
+
+    if (n->right) {
+        range_lock* rl2 = CONTAINING_RECORD(n->right, range_lock, tree_node);
+
+        if (rl2->max_end > rl->max_end)
+            rl->max_end = rl2->max_end;
+    }
+}
+
+void init_range_locks(_In_ chunk* c) {
+    avl_init(&c->range_locks, range_lock_update);
+    KeInitializeSpinLock(&c->range_locks_lock);
+    RtlZeroMemory(&c->range_lock_stats, sizeof(range_lock_stats));
+}
+
+// Called before a chunk is freed, so that its counters aren't lost.
+void add_range_lock_stats(_In_ device_extension* Vcb, _In_ chunk* c) {
+    Vcb->range_lock_stats.acquisitions += c->range_lock_stats.acquisitions;
+    Vcb->range_lock_stats.contentions += c->range_lock_stats.contentions;
+    Vcb->range_lock_stats.wait_time += c->range_lock_stats.wait_time;
+}
+
+// Returns a lock held by another thread which overlaps [start, end), if there is one.
+static range_lock* find_range_lock_conflict(avl_node* n, uint64_t start, uint64_t end, PETHREAD thread) {
+    while (n) {
+        range_lock* rl = CONTAINING_RECORD(n, range_lock, tree_node);
+
+        if (rl->max_end <= start)
+            return NULL;
+
+        if (n->left) {
+            range_lock* rl2 = find_range_lock_conflict(n->left, start, end, thread);
+
+            if (rl2)
+                return rl2;
+        }
+
+        if (rl->start >= end)
+            return NULL;
+
+        if (rl->start + rl->length > start && rl->thread != thread)
+            return rl;
+
+        n = n->right;
+    }
+
+    return NULL;
+}
+
+static void insert_range_lock(chunk* c, range_lock* rl) {
+    avl_node* parent = NULL;
+    avl_node** link = &c->range_locks.root;
+
+    while (*link) {
+        range_lock* rl2 = CONTAINING_RECORD(*link, range_lock, tree_node);
+
+        parent = *link;
+
+        if (rl->start < rl2->start || (rl->start == rl2->start && rl < rl2))
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+
+    avl_insert(&c->range_locks, &rl->tree_node, parent, link);
+}
+
 void chunk_lock_range(_In_ device_extension* Vcb, _In_ chunk* c, _In_ uint64_t start, _In_ uint64_t length) {
-    LIST_ENTRY* le;
-    bool locked;
     range_lock* rl;
+    range_lock_waiter wait;
+    KIRQL irql;
+    bool contended = false;
+    uint64_t wait_start = 0;
 
     rl = ExAllocateFromNPagedLookasideList(&Vcb->range_lock_lookaside);
     if (!rl) {
@@ -5808,60 +6033,98 @@ void chunk_lock_range(_In_ device_extension* Vcb, _In_ chunk* c, _In_ uint64_t s
     rl->start = start;
     rl->length = length;
     rl->thread = PsGetCurrentThread();
+    InitializeListHead(&rl->waiters);
 
     while (true) {
-        locked = false;
+        range_lock* rl2;
 
-        ExAcquireResourceExclusiveLite(&c->range_locks_lock, true);
+        KeAcquireSpinLock(&c->range_locks_lock, &irql);
 
-        le = c->range_locks.Flink;
-        while (le != &c->range_locks) {
-            range_lock* rl2 = CONTAINING_RECORD(le, range_lock, list_entry);
+        rl2 = find_range_lock_conflict(c->range_locks.root, start, start + length, rl->thread);
 
-            if (rl2->start < start + length && rl2->start + rl2->length > start && rl2->thread != PsGetCurrentThread()) {
-                locked = true;
-                break;
-            }
+        if (!rl2) {
+            insert_range_lock(c, rl);
 
-            le = le->Flink;
-        }
+            c->range_lock_stats.acquisitions++;
 
-        if (!locked) {
-            InsertTailList(&c->range_locks, &rl->list_entry);
+            if (contended) {
+                c->range_lock_stats.contentions++;
+                c->range_lock_stats.wait_time += KeQueryInterruptTime() - wait_start;
+            }
 
-            ExReleaseResourceLite(&c->range_locks_lock);
+            KeReleaseSpinLock(&c->range_locks_lock, irql);
             return;
         }
 
-        KeClearEvent(&c->range_locks_event);
+        // Wait for the lock we conflict with to be released, then try again - another
+        // lock may have been taken out on the range in the meantime.
+
+        KeInitializeEvent(&wait.event, NotificationEvent, false);
+        InsertTailList(&rl2->waiters, &wait.list_entry);
 
-        ExReleaseResourceLite(&c->range_locks_lock);
+        KeReleaseSpinLock(&c->range_locks_lock, irql);
 
-        KeWaitForSingleObject(&c->range_locks_event, UserRequest, KernelMode, false, NULL);
+        if (!contended) {
+            contended = true;
+            wait_start = KeQueryInterruptTime();
+        }
+
+        KeWaitForSingleObject(&wait.event, UserRequest, KernelMode, false, NULL);
     }
 }
 
 void chunk_unlock_range(_In_ device_extension* Vcb, _In_ chunk* c, _In_ uint64_t start, _In_ uint64_t length) {
-    LIST_ENTRY* le;
+    avl_node* n;
+    avl_node* first = NULL;
+    range_lock* rl = NULL;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&c->range_locks_lock, &irql);
+
+    // find the leftmost lock starting at start
+
+    n = c->range_locks.root;
+    while (n) {
+        range_lock* rl2 = CONTAINING_RECORD(n, range_lock, tree_node);
 
-    ExAcquireResourceExclusiveLite(&c->range_locks_lock, true);
+        if (rl2->start >= start) {
+            if (rl2->start == start)
+                first = n;
 
-    le = c->range_locks.Flink;
-    while (le != &c->range_locks) {
-        range_lock* rl = CONTAINING_RECORD(le, range_lock, list_entry);
+            n = n->left;
+        } else
+            n = n->right;
+    }
+
+    n = first;
+    while (n) {
+        range_lock* rl2 = CONTAINING_RECORD(n, range_lock, tree_node);
+
+        if (rl2->start != start)
+            break;
 
-        if (rl->start == start && rl->length == length) {
-            RemoveEntryList(&rl->list_entry);
-            ExFreeToNPagedLookasideList(&Vcb->range_lock_lookaside, rl);
+        if (rl2->length == length) {
+            rl = rl2;
             break;
         }
 
-        le = le->Flink;
+        n = avl_next(n);
+    }
+
+    if (rl) {
+        avl_remove(&c->range_locks, &rl->tree_node);
+
+        while (!IsListEmpty(&rl->waiters)) {
+            range_lock_waiter* w = CONTAINING_RECORD(RemoveHeadList(&rl->waiters), range_lock_waiter, list_entry);
+
+            KeSetEvent(&w->event, 0, false);
+        }
     }
 
-    KeSetEvent(&c->range_locks_event, 0, false);
+    KeReleaseSpinLock(&c->range_locks_lock, irql);
 
-    ExReleaseResourceLite(&c->range_locks_lock);
+    if (rl)
+        ExFreeToNPagedLookasideList(&Vcb->range_lock_lookaside, rl);
 }
 
 void log_device_error(_In_ device_extension* Vcb, _Inout_ device* dev, _In_ int error) {
@@ -5926,7 +6189,7 @@ static void init_serial(bool first_time) {
 
 #if defined(_X86_) || defined(_AMD64_)
 static void check_cpu() {
-    bool have_sse2 = false, have_sse42 = false, have_avx2 = false;
+    bool have_sse2 = false, have_ssse3 = false, have_sse42 = false, have_avx2 = false, have_gfni = false, have_avx512 = false;
 
 #ifndef _MSC_VER
     {
@@ -5936,11 +6199,15 @@ static void check_cpu() {
 
         if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
             have_sse42 = ecx & bit_SSE4_2;
+            have_ssse3 = ecx & bit_SSSE3;
             have_sse2 = edx & bit_SSE2;
         }
 
-        if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
             have_avx2 = ebx & bit_AVX2;
+            have_avx512 = ebx & bit_AVX512F;
+            have_gfni = ecx & bit_GFNI;
+        }
 
         if (have_avx2) {
             // check Windows has enabled AVX2 - Windows 10 doesn't immediately
@@ -5955,6 +6222,20 @@ static void check_cpu() {
             } else
                 have_avx2 = false;
         }
+
+        if (have_avx512) {
+            // likewise for the opmask and ZMM registers
+
+            if (have_avx2) {
+                uint32_t xcr0;
+
+                __asm__("xgetbv" : "=a" (xcr0) : "c" (0) : "edx" );
+
+                if ((xcr0 & 0xe0) != 0xe0)
+                    have_avx512 = false;
+            } else
+                have_avx512 = false;
+        }
     }
 #else
     {
@@ -5962,10 +6243,13 @@ static void check_cpu() {
 
         __cpuid(cpu_info, 1);
         have_sse42 = cpu_info[2] & (1 << 20);
+        have_ssse3 = cpu_info[2] & (1 << 9);
         have_sse2 = cpu_info[3] & (1 << 26);
 
         __cpuidex(cpu_info, 7, 0);
         have_avx2 = cpu_info[1] & (1 << 5);
+        have_avx512 = cpu_info[1] & (1 << 16);
+        have_gfni = cpu_info[2] & (1 << 8);
 
         if (have_avx2) {
             // check Windows has enabled AVX2 - Windows 10 doesn't immediately
@@ -5978,6 +6262,18 @@ static void check_cpu() {
             } else
                 have_avx2 = false;
         }
+
+        if (have_avx512) {
+            // likewise for the opmask and ZMM registers
+
+            if (have_avx2) {
+                uint32_t xcr0 = (uint32_t)_xgetbv(0);
+
+                if ((xcr0 & 0xe0) != 0xe0)
+                    have_avx512 = false;
+            } else
+                have_avx512 = false;
+        }
     }
 #endif
 
@@ -5990,16 +6286,43 @@ static void check_cpu() {
     if (have_sse2) {
         TRACE("SSE2 is supported\n");
 
-        if (!have_avx2)
+        if (!have_avx2) {
             do_xor = do_xor_sse2;
+            do_xor_multi = do_xor_multi_sse2;
+            galois_double = galois_double_sse2;
+        }
     } else
         TRACE("SSE2 is not supported\n");
 
+    if (have_ssse3) {
+        TRACE("SSSE3 is supported\n");
+
+        if (!have_avx2)
+            do_galois_mul2 = galois_mul2_ssse3;
+    } else
+        TRACE("SSSE3 is not supported\n");
+
     if (have_avx2) {
         TRACE("AVX2 is supported\n");
         do_xor = do_xor_avx2;
+        do_xor_multi = do_xor_multi_avx2;
+        galois_double = galois_double_avx2;
+        do_galois_mul2 = galois_mul2_avx2;
     } else
         TRACE("AVX2 is not supported\n");
+
+    if (have_avx512) {
+        TRACE("AVX-512 is supported\n");
+        do_xor_multi = do_xor_multi_avx512;
+    } else
+        TRACE("AVX-512 is not supported\n");
+
+    // the GFNI instructions we use are the VEX-encoded ones, so we need the OS to have enabled AVX too
+    if (have_gfni && have_avx2) {
+        TRACE("GFNI is supported\n");
+        do_galois_mul2 = galois_mul2_gfni;
+    } else
+        TRACE("GFNI is not supported\n");
 }
 #endif
 
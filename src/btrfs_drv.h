@@ -98,6 +98,50 @@
 #define COMPRESSED_EXTENT_SIZE 0x20000 // 128 KB
 
 #define READ_AHEAD_GRANULARITY COMPRESSED_EXTENT_SIZE // really ought to be a multiple of COMPRESSED_EXTENT_SIZE
+#define READ_AHEAD_MAX_WINDOW 0x800000 // 8 MB - how far read-ahead can grow on SSDs
+#define READ_AHEAD_MAX_WINDOW_HDD 0x200000 // 2 MB - and on everything else
+
+#define ALLOC_CLUSTER_SIZE 0x1000000 // 16 MB
+#define ALLOC_CLUSTER_THRESHOLD 0x100000 // 1 MB - files smaller than this don't get clusters
+
+#define CSUM_CACHE_SIZE 0x800000 // 8 MB of checksums
+
+#define STRIPE_CACHE_SIZE 0x2000000 // 32 MB of RAID5/6 stripes
+
+#define DEFRAG_EXTENT_SIZE 0x2000000 // 32 MB - default target size for defragmentation
+
+#define AUTODEFRAG_WRITE_SIZE 0x10000 // 64 KB - writes smaller than this get queued for autodefrag
+#define AUTODEFRAG_WINDOW 0x100000 // 1 MB - the range around a write that gets queued
+#define AUTODEFRAG_MAX_RANGE 0x800000 // 8 MB - queue entries don't get merged beyond this
+#define AUTODEFRAG_QUEUE_SIZE 256
+#define AUTODEFRAG_BATCH 16 // entries processed per flush
+#define AUTODEFRAG_RATE 0x1000000 // 16 MB/s
+
+#define DELALLOC_MAX 0x4000000 // 64 MB - most data we'll hold on to waiting for delayed allocation
+
+#define MAX_CSUM_SIZE (4096 - sizeof(tree_header) - sizeof(leaf_node))
+
+#define THROTTLE_TARGET_TIME 10000000 // 1 second - how long we'd like a commit to take
+#define THROTTLE_DEFAULT_BANDWIDTH 0x4000000 // 64 MB/s - what we assume until we've timed a commit
+#define THROTTLE_MIN_LIMIT 0x1000000 // 16 MB
+#define THROTTLE_MAX_LIMIT 0x40000000 // 1 GB
+#define THROTTLE_MIN_SAMPLE 0x400000 // 4 MB - commits smaller than this don't count towards the bandwidth
+#define THROTTLE_MAX_DELAY 1000000 // 100 ms
+
+#define DEDUPE_MAX_LENGTH 0x1000000 // 16 MB, as on Linux
+#define DEDUPE_CHUNK_SIZE 0x100000
+
+#define XOR_MULTI_MAX 16 // sources XORed together in one pass
+
+#define READ_POLICY_ROUND_ROBIN 0
+#define READ_POLICY_LATENCY 1
+
+#define DEVICE_MAX_WRITES 32 // writes each device can have outstanding at once
+#define WRITE_MERGE_MAX 0x40000 // 256 KB - adjacent writes from different callers get merged up to this size
+
+#define DEFER_EXTENTS_THRESHOLD 0x1000000 // 16 MB - files at least this big have their extents loaded a window at a time
+#define EXTENT_WINDOW_SIZE 0x1000000 // 16 MB of the file's extents get loaded at once
+#define EXTENT_WINDOW_CACHE_SIZE 0x1000000 // 16 MB of loaded windows, before we start dropping clean ones
 
 #ifndef IO_REPARSE_TAG_LX_SYMLINK
 
@@ -188,6 +232,20 @@ _Lock_level_order_(tree_lock, fcb_lock)
 
 struct _device_extension;
 
+typedef struct _avl_node {
+    struct _avl_node* parent;
+    struct _avl_node* left;
+    struct _avl_node* right;
+    int height;
+} avl_node;
+
+typedef void (*avl_update_func)(avl_node* n);
+
+typedef struct {
+    avl_node* root;
+    avl_update_func update;
+} avl_tree;
+
 typedef struct _fcb_nonpaged {
     FAST_MUTEX HeaderMutex;
     SECTION_OBJECT_POINTERS segment_object;
@@ -207,10 +265,20 @@ typedef struct {
     void* csum;
 
     LIST_ENTRY list_entry;
+    avl_node tree_node;
 
     EXTENT_DATA extent_data;
 } extent;
 
+typedef struct {
+    uint64_t index;
+    ULONG size;
+    struct _fcb* fcb;
+
+    LIST_ENTRY list_entry;
+    LIST_ENTRY list_entry_vcb;
+} extent_window;
+
 typedef struct {
     uint64_t parent;
     uint64_t index;
@@ -272,6 +340,10 @@ typedef struct _fcb {
     SHARE_ACCESS share_access;
     bool csum_loaded;
     LIST_ENTRY extents;
+    avl_tree extents_tree; // non-ignored extents, by offset
+    bool extents_deferred; // extents are loaded a window at a time - see extent-window.c
+    LIST_ENTRY extent_windows; // loaded windows, by index
+    LIST_ENTRY delalloc; // delalloc_ranges, by offset
     ANSI_STRING reparse_xattr;
     ANSI_STRING ea_xattr;
     ULONG ealen;
@@ -285,6 +357,10 @@ typedef struct _fcb {
     bool case_sensitive_set;
     OPLOCK oplock;
 
+    struct _chunk* cluster_chunk;
+    uint64_t cluster_address;
+    uint64_t cluster_length;
+
     LIST_ENTRY dir_children_index;
     LIST_ENTRY dir_children_hash;
     LIST_ENTRY dir_children_hash_uc;
@@ -310,6 +386,7 @@ typedef struct _fcb {
     LIST_ENTRY list_entry;
     LIST_ENTRY list_entry_all;
     LIST_ENTRY list_entry_dirty;
+    LIST_ENTRY list_entry_cluster;
 } fcb;
 
 typedef struct _file_ref {
@@ -365,6 +442,10 @@ typedef struct _ccb {
     bool lxss;
     send_info* send;
     NTSTATUS send_status;
+    uint64_t ra_last_start;
+    uint64_t ra_last_end;
+    int64_t ra_stride;
+    ULONG ra_window;
 } ccb;
 
 struct _device_extension;
@@ -484,8 +565,11 @@ typedef struct _root_cache {
 typedef struct {
     uint64_t address;
     uint64_t size;
+    uint64_t max_size; // largest entry in subtree of tree_node
     LIST_ENTRY list_entry;
     LIST_ENTRY list_entry_size;
+    avl_node tree_node;
+    avl_node tree_node_size;
 } space;
 
 typedef struct {
@@ -507,15 +591,39 @@ typedef struct {
     LIST_ENTRY list_entry;
     ULONG num_trim_entries;
     LIST_ENTRY trim_list;
+    LONG reads_in_flight;
+    LONG read_latency; // moving average, in 100ns units
+    KSPIN_LOCK write_queue_lock;
+    LIST_ENTRY write_queue; // write_data_stripes waiting to be sent, sorted by offset
+    ULONG writes_in_flight;
+    bool write_queue_running;
+    WORK_QUEUE_ITEM write_queue_work_item;
 } device;
 
+// Range locks are kept in an interval tree ordered by start, with each node
+// also storing the furthest end of anything in its subtree. Threads waiting on
+// a lock queue a range_lock_waiter on it, and get woken when it's released.
+
 typedef struct {
     uint64_t start;
     uint64_t length;
+    uint64_t max_end;
     PETHREAD thread;
-    LIST_ENTRY list_entry;
+    avl_node tree_node;
+    LIST_ENTRY waiters;
 } range_lock;
 
+typedef struct {
+    KEVENT event;
+    LIST_ENTRY list_entry;
+} range_lock_waiter;
+
+typedef struct {
+    uint64_t acquisitions;
+    uint64_t contentions;
+    uint64_t wait_time;
+} range_lock_stats;
+
 typedef struct {
     uint64_t address;
     ULONG* bmparr;
@@ -525,7 +633,7 @@ typedef struct {
     uint8_t data[1];
 } partial_stripe;
 
-typedef struct {
+typedef struct _chunk {
     CHUNK_ITEM* chunk_item;
     uint16_t size;
     uint64_t offset;
@@ -536,11 +644,13 @@ typedef struct {
     fcb* old_cache;
     LIST_ENTRY space;
     LIST_ENTRY space_size;
+    avl_tree space_tree;
+    avl_tree space_size_tree;
     LIST_ENTRY deleting;
     LIST_ENTRY changed_extents;
-    LIST_ENTRY range_locks;
-    ERESOURCE range_locks_lock;
-    KEVENT range_locks_event;
+    avl_tree range_locks;
+    KSPIN_LOCK range_locks_lock;
+    range_lock_stats range_lock_stats;
     ERESOURCE lock;
     ERESOURCE changed_extents_lock;
     bool created;
@@ -555,11 +665,35 @@ typedef struct {
     LIST_ENTRY partial_stripes;
     ERESOURCE partial_stripes_lock;
     ULONG balance_num;
+    LIST_ENTRY clusters;
 
     LIST_ENTRY list_entry;
     LIST_ENTRY list_entry_balance;
 } chunk;
 
+// Sorted snapshot of Vcb->chunks, so that get_chunk_from_address can do a binary
+// search without taking chunk_lock. It's replaced wholesale whenever a chunk is
+// added or removed; old copies are only freed once no readers are left.
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    chunk* c;
+} chunk_map_entry;
+
+typedef struct {
+    ULONG num_entries;
+    LIST_ENTRY list_entry;
+    chunk_map_entry entries[1];
+} chunk_map;
+
+#define CHUNK_MAP_READER_SLOTS 16
+
+typedef struct {
+    LONG readers;
+    uint8_t padding[60]; // keep each slot on its own cache line
+} chunk_map_reader_slot;
+
 typedef struct {
     uint64_t address;
     uint64_t size;
@@ -602,6 +736,10 @@ enum calc_thread_type {
     calc_thread_comp_zlib,
     calc_thread_comp_lzo,
     calc_thread_comp_zstd,
+    calc_thread_load_cache,
+    calc_thread_flush_fcbs,
+    calc_thread_flush_filerefs,
+    calc_thread_write_trees,
 };
 
 typedef struct {
@@ -615,6 +753,14 @@ typedef struct {
     NTSTATUS Status;
 } calc_job;
 
+typedef struct {
+    void** items;
+    uint64_t* ii_offsets;
+    ULONG count;
+    LIST_ENTRY batchlist;
+    NTSTATUS Status;
+} flush_slice;
+
 typedef struct {
     PDEVICE_OBJECT DeviceObject;
     HANDLE handle;
@@ -648,6 +794,13 @@ typedef struct {
     bool clear_cache;
     bool allow_degraded;
     bool no_root_dir;
+    bool alloc_clusters;
+    bool autodefrag;
+    uint32_t read_policy;
+    bool stripe_align;
+    bool delalloc;
+    uint32_t dirty_limit;
+    bool tree_log;
 } mount_options;
 
 #define VCB_TYPE_FS         1
@@ -676,6 +829,16 @@ typedef struct {
     KEVENT finished;
 } balance_info;
 
+typedef struct {
+    PKTHREAD thread;
+    ULONG total_chunks;
+    LONG chunks_done;
+    LONG chunks_deferred;
+    uint64_t duration; // in milliseconds
+    bool stopping;
+    KEVENT finished;
+} cache_preload_info;
+
 typedef struct {
     uint64_t address;
     uint64_t device;
@@ -776,6 +939,37 @@ typedef struct _device_extension {
     LIST_ENTRY trees_hash;
     LIST_ENTRY* trees_ptrs[256];
     FAST_MUTEX trees_list_mutex;
+    avl_tree delayed_refs;
+    bool delay_refs;
+    avl_tree csum_cache;
+    LIST_ENTRY csum_cache_list;
+    ULONG csum_cache_size;
+    ERESOURCE csum_cache_lock;
+    avl_tree stripe_cache;
+    LIST_ENTRY stripe_cache_list;
+    ERESOURCE stripe_cache_lock;
+    btrfs_stripe_cache_stats stripe_cache_stats;
+    LIST_ENTRY autodefrag_queue;
+    ULONG autodefrag_queue_length;
+    ERESOURCE autodefrag_lock;
+    btrfs_autodefrag_stats autodefrag_stats;
+    LIST_ENTRY tree_log_roots;
+    LIST_ENTRY tree_log_blocks;
+    ERESOURCE tree_log_lock;
+    bool tree_log_failed;
+    superblock tree_log_sb;
+    LIST_ENTRY extent_windows;
+    uint64_t extent_windows_size;
+    ERESOURCE extent_windows_lock;
+    uint64_t delalloc_size;
+    uint64_t dirty_bytes;
+    uint64_t dirty_limit;
+    uint64_t commit_bandwidth;
+    uint64_t commit_dirty;
+    uint64_t commit_start_time;
+    LONG flush_kicked;
+    btrfs_throttle_stats throttle_stats;
+    btrfs_readahead_stats readahead_stats;
     LIST_ENTRY all_fcbs;
     LIST_ENTRY dirty_fcbs;
     ERESOURCE dirty_fcbs_lock;
@@ -784,12 +978,18 @@ typedef struct _device_extension {
     LIST_ENTRY dirty_subvols;
     ERESOURCE dirty_subvols_lock;
     ERESOURCE chunk_lock;
+    chunk_map* volatile chunk_map;
+    LIST_ENTRY old_chunk_maps;
+    FAST_MUTEX chunk_map_mutex;
+    chunk_map_reader_slot chunk_map_readers[CHUNK_MAP_READER_SLOTS];
     HANDLE flush_thread_handle;
     KTIMER flush_thread_timer;
     KEVENT flush_thread_finished;
     drv_calc_threads calcthreads;
     balance_info balance;
     scrub_info scrub;
+    cache_preload_info cache_preload;
+    range_lock_stats range_lock_stats;
     ERESOURCE send_load_lock;
     LONG running_sends;
     LIST_ENTRY send_ops;
@@ -896,7 +1096,11 @@ typedef struct {
     PIRP Irp;
     IO_STATUS_BLOCK iosb;
     enum write_data_status status;
+    uint64_t offset;
+    ULONG length;
+    bool no_merge;
     LIST_ENTRY list_entry;
+    LIST_ENTRY list_entry_queue;
 } write_data_stripe;
 
 typedef struct _write_data_context {
@@ -1063,6 +1267,18 @@ __inline static uint32_t get_extent_data_refcount(uint8_t type, void* data) {
 #if defined(_X86_) || defined(_AMD64_)
 void __stdcall do_xor_sse2(uint8_t* buf1, uint8_t* buf2, uint32_t len);
 void __stdcall do_xor_avx2(uint8_t* buf1, uint8_t* buf2, uint32_t len);
+void __stdcall do_xor_multi_sse2(uint8_t* dest, uint8_t** srcs, uint32_t num_srcs, uint32_t len);
+void __stdcall do_xor_multi_avx2(uint8_t* dest, uint8_t** srcs, uint32_t num_srcs, uint32_t len);
+void __stdcall do_xor_multi_avx512(uint8_t* dest, uint8_t** srcs, uint32_t num_srcs, uint32_t len);
+#endif
+
+// in galois-gas.S
+#if defined(_X86_) || defined(_AMD64_)
+void __stdcall galois_double_sse2(uint8_t* data, uint32_t len);
+void __stdcall galois_double_avx2(uint8_t* data, uint32_t len);
+void __stdcall galois_mul2_ssse3(uint8_t* dest, uint8_t* src, uint8_t* tables, uint32_t len);
+void __stdcall galois_mul2_avx2(uint8_t* dest, uint8_t* src, uint8_t* tables, uint32_t len);
+void __stdcall galois_mul2_gfni(uint8_t* dest, uint8_t* src, uint8_t* tables, uint32_t len);
 #endif
 
 // in btrfs.c
@@ -1095,8 +1311,12 @@ void send_notification_fileref(_In_ file_ref* fileref, _In_ ULONG filter_match,
 void queue_notification_fcb(_In_ file_ref* fileref, _In_ ULONG filter_match, _In_ ULONG action, _In_opt_ PUNICODE_STRING stream);
 
 typedef void (__stdcall *xor_func)(uint8_t* buf1, uint8_t* buf2, uint32_t len);
+typedef void (__stdcall *xor_multi_func)(uint8_t* dest, uint8_t** srcs, uint32_t num_srcs, uint32_t len);
 
 extern xor_func do_xor;
+extern xor_multi_func do_xor_multi;
+
+void xor_multi_queue(uint8_t* dest, uint8_t** srcs, uint32_t* num_srcs, uint8_t* src, uint32_t len);
 
 #ifdef DEBUG_CHUNK_LOCKS
 #define acquire_chunk_lock(c, Vcb) { ExAcquireResourceExclusiveLite(&c->lock, true); InterlockedIncrement(&Vcb->chunk_locks_held); }
@@ -1109,6 +1329,8 @@ extern xor_func do_xor;
 void mark_fcb_dirty(_In_ fcb* fcb);
 void mark_fileref_dirty(_In_ file_ref* fileref);
 NTSTATUS delete_fileref(_In_ file_ref* fileref, _In_opt_ PFILE_OBJECT FileObject, _In_ bool make_orphan, _In_opt_ PIRP Irp, _In_ LIST_ENTRY* rollback);
+void init_range_locks(_In_ chunk* c);
+void add_range_lock_stats(_In_ device_extension* Vcb, _In_ chunk* c);
 void chunk_lock_range(_In_ device_extension* Vcb, _In_ chunk* c, _In_ uint64_t start, _In_ uint64_t length);
 void chunk_unlock_range(_In_ device_extension* Vcb, _In_ chunk* c, _In_ uint64_t start, _In_ uint64_t length);
 void init_device(_In_ device_extension* Vcb, _Inout_ device* dev, _In_ bool get_nums);
@@ -1157,6 +1379,13 @@ extern uint32_t mount_clear_cache;
 extern uint32_t mount_allow_degraded;
 extern uint32_t mount_readonly;
 extern uint32_t mount_no_root_dir;
+extern uint32_t mount_alloc_clusters;
+extern uint32_t mount_autodefrag;
+extern uint32_t mount_read_policy;
+extern uint32_t mount_stripe_align;
+extern uint32_t mount_delalloc;
+extern uint32_t mount_dirty_limit;
+extern uint32_t mount_tree_log;
 extern uint32_t no_pnp;
 
 #ifndef __GNUC__
@@ -1230,11 +1459,21 @@ typedef struct {
     extent* ext;
 } rollback_extent;
 
+typedef struct {
+    fcb* fcb;
+    uint64_t start;
+    ULONG length;
+    LIST_ENTRY list_entry;
+    uint8_t data[1];
+} delalloc_range;
+
 enum rollback_type {
     ROLLBACK_INSERT_EXTENT,
     ROLLBACK_DELETE_EXTENT,
     ROLLBACK_ADD_SPACE,
-    ROLLBACK_SUBTRACT_SPACE
+    ROLLBACK_SUBTRACT_SPACE,
+    ROLLBACK_INSERT_DELALLOC,
+    ROLLBACK_DELETE_DELALLOC
 };
 
 typedef struct {
@@ -1313,12 +1552,18 @@ NTSTATUS truncate_file(fcb* fcb, uint64_t end, PIRP Irp, LIST_ENTRY* rollback) _
 NTSTATUS extend_file(fcb* fcb, file_ref* fileref, uint64_t end, bool prealloc, PIRP Irp, LIST_ENTRY* rollback) __attribute__((nonnull(1,6)));
 NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, uint64_t end_data, PIRP Irp, LIST_ENTRY* rollback) __attribute__((nonnull(1,2,6)));
 chunk* get_chunk_from_address(device_extension* Vcb, uint64_t address) __attribute__((nonnull(1)));
+void update_chunk_map(device_extension* Vcb) __attribute__((nonnull(1)));
+void free_chunk_maps(device_extension* Vcb) __attribute__((nonnull(1)));
 NTSTATUS alloc_chunk(device_extension* Vcb, uint64_t flags, chunk** pc, bool full_size) __attribute__((nonnull(1,3)));
 NTSTATUS write_data(_In_ device_extension* Vcb, _In_ uint64_t address, _In_reads_bytes_(length) void* data, _In_ uint32_t length, _In_ write_data_context* wtc,
                     _In_opt_ PIRP Irp, _In_opt_ chunk* c, _In_ bool file_write, _In_ uint64_t irp_offset, _In_ ULONG priority) __attribute__((nonnull(1,3,5)));
 NTSTATUS write_data_complete(device_extension* Vcb, uint64_t address, void* data, uint32_t length, PIRP Irp, chunk* c, bool file_write,
                              uint64_t irp_offset, ULONG priority) __attribute__((nonnull(1,3)));
 void free_write_data_stripes(write_data_context* wtc) __attribute__((nonnull(1)));
+void init_write_queue(device* dev) __attribute__((nonnull(1)));
+void wait_for_write_queue(device* dev) __attribute__((nonnull(1)));
+void submit_write(write_data_stripe* stripe) __attribute__((nonnull(1)));
+void release_alloc_clusters(device_extension* Vcb) __attribute__((nonnull(1)));
 
 _Dispatch_type_(IRP_MJ_WRITE)
 _Function_class_(DRIVER_DISPATCH)
@@ -1336,6 +1581,9 @@ void get_raid56_lock_range(chunk* c, uint64_t address, uint64_t length, uint64_t
 NTSTATUS add_extent_to_fcb(_In_ fcb* fcb, _In_ uint64_t offset, _In_reads_bytes_(edsize) EXTENT_DATA* ed, _In_ uint16_t edsize,
                            _In_ bool unique, _In_opt_ _When_(return >= 0, __drv_aliasesMem) void* csum, _In_ LIST_ENTRY* rollback) __attribute__((nonnull(1,3,7)));
 void add_extent(_In_ fcb* fcb, _In_ LIST_ENTRY* prevextle, _In_ __drv_aliasesMem extent* newext) __attribute__((nonnull(1,2,3)));
+void insert_extent_index(fcb* fcb, extent* ext) __attribute__((nonnull(1,2)));
+void remove_extent_index(fcb* fcb, extent* ext) __attribute__((nonnull(1,2)));
+LIST_ENTRY* find_extent_index(fcb* fcb, uint64_t offset) __attribute__((nonnull(1)));
 
 // in dirctrl.c
 
@@ -1408,6 +1656,9 @@ NTSTATUS open_fileref(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusiv
 NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lock_held_(_Curr_->fcb_lock) device_extension* Vcb,
                   root* subvol, uint64_t inode, uint8_t type, PANSI_STRING utf8, bool always_add_hl, fcb* parent, fcb** pfcb, POOL_TYPE pooltype, PIRP Irp);
 NTSTATUS load_csum(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, void* csum, uint64_t start, uint64_t length, PIRP Irp);
+NTSTATUS load_extent_item(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, traverse_ptr* tp, LIST_ENTRY* next,
+                          POOL_TYPE pooltype, PIRP Irp);
+NTSTATUS load_extent_csum(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, extent* ext, PIRP Irp);
 NTSTATUS load_dir_children(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, bool ignore_size, PIRP Irp);
 NTSTATUS add_dir_child(fcb* fcb, uint64_t inode, bool subvol, PANSI_STRING utf8, PUNICODE_STRING name, uint8_t type, dir_child** pdc);
 NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb,
@@ -1447,6 +1698,11 @@ NTSTATUS insert_tree_item_batch(LIST_ENTRY* batchlist, device_extension* Vcb, ro
 NTSTATUS flush_partial_stripe(device_extension* Vcb, chunk* c, partial_stripe* ps);
 NTSTATUS update_dev_item(device_extension* Vcb, device* device, PIRP Irp);
 void calc_tree_checksum(device_extension* Vcb, tree_header* th);
+void flush_fcb_slice(flush_slice* fs);
+void flush_fileref_slice(flush_slice* fs);
+void serialize_tree(device_extension* Vcb, tree* t, uint8_t* data);
+void flush_disk_caches(device_extension* Vcb);
+NTSTATUS write_superblocks2(device_extension* Vcb, superblock* sb);
 
 // in read.c
 
@@ -1466,6 +1722,8 @@ void get_tree_checksum(device_extension* Vcb, tree_header* th, void* csum);
 bool check_tree_checksum(device_extension* Vcb, tree_header* th);
 void get_sector_csum(device_extension* Vcb, void* buf, void* csum);
 bool check_sector_csum(device_extension* Vcb, void* buf, void* csum);
+void readahead_read_done(PFILE_OBJECT FileObject, PLARGE_INTEGER offset, ULONG length);
+NTSTATUS get_readahead_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen);
 
 // in pnp.c
 
@@ -1489,6 +1747,15 @@ void space_list_subtract(chunk* c, uint64_t address, uint64_t length, LIST_ENTRY
 void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address, uint64_t length, chunk* c, LIST_ENTRY* rollback);
 void space_list_merge(LIST_ENTRY* spacelist, LIST_ENTRY* spacelist_size, LIST_ENTRY* deleting);
 NTSTATUS load_stored_free_space_cache(device_extension* Vcb, chunk* c, bool load_only, PIRP Irp);
+void init_space_index(chunk* c);
+space* find_space_floor(chunk* c, uint64_t address);
+space* find_space_best_fit(chunk* c, uint64_t length);
+space* find_space_first_fit(chunk* c, uint64_t length);
+NTSTATUS preload_cache_chunk(device_extension* Vcb, uint64_t address, bool wait);
+NTSTATUS start_cache_preload(device_extension* Vcb);
+void stop_cache_preload(device_extension* Vcb);
+NTSTATUS get_cache_preload_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen);
+void add_rollback_space(LIST_ENTRY* rollback, bool add, LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address, uint64_t length, chunk* c);
 
 // in extent-tree.c
 NTSTATUS increase_extent_refcount_data(device_extension* Vcb, uint64_t address, uint64_t size, uint64_t root, uint64_t inode, uint64_t offset, uint32_t refcount, PIRP Irp);
@@ -1508,6 +1775,78 @@ uint32_t find_extent_shared_data_refcount(device_extension* Vcb, uint64_t addres
 NTSTATUS decrease_extent_refcount(device_extension* Vcb, uint64_t address, uint64_t size, uint8_t type, void* data, KEY* firstitem,
                                   uint8_t level, uint64_t parent, bool superseded, PIRP Irp);
 uint64_t get_extent_data_ref_hash2(uint64_t root, uint64_t objid, uint64_t offset);
+void start_delayed_refs(device_extension* Vcb);
+NTSTATUS run_delayed_refs(device_extension* Vcb, PIRP Irp);
+NTSTATUS run_delayed_refs_address(device_extension* Vcb, uint64_t address, PIRP Irp);
+void clear_delayed_refs(device_extension* Vcb);
+
+// in avl-tree.c
+void avl_init(avl_tree* t, avl_update_func update);
+void avl_insert(avl_tree* t, avl_node* n, avl_node* parent, avl_node** link);
+void avl_remove(avl_tree* t, avl_node* n);
+void avl_fixup(avl_tree* t, avl_node* n);
+avl_node* avl_first(avl_tree* t);
+avl_node* avl_last(avl_tree* t);
+avl_node* avl_next(avl_node* n);
+avl_node* avl_prev(avl_node* n);
+
+// in csum-cache.c
+void init_csum_cache(device_extension* Vcb);
+void free_csum_cache(device_extension* Vcb);
+uint64_t csum_cache_lookup(device_extension* Vcb, void* csum, uint64_t start, uint64_t length);
+void csum_cache_add_leaf(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, tree* t);
+void csum_cache_invalidate(device_extension* Vcb, uint64_t address, uint64_t length);
+
+// in stripe-cache.c
+void init_stripe_cache(device_extension* Vcb);
+void free_stripe_cache(device_extension* Vcb);
+bool stripe_cache_lookup(device_extension* Vcb, uint64_t address, uint8_t* data, ULONG length, uint8_t* parity, ULONG parity_length);
+void stripe_cache_store(device_extension* Vcb, uint64_t address, uint8_t* data, ULONG length, uint8_t* parity, ULONG parity_length);
+void stripe_cache_invalidate(device_extension* Vcb, uint64_t address, uint64_t length);
+NTSTATUS get_stripe_cache_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen);
+
+// in defrag.c
+NTSTATUS defrag_fcb(fcb* fcb, uint64_t start, uint64_t end, uint64_t extent_size, uint32_t max_rate, uint32_t flags, uint64_t* written, PIRP Irp);
+NTSTATUS defrag_file(device_extension* Vcb, PFILE_OBJECT FileObject, void* data, ULONG length, PIRP Irp);
+void init_autodefrag(device_extension* Vcb);
+void free_autodefrag(device_extension* Vcb);
+void autodefrag_add(fcb* fcb, uint64_t start, uint64_t end);
+void do_autodefrag(device_extension* Vcb);
+NTSTATUS get_autodefrag_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen);
+
+// in delalloc.c
+NTSTATUS delalloc_add(fcb* fcb, uint64_t start, uint64_t end, uint8_t* data, PIRP Irp, bool* added, LIST_ENTRY* rollback);
+NTSTATUS delalloc_drop(fcb* fcb, uint64_t start, uint64_t end, LIST_ENTRY* rollback);
+void delalloc_read(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length);
+NTSTATUS delalloc_flush_fcb(fcb* fcb, PIRP Irp, LIST_ENTRY* rollback);
+NTSTATUS delalloc_flush(fcb* fcb, PIRP Irp);
+void delalloc_free_fcb(fcb* fcb);
+void delalloc_rollback(delalloc_range* dr, bool inserted);
+
+// in throttle.c
+void init_throttle(device_extension* Vcb);
+void throttle_dirty(device_extension* Vcb, uint64_t length);
+void throttle_write(device_extension* Vcb, ULONG length);
+void throttle_commit_start(device_extension* Vcb);
+void throttle_commit_end(device_extension* Vcb);
+NTSTATUS get_throttle_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen);
+
+// in treelog.c
+void init_tree_log(device_extension* Vcb);
+void free_tree_log(device_extension* Vcb);
+void drop_tree_log(device_extension* Vcb);
+NTSTATUS tree_log_fsync(fcb* fcb, file_ref* fileref, PIRP Irp);
+NTSTATUS replay_tree_log(device_extension* Vcb, PIRP Irp);
+
+// in extent-window.c
+void init_extent_windows(device_extension* Vcb);
+void free_extent_windows(device_extension* Vcb);
+bool fcb_extents_loaded(fcb* fcb, uint64_t start, uint64_t length);
+NTSTATUS load_fcb_extents(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, uint64_t start, uint64_t length, PIRP Irp);
+NTSTATUS load_fcb_extents_tail(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, PIRP Irp);
+NTSTATUS acquire_fcb_extents(fcb* fcb, uint64_t start, uint64_t length, bool wait, PIRP Irp);
+void free_fcb_extent_windows(fcb* fcb);
+void trim_extent_windows(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb);
 
 // in worker-thread.c
 NTSTATUS do_read_job(PIRP Irp);
@@ -1531,8 +1870,15 @@ NTSTATUS lzo_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t
 NTSTATUS zstd_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, uint32_t level, unsigned int* space_left);
 
 // in galois.c
-void galois_double(uint8_t* data, uint32_t len);
+typedef void (__stdcall *galois_double_func)(uint8_t* data, uint32_t len);
+typedef void (__stdcall *galois_mul2_func)(uint8_t* dest, uint8_t* src, uint8_t* tables, uint32_t len);
+
+extern galois_double_func galois_double;
+extern galois_mul2_func do_galois_mul2;
+
 void galois_divpower(uint8_t* data, uint8_t div, uint32_t readlen);
+void galois_mul2(uint8_t* dest, uint8_t* src, uint8_t a, uint8_t b, uint32_t len);
+void galois_recover2(uint8_t* p, uint8_t* q, uint8_t* pxy, uint8_t* qxy, uint16_t x, uint16_t y, uint32_t len);
 uint8_t gpow2(uint8_t e);
 uint8_t gmul(uint8_t a, uint8_t b);
 uint8_t gdiv(uint8_t a, uint8_t b);
@@ -38,6 +38,13 @@
 #define FSCTL_BTRFS_RESIZE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x848, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
 #define IOCTL_BTRFS_UNLOAD CTL_CODE(FILE_DEVICE_UNKNOWN, 0x849, METHOD_NEITHER, FILE_ANY_ACCESS)
 #define FSCTL_BTRFS_GET_CSUM_INFO CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84a, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define FSCTL_BTRFS_DEFRAGMENT CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84b, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_AUTODEFRAG_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84c, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_DEDUPE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84d, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_READAHEAD_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84e, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_STRIPE_CACHE_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84f, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_THROTTLE_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x850, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_CACHE_PRELOAD_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x851, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
 typedef struct {
     uint64_t subvol;
@@ -287,3 +294,85 @@ typedef struct {
     uint64_t num_sectors;
     uint8_t data[1];
 } btrfs_csum_info;
+
+#define BTRFS_DEFRAG_COMPRESS       0x1
+#define BTRFS_DEFRAG_SKIP_SHARED    0x2
+
+typedef struct {
+    uint64_t start;
+    uint64_t length; // 0 means to the end of the file
+    uint64_t extent_size; // extents smaller than this get rewritten; 0 means the default
+    uint32_t max_rate; // in bytes per second; 0 means no limit
+    uint32_t flags;
+} btrfs_defrag;
+
+typedef struct {
+    uint64_t queued;
+    uint64_t merged;
+    uint64_t dropped;
+    uint64_t processed;
+    uint64_t bytes_rewritten;
+    uint32_t queue_length;
+} btrfs_autodefrag_stats;
+
+typedef struct {
+    uint64_t sequential_reads;
+    uint64_t strided_reads;
+    uint64_t random_reads;
+    uint64_t window_increases;
+    uint64_t window_resets;
+    uint64_t readahead_bytes; // read from disk by the Cache Manager's read-ahead
+    uint64_t hit_bytes; // read by applications in a pattern we were reading ahead for
+    uint64_t wasted_bytes; // estimate of how much read-ahead was thrown away when a pattern stopped
+} btrfs_readahead_stats;
+
+typedef struct {
+    uint64_t hits; // partial stripe flushes that didn't need to read anything from disk
+    uint64_t misses; // partial stripe flushes that had to do a read-modify-write
+    uint64_t bytes_not_read;
+    uint64_t evictions;
+    uint64_t invalidations;
+    uint64_t size;
+    uint32_t entries;
+} btrfs_stripe_cache_stats;
+
+typedef struct {
+    uint64_t dirty_bytes; // written since the last commit
+    uint64_t dirty_limit; // where writers start getting held up
+    uint64_t bandwidth; // in bytes per second, as measured from recent commits
+    uint64_t commits;
+    uint64_t early_commits; // commits started because we got to the dirty limit
+    uint64_t throttled_writes;
+    uint64_t throttle_time; // total time writers have been held up for, in 100ns units
+    uint64_t last_commit_time; // in 100ns units
+    uint64_t max_commit_time; // in 100ns units
+} btrfs_throttle_stats;
+
+typedef struct {
+    uint32_t total_chunks; // chunks whose free space wasn't already loaded at mount
+    uint32_t chunks_done;
+    uint32_t chunks_deferred; // chunks the calc threads couldn't lock, so got done afterwards
+    uint8_t running;
+    uint64_t duration; // in milliseconds, once finished
+} btrfs_cache_preload_stats;
+
+#define BTRFS_DEDUPE_SAME       0
+#define BTRFS_DEDUPE_DIFFERS    1
+
+typedef struct {
+    HANDLE source;
+    uint64_t source_offset;
+    uint64_t target_offset;
+    uint64_t length; // at most 16 MB gets done at a time
+    uint64_t bytes_deduped; // out
+    uint32_t status; // out
+} btrfs_dedupe;
+
+typedef struct {
+    void* POINTER_32 source;
+    uint64_t source_offset;
+    uint64_t target_offset;
+    uint64_t length;
+    uint64_t bytes_deduped;
+    uint32_t status;
+} btrfs_dedupe32;
@@ -59,10 +59,16 @@ static void __stdcall release_from_lazy_write(PVOID Context) {
 static BOOLEAN __stdcall acquire_for_read_ahead(PVOID Context, BOOLEAN Wait) {
     PFILE_OBJECT FileObject = Context;
     fcb* fcb = FileObject->FsContext;
+    ccb* ccb = FileObject->FsContext2;
 
     TRACE("(%p, %u)\n", Context, Wait);
 
-    if (!ExAcquireResourceSharedLite(fcb->Header.Resource, Wait))
+    // Read-ahead carries on from the end of the last read on this handle, and read_file can't load
+    // any windows of extents there while we only hold the fcb shared, so load them now if need be.
+    if (fcb->extents_deferred && ccb) {
+        if (!NT_SUCCESS(acquire_fcb_extents(fcb, ccb->ra_last_end, 2 * max(ccb->ra_window, READ_AHEAD_GRANULARITY), Wait, NULL)))
+            return false;
+    } else if (!ExAcquireResourceSharedLite(fcb->Header.Resource, Wait))
         return false;
 
     IoSetTopLevelIrp((PIRP)FSRTL_CACHE_TOP_LEVEL_IRP);
@@ -43,6 +43,22 @@ void calc_thread_main(device_extension* Vcb, calc_job* cj) {
             }
 
             cj2 = CONTAINING_RECORD(Vcb->calcthreads.job_list.Flink, calc_job, list_entry);
+
+            // preloading the free space cache is done in the background, so let anything queued after it go first
+            if (cj2->type == calc_thread_load_cache) {
+                LIST_ENTRY* le = cj2->list_entry.Flink;
+
+                while (le != &Vcb->calcthreads.job_list) {
+                    calc_job* cj3 = CONTAINING_RECORD(le, calc_job, list_entry);
+
+                    if (cj3->type != calc_thread_load_cache) {
+                        cj2 = cj3;
+                        break;
+                    }
+
+                    le = le->Flink;
+                }
+            }
         }
 
         src = cj2->in;
@@ -57,6 +73,21 @@ void calc_thread_main(device_extension* Vcb, calc_job* cj) {
                 cj2->out = (uint8_t*)cj2->out + Vcb->csum_size;
             break;
 
+            case calc_thread_load_cache:
+                cj2->in = (uint8_t*)cj2->in + sizeof(uint64_t);
+                cj2->out = (uint8_t*)cj2->out + sizeof(NTSTATUS);
+            break;
+
+            case calc_thread_flush_fcbs:
+            case calc_thread_flush_filerefs:
+                cj2->in = (flush_slice*)cj2->in + 1;
+            break;
+
+            case calc_thread_write_trees:
+                cj2->in = (tree**)cj2->in + 1;
+                cj2->out = (tree_write**)cj2->out + 1;
+            break;
+
             default:
                 break;
         }
@@ -128,6 +159,22 @@ void calc_thread_main(device_extension* Vcb, calc_job* cj) {
                 if (!NT_SUCCESS(cj2->Status))
                     ERR("zstd_compress returned %08lx\n", cj2->Status);
             break;
+
+            case calc_thread_load_cache:
+                *(NTSTATUS*)dest = preload_cache_chunk(Vcb, *(uint64_t*)src, false);
+            break;
+
+            case calc_thread_flush_fcbs:
+                flush_fcb_slice((flush_slice*)src);
+            break;
+
+            case calc_thread_flush_filerefs:
+                flush_fileref_slice((flush_slice*)src);
+            break;
+
+            case calc_thread_write_trees:
+                serialize_tree(Vcb, *(tree**)src, (*(tree_write**)dest)->data);
+            break;
         }
 
         if (InterlockedDecrement(&cj2->left) == 0)
@@ -143,6 +143,9 @@ fcb* create_fcb(device_extension* Vcb, POOL_TYPE pool_type) {
     FsRtlInitializeOplock(fcb_oplock(fcb));
 
     InitializeListHead(&fcb->extents);
+    avl_init(&fcb->extents_tree, NULL);
+    InitializeListHead(&fcb->extent_windows);
+    InitializeListHead(&fcb->delalloc);
     InitializeListHead(&fcb->hardlinks);
     InitializeListHead(&fcb->xattrs);
 
@@ -442,13 +445,14 @@ cleanup:
     return Status;
 }
 
-NTSTATUS load_csum(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, void* csum, uint64_t start, uint64_t length, PIRP Irp) {
+static NTSTATUS load_csum_from_tree(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, void* csum, uint64_t start, uint64_t length, PIRP Irp) {
     NTSTATUS Status;
     KEY searchkey;
     traverse_ptr tp, next_tp;
     uint64_t i, j;
     bool b;
     void* ptr = csum;
+    tree* last_tree = NULL;
 
     searchkey.obj_id = EXTENT_CSUM_ID;
     searchkey.obj_type = TYPE_EXTENT_CSUM;
@@ -462,6 +466,11 @@ NTSTATUS load_csum(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb
 
     i = 0;
     do {
+        if (tp.tree != last_tree) {
+            csum_cache_add_leaf(Vcb, tp.tree);
+            last_tree = tp.tree;
+        }
+
         if (tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type == searchkey.obj_type) {
             ULONG readlen;
 
@@ -499,6 +508,17 @@ NTSTATUS load_csum(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb
     return STATUS_SUCCESS;
 }
 
+NTSTATUS load_csum(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, void* csum, uint64_t start, uint64_t length, PIRP Irp) {
+    uint64_t i;
+
+    i = csum_cache_lookup(Vcb, csum, start, length);
+
+    if (i == length)
+        return STATUS_SUCCESS;
+
+    return load_csum_from_tree(Vcb, (uint8_t*)csum + (i * Vcb->csum_size), start + (i << Vcb->sector_shift), length - i, Irp);
+}
+
 NTSTATUS load_dir_children(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, bool ignore_size, PIRP Irp) {
     KEY searchkey;
     traverse_ptr tp, next_tp;
@@ -695,13 +715,62 @@ cont:
     return STATUS_SUCCESS;
 }
 
+// Adds the EXTENT_DATA item at tp to fcb->extents, before next.
+NTSTATUS load_extent_item(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, traverse_ptr* tp, LIST_ENTRY* next,
+                          POOL_TYPE pooltype, PIRP Irp) {
+    EXTENT_DATA* ed = (EXTENT_DATA*)tp->item->data;
+    extent* ext;
+    bool unique = false;
+
+    if (tp->item->size < sizeof(EXTENT_DATA)) {
+        ERR("(%I64x,%x,%I64x) was %u bytes, expected at least %Iu\n", tp->item->key.obj_id, tp->item->key.obj_type, tp->item->key.offset,
+            tp->item->size, sizeof(EXTENT_DATA));
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    if (ed->type == EXTENT_TYPE_REGULAR || ed->type == EXTENT_TYPE_PREALLOC) {
+        EXTENT_DATA2* ed2 = (EXTENT_DATA2*)&ed->data[0];
+
+        if (tp->item->size < sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2)) {
+            ERR("(%I64x,%x,%I64x) was %u bytes, expected at least %Iu\n", tp->item->key.obj_id, tp->item->key.obj_type, tp->item->key.offset,
+                tp->item->size, sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2));
+            return STATUS_INTERNAL_ERROR;
+        }
+
+        if (ed2->address == 0 || ed2->size == 0) // sparse
+            return STATUS_SUCCESS;
+
+        if (ed2->size != 0 && is_tree_unique(Vcb, tp->tree, Irp))
+            unique = is_extent_unique(Vcb, ed2->address, ed2->size, Irp);
+    }
+
+    ext = ExAllocatePoolWithTag(pooltype, offsetof(extent, extent_data) + tp->item->size, ALLOC_TAG);
+    if (!ext) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ext->offset = tp->item->key.offset;
+    RtlCopyMemory(&ext->extent_data, tp->item->data, tp->item->size);
+    ext->datalen = tp->item->size;
+    ext->unique = unique;
+    ext->ignore = false;
+    ext->inserted = false;
+    ext->csum = NULL;
+
+    InsertTailList(next, &ext->list_entry);
+    insert_extent_index(fcb, ext);
+
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lock_held_(_Curr_->fcb_lock) device_extension* Vcb,
                   root* subvol, uint64_t inode, uint8_t type, PANSI_STRING utf8, bool always_add_hl, fcb* parent, fcb** pfcb, POOL_TYPE pooltype, PIRP Irp) {
     KEY searchkey;
     traverse_ptr tp, next_tp;
     NTSTATUS Status;
     fcb *fcb, *deleted_fcb = NULL;
-    bool atts_set = false, sd_set = false, no_data;
+    bool atts_set = false, sd_set = false, no_data, defer_extents;
     LIST_ENTRY* lastle = NULL;
     EXTENT_DATA* ed = NULL;
     uint64_t fcbs_version = 0;
@@ -813,6 +882,9 @@ NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lo
 
     no_data = fcb->inode_item.st_size == 0 || (fcb->type != BTRFS_TYPE_FILE && fcb->type != BTRFS_TYPE_SYMLINK);
 
+    // the free space cache gets read through read_file, so always load that
+    defer_extents = fcb->type == BTRFS_TYPE_FILE && subvol != Vcb->root_root && fcb->inode_item.st_size >= DEFER_EXTENTS_THRESHOLD;
+
     while (find_next_item(Vcb, &tp, &next_tp, false, Irp)) {
         tp = next_tp;
 
@@ -1169,53 +1241,20 @@ NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lo
                 di = (DIR_ITEM*)&di->name[di->m + di->n];
             } while (true);
         } else if (tp.item->key.obj_type == TYPE_EXTENT_DATA) {
-            extent* ext;
-            bool unique = false;
-
-            ed = (EXTENT_DATA*)tp.item->data;
-
-            if (tp.item->size < sizeof(EXTENT_DATA)) {
-                ERR("(%I64x,%x,%I64x) was %u bytes, expected at least %Iu\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset,
-                    tp.item->size, sizeof(EXTENT_DATA));
-
-                reap_fcb(fcb);
-                return STATUS_INTERNAL_ERROR;
+            // reparse points get read through read_file, so we need their extents
+            if (defer_extents && !(fcb->atts & FILE_ATTRIBUTE_REPARSE_POINT)) {
+                fcb->extents_deferred = true;
+                break;
             }
 
-            if (ed->type == EXTENT_TYPE_REGULAR || ed->type == EXTENT_TYPE_PREALLOC) {
-                EXTENT_DATA2* ed2 = (EXTENT_DATA2*)&ed->data[0];
-
-                if (tp.item->size < sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2)) {
-                    ERR("(%I64x,%x,%I64x) was %u bytes, expected at least %Iu\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset,
-                        tp.item->size, sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2));
-
-                    reap_fcb(fcb);
-                    return STATUS_INTERNAL_ERROR;
-                }
-
-                if (ed2->address == 0 || ed2->size == 0) // sparse
-                    continue;
-
-                if (ed2->size != 0 && is_tree_unique(Vcb, tp.tree, Irp))
-                    unique = is_extent_unique(Vcb, ed2->address, ed2->size, Irp);
-            }
+            ed = (EXTENT_DATA*)tp.item->data;
 
-            ext = ExAllocatePoolWithTag(pooltype, offsetof(extent, extent_data) + tp.item->size, ALLOC_TAG);
-            if (!ext) {
-                ERR("out of memory\n");
+            Status = load_extent_item(Vcb, fcb, &tp, &fcb->extents, pooltype, Irp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("load_extent_item returned %08lx\n", Status);
                 reap_fcb(fcb);
-                return STATUS_INSUFFICIENT_RESOURCES;
+                return Status;
             }
-
-            ext->offset = tp.item->key.offset;
-            RtlCopyMemory(&ext->extent_data, tp.item->data, tp.item->size);
-            ext->datalen = tp.item->size;
-            ext->unique = unique;
-            ext->ignore = false;
-            ext->inserted = false;
-            ext->csum = NULL;
-
-            InsertTailList(&fcb->extents, &ext->list_entry);
         }
     }
 
@@ -3522,10 +3561,42 @@ static NTSTATUS get_reparse_block(fcb* fcb, uint8_t** data) {
     return STATUS_SUCCESS;
 }
 
+NTSTATUS load_extent_csum(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, extent* ext, PIRP Irp) {
+    EXTENT_DATA2* ed2 = (EXTENT_DATA2*)&ext->extent_data.data[0];
+    NTSTATUS Status;
+    uint64_t len;
+
+    if (ext->ignore || ext->extent_data.type != EXTENT_TYPE_REGULAR)
+        return STATUS_SUCCESS;
+
+    len = (ext->extent_data.compression == BTRFS_COMPRESSION_NONE ? ed2->num_bytes : ed2->size) >> Vcb->sector_shift;
+
+    ext->csum = ExAllocatePoolWithTag(NonPagedPool, (ULONG)(len * Vcb->csum_size), ALLOC_TAG);
+    if (!ext->csum) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Status = load_csum(Vcb, ext->csum, ed2->address + (ext->extent_data.compression == BTRFS_COMPRESSION_NONE ? ed2->offset : 0), len, Irp);
+
+    if (!NT_SUCCESS(Status)) {
+        ERR("load_csum returned %08lx\n", Status);
+        ExFreePool(ext->csum);
+        ext->csum = NULL;
+        return Status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
 static void fcb_load_csums(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, PIRP Irp) {
     LIST_ENTRY* le;
     NTSTATUS Status;
 
+    // windows of extents load their own checksums
+    if (fcb->extents_deferred)
+        return;
+
     if (fcb->csum_loaded)
         return;
 
@@ -3536,24 +3607,10 @@ static void fcb_load_csums(_Requires_lock_held_(_Curr_->tree_lock) device_extens
     while (le != &fcb->extents) {
         extent* ext = CONTAINING_RECORD(le, extent, list_entry);
 
-        if (!ext->ignore && ext->extent_data.type == EXTENT_TYPE_REGULAR) {
-            EXTENT_DATA2* ed2 = (EXTENT_DATA2*)&ext->extent_data.data[0];
-            uint64_t len;
-
-            len = (ext->extent_data.compression == BTRFS_COMPRESSION_NONE ? ed2->num_bytes : ed2->size) >> Vcb->sector_shift;
-
-            ext->csum = ExAllocatePoolWithTag(NonPagedPool, (ULONG)(len * Vcb->csum_size), ALLOC_TAG);
-            if (!ext->csum) {
-                ERR("out of memory\n");
-                goto end;
-            }
-
-            Status = load_csum(Vcb, ext->csum, ed2->address + (ext->extent_data.compression == BTRFS_COMPRESSION_NONE ? ed2->offset : 0), len, Irp);
-
-            if (!NT_SUCCESS(Status)) {
-                ERR("load_csum returned %08lx\n", Status);
-                goto end;
-            }
+        Status = load_extent_csum(Vcb, ext, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_extent_csum returned %08lx\n", Status);
+            goto end;
         }
 
         le = le->Flink;
@@ -3804,6 +3861,10 @@ static NTSTATUS open_file3(device_extension* Vcb, PIRP Irp, ACCESS_MASK granted_
 
         ExAcquireResourceExclusiveLite(fileref->fcb->Header.Resource, true);
 
+        Status = load_fcb_extents(Vcb, fileref->fcb, 0, 0xffffffffffffffff, Irp);
+        if (!NT_SUCCESS(Status))
+            ERR("load_fcb_extents returned %08lx\n", Status);
+
         le = fileref->fcb->extents.Flink;
 
         while (le != &fileref->fcb->extents) {
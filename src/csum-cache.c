@@ -0,0 +1,187 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+
+// Cache of the checksum tree, keyed by disk address. Whenever load_csum has to go
+// to the tree, we copy every EXTENT_CSUM item in the leaves it visits, so that
+// reading the rest of a file - or opening it again - doesn't have to walk the tree.
+// Entries never overlap, and add_checksum_entry drops any that cover a range it's
+// changing. When we go over CSUM_CACHE_SIZE, the oldest entries get thrown out.
+
+typedef struct {
+    uint64_t address;
+    uint64_t length;
+    avl_node tree_node;
+    LIST_ENTRY list_entry;
+    uint8_t csum[1];
+} csum_cache_entry;
+
+void init_csum_cache(device_extension* Vcb) {
+    avl_init(&Vcb->csum_cache, NULL);
+    InitializeListHead(&Vcb->csum_cache_list);
+    Vcb->csum_cache_size = 0;
+    ExInitializeResourceLite(&Vcb->csum_cache_lock);
+}
+
+void free_csum_cache(device_extension* Vcb) {
+    while (!IsListEmpty(&Vcb->csum_cache_list)) {
+        csum_cache_entry* cce = CONTAINING_RECORD(RemoveHeadList(&Vcb->csum_cache_list), csum_cache_entry, list_entry);
+
+        ExFreePool(cce);
+    }
+
+    avl_init(&Vcb->csum_cache, NULL);
+    Vcb->csum_cache_size = 0;
+
+    ExDeleteResourceLite(&Vcb->csum_cache_lock);
+}
+
+// Returns the last entry starting before address, or NULL if there isn't one.
+static csum_cache_entry* find_csum_cache_entry(device_extension* Vcb, uint64_t address) {
+    avl_node* n = Vcb->csum_cache.root;
+    csum_cache_entry* ret = NULL;
+
+    while (n) {
+        csum_cache_entry* cce = CONTAINING_RECORD(n, csum_cache_entry, tree_node);
+
+        if (cce->address < address) {
+            ret = cce;
+            n = n->right;
+        } else
+            n = n->left;
+    }
+
+    return ret;
+}
+
+static void remove_csum_cache_entry(device_extension* Vcb, csum_cache_entry* cce) {
+    avl_remove(&Vcb->csum_cache, &cce->tree_node);
+    RemoveEntryList(&cce->list_entry);
+    Vcb->csum_cache_size -= (ULONG)((cce->length >> Vcb->sector_shift) * Vcb->csum_size);
+
+    ExFreePool(cce);
+}
+
+// Copies as many checksums as we have cached for the sectors starting at start,
+// and returns how many that was.
+uint64_t csum_cache_lookup(device_extension* Vcb, void* csum, uint64_t start, uint64_t length) {
+    uint64_t i = 0;
+    csum_cache_entry* cce;
+
+    ExAcquireResourceSharedLite(&Vcb->csum_cache_lock, true);
+
+    cce = find_csum_cache_entry(Vcb, start + 1);
+
+    while (cce && i < length) {
+        uint64_t addr = start + (i << Vcb->sector_shift);
+        uint64_t off, readlen;
+        avl_node* n;
+
+        if (addr < cce->address || addr >= cce->address + cce->length)
+            break;
+
+        off = (addr - cce->address) >> Vcb->sector_shift;
+        readlen = min((cce->length >> Vcb->sector_shift) - off, length - i);
+
+        RtlCopyMemory((uint8_t*)csum + (i * Vcb->csum_size), cce->csum + (off * Vcb->csum_size), (size_t)(readlen * Vcb->csum_size));
+
+        i += readlen;
+
+        n = avl_next(&cce->tree_node);
+        cce = n ? CONTAINING_RECORD(n, csum_cache_entry, tree_node) : NULL;
+    }
+
+    ExReleaseResourceLite(&Vcb->csum_cache_lock);
+
+    return i;
+}
+
+void csum_cache_add_leaf(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, tree* t) {
+    LIST_ENTRY* le;
+
+    ExAcquireResourceExclusiveLite(&Vcb->csum_cache_lock, true);
+
+    le = t->itemlist.Flink;
+    while (le != &t->itemlist) {
+        tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
+
+        if (!td->ignore && td->key.obj_id == EXTENT_CSUM_ID && td->key.obj_type == TYPE_EXTENT_CSUM &&
+            td->size > 0 && td->size % Vcb->csum_size == 0) {
+            uint64_t length = (td->size / Vcb->csum_size) << Vcb->sector_shift;
+            csum_cache_entry* cce = find_csum_cache_entry(Vcb, td->key.offset + length);
+
+            // skip if already cached
+            if (!cce || cce->address + cce->length <= td->key.offset) {
+                avl_node* parent = NULL;
+                avl_node** link = &Vcb->csum_cache.root;
+
+                cce = ExAllocatePoolWithTag(PagedPool, offsetof(csum_cache_entry, csum[0]) + td->size, ALLOC_TAG);
+                if (!cce) {
+                    ERR("out of memory\n");
+                    break;
+                }
+
+                cce->address = td->key.offset;
+                cce->length = length;
+                RtlCopyMemory(cce->csum, td->data, td->size);
+
+                while (*link) {
+                    csum_cache_entry* cce2 = CONTAINING_RECORD(*link, csum_cache_entry, tree_node);
+
+                    parent = *link;
+
+                    if (cce->address < cce2->address)
+                        link = &parent->left;
+                    else
+                        link = &parent->right;
+                }
+
+                avl_insert(&Vcb->csum_cache, &cce->tree_node, parent, link);
+                InsertTailList(&Vcb->csum_cache_list, &cce->list_entry);
+                Vcb->csum_cache_size += td->size;
+            }
+        }
+
+        le = le->Flink;
+    }
+
+    while (Vcb->csum_cache_size > CSUM_CACHE_SIZE && !IsListEmpty(&Vcb->csum_cache_list)) {
+        remove_csum_cache_entry(Vcb, CONTAINING_RECORD(Vcb->csum_cache_list.Flink, csum_cache_entry, list_entry));
+    }
+
+    ExReleaseResourceLite(&Vcb->csum_cache_lock);
+}
+
+// Drops everything overlapping [address, address + length).
+void csum_cache_invalidate(device_extension* Vcb, uint64_t address, uint64_t length) {
+    csum_cache_entry* cce;
+
+    ExAcquireResourceExclusiveLite(&Vcb->csum_cache_lock, true);
+
+    cce = find_csum_cache_entry(Vcb, address + length);
+
+    while (cce && cce->address + cce->length > address) {
+        avl_node* n = avl_prev(&cce->tree_node);
+
+        remove_csum_cache_entry(Vcb, cce);
+
+        cce = n ? CONTAINING_RECORD(n, csum_cache_entry, tree_node) : NULL;
+    }
+
+    ExReleaseResourceLite(&Vcb->csum_cache_lock);
+}
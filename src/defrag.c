@@ -0,0 +1,469 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+#include "btrfsioctl.h"
+
+// Online defragmentation. We look for runs of small extents which sit next to each other
+// in the file, read them in, and write them back out through do_write_file, which COWs
+// them into a single new extent if there's the space for it. The locks only get held for
+// one run at a time, so that other I/O to the file can carry on in between.
+
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    unsigned int num_extents;
+    bool uncompressed;
+} defrag_run;
+
+static bool defrag_run_worthwhile(defrag_run* run, uint32_t flags) {
+    if (run->num_extents > 1)
+        return true;
+
+    // a single extent is only worth rewriting if we're compressing it
+    return run->num_extents == 1 && flags & BTRFS_DEFRAG_COMPRESS && run->uncompressed;
+}
+
+// Finds the first run of extents in [start, end) that wants rewriting. Runs are made up of
+// whole extents, and stop once they reach extent_size.
+static bool find_defrag_run(fcb* fcb, uint64_t start, uint64_t end, uint64_t extent_size, uint32_t flags, defrag_run* run) {
+    LIST_ENTRY* le;
+
+    run->num_extents = 0;
+
+    le = find_extent_index(fcb, start);
+
+    while (le != &fcb->extents) {
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+
+        if (!ext->ignore) {
+            EXTENT_DATA* ed = &ext->extent_data;
+            EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
+            uint64_t len;
+            bool eligible;
+
+            if (ext->offset >= end)
+                break;
+
+            if (ed->type == EXTENT_TYPE_INLINE) {
+                len = ed->decoded_size;
+                eligible = false;
+            } else {
+                len = ed2->num_bytes;
+                eligible = ed->type == EXTENT_TYPE_REGULAR && ed2->size != 0 && len < extent_size &&
+                           (ed->compression == BTRFS_COMPRESSION_NONE || flags & BTRFS_DEFRAG_COMPRESS) &&
+                           (ext->unique || !(flags & BTRFS_DEFRAG_SKIP_SHARED));
+            }
+
+            if (ext->offset + len > start) {
+                if (run->num_extents > 0 && (!eligible || ext->offset != run->end)) {
+                    if (defrag_run_worthwhile(run, flags))
+                        return true;
+
+                    run->num_extents = 0;
+                }
+
+                if (eligible) {
+                    if (run->num_extents == 0) {
+                        run->start = ext->offset;
+                        run->uncompressed = false;
+                    }
+
+                    run->end = ext->offset + len;
+                    run->num_extents++;
+
+                    if (ed->compression == BTRFS_COMPRESSION_NONE)
+                        run->uncompressed = true;
+
+                    if (run->end - run->start >= extent_size && defrag_run_worthwhile(run, flags))
+                        return true;
+                }
+            }
+        }
+
+        le = le->Flink;
+    }
+
+    return defrag_run_worthwhile(run, flags);
+}
+
+static NTSTATUS defrag_run_write(fcb* fcb, defrag_run* run, uint32_t flags, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    uint8_t* data;
+    ULONG bytes_read;
+    uint64_t len = run->end - run->start;
+    IO_STATUS_BLOCK iosb;
+    LARGE_INTEGER off;
+
+    // make sure that what's on disk is up to date before we read it back
+    if (fcb->nonpaged->segment_object.DataSectionObject) {
+        off.QuadPart = run->start;
+        CcFlushCache(&fcb->nonpaged->segment_object, &off, (ULONG)len, &iosb);
+
+        if (!NT_SUCCESS(iosb.Status)) {
+            ERR("CcFlushCache returned %08lx\n", iosb.Status);
+            return iosb.Status;
+        }
+    }
+
+    data = ExAllocatePoolWithTag(PagedPool, (ULONG)len, ALLOC_TAG);
+    if (!data) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Status = read_file(fcb, data, run->start, min(len, fcb->inode_item.st_size - run->start), &bytes_read, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("read_file returned %08lx\n", Status);
+        ExFreePool(data);
+        return Status;
+    }
+
+    if (bytes_read < len)
+        RtlZeroMemory(data + bytes_read, (ULONG)(len - bytes_read));
+
+    if (flags & BTRFS_DEFRAG_COMPRESS) {
+        Status = write_compressed(fcb, run->start, run->end, data, Irp, rollback);
+        if (!NT_SUCCESS(Status))
+            ERR("write_compressed returned %08lx\n", Status);
+    } else {
+        Status = do_write_file(fcb, run->start, run->end, data, Irp, false, 0, rollback);
+        if (!NT_SUCCESS(Status))
+            ERR("do_write_file returned %08lx\n", Status);
+    }
+
+    ExFreePool(data);
+
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    fcb->extents_changed = true;
+    fcb->inode_item_changed = true;
+    mark_fcb_dirty(fcb);
+
+    return STATUS_SUCCESS;
+}
+
+// If max_rate is set, sleep until we're back under it.
+static void defrag_throttle(uint64_t written, uint32_t max_rate, uint64_t start_time) {
+    uint64_t due, now;
+
+    if (max_rate == 0)
+        return;
+
+    due = start_time + ((written / max_rate) * 10000000) + (((written % max_rate) * 10000000) / max_rate);
+    now = KeQueryInterruptTime();
+
+    if (due > now) {
+        LARGE_INTEGER delay;
+
+        delay.QuadPart = -(LONGLONG)(due - now);
+
+        KeDelayExecutionThread(KernelMode, false, &delay);
+    }
+}
+
+NTSTATUS defrag_fcb(fcb* fcb, uint64_t start, uint64_t end, uint64_t extent_size, uint32_t max_rate, uint32_t flags, uint64_t* written, PIRP Irp) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    device_extension* Vcb = fcb->Vcb;
+    uint64_t pos = start, start_time = KeQueryInterruptTime();
+
+    *written = 0;
+
+    if (extent_size == 0)
+        extent_size = DEFRAG_EXTENT_SIZE;
+    else
+        extent_size = min(max(extent_size, Vcb->superblock.sector_size), MAX_EXTENT_SIZE);
+
+    while (pos < end) {
+        defrag_run run;
+        LIST_ENTRY rollback;
+        uint64_t limit, search_end;
+
+        if (Vcb->removing || (Irp && Irp->Cancel)) {
+            Status = STATUS_CANCELLED;
+            break;
+        }
+
+        InitializeListHead(&rollback);
+
+        ExAcquireResourceSharedLite(&Vcb->tree_lock, true);
+        ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
+
+        if (fcb->deleted) {
+            ExReleaseResourceLite(fcb->Header.Resource);
+            ExReleaseResourceLite(&Vcb->tree_lock);
+            break;
+        }
+
+        limit = min(end, fcb->inode_item.st_size);
+
+        if (pos >= limit) {
+            ExReleaseResourceLite(fcb->Header.Resource);
+            ExReleaseResourceLite(&Vcb->tree_lock);
+            break;
+        }
+
+        // Only look at part of the file at a time, so that big files don't need all their extents
+        // loaded at once. Anything twice extent_size long is enough to find a full run in.
+        search_end = min(limit, pos + max(EXTENT_WINDOW_SIZE, 2 * extent_size));
+
+        Status = load_fcb_extents(Vcb, fcb, pos, search_end - pos, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_fcb_extents returned %08lx\n", Status);
+            ExReleaseResourceLite(fcb->Header.Resource);
+            ExReleaseResourceLite(&Vcb->tree_lock);
+            break;
+        }
+
+        if (!find_defrag_run(fcb, pos, search_end, extent_size, flags, &run)) {
+            ExReleaseResourceLite(fcb->Header.Resource);
+            ExReleaseResourceLite(&Vcb->tree_lock);
+
+            if (search_end == limit)
+                break;
+
+            // start again from any run that was cut short at search_end
+            pos = run.num_extents > 0 && run.start > pos ? run.start : search_end;
+            continue;
+        }
+
+        TRACE("rewriting %I64x to %I64x (%u extents)\n", run.start, run.end, run.num_extents);
+
+        Status = defrag_run_write(fcb, &run, flags, Irp, &rollback);
+
+        if (!NT_SUCCESS(Status))
+            do_rollback(Vcb, &rollback);
+        else
+            clear_rollback(&rollback);
+
+        ExReleaseResourceLite(fcb->Header.Resource);
+        ExReleaseResourceLite(&Vcb->tree_lock);
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("defrag_run_write returned %08lx\n", Status);
+            break;
+        }
+
+        *written += run.end - run.start;
+        pos = run.end;
+
+        defrag_throttle(*written, max_rate, start_time);
+    }
+
+    return Status;
+}
+
+NTSTATUS defrag_file(device_extension* Vcb, PFILE_OBJECT FileObject, void* data, ULONG length, PIRP Irp) {
+    btrfs_defrag* bd = data;
+    fcb* fcb;
+    ccb* ccb;
+    uint64_t end, written;
+
+    if (!data || length < sizeof(btrfs_defrag))
+        return STATUS_INVALID_PARAMETER;
+
+    if (!FileObject)
+        return STATUS_INVALID_PARAMETER;
+
+    fcb = FileObject->FsContext;
+    ccb = FileObject->FsContext2;
+
+    if (!fcb || !ccb || fcb == Vcb->volume_fcb)
+        return STATUS_INVALID_PARAMETER;
+
+    if (Irp->RequestorMode == UserMode && !(ccb->access & FILE_WRITE_DATA)) {
+        WARN("insufficient privileges\n");
+        return STATUS_ACCESS_DENIED;
+    }
+
+    if (Vcb->readonly)
+        return STATUS_MEDIA_WRITE_PROTECTED;
+
+    if (is_subvol_readonly(fcb->subvol, Irp))
+        return STATUS_ACCESS_DENIED;
+
+    if (fcb->type != BTRFS_TYPE_FILE || fcb->ads) {
+        WARN("FileObject did not point to a file\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE)
+        return STATUS_ACCESS_DENIED;
+
+    // do_write_file overwrites nodatacow extents in place, so there's nothing we can do here
+    if (fcb->inode_item.flags & BTRFS_INODE_NODATACOW) {
+        WARN("not defragmenting nodatacow file\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (bd->length == 0 || bd->length > 0xffffffffffffffff - bd->start)
+        end = 0xffffffffffffffff;
+    else
+        end = bd->start + bd->length;
+
+    return defrag_fcb(fcb, bd->start, end, bd->extent_size, bd->max_rate, bd->flags, &written, Irp);
+}
+
+// Autodefrag. Small writes into the middle of a file each leave behind a little COW extent,
+// so write_file2 tells us about them, and we queue up the area around each one. When the
+// flush thread finds it has nothing to write, it hands a few entries to defrag_fcb.
+
+typedef struct {
+    fcb* fcb;
+    uint64_t start;
+    uint64_t end;
+    LIST_ENTRY list_entry;
+} autodefrag_entry;
+
+void init_autodefrag(device_extension* Vcb) {
+    InitializeListHead(&Vcb->autodefrag_queue);
+    Vcb->autodefrag_queue_length = 0;
+    RtlZeroMemory(&Vcb->autodefrag_stats, sizeof(btrfs_autodefrag_stats));
+    ExInitializeResourceLite(&Vcb->autodefrag_lock);
+}
+
+void free_autodefrag(device_extension* Vcb) {
+    while (!IsListEmpty(&Vcb->autodefrag_queue)) {
+        autodefrag_entry* ae = CONTAINING_RECORD(RemoveHeadList(&Vcb->autodefrag_queue), autodefrag_entry, list_entry);
+
+        free_fcb(ae->fcb);
+        ExFreePool(ae);
+    }
+
+    Vcb->autodefrag_queue_length = 0;
+
+    TRACE("autodefrag: %I64u queued, %I64u merged, %I64u dropped, %I64u processed, %I64u bytes rewritten\n",
+          Vcb->autodefrag_stats.queued, Vcb->autodefrag_stats.merged, Vcb->autodefrag_stats.dropped,
+          Vcb->autodefrag_stats.processed, Vcb->autodefrag_stats.bytes_rewritten);
+
+    ExDeleteResourceLite(&Vcb->autodefrag_lock);
+}
+
+// Called with the fcb held exclusively, after a write to [start, end) which didn't change the file's length.
+void autodefrag_add(fcb* fcb, uint64_t start, uint64_t end) {
+    device_extension* Vcb = fcb->Vcb;
+    autodefrag_entry* ae;
+    LIST_ENTRY* le;
+
+    if (end - start >= AUTODEFRAG_WRITE_SIZE || fcb->ads || fcb->subvol == Vcb->root_root || fcb->inode_item.flags & BTRFS_INODE_NODATACOW ||
+        fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE)
+        return;
+
+    start &= ~(uint64_t)(AUTODEFRAG_WINDOW - 1);
+    end = sector_align(end, AUTODEFRAG_WINDOW);
+
+    ExAcquireResourceExclusiveLite(&Vcb->autodefrag_lock, true);
+
+    le = Vcb->autodefrag_queue.Flink;
+    while (le != &Vcb->autodefrag_queue) {
+        ae = CONTAINING_RECORD(le, autodefrag_entry, list_entry);
+
+        if (ae->fcb == fcb && ae->start <= end && start <= ae->end && max(ae->end, end) - min(ae->start, start) <= AUTODEFRAG_MAX_RANGE) {
+            ae->start = min(ae->start, start);
+            ae->end = max(ae->end, end);
+            Vcb->autodefrag_stats.merged++;
+
+            ExReleaseResourceLite(&Vcb->autodefrag_lock);
+            return;
+        }
+
+        le = le->Flink;
+    }
+
+    if (Vcb->autodefrag_queue_length >= AUTODEFRAG_QUEUE_SIZE) {
+        Vcb->autodefrag_stats.dropped++;
+        ExReleaseResourceLite(&Vcb->autodefrag_lock);
+        return;
+    }
+
+    ae = ExAllocatePoolWithTag(PagedPool, sizeof(autodefrag_entry), ALLOC_TAG);
+    if (!ae) {
+        ERR("out of memory\n");
+        ExReleaseResourceLite(&Vcb->autodefrag_lock);
+        return;
+    }
+
+    ae->fcb = fcb;
+    ae->start = start;
+    ae->end = end;
+
+    InterlockedIncrement(&fcb->refcount);
+
+    InsertTailList(&Vcb->autodefrag_queue, &ae->list_entry);
+    Vcb->autodefrag_queue_length++;
+    Vcb->autodefrag_stats.queued++;
+
+    ExReleaseResourceLite(&Vcb->autodefrag_lock);
+}
+
+void do_autodefrag(device_extension* Vcb) {
+    unsigned int i;
+
+    for (i = 0; i < AUTODEFRAG_BATCH; i++) {
+        NTSTATUS Status;
+        autodefrag_entry* ae;
+        uint64_t written = 0;
+
+        if (Vcb->removing || Vcb->locked || Vcb->readonly)
+            break;
+
+        ExAcquireResourceExclusiveLite(&Vcb->autodefrag_lock, true);
+
+        if (IsListEmpty(&Vcb->autodefrag_queue)) {
+            ExReleaseResourceLite(&Vcb->autodefrag_lock);
+            break;
+        }
+
+        ae = CONTAINING_RECORD(RemoveHeadList(&Vcb->autodefrag_queue), autodefrag_entry, list_entry);
+        Vcb->autodefrag_queue_length--;
+
+        ExReleaseResourceLite(&Vcb->autodefrag_lock);
+
+        if (!ae->fcb->deleted) {
+            Status = defrag_fcb(ae->fcb, ae->start, ae->end, 0, AUTODEFRAG_RATE, BTRFS_DEFRAG_SKIP_SHARED, &written, NULL);
+            if (!NT_SUCCESS(Status))
+                WARN("defrag_fcb returned %08lx\n", Status);
+        }
+
+        ExAcquireResourceExclusiveLite(&Vcb->autodefrag_lock, true);
+        Vcb->autodefrag_stats.processed++;
+        Vcb->autodefrag_stats.bytes_rewritten += written;
+        ExReleaseResourceLite(&Vcb->autodefrag_lock);
+
+        free_fcb(ae->fcb);
+        ExFreePool(ae);
+    }
+}
+
+NTSTATUS get_autodefrag_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen) {
+    btrfs_autodefrag_stats* bas = data;
+
+    if (!data || length < sizeof(btrfs_autodefrag_stats))
+        return STATUS_BUFFER_TOO_SMALL;
+
+    ExAcquireResourceSharedLite(&Vcb->autodefrag_lock, true);
+
+    RtlCopyMemory(bas, &Vcb->autodefrag_stats, sizeof(btrfs_autodefrag_stats));
+    bas->queue_length = Vcb->autodefrag_queue_length;
+
+    ExReleaseResourceLite(&Vcb->autodefrag_lock);
+
+    *retlen = sizeof(btrfs_autodefrag_stats);
+
+    return STATUS_SUCCESS;
+}
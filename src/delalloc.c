@@ -0,0 +1,294 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+
+// Delayed allocation. The lazy writer sends us buffered writes in whatever sizes it feels like,
+// and if we allocated space for each one as it came in, a file written sequentially would end up
+// as lots of little extents scattered across the disk. Instead, write_file2 hands paging writes to
+// delalloc_add, which keeps a copy of the data in a list hanging off the fcb, sorted by offset and
+// with no overlaps. When the transaction gets committed, delalloc_flush_fcb joins up the contiguous
+// ranges and writes each run out with do_write_file, so we get extents of up to MAX_EXTENT_SIZE.
+// Until then, read_file lays the pending data over what it reads from disk, and excise_extents
+// throws away anything that's been truncated or overwritten. The list is protected by the fcb's
+// lock, and changes to it go on the rollback list like changes to the extents do.
+
+static delalloc_range* alloc_delalloc_range(fcb* fcb, uint64_t start, ULONG length, uint8_t* data) {
+    delalloc_range* dr;
+
+    dr = ExAllocatePoolWithTag(PagedPool, offsetof(delalloc_range, data[0]) + length, ALLOC_TAG);
+    if (!dr) {
+        ERR("out of memory\n");
+        return NULL;
+    }
+
+    dr->fcb = fcb;
+    dr->start = start;
+    dr->length = length;
+    RtlCopyMemory(dr->data, data, length);
+
+    return dr;
+}
+
+static void insert_delalloc_range(delalloc_range* dr) {
+    fcb* fcb = dr->fcb;
+    LIST_ENTRY* le = fcb->delalloc.Blink;
+
+    // writes are usually sequential, so search backwards
+    while (le != &fcb->delalloc) {
+        delalloc_range* dr2 = CONTAINING_RECORD(le, delalloc_range, list_entry);
+
+        if (dr2->start < dr->start)
+            break;
+
+        le = le->Blink;
+    }
+
+    InsertHeadList(le, &dr->list_entry);
+
+    InterlockedExchangeAdd64((LONG64*)&fcb->Vcb->delalloc_size, dr->length);
+}
+
+static void remove_delalloc_range(delalloc_range* dr) {
+    RemoveEntryList(&dr->list_entry);
+
+    InterlockedExchangeAdd64((LONG64*)&dr->fcb->Vcb->delalloc_size, -(LONG64)dr->length);
+}
+
+// Throws away whatever's pending for [start, end), keeping any bits either side.
+NTSTATUS delalloc_drop(fcb* fcb, uint64_t start, uint64_t end, LIST_ENTRY* rollback) {
+    LIST_ENTRY* le = fcb->delalloc.Flink;
+
+    while (le != &fcb->delalloc) {
+        LIST_ENTRY* le2 = le->Flink;
+        delalloc_range* dr = CONTAINING_RECORD(le, delalloc_range, list_entry);
+
+        if (dr->start >= end)
+            break;
+
+        if (dr->start + dr->length > start) {
+            delalloc_range *head = NULL, *tail = NULL;
+
+            if (dr->start < start) {
+                head = alloc_delalloc_range(fcb, dr->start, (ULONG)(start - dr->start), dr->data);
+                if (!head)
+                    return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            if (dr->start + dr->length > end) {
+                tail = alloc_delalloc_range(fcb, end, (ULONG)(dr->start + dr->length - end), dr->data + end - dr->start);
+                if (!tail) {
+                    if (head)
+                        ExFreePool(head);
+
+                    return STATUS_INSUFFICIENT_RESOURCES;
+                }
+            }
+
+            remove_delalloc_range(dr);
+            add_rollback(rollback, ROLLBACK_DELETE_DELALLOC, dr);
+
+            if (head) {
+                insert_delalloc_range(head);
+                add_rollback(rollback, ROLLBACK_INSERT_DELALLOC, head);
+            }
+
+            if (tail) {
+                insert_delalloc_range(tail);
+                add_rollback(rollback, ROLLBACK_INSERT_DELALLOC, tail);
+            }
+        }
+
+        le = le2;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Called from write_file2 with the fcb held exclusively, for a paging write of [start, end). If added
+// comes back false, the caller should write the data out itself.
+NTSTATUS delalloc_add(fcb* fcb, uint64_t start, uint64_t end, uint8_t* data, PIRP Irp, bool* added, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    device_extension* Vcb = fcb->Vcb;
+    delalloc_range* dr;
+
+    *added = false;
+
+    if (!Vcb->options.delalloc || fcb->ads || fcb->subvol == Vcb->root_root || fcb->inode_item.flags & BTRFS_INODE_NODATACOW ||
+        fcb->atts & FILE_ATTRIBUTE_SPARSE_FILE || fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE || fcb_is_inline(fcb) ||
+        end - start > DELALLOC_MAX)
+        return STATUS_SUCCESS;
+
+    // If we're holding on to too much, write out what we've got for this file first.
+    if (Vcb->delalloc_size + end - start > DELALLOC_MAX && !IsListEmpty(&fcb->delalloc)) {
+        Status = delalloc_flush_fcb(fcb, Irp, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("delalloc_flush_fcb returned %08lx\n", Status);
+            return Status;
+        }
+    }
+
+    if (Vcb->delalloc_size + end - start > DELALLOC_MAX)
+        return STATUS_SUCCESS;
+
+    dr = alloc_delalloc_range(fcb, start, (ULONG)(end - start), data);
+    if (!dr)
+        return STATUS_SUCCESS;
+
+    Status = delalloc_drop(fcb, start, end, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("delalloc_drop returned %08lx\n", Status);
+        ExFreePool(dr);
+        return Status;
+    }
+
+    insert_delalloc_range(dr);
+    add_rollback(rollback, ROLLBACK_INSERT_DELALLOC, dr);
+
+    *added = true;
+
+    return STATUS_SUCCESS;
+}
+
+// Copies anything pending over the top of what read_file got from disk.
+void delalloc_read(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length) {
+    LIST_ENTRY* le = fcb->delalloc.Flink;
+
+    while (le != &fcb->delalloc) {
+        delalloc_range* dr = CONTAINING_RECORD(le, delalloc_range, list_entry);
+
+        if (dr->start >= start + length)
+            break;
+
+        if (dr->start + dr->length > start) {
+            uint64_t s = max(dr->start, start);
+            uint64_t e = min(dr->start + dr->length, start + length);
+
+            RtlCopyMemory(data + s - start, dr->data + s - dr->start, (ULONG)(e - s));
+        }
+
+        le = le->Flink;
+    }
+}
+
+// Allocates space for everything pending for fcb, and writes it out. The caller needs to hold
+// the tree lock and the fcb exclusively.
+NTSTATUS delalloc_flush_fcb(fcb* fcb, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+
+    if (IsListEmpty(&fcb->delalloc))
+        return STATUS_SUCCESS;
+
+    while (!IsListEmpty(&fcb->delalloc)) {
+        delalloc_range* dr = CONTAINING_RECORD(fcb->delalloc.Flink, delalloc_range, list_entry);
+        uint64_t run_start = dr->start, run_end = dr->start + dr->length;
+        LIST_ENTRY* le = dr->list_entry.Flink;
+        uint8_t* data;
+
+        while (le != &fcb->delalloc) {
+            delalloc_range* dr2 = CONTAINING_RECORD(le, delalloc_range, list_entry);
+
+            if (dr2->start != run_end || run_end + dr2->length - run_start > MAX_EXTENT_SIZE)
+                break;
+
+            run_end += dr2->length;
+            le = le->Flink;
+        }
+
+        if (run_end - run_start == dr->length)
+            data = dr->data;
+        else {
+            data = ExAllocatePoolWithTag(PagedPool, (ULONG)(run_end - run_start), ALLOC_TAG);
+            if (!data) {
+                ERR("out of memory\n");
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+        }
+
+        // Take the ranges off the list, so that excise_extents doesn't find them. The rollback
+        // list keeps hold of them until we're finished.
+        while (fcb->delalloc.Flink != le) {
+            delalloc_range* dr2 = CONTAINING_RECORD(fcb->delalloc.Flink, delalloc_range, list_entry);
+
+            if (data != dr->data)
+                RtlCopyMemory(data + dr2->start - run_start, dr2->data, dr2->length);
+
+            remove_delalloc_range(dr2);
+            add_rollback(rollback, ROLLBACK_DELETE_DELALLOC, dr2);
+        }
+
+        Status = do_write_file(fcb, run_start, run_end, data, Irp, false, 0, rollback);
+
+        if (data != dr->data)
+            ExFreePool(data);
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("do_write_file returned %08lx\n", Status);
+            return Status;
+        }
+    }
+
+    fcb->extents_changed = true;
+    fcb->inode_item_changed = true;
+    mark_fcb_dirty(fcb);
+
+    return STATUS_SUCCESS;
+}
+
+// For when something's about to look at fcb's extents directly, rather than going through read_file.
+NTSTATUS delalloc_flush(fcb* fcb, PIRP Irp) {
+    NTSTATUS Status;
+    device_extension* Vcb = fcb->Vcb;
+    LIST_ENTRY rollback;
+
+    if (IsListEmpty(&fcb->delalloc))
+        return STATUS_SUCCESS;
+
+    InitializeListHead(&rollback);
+
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, true);
+    ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
+
+    Status = delalloc_flush_fcb(fcb, Irp, &rollback);
+
+    if (!NT_SUCCESS(Status))
+        do_rollback(Vcb, &rollback);
+    else
+        clear_rollback(&rollback);
+
+    ExReleaseResourceLite(fcb->Header.Resource);
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    return Status;
+}
+
+void delalloc_free_fcb(fcb* fcb) {
+    while (!IsListEmpty(&fcb->delalloc)) {
+        delalloc_range* dr = CONTAINING_RECORD(fcb->delalloc.Flink, delalloc_range, list_entry);
+
+        remove_delalloc_range(dr);
+        ExFreePool(dr);
+    }
+}
+
+void delalloc_rollback(delalloc_range* dr, bool inserted) {
+    if (inserted) {
+        remove_delalloc_range(dr);
+        ExFreePool(dr);
+    } else
+        insert_delalloc_range(dr);
+}
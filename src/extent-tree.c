@@ -451,7 +451,7 @@ end:
     return Status;
 }
 
-NTSTATUS increase_extent_refcount(device_extension* Vcb, uint64_t address, uint64_t size, uint8_t type, void* data, KEY* firstitem, uint8_t level, PIRP Irp) {
+static NTSTATUS increase_extent_refcount2(device_extension* Vcb, uint64_t address, uint64_t size, uint8_t type, void* data, KEY* firstitem, uint8_t level, PIRP Irp) {
     NTSTATUS Status;
     KEY searchkey;
     traverse_ptr tp;
@@ -537,7 +537,7 @@ NTSTATUS increase_extent_refcount(device_extension* Vcb, uint64_t address, uint6
             return Status;
         }
 
-        return increase_extent_refcount(Vcb, address, size, type, data, firstitem, level, Irp);
+        return increase_extent_refcount2(Vcb, address, size, type, data, firstitem, level, Irp);
     }
 
     if (tp.item->size < sizeof(EXTENT_ITEM)) {
@@ -900,8 +900,8 @@ NTSTATUS increase_extent_refcount_data(device_extension* Vcb, uint64_t address,
     return increase_extent_refcount(Vcb, address, size, TYPE_EXTENT_DATA_REF, &edr, NULL, 0, Irp);
 }
 
-NTSTATUS decrease_extent_refcount(device_extension* Vcb, uint64_t address, uint64_t size, uint8_t type, void* data, KEY* firstitem,
-                                  uint8_t level, uint64_t parent, bool superseded, PIRP Irp) {
+static NTSTATUS decrease_extent_refcount2(device_extension* Vcb, uint64_t address, uint64_t size, uint8_t type, void* data, KEY* firstitem,
+                                          uint8_t level, uint64_t parent, bool superseded, PIRP Irp) {
     KEY searchkey;
     NTSTATUS Status;
     traverse_ptr tp, tp2;
@@ -957,7 +957,7 @@ NTSTATUS decrease_extent_refcount(device_extension* Vcb, uint64_t address, uint6
                 return Status;
             }
 
-            return decrease_extent_refcount(Vcb, address, size, type, data, firstitem, level, parent, superseded, Irp);
+            return decrease_extent_refcount2(Vcb, address, size, type, data, firstitem, level, parent, superseded, Irp);
         }
     }
 
@@ -1545,6 +1545,308 @@ NTSTATUS decrease_extent_refcount(device_extension* Vcb, uint64_t address, uint6
     }
 }
 
+// While delay_refs is set, backref changes are collected in Vcb->delayed_refs rather than being
+// made to the extent tree straight away. Changes to the same ref get merged, so that e.g. a +1 and
+// -1 from COWing a shared tree never reach the extent tree at all, and the net changes are then
+// applied in address order by run_delayed_refs. Anything which reads an extent's refs has to call
+// run_delayed_refs_address first, so it doesn't see stale counts.
+
+typedef struct {
+    uint64_t address;
+    uint64_t size;
+    uint8_t type;
+
+    union {
+        EXTENT_DATA_REF edr;
+        SHARED_DATA_REF sdr;
+        TREE_BLOCK_REF tbr;
+        SHARED_BLOCK_REF sbr;
+    };
+
+    int64_t count;
+    KEY firstitem;
+    bool has_firstitem;
+    uint8_t level;
+    uint64_t parent;
+    bool superseded;
+    avl_node tree_node;
+    LIST_ENTRY list_entry;
+} delayed_ref;
+
+static __inline int cmp_uint64(uint64_t a, uint64_t b) {
+    if (a < b)
+        return -1;
+    else if (a > b)
+        return 1;
+    else
+        return 0;
+}
+
+// Compares by address, then type, then by whatever identifies the ref within the extent (i.e. not the count).
+static int delayed_ref_cmp(uint64_t address, uint8_t type, void* data, delayed_ref* dr) {
+    int cmp;
+
+    cmp = cmp_uint64(address, dr->address);
+    if (cmp != 0)
+        return cmp;
+
+    if (type != dr->type)
+        return type < dr->type ? -1 : 1;
+
+    switch (type) {
+        case TYPE_EXTENT_DATA_REF: {
+            EXTENT_DATA_REF* edr = (EXTENT_DATA_REF*)data;
+
+            cmp = cmp_uint64(edr->root, dr->edr.root);
+            if (cmp != 0)
+                return cmp;
+
+            cmp = cmp_uint64(edr->objid, dr->edr.objid);
+            if (cmp != 0)
+                return cmp;
+
+            return cmp_uint64(edr->offset, dr->edr.offset);
+        }
+
+        case TYPE_SHARED_DATA_REF:
+            return cmp_uint64(((SHARED_DATA_REF*)data)->offset, dr->sdr.offset);
+
+        case TYPE_TREE_BLOCK_REF:
+            return cmp_uint64(((TREE_BLOCK_REF*)data)->offset, dr->tbr.offset);
+
+        case TYPE_SHARED_BLOCK_REF:
+            return cmp_uint64(((SHARED_BLOCK_REF*)data)->offset, dr->sbr.offset);
+    }
+
+    return 0;
+}
+
+static NTSTATUS add_delayed_ref(device_extension* Vcb, uint64_t address, uint64_t size, uint8_t type, void* data, KEY* firstitem,
+                                uint8_t level, uint64_t parent, bool superseded, int64_t count) {
+    avl_node* parent_node = NULL;
+    avl_node** link = &Vcb->delayed_refs.root;
+    delayed_ref* dr;
+    uint16_t datalen = get_extent_data_len(type);
+
+    if (datalen == 0) {
+        ERR("unrecognized extent type %x\n", type);
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    while (*link) {
+        int cmp;
+
+        dr = CONTAINING_RECORD(*link, delayed_ref, tree_node);
+
+        cmp = delayed_ref_cmp(address, type, data, dr);
+
+        if (cmp == 0) {
+            dr->count += count;
+
+            if (count < 0) {
+                dr->parent = parent;
+                dr->superseded = dr->superseded || superseded;
+            }
+
+            if (firstitem && !dr->has_firstitem) {
+                dr->firstitem = *firstitem;
+                dr->has_firstitem = true;
+                dr->level = level;
+            }
+
+            return STATUS_SUCCESS;
+        }
+
+        parent_node = *link;
+        link = cmp < 0 ? &(*link)->left : &(*link)->right;
+    }
+
+    dr = ExAllocatePoolWithTag(PagedPool, sizeof(delayed_ref), ALLOC_TAG);
+    if (!dr) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    dr->address = address;
+    dr->size = size;
+    dr->type = type;
+    RtlCopyMemory(&dr->edr, data, datalen);
+    dr->count = count;
+    dr->level = level;
+    dr->parent = parent;
+    dr->superseded = superseded;
+
+    if (firstitem) {
+        dr->firstitem = *firstitem;
+        dr->has_firstitem = true;
+    } else
+        dr->has_firstitem = false;
+
+    avl_insert(&Vcb->delayed_refs, &dr->tree_node, parent_node, link);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS apply_delayed_ref(device_extension* Vcb, delayed_ref* dr, PIRP Irp) {
+    NTSTATUS Status;
+    bool is_tree = dr->type == TYPE_TREE_BLOCK_REF || dr->type == TYPE_SHARED_BLOCK_REF;
+    uint64_t count = dr->count < 0 ? -dr->count : dr->count;
+    uint64_t i, times;
+    KEY* firstitem = dr->has_firstitem ? &dr->firstitem : NULL;
+
+    // tree refs don't have counts, so have to be done one at a time
+    if (is_tree)
+        times = count;
+    else {
+        times = 1;
+
+        if (dr->type == TYPE_EXTENT_DATA_REF)
+            dr->edr.count = (uint32_t)count;
+        else
+            dr->sdr.count = (uint32_t)count;
+    }
+
+    for (i = 0; i < times; i++) {
+        if (dr->count > 0) {
+            Status = increase_extent_refcount2(Vcb, dr->address, dr->size, dr->type, &dr->edr, firstitem, dr->level, Irp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("increase_extent_refcount2 returned %08lx\n", Status);
+                return Status;
+            }
+        } else {
+            Status = decrease_extent_refcount2(Vcb, dr->address, dr->size, dr->type, &dr->edr, firstitem, dr->level, dr->parent,
+                                               dr->superseded, Irp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("decrease_extent_refcount2 returned %08lx\n", Status);
+                return Status;
+            }
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Takes all the refs for address out of the tree and applies them. The increases go first,
+// so that the extent item can't disappear part of the way through.
+static NTSTATUS run_delayed_refs_address2(device_extension* Vcb, avl_node* n, PIRP Irp) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    LIST_ENTRY refs;
+    uint64_t address = CONTAINING_RECORD(n, delayed_ref, tree_node)->address;
+    unsigned int pass;
+
+    InitializeListHead(&refs);
+
+    while (n) {
+        delayed_ref* dr = CONTAINING_RECORD(n, delayed_ref, tree_node);
+
+        if (dr->address != address)
+            break;
+
+        n = avl_next(n);
+
+        avl_remove(&Vcb->delayed_refs, &dr->tree_node);
+        InsertTailList(&refs, &dr->list_entry);
+    }
+
+    for (pass = 0; pass < 2 && NT_SUCCESS(Status); pass++) {
+        LIST_ENTRY* le = refs.Flink;
+
+        while (le != &refs) {
+            delayed_ref* dr = CONTAINING_RECORD(le, delayed_ref, list_entry);
+
+            if (pass == 0 ? dr->count > 0 : dr->count < 0) {
+                Status = apply_delayed_ref(Vcb, dr, Irp);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("apply_delayed_ref returned %08lx\n", Status);
+                    break;
+                }
+            }
+
+            le = le->Flink;
+        }
+    }
+
+    while (!IsListEmpty(&refs)) {
+        delayed_ref* dr = CONTAINING_RECORD(RemoveHeadList(&refs), delayed_ref, list_entry);
+
+        ExFreePool(dr);
+    }
+
+    return Status;
+}
+
+NTSTATUS run_delayed_refs_address(device_extension* Vcb, uint64_t address, PIRP Irp) {
+    avl_node* n = Vcb->delayed_refs.root;
+    avl_node* first = NULL;
+
+    // find the first ref for address, if there is one
+    while (n) {
+        delayed_ref* dr = CONTAINING_RECORD(n, delayed_ref, tree_node);
+
+        if (dr->address < address)
+            n = n->right;
+        else {
+            if (dr->address == address)
+                first = n;
+
+            n = n->left;
+        }
+    }
+
+    if (!first)
+        return STATUS_SUCCESS;
+
+    return run_delayed_refs_address2(Vcb, first, Irp);
+}
+
+void start_delayed_refs(device_extension* Vcb) {
+    Vcb->delay_refs = true;
+}
+
+NTSTATUS run_delayed_refs(device_extension* Vcb, PIRP Irp) {
+    NTSTATUS Status;
+    avl_node* n;
+
+    Vcb->delay_refs = false;
+
+    while ((n = avl_first(&Vcb->delayed_refs))) {
+        Status = run_delayed_refs_address2(Vcb, n, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("run_delayed_refs_address2 returned %08lx\n", Status);
+            clear_delayed_refs(Vcb);
+            return Status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+void clear_delayed_refs(device_extension* Vcb) {
+    avl_node* n;
+
+    Vcb->delay_refs = false;
+
+    while ((n = avl_first(&Vcb->delayed_refs))) {
+        avl_remove(&Vcb->delayed_refs, n);
+        ExFreePool(CONTAINING_RECORD(n, delayed_ref, tree_node));
+    }
+}
+
+NTSTATUS increase_extent_refcount(device_extension* Vcb, uint64_t address, uint64_t size, uint8_t type, void* data, KEY* firstitem, uint8_t level, PIRP Irp) {
+    if (Vcb->delay_refs)
+        return add_delayed_ref(Vcb, address, size, type, data, firstitem, level, 0, false, get_extent_data_refcount(type, data));
+
+    return increase_extent_refcount2(Vcb, address, size, type, data, firstitem, level, Irp);
+}
+
+NTSTATUS decrease_extent_refcount(device_extension* Vcb, uint64_t address, uint64_t size, uint8_t type, void* data, KEY* firstitem,
+                                  uint8_t level, uint64_t parent, bool superseded, PIRP Irp) {
+    if (Vcb->delay_refs && data)
+        return add_delayed_ref(Vcb, address, size, type, data, firstitem, level, parent, superseded, -(int64_t)get_extent_data_refcount(type, data));
+
+    return decrease_extent_refcount2(Vcb, address, size, type, data, firstitem, level, parent, superseded, Irp);
+}
+
 NTSTATUS decrease_extent_refcount_data(device_extension* Vcb, uint64_t address, uint64_t size, uint64_t root, uint64_t inode,
                                        uint64_t offset, uint32_t refcount, bool superseded, PIRP Irp) {
     EXTENT_DATA_REF edr;
@@ -1571,6 +1873,12 @@ static uint32_t find_extent_data_refcount(device_extension* Vcb, uint64_t addres
     KEY searchkey;
     traverse_ptr tp;
 
+    Status = run_delayed_refs_address(Vcb, address, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("run_delayed_refs_address returned %08lx\n", Status);
+        return 0;
+    }
+
     searchkey.obj_id = address;
     searchkey.obj_type = TYPE_EXTENT_ITEM;
     searchkey.offset = 0xffffffffffffffff;
@@ -1654,6 +1962,12 @@ uint64_t get_extent_refcount(device_extension* Vcb, uint64_t address, uint64_t s
     NTSTATUS Status;
     EXTENT_ITEM* ei;
 
+    Status = run_delayed_refs_address(Vcb, address, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("run_delayed_refs_address returned %08lx\n", Status);
+        return 0;
+    }
+
     searchkey.obj_id = address;
     searchkey.obj_type = Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA ? TYPE_METADATA_ITEM : TYPE_EXTENT_ITEM;
     searchkey.offset = 0xffffffffffffffff;
@@ -1838,6 +2152,12 @@ uint64_t get_extent_flags(device_extension* Vcb, uint64_t address, PIRP Irp) {
     NTSTATUS Status;
     EXTENT_ITEM* ei;
 
+    Status = run_delayed_refs_address(Vcb, address, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("run_delayed_refs_address returned %08lx\n", Status);
+        return 0;
+    }
+
     searchkey.obj_id = address;
     searchkey.obj_type = Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA ? TYPE_METADATA_ITEM : TYPE_EXTENT_ITEM;
     searchkey.offset = 0xffffffffffffffff;
@@ -1879,6 +2199,12 @@ void update_extent_flags(device_extension* Vcb, uint64_t address, uint64_t flags
     NTSTATUS Status;
     EXTENT_ITEM* ei;
 
+    Status = run_delayed_refs_address(Vcb, address, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("run_delayed_refs_address returned %08lx\n", Status);
+        return;
+    }
+
     searchkey.obj_id = address;
     searchkey.obj_type = Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA ? TYPE_METADATA_ITEM : TYPE_EXTENT_ITEM;
     searchkey.offset = 0xffffffffffffffff;
@@ -2125,6 +2451,12 @@ uint64_t find_extent_shared_tree_refcount(device_extension* Vcb, uint64_t addres
     uint32_t len;
     uint8_t* ptr;
 
+    Status = run_delayed_refs_address(Vcb, address, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("run_delayed_refs_address returned %08lx\n", Status);
+        return 0;
+    }
+
     searchkey.obj_id = address;
     searchkey.obj_type = Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA ? TYPE_METADATA_ITEM : TYPE_EXTENT_ITEM;
     searchkey.offset = 0xffffffffffffffff;
@@ -2226,6 +2558,12 @@ uint32_t find_extent_shared_data_refcount(device_extension* Vcb, uint64_t addres
     uint32_t len;
     uint8_t* ptr;
 
+    Status = run_delayed_refs_address(Vcb, address, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("run_delayed_refs_address returned %08lx\n", Status);
+        return 0;
+    }
+
     searchkey.obj_id = address;
     searchkey.obj_type = Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA ? TYPE_METADATA_ITEM : TYPE_EXTENT_ITEM;
     searchkey.offset = 0xffffffffffffffff;
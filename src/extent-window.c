@@ -0,0 +1,613 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+
+// Big files can have hundreds of thousands of extents, so rather than reading them all into
+// fcb->extents, open_fcb stops before the EXTENT_DATA items of files of at least
+// DEFER_EXTENTS_THRESHOLD and sets extents_deferred. Their extents then get loaded
+// EXTENT_WINDOW_SIZE of the file at a time, around whatever's being read or written. Each
+// window that's loaded has an extent_window on fcb->extent_windows, and on
+// Vcb->extent_windows in the order they were loaded.
+//
+// A range is always loaded along with anything that overlaps it, so that no extent or hole,
+// in memory or on the disk, crosses from a loaded window into one that isn't. Nothing in a
+// window that isn't loaded ever changes, so when extents_changed is set flush_fcb_tree
+// only has to replace the EXTENT_DATA items of each run of loaded windows.
+//
+// Once there's more than EXTENT_WINDOW_CACHE_SIZE loaded, trim_extent_windows drops the
+// oldest windows of files with nothing waiting to be written. Loading needs the tree lock and
+// the fcb held exclusively, and trimming is done with the tree lock held exclusively, so
+// either the tree lock or the fcb is enough to stop a window changing under you.
+
+void init_extent_windows(device_extension* Vcb) {
+    InitializeListHead(&Vcb->extent_windows);
+    Vcb->extent_windows_size = 0;
+    ExInitializeResourceLite(&Vcb->extent_windows_lock);
+}
+
+void free_extent_windows(device_extension* Vcb) {
+    // by now the windows have all been freed along with their fcbs
+    ExDeleteResourceLite(&Vcb->extent_windows_lock);
+}
+
+static bool extent_item_sparse(traverse_ptr* tp) {
+    EXTENT_DATA* ed = (EXTENT_DATA*)tp->item->data;
+    EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
+
+    if (tp->item->size < sizeof(EXTENT_DATA) || ed->type == EXTENT_TYPE_INLINE)
+        return false;
+
+    if (tp->item->size < sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2))
+        return false;
+
+    return ed2->address == 0 || ed2->size == 0;
+}
+
+static uint64_t extent_item_end(traverse_ptr* tp) {
+    EXTENT_DATA* ed = (EXTENT_DATA*)tp->item->data;
+
+    if (tp->item->size < sizeof(EXTENT_DATA))
+        return tp->item->key.offset;
+
+    if (ed->type == EXTENT_TYPE_INLINE)
+        return tp->item->key.offset + ed->decoded_size;
+
+    if (tp->item->size < sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2))
+        return tp->item->key.offset;
+
+    return tp->item->key.offset + ((EXTENT_DATA2*)ed->data)->num_bytes;
+}
+
+// Finds the last EXTENT_DATA item of fcb which starts before offset, hole or not.
+static NTSTATUS find_extent_item_before(device_extension* Vcb, fcb* fcb, uint64_t offset, traverse_ptr* tp, bool* found, PIRP Irp) {
+    NTSTATUS Status;
+    KEY searchkey;
+
+    *found = false;
+
+    if (offset == 0)
+        return STATUS_SUCCESS;
+
+    searchkey.obj_id = fcb->inode;
+    searchkey.obj_type = TYPE_EXTENT_DATA;
+    searchkey.offset = offset - 1;
+
+    Status = find_item(Vcb, fcb->subvol, tp, &searchkey, false, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08lx\n", Status);
+        return Status;
+    }
+
+    if (tp->item->key.obj_id == fcb->inode && tp->item->key.obj_type == TYPE_EXTENT_DATA && tp->item->key.offset < offset)
+        *found = true;
+
+    return STATUS_SUCCESS;
+}
+
+// Whether an EXTENT_DATA item on the disk crosses boundary. If we can't tell, we assume it does.
+static bool extent_item_crosses(device_extension* Vcb, fcb* fcb, uint64_t boundary) {
+    traverse_ptr tp;
+    bool found;
+
+    if (!NT_SUCCESS(find_extent_item_before(Vcb, fcb, boundary, &tp, &found, NULL)))
+        return true;
+
+    return found && extent_item_end(&tp) > boundary;
+}
+
+// Returns the first window of fcb with an index of at least index, or the list head.
+static LIST_ENTRY* find_extent_window(fcb* fcb, uint64_t index) {
+    LIST_ENTRY* le = fcb->extent_windows.Flink;
+
+    while (le != &fcb->extent_windows) {
+        extent_window* w = CONTAINING_RECORD(le, extent_window, list_entry);
+
+        if (w->index >= index)
+            break;
+
+        le = le->Flink;
+    }
+
+    return le;
+}
+
+// Whether everything between start and start + length is loaded. The caller needs to hold the fcb.
+bool fcb_extents_loaded(fcb* fcb, uint64_t start, uint64_t length) {
+    uint64_t index, last;
+    LIST_ENTRY* le;
+
+    if (!fcb->extents_deferred || length == 0)
+        return true;
+
+    // to the end of the file - we'd have to look at the tree to know where that is
+    if (length > 0xffffffffffffffff - start)
+        return false;
+
+    index = start / EXTENT_WINDOW_SIZE;
+    last = (start + length - 1) / EXTENT_WINDOW_SIZE;
+
+    le = find_extent_window(fcb, index);
+
+    while (index <= last) {
+        if (le == &fcb->extent_windows || CONTAINING_RECORD(le, extent_window, list_entry)->index != index)
+            return false;
+
+        index++;
+        le = le->Flink;
+    }
+
+    return true;
+}
+
+// Frees a window's extents, and the window itself. Taking it off Vcb->extent_windows is up to the caller.
+static void free_extent_window(fcb* fcb, extent_window* w) {
+    uint64_t start = w->index * EXTENT_WINDOW_SIZE;
+    LIST_ENTRY* le = find_extent_index(fcb, start);
+
+    while (le->Blink != &fcb->extents && CONTAINING_RECORD(le->Blink, extent, list_entry)->offset >= start) {
+        le = le->Blink;
+    }
+
+    while (le != &fcb->extents) {
+        LIST_ENTRY* le2 = le->Flink;
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+
+        if (ext->offset >= start + EXTENT_WINDOW_SIZE)
+            break;
+
+        if (ext->offset >= start) {
+            RemoveEntryList(&ext->list_entry);
+
+            if (!ext->ignore)
+                remove_extent_index(fcb, ext);
+
+            if (ext->csum)
+                ExFreePool(ext->csum);
+
+            ExFreePool(ext);
+        }
+
+        le = le2;
+    }
+
+    RemoveEntryList(&w->list_entry);
+    ExFreePool(w);
+}
+
+static NTSTATUS load_extent_window(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, uint64_t index, LIST_ENTRY* wle,
+                                   LIST_ENTRY* new_windows, PIRP Irp) {
+    NTSTATUS Status;
+    KEY searchkey;
+    traverse_ptr tp, next_tp;
+    uint64_t start = index * EXTENT_WINDOW_SIZE, last = start + EXTENT_WINDOW_SIZE - 1;
+    LIST_ENTRY *next, *prev, *le;
+    extent_window* w;
+    ULONG size = sizeof(extent_window);
+    bool b;
+
+    w = ExAllocatePoolWithTag(fcb->pool_type, sizeof(extent_window), ALLOC_TAG);
+    if (!w) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // nothing in the window is in memory yet, so its extents all go before the first one after it
+    next = find_extent_index(fcb, start);
+
+    while (next != &fcb->extents && CONTAINING_RECORD(next, extent, list_entry)->offset < start) {
+        next = next->Flink;
+    }
+
+    prev = next->Blink;
+
+    searchkey.obj_id = fcb->inode;
+    searchkey.obj_type = TYPE_EXTENT_DATA;
+    searchkey.offset = start;
+
+    Status = find_item(Vcb, fcb->subvol, &tp, &searchkey, false, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08lx\n", Status);
+        ExFreePool(w);
+        return Status;
+    }
+
+    do {
+        if (tp.item->key.obj_id > fcb->inode || (tp.item->key.obj_id == fcb->inode && tp.item->key.obj_type > TYPE_EXTENT_DATA))
+            break;
+
+        if (tp.item->key.obj_id == fcb->inode && tp.item->key.obj_type == TYPE_EXTENT_DATA) {
+            if (tp.item->key.offset > last)
+                break;
+
+            if (tp.item->key.offset >= start) {
+                Status = load_extent_item(Vcb, fcb, &tp, next, fcb->pool_type, Irp);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("load_extent_item returned %08lx\n", Status);
+                    goto end;
+                }
+            }
+        }
+
+        b = find_next_item(Vcb, &tp, &next_tp, false, Irp);
+
+        if (b)
+            tp = next_tp;
+    } while (b);
+
+    le = prev->Flink;
+    while (le != next) {
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+
+        if (!(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
+            Status = load_extent_csum(Vcb, ext, Irp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("load_extent_csum returned %08lx\n", Status);
+                goto end;
+            }
+        }
+
+        size += offsetof(extent, extent_data) + ext->datalen;
+
+        if (ext->csum) {
+            EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ext->extent_data.data;
+
+            size += (ULONG)(((ext->extent_data.compression == BTRFS_COMPRESSION_NONE ? ed2->num_bytes : ed2->size) >> Vcb->sector_shift) * Vcb->csum_size);
+        }
+
+        le = le->Flink;
+    }
+
+    w->index = index;
+    w->size = size;
+    w->fcb = fcb;
+    InsertTailList(wle, &w->list_entry);
+    InsertTailList(new_windows, &w->list_entry_vcb);
+
+    return STATUS_SUCCESS;
+
+end:
+    while (prev->Flink != next) {
+        extent* ext = CONTAINING_RECORD(prev->Flink, extent, list_entry);
+
+        RemoveEntryList(&ext->list_entry);
+        remove_extent_index(fcb, ext);
+
+        if (ext->csum)
+            ExFreePool(ext->csum);
+
+        ExFreePool(ext);
+    }
+
+    ExFreePool(w);
+
+    return Status;
+}
+
+// Makes sure everything between start and start + length is loaded, along with anything which
+// overlaps it. If length runs off the end, it means everything up to the end of the file. The
+// caller needs to hold the fcb exclusively.
+NTSTATUS load_fcb_extents(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, uint64_t start, uint64_t length, PIRP Irp) {
+    NTSTATUS Status;
+    traverse_ptr tp;
+    uint64_t first, last, end, index;
+    LIST_ENTRY new_windows, *le;
+    bool found;
+
+    if (fcb_extents_loaded(fcb, start, length))
+        return STATUS_SUCCESS;
+
+    if (length > 0xffffffffffffffff - start) {
+        Status = find_extent_item_before(Vcb, fcb, 0xffffffffffffffff, &tp, &found, Irp);
+        if (!NT_SUCCESS(Status))
+            return Status;
+
+        end = max(fcb->inode_item.st_size, found ? extent_item_end(&tp) : 0);
+        end = max(end, start + 1);
+    } else
+        end = start + length;
+
+    first = start / EXTENT_WINDOW_SIZE;
+    last = (end - 1) / EXTENT_WINDOW_SIZE;
+
+    // pull in the windows of anything that crosses into the range from either side
+
+    while (first > 0) {
+        Status = find_extent_item_before(Vcb, fcb, first * EXTENT_WINDOW_SIZE, &tp, &found, Irp);
+        if (!NT_SUCCESS(Status))
+            return Status;
+
+        if (!found || extent_item_end(&tp) <= first * EXTENT_WINDOW_SIZE)
+            break;
+
+        first = tp.item->key.offset / EXTENT_WINDOW_SIZE;
+    }
+
+    while (last < 0xffffffffffffffff / EXTENT_WINDOW_SIZE) {
+        uint64_t boundary = (last + 1) * EXTENT_WINDOW_SIZE, item_end;
+
+        Status = find_extent_item_before(Vcb, fcb, boundary, &tp, &found, Irp);
+        if (!NT_SUCCESS(Status))
+            return Status;
+
+        if (!found)
+            break;
+
+        item_end = extent_item_end(&tp);
+
+        if (item_end <= boundary)
+            break;
+
+        last = (item_end - 1) / EXTENT_WINDOW_SIZE;
+    }
+
+    InitializeListHead(&new_windows);
+
+    le = find_extent_window(fcb, first);
+
+    for (index = first; index <= last; index++) {
+        if (le != &fcb->extent_windows && CONTAINING_RECORD(le, extent_window, list_entry)->index == index) {
+            le = le->Flink;
+            continue;
+        }
+
+        Status = load_extent_window(Vcb, fcb, index, le, &new_windows, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_extent_window returned %08lx\n", Status);
+
+            // only having some of them would leave extents crossing into windows that aren't loaded
+            while (!IsListEmpty(&new_windows)) {
+                extent_window* w = CONTAINING_RECORD(RemoveHeadList(&new_windows), extent_window, list_entry_vcb);
+
+                free_extent_window(fcb, w);
+            }
+
+            return Status;
+        }
+
+        if (index == 0xffffffffffffffff / EXTENT_WINDOW_SIZE)
+            break;
+    }
+
+    if (!IsListEmpty(&new_windows)) {
+        ExAcquireResourceExclusiveLite(&Vcb->extent_windows_lock, true);
+
+        while (!IsListEmpty(&new_windows)) {
+            extent_window* w = CONTAINING_RECORD(RemoveHeadList(&new_windows), extent_window, list_entry_vcb);
+
+            InsertTailList(&Vcb->extent_windows, &w->list_entry_vcb);
+            Vcb->extent_windows_size += w->size;
+        }
+
+        ExReleaseResourceLite(&Vcb->extent_windows_lock);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// For extend_file, which needs the last extent of the file. A window that isn't loaded is the
+// same in memory as on the disk, so we work back through the data extents on the disk, loading
+// everything from each one onwards, until the last extent in memory is at least as far along.
+NTSTATUS load_fcb_extents_tail(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, PIRP Irp) {
+    NTSTATUS Status;
+    KEY searchkey;
+    traverse_ptr tp, prev_tp;
+    bool b;
+
+    if (!fcb->extents_deferred)
+        return STATUS_SUCCESS;
+
+    Status = load_fcb_extents(Vcb, fcb, fcb->inode_item.st_size, 0xffffffffffffffff, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("load_fcb_extents returned %08lx\n", Status);
+        return Status;
+    }
+
+    searchkey.obj_id = fcb->inode;
+    searchkey.obj_type = TYPE_EXTENT_DATA;
+    searchkey.offset = 0xffffffffffffffff;
+
+    Status = find_item(Vcb, fcb->subvol, &tp, &searchkey, false, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08lx\n", Status);
+        return Status;
+    }
+
+    do {
+        if (tp.item->key.obj_id < fcb->inode || (tp.item->key.obj_id == fcb->inode && tp.item->key.obj_type < TYPE_EXTENT_DATA))
+            break;
+
+        if (!tp.item->ignore && tp.item->key.obj_id == fcb->inode && tp.item->key.obj_type == TYPE_EXTENT_DATA && !extent_item_sparse(&tp)) {
+            avl_node* n;
+
+            Status = load_fcb_extents(Vcb, fcb, tp.item->key.offset, 0xffffffffffffffff, Irp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("load_fcb_extents returned %08lx\n", Status);
+                return Status;
+            }
+
+            n = avl_last(&fcb->extents_tree);
+
+            if (n && CONTAINING_RECORD(n, extent, tree_node)->offset >= tp.item->key.offset - (tp.item->key.offset % EXTENT_WINDOW_SIZE))
+                break;
+        }
+
+        b = find_prev_item(Vcb, &tp, &prev_tp, Irp);
+
+        if (b)
+            tp = prev_tp;
+    } while (b);
+
+    return STATUS_SUCCESS;
+}
+
+// Acquires the fcb shared, with everything between start and start + length loaded. This is
+// for callers which don't already hold the fcb - loading anything means taking the tree lock and
+// holding the fcb exclusively, which then gets converted to shared. Returns STATUS_PENDING if
+// wait is false and we'd have to wait.
+NTSTATUS acquire_fcb_extents(fcb* fcb, uint64_t start, uint64_t length, bool wait, PIRP Irp) {
+    NTSTATUS Status;
+
+    // A cached read can fault in anything else in the Cc view it's using, and read_file can't
+    // load anything then, so round out to whole views.
+    if (length > 0 && length <= 0xffffffffffffffff - start) {
+        uint64_t end = start + length;
+
+        start &= ~(uint64_t)(VACB_MAPPING_GRANULARITY - 1);
+
+        if (end <= 0xffffffffffffffff - VACB_MAPPING_GRANULARITY)
+            end = sector_align(end, VACB_MAPPING_GRANULARITY);
+
+        length = end - start;
+    }
+
+    if (!ExAcquireResourceSharedLite(fcb->Header.Resource, wait))
+        return STATUS_PENDING;
+
+    if (fcb_extents_loaded(fcb, start, length))
+        return STATUS_SUCCESS;
+
+    ExReleaseResourceLite(fcb->Header.Resource);
+
+    if (!ExAcquireResourceSharedLite(&fcb->Vcb->tree_lock, wait))
+        return STATUS_PENDING;
+
+    if (!ExAcquireResourceExclusiveLite(fcb->Header.Resource, wait)) {
+        ExReleaseResourceLite(&fcb->Vcb->tree_lock);
+        return STATUS_PENDING;
+    }
+
+    Status = load_fcb_extents(fcb->Vcb, fcb, start, length, Irp);
+
+    if (NT_SUCCESS(Status))
+        ExConvertExclusiveToSharedLite(fcb->Header.Resource);
+    else {
+        ERR("load_fcb_extents returned %08lx\n", Status);
+        ExReleaseResourceLite(fcb->Header.Resource);
+    }
+
+    ExReleaseResourceLite(&fcb->Vcb->tree_lock);
+
+    return Status;
+}
+
+// Called from reap_fcb, which frees the extents themselves.
+void free_fcb_extent_windows(fcb* fcb) {
+    device_extension* Vcb = fcb->Vcb;
+
+    if (IsListEmpty(&fcb->extent_windows))
+        return;
+
+    ExAcquireResourceExclusiveLite(&Vcb->extent_windows_lock, true);
+
+    while (!IsListEmpty(&fcb->extent_windows)) {
+        extent_window* w = CONTAINING_RECORD(RemoveHeadList(&fcb->extent_windows), extent_window, list_entry);
+
+        RemoveEntryList(&w->list_entry_vcb);
+        Vcb->extent_windows_size -= w->size;
+
+        ExFreePool(w);
+    }
+
+    ExReleaseResourceLite(&Vcb->extent_windows_lock);
+}
+
+// Drops w, along with any neighbouring windows an extent crosses into from it.
+static void drop_extent_window(device_extension* Vcb, fcb* fcb, extent_window* w) {
+    LIST_ENTRY *first = &w->list_entry, *last = &w->list_entry, *le;
+
+    while (first->Blink != &fcb->extent_windows) {
+        uint64_t index = CONTAINING_RECORD(first, extent_window, list_entry)->index;
+
+        if (CONTAINING_RECORD(first->Blink, extent_window, list_entry)->index != index - 1 ||
+            !extent_item_crosses(Vcb, fcb, index * EXTENT_WINDOW_SIZE))
+            break;
+
+        first = first->Blink;
+    }
+
+    while (last->Flink != &fcb->extent_windows) {
+        uint64_t index = CONTAINING_RECORD(last, extent_window, list_entry)->index;
+
+        if (CONTAINING_RECORD(last->Flink, extent_window, list_entry)->index != index + 1 ||
+            !extent_item_crosses(Vcb, fcb, (index + 1) * EXTENT_WINDOW_SIZE))
+            break;
+
+        last = last->Flink;
+    }
+
+    le = first;
+    while (true) {
+        LIST_ENTRY* le2 = le->Flink;
+        extent_window* w2 = CONTAINING_RECORD(le, extent_window, list_entry);
+        bool done = le == last;
+
+        RemoveEntryList(&w2->list_entry_vcb);
+        Vcb->extent_windows_size -= w2->size;
+
+        free_extent_window(fcb, w2);
+
+        if (done)
+            break;
+
+        le = le2;
+    }
+}
+
+// Called from do_flush after the trees have been written. Only files which are clean - with
+// nothing in memory that isn't on the disk - can have windows dropped, and then only if nobody's
+// using them.
+void trim_extent_windows(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb) {
+    LIST_ENTRY* le;
+    ULONG count = 0;
+
+    ExAcquireResourceExclusiveLite(&Vcb->extent_windows_lock, true);
+
+    if (Vcb->extent_windows_size <= EXTENT_WINDOW_CACHE_SIZE) {
+        ExReleaseResourceLite(&Vcb->extent_windows_lock);
+        return;
+    }
+
+    le = Vcb->extent_windows.Flink;
+    while (le != &Vcb->extent_windows) {
+        count++;
+        le = le->Flink;
+    }
+
+    while (count > 0 && !IsListEmpty(&Vcb->extent_windows) && Vcb->extent_windows_size > EXTENT_WINDOW_CACHE_SIZE) {
+        extent_window* w = CONTAINING_RECORD(Vcb->extent_windows.Flink, extent_window, list_entry_vcb);
+        fcb* fcb = w->fcb;
+
+        count--;
+
+        if (ExAcquireResourceExclusiveLite(fcb->Header.Resource, false)) {
+            if (!fcb->extents_changed && IsListEmpty(&fcb->delalloc) && !fcb->deleted && !(fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE)) {
+                drop_extent_window(Vcb, fcb, w);
+                ExReleaseResourceLite(fcb->Header.Resource);
+                continue;
+            }
+
+            ExReleaseResourceLite(fcb->Header.Resource);
+        }
+
+        // try again next time
+        RemoveEntryList(&w->list_entry_vcb);
+        InsertTailList(&Vcb->extent_windows, &w->list_entry_vcb);
+    }
+
+    ExReleaseResourceLite(&Vcb->extent_windows_lock);
+}
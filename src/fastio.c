@@ -342,11 +342,74 @@ static NTSTATUS __stdcall fast_io_release_for_ccflush(PFILE_OBJECT FileObject, P
     return STATUS_SUCCESS;
 }
 
+// FsRtlCopyRead and FsRtlCopyWrite can fault in anything in the Cc views they use, with the fcb
+// only held shared, which isn't enough for read_file to load any extents. If they're not all
+// loaded already, we leave it to the IRP path. The caller needs to hold the tree lock, so that
+// nothing gets dropped in the meantime.
+static bool fast_io_extents_loaded(fcb* fcb, PLARGE_INTEGER FileOffset, ULONG Length, BOOLEAN Wait) {
+    uint64_t start, end;
+    bool ret;
+
+    if (!fcb->extents_deferred)
+        return true;
+
+    if (FileOffset->QuadPart < 0)
+        return false;
+
+    start = FileOffset->QuadPart & ~(uint64_t)(VACB_MAPPING_GRANULARITY - 1);
+    end = sector_align(FileOffset->QuadPart + Length, VACB_MAPPING_GRANULARITY);
+
+    if (!ExAcquireResourceSharedLite(fcb->Header.Resource, Wait))
+        return false;
+
+    ret = fcb_extents_loaded(fcb, start, end - start);
+
+    ExReleaseResourceLite(fcb->Header.Resource);
+
+    return ret;
+}
+
+_Function_class_(FAST_IO_READ)
+static BOOLEAN __stdcall fast_io_read(PFILE_OBJECT FileObject, PLARGE_INTEGER FileOffset, ULONG Length, BOOLEAN Wait, ULONG LockKey, PVOID Buffer, PIO_STATUS_BLOCK IoStatus, PDEVICE_OBJECT DeviceObject) {
+    fcb* fcb = FileObject->FsContext;
+    BOOLEAN ret;
+
+    if (fcb->extents_deferred) {
+        FsRtlEnterFileSystem();
+
+        if (!ExAcquireResourceSharedLite(&fcb->Vcb->tree_lock, Wait)) {
+            FsRtlExitFileSystem();
+            return false;
+        }
+
+        if (!fast_io_extents_loaded(fcb, FileOffset, Length, Wait)) {
+            ExReleaseResourceLite(&fcb->Vcb->tree_lock);
+            FsRtlExitFileSystem();
+            return false;
+        }
+    }
+
+    ret = FsRtlCopyRead(FileObject, FileOffset, Length, Wait, LockKey, Buffer, IoStatus, DeviceObject);
+
+    if (fcb->extents_deferred) {
+        ExReleaseResourceLite(&fcb->Vcb->tree_lock);
+        FsRtlExitFileSystem();
+    }
+
+    if (ret && NT_SUCCESS(IoStatus->Status))
+        readahead_read_done(FileObject, FileOffset, Length);
+
+    return ret;
+}
+
 _Function_class_(FAST_IO_WRITE)
 static BOOLEAN __stdcall fast_io_write(PFILE_OBJECT FileObject, PLARGE_INTEGER FileOffset, ULONG Length, BOOLEAN Wait, ULONG LockKey, PVOID Buffer, PIO_STATUS_BLOCK IoStatus, PDEVICE_OBJECT DeviceObject) {
     fcb* fcb = FileObject->FsContext;
     bool ret;
 
+    if (Wait)
+        throttle_write(fcb->Vcb, Length);
+
     FsRtlEnterFileSystem();
 
     if (!ExAcquireResourceSharedLite(&fcb->Vcb->tree_lock, Wait)) {
@@ -354,6 +417,12 @@ static BOOLEAN __stdcall fast_io_write(PFILE_OBJECT FileObject, PLARGE_INTEGER F
         return false;
     }
 
+    if (!fast_io_extents_loaded(fcb, FileOffset, Length, Wait)) {
+        ExReleaseResourceLite(&fcb->Vcb->tree_lock);
+        FsRtlExitFileSystem();
+        return false;
+    }
+
     ret = FsRtlCopyWrite(FileObject, FileOffset, Length, Wait, LockKey, Buffer, IoStatus, DeviceObject);
 
     if (ret)
@@ -532,7 +601,7 @@ void init_fast_io_dispatch(FAST_IO_DISPATCH** fiod) {
     FastIoDispatch.SizeOfFastIoDispatch = sizeof(FAST_IO_DISPATCH);
 
     FastIoDispatch.FastIoCheckIfPossible = fast_io_check_if_possible;
-    FastIoDispatch.FastIoRead = FsRtlCopyRead;
+    FastIoDispatch.FastIoRead = fast_io_read;
     FastIoDispatch.FastIoWrite = fast_io_write;
     FastIoDispatch.FastIoQueryBasicInfo = fast_query_basic_info;
     FastIoDispatch.FastIoQueryStandardInfo = fast_query_standard_info;
@@ -424,9 +424,16 @@ static NTSTATUS duplicate_fcb(fcb* oldfcb, fcb** pfcb) {
     device_extension* Vcb = oldfcb->Vcb;
     fcb* fcb;
     LIST_ENTRY* le;
+    NTSTATUS Status;
 
     // FIXME - we can skip a lot of this if the inode is about to be deleted
 
+    Status = load_fcb_extents(Vcb, oldfcb, 0, 0xffffffffffffffff, NULL);
+    if (!NT_SUCCESS(Status)) {
+        ERR("load_fcb_extents returned %08lx\n", Status);
+        return Status;
+    }
+
     fcb = create_fcb(Vcb, PagedPool); // FIXME - what if we duplicate the paging file?
     if (!fcb) {
         ERR("out of memory\n");
@@ -540,6 +547,7 @@ static NTSTATUS duplicate_fcb(fcb* oldfcb, fcb** pfcb) {
                 ext2->csum = NULL;
 
             InsertTailList(&fcb->extents, &ext2->list_entry);
+            insert_extent_index(fcb, ext2);
         }
 
         le = le->Flink;
@@ -2380,6 +2388,8 @@ static NTSTATUS rename_file_to_stream(device_extension* Vcb, file_ref* fileref,
         le = le->Flink;
     }
 
+    avl_init(&fileref->fcb->extents_tree, NULL);
+
     while (!IsListEmpty(&fileref->fcb->dir_children_index)) {
         InsertTailList(&dummyfcb->dir_children_index, RemoveHeadList(&fileref->fcb->dir_children_index));
     }
@@ -22,7 +22,8 @@
 #include <ntddscsi.h>
 #include <ntddstor.h>
 
-#define MAX_CSUM_SIZE (4096 - sizeof(tree_header) - sizeof(leaf_node))
+#define FLUSH_SLICE_MIN 64 // fewest fcbs or filerefs worth handing to another thread
+#define WRITE_TREES_BATCH 256 // nodes serialized at a time, while the previous batch is being written
 
 // #define DEBUG_WRITE_LOOPS
 
@@ -737,7 +738,6 @@ static bool insert_tree_extent_skinny(device_extension* Vcb, uint8_t level, uint
 }
 
 bool find_metadata_address_in_chunk(device_extension* Vcb, chunk* c, uint64_t* address) {
-    LIST_ENTRY* le;
     space* s;
 
     TRACE("(%p, %I64x, %p)\n", Vcb, c->offset, address);
@@ -770,51 +770,22 @@ bool find_metadata_address_in_chunk(device_extension* Vcb, chunk* c, uint64_t* a
         }
     }
 
-    le = c->space.Flink;
-    while (le != &c->space) {
-        s = CONTAINING_RECORD(le, space, list_entry);
-
-        if (s->address <= c->last_alloc && s->address + s->size >= c->last_alloc + Vcb->superblock.node_size) {
-            *address = c->last_alloc;
-            c->last_alloc += Vcb->superblock.node_size;
-            return true;
-        }
-
-        le = le->Flink;
-    }
-
-    le = c->space_size.Flink;
-    while (le != &c->space_size) {
-        s = CONTAINING_RECORD(le, space, list_entry_size);
-
-        if (s->size == Vcb->superblock.node_size) {
-            *address = s->address;
-            c->last_alloc = s->address + Vcb->superblock.node_size;
-            return true;
-        } else if (s->size < Vcb->superblock.node_size) {
-            if (le == c->space_size.Flink)
-                return false;
-
-            s = CONTAINING_RECORD(le->Blink, space, list_entry_size);
-
-            *address = s->address;
-            c->last_alloc = s->address + Vcb->superblock.node_size;
-
-            return true;
-        }
+    s = find_space_floor(c, c->last_alloc);
 
-        le = le->Flink;
+    if (s && s->address + s->size >= c->last_alloc + Vcb->superblock.node_size) {
+        *address = c->last_alloc;
+        c->last_alloc += Vcb->superblock.node_size;
+        return true;
     }
 
-    s = CONTAINING_RECORD(c->space_size.Blink, space, list_entry_size);
+    s = find_space_best_fit(c, Vcb->superblock.node_size);
+    if (!s)
+        return false;
 
-    if (s->size > Vcb->superblock.node_size) {
-        *address = s->address;
-        c->last_alloc = s->address + Vcb->superblock.node_size;
-        return true;
-    }
+    *address = s->address;
+    c->last_alloc = s->address + Vcb->superblock.node_size;
 
-    return false;
+    return true;
 }
 
 static bool insert_tree_extent(device_extension* Vcb, uint8_t level, uint64_t root_id, chunk* c, uint64_t* new_address, PIRP Irp, LIST_ENTRY* rollback) {
@@ -1086,6 +1057,12 @@ static bool shared_tree_is_unique(device_extension* Vcb, tree* t, PIRP Irp, LIST
         }
     }
 
+    Status = run_delayed_refs_address(Vcb, t->header.address, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("run_delayed_refs_address returned %08lx\n", Status);
+        return false;
+    }
+
     searchkey.obj_id = t->header.address;
     searchkey.obj_type = Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA ? TYPE_METADATA_ITEM : TYPE_EXTENT_ITEM;
     searchkey.offset = 0xffffffffffffffff;
@@ -1523,6 +1500,10 @@ static NTSTATUS allocate_tree_extents(device_extension* Vcb, PIRP Irp, LIST_ENTR
     if (!changed)
         return STATUS_SUCCESS;
 
+    // COWing shared trees produces lots of backref changes which cancel each other out,
+    // so we queue them up and only apply the net result, in address order.
+    start_delayed_refs(Vcb);
+
     level = max_level;
     do {
         le = Vcb->trees.Flink;
@@ -1533,6 +1514,7 @@ static NTSTATUS allocate_tree_extents(device_extension* Vcb, PIRP Irp, LIST_ENTR
                 Status = update_tree_extents(Vcb, t, Irp, rollback);
                 if (!NT_SUCCESS(Status)) {
                     ERR("update_tree_extents returned %08lx\n", Status);
+                    clear_delayed_refs(Vcb);
                     return Status;
                 }
             }
@@ -1546,6 +1528,12 @@ static NTSTATUS allocate_tree_extents(device_extension* Vcb, PIRP Irp, LIST_ENTR
         level--;
     } while (true);
 
+    Status = run_delayed_refs(Vcb, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("run_delayed_refs returned %08lx\n", Status);
+        return Status;
+    }
+
     return STATUS_SUCCESS;
 }
 
@@ -1727,7 +1715,7 @@ NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, bool no_
 
                 if (stripe->status != WriteDataStatus_Ignore) {
                     wtc[i].need_wait = true;
-                    IoCallDriver(stripe->device->devobj, stripe->Irp);
+                    submit_write(stripe);
                 }
 
                 le = le->Flink;
@@ -1818,17 +1806,119 @@ void calc_tree_checksum(device_extension* Vcb, tree_header* th) {
     }
 }
 
+// Writes t out into data, ready to go to disk. This gets called from the calc threads, so it
+// mustn't change anything in t.
+void serialize_tree(device_extension* Vcb, tree* t, uint8_t* data) {
+    uint8_t* body = data + sizeof(tree_header);
+    LIST_ENTRY* le;
+
+    RtlCopyMemory(data, &t->header, sizeof(tree_header));
+    RtlZeroMemory(body, Vcb->superblock.node_size - sizeof(tree_header));
+
+    if (t->header.level == 0) {
+        leaf_node* itemptr = (leaf_node*)body;
+        int i = 0;
+        uint8_t* dataptr = data + Vcb->superblock.node_size;
+
+        le = t->itemlist.Flink;
+        while (le != &t->itemlist) {
+            tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
+            if (!td->ignore) {
+                dataptr = dataptr - td->size;
+
+                itemptr[i].key = td->key;
+                itemptr[i].offset = (uint32_t)((uint8_t*)dataptr - (uint8_t*)body);
+                itemptr[i].size = td->size;
+                i++;
+
+                if (td->size > 0)
+                    RtlCopyMemory(dataptr, td->data, td->size);
+            }
+
+            le = le->Flink;
+        }
+    } else {
+        internal_node* itemptr = (internal_node*)body;
+        int i = 0;
+
+        le = t->itemlist.Flink;
+        while (le != &t->itemlist) {
+            tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
+            if (!td->ignore) {
+                itemptr[i].key = td->key;
+                itemptr[i].address = td->treeholder.address;
+                itemptr[i].generation = td->treeholder.generation;
+                i++;
+            }
+
+            le = le->Flink;
+        }
+    }
+
+    calc_tree_checksum(Vcb, (tree_header*)data);
+}
+
+static void sift_tree(tree** trees, ULONG root, ULONG end) {
+    while (root * 2 + 1 < end) {
+        ULONG child = root * 2 + 1;
+        tree* tmp;
+
+        if (child + 1 < end && trees[child + 1]->new_address > trees[child]->new_address)
+            child++;
+
+        if (trees[root]->new_address >= trees[child]->new_address)
+            break;
+
+        tmp = trees[root];
+        trees[root] = trees[child];
+        trees[child] = tmp;
+
+        root = child;
+    }
+}
+
+// heapsort, as there can be tens of thousands of these
+static void sort_trees_by_address(tree** trees, ULONG num) {
+    ULONG i;
+
+    for (i = num / 2; i > 0; i--) {
+        sift_tree(trees, i - 1, num);
+    }
+
+    for (i = num; i > 1; i--) {
+        tree* tmp = trees[0];
+
+        trees[0] = trees[i - 1];
+        trees[i - 1] = tmp;
+
+        sift_tree(trees, 0, i - 1);
+    }
+}
+
+static void free_tree_writes(LIST_ENTRY* tree_writes) {
+    while (!IsListEmpty(tree_writes)) {
+        tree_write* tw = CONTAINING_RECORD(RemoveHeadList(tree_writes), tree_write, list_entry);
+
+        if (tw->data)
+            ExFreePool(tw->data);
+
+        ExFreePool(tw);
+    }
+}
+
 static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
-    ULONG level;
-    uint8_t *data, *body;
+    ULONG level, num_trees = 0, n, start, i;
     NTSTATUS Status;
     LIST_ENTRY* le;
-    LIST_ENTRY tree_writes;
+    LIST_ENTRY tree_writes, batch;
     tree_write* tw;
+    tree** trees;
+    tree_write** tws;
 
     TRACE("(%p)\n", Vcb);
 
     InitializeListHead(&tree_writes);
+    InitializeListHead(&batch);
 
     for (level = 0; level <= 255; level++) {
         bool nothing_found = true;
@@ -1907,8 +1997,36 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
     le = Vcb->trees.Flink;
     while (le != &Vcb->trees) {
         tree* t = CONTAINING_RECORD(le, tree, list_entry);
-        LIST_ENTRY* le2;
+
+        if (t->write)
+            num_trees++;
+
+        le = le->Flink;
+    }
+
+    if (num_trees == 0)
+        return STATUS_SUCCESS;
+
+    trees = ExAllocatePoolWithTag(PagedPool, sizeof(tree*) * num_trees, ALLOC_TAG);
+    if (!trees) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    tws = ExAllocatePoolWithTag(PagedPool, sizeof(tree_write*) * min(num_trees, WRITE_TREES_BATCH), ALLOC_TAG);
+    if (!tws) {
+        ERR("out of memory\n");
+        ExFreePool(trees);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    n = 0;
+
+    le = Vcb->trees.Flink;
+    while (le != &Vcb->trees) {
+        tree* t = CONTAINING_RECORD(le, tree, list_entry);
 #ifdef DEBUG_PARANOID
+        LIST_ENTRY* le2;
         uint32_t num_items = 0, size = 0;
         bool crash = false;
 #endif
@@ -1988,97 +2106,88 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
             t->header.fs_uuid = Vcb->superblock.metadata_uuid;
             t->has_address = true;
 
-            data = ExAllocatePoolWithTag(NonPagedPool, Vcb->superblock.node_size, ALLOC_TAG);
-            if (!data) {
-                ERR("out of memory\n");
-                Status = STATUS_INSUFFICIENT_RESOURCES;
-                goto end;
-            }
-
-            body = data + sizeof(tree_header);
-
-            RtlCopyMemory(data, &t->header, sizeof(tree_header));
-            RtlZeroMemory(body, Vcb->superblock.node_size - sizeof(tree_header));
-
-            if (t->header.level == 0) {
-                leaf_node* itemptr = (leaf_node*)body;
-                int i = 0;
-                uint8_t* dataptr = data + Vcb->superblock.node_size;
-
-                le2 = t->itemlist.Flink;
-                while (le2 != &t->itemlist) {
-                    tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
-                    if (!td->ignore) {
-                        dataptr = dataptr - td->size;
-
-                        itemptr[i].key = td->key;
-                        itemptr[i].offset = (uint32_t)((uint8_t*)dataptr - (uint8_t*)body);
-                        itemptr[i].size = td->size;
-                        i++;
+            trees[n] = t;
+            n++;
+        }
 
-                        if (td->size > 0)
-                            RtlCopyMemory(dataptr, td->data, td->size);
-                    }
+        le = le->Flink;
+    }
 
-                    le2 = le2->Flink;
-                }
-            } else {
-                internal_node* itemptr = (internal_node*)body;
-                int i = 0;
+    sort_trees_by_address(trees, num_trees);
 
-                le2 = t->itemlist.Flink;
-                while (le2 != &t->itemlist) {
-                    tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
-                    if (!td->ignore) {
-                        itemptr[i].key = td->key;
-                        itemptr[i].address = td->treeholder.address;
-                        itemptr[i].generation = td->treeholder.generation;
-                        i++;
-                    }
+    // The calc threads serialize and checksum one batch of nodes while we're writing out the last
+    // one, so the disks don't have to wait for every node to be ready before they get anything.
 
-                    le2 = le2->Flink;
-                }
-            }
+    for (start = 0; start < num_trees; start += n) {
+        calc_job cj;
+        KIRQL irql;
+        NTSTATUS Status2;
 
-            calc_tree_checksum(Vcb, (tree_header*)data);
+        n = min(num_trees - start, WRITE_TREES_BATCH);
 
+        for (i = 0; i < n; i++) {
             tw = ExAllocatePoolWithTag(PagedPool, sizeof(tree_write), ALLOC_TAG);
             if (!tw) {
                 ERR("out of memory\n");
-                ExFreePool(data);
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto end;
             }
 
-            tw->address = t->new_address;
+            tw->address = trees[start + i]->new_address;
             tw->length = Vcb->superblock.node_size;
-            tw->data = data;
             tw->allocated = false;
 
-            if (IsListEmpty(&tree_writes))
-                InsertTailList(&tree_writes, &tw->list_entry);
-            else {
-                bool inserted = false;
+            tw->data = ExAllocatePoolWithTag(NonPagedPool, Vcb->superblock.node_size, ALLOC_TAG);
+            if (!tw->data) {
+                ERR("out of memory\n");
+                ExFreePool(tw);
+                Status = STATUS_INSUFFICIENT_RESOURCES;
+                goto end;
+            }
 
-                le2 = tree_writes.Flink;
-                while (le2 != &tree_writes) {
-                    tree_write* tw2 = CONTAINING_RECORD(le2, tree_write, list_entry);
+            InsertTailList(&batch, &tw->list_entry);
+            tws[i] = tw;
+        }
 
-                    if (tw2->address > tw->address) {
-                        InsertHeadList(le2->Blink, &tw->list_entry);
-                        inserted = true;
-                        break;
-                    }
+        cj.in = &trees[start];
+        cj.out = tws;
+        cj.left = cj.not_started = n;
+        cj.type = calc_thread_write_trees;
 
-                    le2 = le2->Flink;
-                }
+        KeInitializeEvent(&cj.event, NotificationEvent, false);
 
-                if (!inserted)
-                    InsertTailList(&tree_writes, &tw->list_entry);
-            }
+        KeAcquireSpinLock(&Vcb->calcthreads.spinlock, &irql);
+
+        InsertTailList(&Vcb->calcthreads.job_list, &cj.list_entry);
+
+        KeSetEvent(&Vcb->calcthreads.event, 0, false);
+        KeClearEvent(&Vcb->calcthreads.event);
+
+        KeReleaseSpinLock(&Vcb->calcthreads.spinlock, irql);
+
+        Status2 = STATUS_SUCCESS;
+
+        if (!IsListEmpty(&tree_writes)) {
+            Status2 = do_tree_writes(Vcb, &tree_writes, false);
+            if (!NT_SUCCESS(Status2))
+                ERR("do_tree_writes returned %08lx\n", Status2);
+
+            free_tree_writes(&tree_writes);
         }
 
-        le = le->Flink;
+        // the job's on our stack, so we have to see it through even if the write failed
+        calc_thread_main(Vcb, &cj);
+
+        KeWaitForSingleObject(&cj.event, Executive, KernelMode, false, NULL);
+
+        while (!IsListEmpty(&batch)) {
+            InsertTailList(&tree_writes, RemoveHeadList(&batch));
+        }
+
+        if (!NT_SUCCESS(Status2)) {
+            Status = Status2;
+            goto end;
+        }
     }
 
     Status = do_tree_writes(Vcb, &tree_writes, false);
@@ -2090,15 +2199,11 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
     Status = STATUS_SUCCESS;
 
 end:
-    while (!IsListEmpty(&tree_writes)) {
-        le = RemoveHeadList(&tree_writes);
-        tw = CONTAINING_RECORD(le, tree_write, list_entry);
+    free_tree_writes(&batch);
+    free_tree_writes(&tree_writes);
 
-        if (tw->data)
-            ExFreePool(tw->data);
-
-        ExFreePool(tw);
-    }
+    ExFreePool(tws);
+    ExFreePool(trees);
 
     return Status;
 }
@@ -2223,7 +2328,7 @@ static void calc_superblock_checksum(superblock* sb) {
     }
 }
 
-static NTSTATUS write_superblock(device_extension* Vcb, device* device, write_superblocks_context* context) {
+static NTSTATUS write_superblock(device_extension* Vcb, device* device, superblock* src, write_superblocks_context* context) {
     unsigned int i = 0;
 
     // All the documentation says that the Linux driver only writes one superblock
@@ -2241,7 +2346,7 @@ static NTSTATUS write_superblock(device_extension* Vcb, device* device, write_su
             return STATUS_INSUFFICIENT_RESOURCES;
         }
 
-        RtlCopyMemory(sb, &Vcb->superblock, sizeof(superblock));
+        RtlCopyMemory(sb, src, sizeof(superblock));
 
         if (sblen > sizeof(superblock))
             RtlZeroMemory((uint8_t*)sb + sizeof(superblock), sblen - sizeof(superblock));
@@ -2320,9 +2425,7 @@ static NTSTATUS write_superblock(device_extension* Vcb, device* device, write_su
 
 static NTSTATUS write_superblocks(device_extension* Vcb, PIRP Irp) {
     uint64_t i;
-    NTSTATUS Status;
     LIST_ENTRY* le;
-    write_superblocks_context context;
 
     TRACE("(%p)\n", Vcb);
 
@@ -2350,6 +2453,15 @@ static NTSTATUS write_superblocks(device_extension* Vcb, PIRP Irp) {
 
     update_backup_superblock(Vcb, &Vcb->superblock.backup[BTRFS_NUM_BACKUP_ROOTS - 1], Irp);
 
+    return write_superblocks2(Vcb, &Vcb->superblock);
+}
+
+// Writes every copy of sb to every device, filling in the device-specific bits as it goes.
+NTSTATUS write_superblocks2(device_extension* Vcb, superblock* sb) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+    write_superblocks_context context;
+
     KeInitializeEvent(&context.Event, NotificationEvent, false);
     InitializeListHead(&context.stripes);
     context.left = 0;
@@ -2359,7 +2471,7 @@ static NTSTATUS write_superblocks(device_extension* Vcb, PIRP Irp) {
         device* dev = CONTAINING_RECORD(le, device, list_entry);
 
         if (dev->devobj && !dev->readonly) {
-            Status = write_superblock(Vcb, dev, &context);
+            Status = write_superblock(Vcb, dev, sb, &context);
             if (!NT_SUCCESS(Status)) {
                 ERR("write_superblock returned %08lx\n", Status);
                 goto end;
@@ -2606,6 +2718,8 @@ void add_checksum_entry(device_extension* Vcb, uint64_t address, ULONG length, v
 
     TRACE("(%p, %I64x, %lx, %p, %p)\n", Vcb, address, length, csum, Irp);
 
+    csum_cache_invalidate(Vcb, address, (uint64_t)length << Vcb->sector_shift);
+
     searchkey.obj_id = EXTENT_CSUM_ID;
     searchkey.obj_type = TYPE_EXTENT_CSUM;
     searchkey.offset = address;
@@ -4401,7 +4515,8 @@ static NTSTATUS delete_xattr(device_extension* Vcb, LIST_ENTRY* batchlist, root*
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS insert_sparse_extent(fcb* fcb, LIST_ENTRY* batchlist, uint64_t start, uint64_t length) {
+// If batchlist is NULL, the item goes straight into the tree.
+static NTSTATUS insert_sparse_extent(fcb* fcb, LIST_ENTRY* batchlist, uint64_t start, uint64_t length, PIRP Irp) {
     NTSTATUS Status;
     EXTENT_DATA* ed;
     EXTENT_DATA2* ed2;
@@ -4427,6 +4542,17 @@ static NTSTATUS insert_sparse_extent(fcb* fcb, LIST_ENTRY* batchlist, uint64_t s
     ed2->offset = 0;
     ed2->num_bytes = length;
 
+    if (!batchlist) {
+        Status = insert_tree_item(fcb->Vcb, fcb->subvol, fcb->inode, TYPE_EXTENT_DATA, start, ed, sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2), NULL, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("insert_tree_item returned %08lx\n", Status);
+            ExFreePool(ed);
+            return Status;
+        }
+
+        return STATUS_SUCCESS;
+    }
+
     Status = insert_tree_item_batch(batchlist, fcb->Vcb, fcb->subvol, fcb->inode, TYPE_EXTENT_DATA, start, ed, sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2), Batch_Insert);
     if (!NT_SUCCESS(Status)) {
         ERR("insert_tree_item_batch returned %08lx\n", Status);
@@ -4811,65 +4937,100 @@ end:
     }
 }
 
-NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
-    traverse_ptr tp;
-    KEY searchkey;
+// The parts of flushing an fcb which look at the trees: writing out the checksums, sorting
+// out the extent refs, and finding the old INODE_ITEM. These have to be done one fcb at a time,
+// but everything else goes on the batch list, so flush_fcb_items can be run in parallel.
+// For files whose extents are loaded in windows (see extent-window.c): deletes the EXTENT_DATA
+// items of each run of loaded windows, which flush_fcb_items then puts back from fcb->extents.
+// Nothing crosses the edge of a run, so the rest of the file's items can be left as they are -
+// apart from after a run, where if the file's been extended there may be a gap to fill with a hole.
+static NTSTATUS flush_fcb_windows(fcb* fcb, PIRP Irp) {
     NTSTATUS Status;
-    INODE_ITEM* ii;
-    uint64_t ii_offset;
-#ifdef DEBUG_PARANOID
-    uint64_t old_size = 0;
-    bool extents_changed;
-#endif
+    LIST_ENTRY* le = fcb->extent_windows.Flink;
+    uint64_t alloc = sector_align(fcb->inode_item.st_size, fcb->Vcb->superblock.sector_size);
 
-    if (fcb->ads) {
-        if (fcb->deleted) {
-            Status = delete_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, fcb->adsxattr.Buffer, fcb->adsxattr.Length, fcb->adshash);
-            if (!NT_SUCCESS(Status)) {
-                ERR("delete_xattr returned %08lx\n", Status);
-                goto end;
-            }
-        } else {
-            Status = set_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, fcb->adsxattr.Buffer, fcb->adsxattr.Length,
-                               fcb->adshash, (uint8_t*)fcb->adsdata.Buffer, fcb->adsdata.Length);
-            if (!NT_SUCCESS(Status)) {
-                ERR("set_xattr returned %08lx\n", Status);
-                goto end;
-            }
+    while (le != &fcb->extent_windows) {
+        extent_window* w = CONTAINING_RECORD(le, extent_window, list_entry);
+        uint64_t run_start = w->index * EXTENT_WINDOW_SIZE, run_end, gap_end;
+        KEY searchkey;
+        traverse_ptr tp, next_tp;
+        bool b;
+
+        while (le->Flink != &fcb->extent_windows && CONTAINING_RECORD(le->Flink, extent_window, list_entry)->index == w->index + 1) {
+            le = le->Flink;
+            w = CONTAINING_RECORD(le, extent_window, list_entry);
         }
 
-        Status = STATUS_SUCCESS;
-        goto end;
-    }
+        run_end = (w->index + 1) * EXTENT_WINDOW_SIZE;
+        le = le->Flink;
 
-    if (fcb->deleted) {
-        Status = insert_tree_item_batch(batchlist, fcb->Vcb, fcb->subvol, fcb->inode, TYPE_INODE_ITEM, 0xffffffffffffffff, NULL, 0, Batch_DeleteInode);
+        gap_end = alloc;
+
+        if (le != &fcb->extent_windows)
+            gap_end = min(gap_end, CONTAINING_RECORD(le, extent_window, list_entry)->index * EXTENT_WINDOW_SIZE);
+
+        searchkey.obj_id = fcb->inode;
+        searchkey.obj_type = TYPE_EXTENT_DATA;
+        searchkey.offset = run_start;
+
+        Status = find_item(fcb->Vcb, fcb->subvol, &tp, &searchkey, false, Irp);
         if (!NT_SUCCESS(Status)) {
-            ERR("insert_tree_item_batch returned %08lx\n", Status);
-            goto end;
+            ERR("find_item returned %08lx\n", Status);
+            return Status;
         }
 
-        if (fcb->marked_as_orphan) {
-            Status = insert_tree_item_batch(batchlist, fcb->Vcb, fcb->subvol, BTRFS_ORPHAN_INODE_OBJID, TYPE_ORPHAN_INODE,
-                                            fcb->inode, NULL, 0, Batch_Delete);
+        do {
+            if (tp.item->key.obj_id > fcb->inode || (tp.item->key.obj_id == fcb->inode && tp.item->key.obj_type > TYPE_EXTENT_DATA))
+                break;
+
+            if (tp.item->key.obj_id == fcb->inode && tp.item->key.obj_type == TYPE_EXTENT_DATA && tp.item->key.offset >= run_start) {
+                if (tp.item->key.offset >= run_end) {
+                    gap_end = min(gap_end, tp.item->key.offset);
+                    break;
+                }
+
+                Status = delete_tree_item(fcb->Vcb, &tp);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("delete_tree_item returned %08lx\n", Status);
+                    return Status;
+                }
+            }
+
+            b = find_next_item(fcb->Vcb, &tp, &next_tp, false, Irp);
+
+            if (b)
+                tp = next_tp;
+        } while (b);
+
+        if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_NO_HOLES) && gap_end > run_end) {
+            Status = insert_sparse_extent(fcb, NULL, run_end, gap_end - run_end, Irp);
             if (!NT_SUCCESS(Status)) {
-                ERR("insert_tree_item_batch returned %08lx\n", Status);
-                goto end;
+                ERR("insert_sparse_extent returned %08lx\n", Status);
+                return Status;
             }
         }
-
-        Status = STATUS_SUCCESS;
-        goto end;
     }
 
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS flush_fcb_tree(fcb* fcb, bool cache, PIRP Irp, uint64_t* ii_offset) {
+    traverse_ptr tp;
+    KEY searchkey;
+    NTSTATUS Status;
+    INODE_ITEM* ii;
 #ifdef DEBUG_PARANOID
-    extents_changed = fcb->extents_changed;
+    uint64_t old_size = 0;
 #endif
 
-    if (fcb->extents_changed) {
-        LIST_ENTRY* le;
-        bool prealloc = false, extents_inline = false;
-        uint64_t last_end;
+    *ii_offset = 0;
+
+    if (fcb->ads || fcb->deleted)
+        return STATUS_SUCCESS;
+
+    if (fcb->extents_changed) {
+        LIST_ENTRY* le;
+        bool prealloc = false;
 
         // delete ignored extent items
         le = fcb->extents.Flink;
@@ -4908,7 +5069,9 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
         }
 
         if (!IsListEmpty(&fcb->extents)) {
-            rationalize_extents(fcb, Irp);
+            // rationalize_extents needs to see every reference the file has to an extent
+            if (!fcb->extents_deferred)
+                rationalize_extents(fcb, Irp);
 
             // merge together adjacent EXTENT_DATAs pointing to same extent
 
@@ -4935,8 +5098,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                 csum = ExAllocatePoolWithTag(NonPagedPool, len * fcb->Vcb->csum_size, ALLOC_TAG);
                                 if (!csum) {
                                     ERR("out of memory\n");
-                                    Status = STATUS_INSUFFICIENT_RESOURCES;
-                                    goto end;
+                                    return STATUS_INSUFFICIENT_RESOURCES;
                                 }
 
                                 RtlCopyMemory(csum, ext->csum, (ULONG)((ed2->num_bytes * fcb->Vcb->csum_size) >> fcb->Vcb->sector_shift));
@@ -4950,6 +5112,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                             ext->extent_data.generation = fcb->Vcb->superblock.generation;
                             ed2->num_bytes += ned2->num_bytes;
 
+                            remove_extent_index(fcb, nextext);
                             RemoveEntryList(&nextext->list_entry);
 
                             if (nextext->csum)
@@ -4966,7 +5129,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                                                 fcb->inode_item.flags & BTRFS_INODE_NODATASUM, false, Irp);
                                 if (!NT_SUCCESS(Status)) {
                                     ERR("update_changed_extent_ref returned %08lx\n", Status);
-                                    goto end;
+                                    return Status;
                                 }
                             }
 
@@ -4979,89 +5142,35 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
             }
         }
 
-        if (!fcb->created) {
-            // delete existing EXTENT_DATA items
-
-            Status = insert_tree_item_batch(batchlist, fcb->Vcb, fcb->subvol, fcb->inode, TYPE_EXTENT_DATA, 0, NULL, 0, Batch_DeleteExtentData);
+        if (fcb->extents_deferred) {
+            Status = flush_fcb_windows(fcb, Irp);
             if (!NT_SUCCESS(Status)) {
-                ERR("insert_tree_item_batch returned %08lx\n", Status);
-                goto end;
+                ERR("flush_fcb_windows returned %08lx\n", Status);
+                return Status;
             }
         }
 
-        // add new EXTENT_DATAs
-
-        last_end = 0;
+        // update prealloc flag in INODE_ITEM
 
         le = fcb->extents.Flink;
         while (le != &fcb->extents) {
             extent* ext = CONTAINING_RECORD(le, extent, list_entry);
-            EXTENT_DATA* ed;
-
-            ext->inserted = false;
-
-            if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_NO_HOLES) && ext->offset > last_end) {
-                Status = insert_sparse_extent(fcb, batchlist, last_end, ext->offset - last_end);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("insert_sparse_extent returned %08lx\n", Status);
-                    goto end;
-                }
-            }
-
-            ed = ExAllocatePoolWithTag(PagedPool, ext->datalen, ALLOC_TAG);
-            if (!ed) {
-                ERR("out of memory\n");
-                Status = STATUS_INSUFFICIENT_RESOURCES;
-                goto end;
-            }
-
-            RtlCopyMemory(ed, &ext->extent_data, ext->datalen);
-
-            Status = insert_tree_item_batch(batchlist, fcb->Vcb, fcb->subvol, fcb->inode, TYPE_EXTENT_DATA, ext->offset,
-                                            ed, ext->datalen, Batch_Insert);
-            if (!NT_SUCCESS(Status)) {
-                ERR("insert_tree_item_batch returned %08lx\n", Status);
-                goto end;
-            }
 
-            if (ed->type == EXTENT_TYPE_PREALLOC)
+            if (ext->extent_data.type == EXTENT_TYPE_PREALLOC) {
                 prealloc = true;
-
-            if (ed->type == EXTENT_TYPE_INLINE)
-                extents_inline = true;
-
-            if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_NO_HOLES)) {
-                if (ed->type == EXTENT_TYPE_INLINE)
-                    last_end = ext->offset + ed->decoded_size;
-                else {
-                    EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
-
-                    last_end = ext->offset + ed2->num_bytes;
-                }
+                break;
             }
 
             le = le->Flink;
         }
 
-        if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_NO_HOLES) && !extents_inline &&
-            sector_align(fcb->inode_item.st_size, fcb->Vcb->superblock.sector_size) > last_end) {
-            Status = insert_sparse_extent(fcb, batchlist, last_end, sector_align(fcb->inode_item.st_size, fcb->Vcb->superblock.sector_size) - last_end);
-            if (!NT_SUCCESS(Status)) {
-                ERR("insert_sparse_extent returned %08lx\n", Status);
-                goto end;
-            }
-        }
-
-        // update prealloc flag in INODE_ITEM
-
-        if (!prealloc)
+        // windows that aren't loaded might have prealloc extents in them
+        if (!prealloc && !fcb->extents_deferred)
             fcb->inode_item.flags &= ~BTRFS_INODE_PREALLOC;
-        else
+        else if (prealloc)
             fcb->inode_item.flags |= BTRFS_INODE_PREALLOC;
 
         fcb->inode_item_changed = true;
-
-        fcb->extents_changed = false;
     }
 
     if ((!fcb->created && fcb->inode_item_changed) || cache) {
@@ -5072,7 +5181,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
         Status = find_item(fcb->Vcb, fcb->subvol, &tp, &searchkey, false, Irp);
         if (!NT_SUCCESS(Status)) {
             ERR("error - find_item returned %08lx\n", Status);
-            goto end;
+            return Status;
         }
 
         if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
@@ -5080,8 +5189,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                 ii = ExAllocatePoolWithTag(PagedPool, sizeof(INODE_ITEM), ALLOC_TAG);
                 if (!ii) {
                     ERR("out of memory\n");
-                    Status = STATUS_INSUFFICIENT_RESOURCES;
-                    goto end;
+                    return STATUS_INSUFFICIENT_RESOURCES;
                 }
 
                 RtlCopyMemory(ii, &fcb->inode_item, sizeof(INODE_ITEM));
@@ -5089,14 +5197,11 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                 Status = insert_tree_item(fcb->Vcb, fcb->subvol, fcb->inode, TYPE_INODE_ITEM, 0, ii, sizeof(INODE_ITEM), NULL, Irp);
                 if (!NT_SUCCESS(Status)) {
                     ERR("insert_tree_item returned %08lx\n", Status);
-                    goto end;
+                    return Status;
                 }
-
-                ii_offset = 0;
             } else {
                 ERR("could not find INODE_ITEM for inode %I64x in subvol %I64x\n", fcb->inode, fcb->subvol->id);
-                Status = STATUS_INTERNAL_ERROR;
-                goto end;
+                return STATUS_INTERNAL_ERROR;
             }
         } else {
 #ifdef DEBUG_PARANOID
@@ -5105,42 +5210,205 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
             old_size = ii2->st_size;
 #endif
 
-            ii_offset = tp.item->key.offset;
+            *ii_offset = tp.item->key.offset;
         }
 
         if (!cache) {
             Status = delete_tree_item(fcb->Vcb, &tp);
             if (!NT_SUCCESS(Status)) {
                 ERR("delete_tree_item returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         } else {
             searchkey.obj_id = fcb->inode;
             searchkey.obj_type = TYPE_INODE_ITEM;
-            searchkey.offset = ii_offset;
+            searchkey.offset = *ii_offset;
 
             Status = find_item(fcb->Vcb, fcb->subvol, &tp, &searchkey, false, Irp);
             if (!NT_SUCCESS(Status)) {
                 ERR("error - find_item returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
 
             if (keycmp(tp.item->key, searchkey)) {
                 ERR("could not find INODE_ITEM for inode %I64x in subvol %I64x\n", fcb->inode, fcb->subvol->id);
-                Status = STATUS_INTERNAL_ERROR;
-                goto end;
+                return STATUS_INTERNAL_ERROR;
             } else
                 RtlCopyMemory(tp.item->data, &fcb->inode_item, min(tp.item->size, sizeof(INODE_ITEM)));
         }
 
 #ifdef DEBUG_PARANOID
-        if (!extents_changed && fcb->type != BTRFS_TYPE_DIRECTORY && old_size != fcb->inode_item.st_size) {
+        if (!fcb->extents_changed && fcb->type != BTRFS_TYPE_DIRECTORY && old_size != fcb->inode_item.st_size) {
             ERR("error - size has changed but extents not marked as changed\n");
             int3;
         }
 #endif
-    } else
-        ii_offset = 0;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Inserts EXTENT_DATA items for the extents from *ple onwards which start before end, with holes
+// in between (and up to end, or the end of the file) unless the filesystem has NO_HOLES.
+static NTSTATUS insert_fcb_extents(fcb* fcb, LIST_ENTRY* batchlist, LIST_ENTRY** ple, uint64_t start, uint64_t end) {
+    NTSTATUS Status;
+    LIST_ENTRY* le = *ple;
+    bool extents_inline = false;
+    uint64_t last_end = start;
+
+    while (le != &fcb->extents) {
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+        EXTENT_DATA* ed;
+
+        if (ext->offset >= end)
+            break;
+
+        ext->inserted = false;
+
+        if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_NO_HOLES) && ext->offset > last_end) {
+            Status = insert_sparse_extent(fcb, batchlist, last_end, ext->offset - last_end, NULL);
+            if (!NT_SUCCESS(Status)) {
+                ERR("insert_sparse_extent returned %08lx\n", Status);
+                return Status;
+            }
+        }
+
+        ed = ExAllocatePoolWithTag(PagedPool, ext->datalen, ALLOC_TAG);
+        if (!ed) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        RtlCopyMemory(ed, &ext->extent_data, ext->datalen);
+
+        Status = insert_tree_item_batch(batchlist, fcb->Vcb, fcb->subvol, fcb->inode, TYPE_EXTENT_DATA, ext->offset,
+                                        ed, ext->datalen, Batch_Insert);
+        if (!NT_SUCCESS(Status)) {
+            ERR("insert_tree_item_batch returned %08lx\n", Status);
+            return Status;
+        }
+
+        if (ed->type == EXTENT_TYPE_INLINE)
+            extents_inline = true;
+
+        if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_NO_HOLES)) {
+            if (ed->type == EXTENT_TYPE_INLINE)
+                last_end = ext->offset + ed->decoded_size;
+            else {
+                EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
+
+                last_end = ext->offset + ed2->num_bytes;
+            }
+        }
+
+        le = le->Flink;
+    }
+
+    *ple = le;
+
+    end = min(end, sector_align(fcb->inode_item.st_size, fcb->Vcb->superblock.sector_size));
+
+    if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_NO_HOLES) && !extents_inline && end > last_end) {
+        Status = insert_sparse_extent(fcb, batchlist, last_end, end - last_end, NULL);
+        if (!NT_SUCCESS(Status)) {
+            ERR("insert_sparse_extent returned %08lx\n", Status);
+            return Status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS flush_fcb_items(fcb* fcb, bool cache, LIST_ENTRY* batchlist, uint64_t ii_offset) {
+    NTSTATUS Status;
+    INODE_ITEM* ii;
+
+    if (fcb->ads) {
+        if (fcb->deleted) {
+            Status = delete_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, fcb->adsxattr.Buffer, fcb->adsxattr.Length, fcb->adshash);
+            if (!NT_SUCCESS(Status)) {
+                ERR("delete_xattr returned %08lx\n", Status);
+                return Status;
+            }
+        } else {
+            Status = set_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, fcb->adsxattr.Buffer, fcb->adsxattr.Length,
+                               fcb->adshash, (uint8_t*)fcb->adsdata.Buffer, fcb->adsdata.Length);
+            if (!NT_SUCCESS(Status)) {
+                ERR("set_xattr returned %08lx\n", Status);
+                return Status;
+            }
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    if (fcb->deleted) {
+        Status = insert_tree_item_batch(batchlist, fcb->Vcb, fcb->subvol, fcb->inode, TYPE_INODE_ITEM, 0xffffffffffffffff, NULL, 0, Batch_DeleteInode);
+        if (!NT_SUCCESS(Status)) {
+            ERR("insert_tree_item_batch returned %08lx\n", Status);
+            return Status;
+        }
+
+        if (fcb->marked_as_orphan) {
+            Status = insert_tree_item_batch(batchlist, fcb->Vcb, fcb->subvol, BTRFS_ORPHAN_INODE_OBJID, TYPE_ORPHAN_INODE,
+                                            fcb->inode, NULL, 0, Batch_Delete);
+            if (!NT_SUCCESS(Status)) {
+                ERR("insert_tree_item_batch returned %08lx\n", Status);
+                return Status;
+            }
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    if (fcb->extents_changed) {
+        LIST_ENTRY* le;
+
+        if (!fcb->created && !fcb->extents_deferred) {
+            // delete existing EXTENT_DATA items
+
+            Status = insert_tree_item_batch(batchlist, fcb->Vcb, fcb->subvol, fcb->inode, TYPE_EXTENT_DATA, 0, NULL, 0, Batch_DeleteExtentData);
+            if (!NT_SUCCESS(Status)) {
+                ERR("insert_tree_item_batch returned %08lx\n", Status);
+                return Status;
+            }
+        }
+
+        // add new EXTENT_DATAs
+
+        le = fcb->extents.Flink;
+
+        if (!fcb->extents_deferred) {
+            Status = insert_fcb_extents(fcb, batchlist, &le, 0, 0xffffffffffffffff);
+            if (!NT_SUCCESS(Status)) {
+                ERR("insert_fcb_extents returned %08lx\n", Status);
+                return Status;
+            }
+        } else {
+            LIST_ENTRY* le2 = fcb->extent_windows.Flink;
+
+            // only the runs of loaded windows, whose old items flush_fcb_windows has deleted
+            while (le2 != &fcb->extent_windows) {
+                extent_window* w = CONTAINING_RECORD(le2, extent_window, list_entry);
+                uint64_t run_start = w->index * EXTENT_WINDOW_SIZE;
+
+                while (le2->Flink != &fcb->extent_windows && CONTAINING_RECORD(le2->Flink, extent_window, list_entry)->index == w->index + 1) {
+                    le2 = le2->Flink;
+                    w = CONTAINING_RECORD(le2, extent_window, list_entry);
+                }
+
+                Status = insert_fcb_extents(fcb, batchlist, &le, run_start, (w->index + 1) * EXTENT_WINDOW_SIZE);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("insert_fcb_extents returned %08lx\n", Status);
+                    return Status;
+                }
+
+                le2 = le2->Flink;
+            }
+        }
+
+        fcb->extents_changed = false;
+    }
 
     fcb->created = false;
 
@@ -5148,8 +5416,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
         ii = ExAllocatePoolWithTag(PagedPool, sizeof(INODE_ITEM), ALLOC_TAG);
         if (!ii) {
             ERR("out of memory\n");
-            Status = STATUS_INSUFFICIENT_RESOURCES;
-            goto end;
+            return STATUS_INSUFFICIENT_RESOURCES;
         }
 
         RtlCopyMemory(ii, &fcb->inode_item, sizeof(INODE_ITEM));
@@ -5158,7 +5425,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                         Batch_Insert);
         if (!NT_SUCCESS(Status)) {
             ERR("insert_tree_item_batch returned %08lx\n", Status);
-            goto end;
+            return Status;
         }
 
         fcb->inode_item_changed = false;
@@ -5170,13 +5437,13 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                EA_NTACL_HASH, (uint8_t*)fcb->sd, (uint16_t)RtlLengthSecurityDescriptor(fcb->sd));
             if (!NT_SUCCESS(Status)) {
                 ERR("set_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         } else {
             Status = delete_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, EA_NTACL, sizeof(EA_NTACL) - 1, EA_NTACL_HASH);
             if (!NT_SUCCESS(Status)) {
                 ERR("delete_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         }
 
@@ -5212,13 +5479,13 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                EA_DOSATTRIB_HASH, val2, (uint16_t)(val + sizeof(val) - val2));
             if (!NT_SUCCESS(Status)) {
                 ERR("set_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         } else {
             Status = delete_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, EA_DOSATTRIB, sizeof(EA_DOSATTRIB) - 1, EA_DOSATTRIB_HASH);
             if (!NT_SUCCESS(Status)) {
                 ERR("delete_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         }
 
@@ -5232,13 +5499,13 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                EA_REPARSE_HASH, (uint8_t*)fcb->reparse_xattr.Buffer, (uint16_t)fcb->reparse_xattr.Length);
             if (!NT_SUCCESS(Status)) {
                 ERR("set_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         } else {
             Status = delete_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, EA_REPARSE, sizeof(EA_REPARSE) - 1, EA_REPARSE_HASH);
             if (!NT_SUCCESS(Status)) {
                 ERR("delete_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         }
 
@@ -5251,13 +5518,13 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                EA_EA_HASH, (uint8_t*)fcb->ea_xattr.Buffer, (uint16_t)fcb->ea_xattr.Length);
             if (!NT_SUCCESS(Status)) {
                 ERR("set_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         } else {
             Status = delete_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, EA_EA, sizeof(EA_EA) - 1, EA_EA_HASH);
             if (!NT_SUCCESS(Status)) {
                 ERR("delete_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         }
 
@@ -5269,7 +5536,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
             Status = delete_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, EA_PROP_COMPRESSION, sizeof(EA_PROP_COMPRESSION) - 1, EA_PROP_COMPRESSION_HASH);
             if (!NT_SUCCESS(Status)) {
                 ERR("delete_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         } else if (fcb->prop_compression == PropCompression_Zlib) {
             static const char zlib[] = "zlib";
@@ -5278,7 +5545,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                EA_PROP_COMPRESSION_HASH, (uint8_t*)zlib, sizeof(zlib) - 1);
             if (!NT_SUCCESS(Status)) {
                 ERR("set_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         } else if (fcb->prop_compression == PropCompression_LZO) {
             static const char lzo[] = "lzo";
@@ -5287,7 +5554,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                EA_PROP_COMPRESSION_HASH, (uint8_t*)lzo, sizeof(lzo) - 1);
             if (!NT_SUCCESS(Status)) {
                 ERR("set_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         } else if (fcb->prop_compression == PropCompression_ZSTD) {
             static const char zstd[] = "zstd";
@@ -5296,7 +5563,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                EA_PROP_COMPRESSION_HASH, (uint8_t*)zstd, sizeof(zstd) - 1);
             if (!NT_SUCCESS(Status)) {
                 ERR("set_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         }
 
@@ -5318,7 +5585,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                     Status = delete_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, xa->data, xa->namelen, hash);
                     if (!NT_SUCCESS(Status)) {
                         ERR("delete_xattr returned %08lx\n", Status);
-                        goto end;
+                        return Status;
                     }
 
                     RemoveEntryList(&xa->list_entry);
@@ -5328,7 +5595,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                        hash, (uint8_t*)&xa->data[xa->namelen], xa->valuelen);
                     if (!NT_SUCCESS(Status)) {
                         ERR("set_xattr returned %08lx\n", Status);
-                        goto end;
+                        return Status;
                     }
 
                     xa->dirty = false;
@@ -5346,7 +5613,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                               sizeof(EA_CASE_SENSITIVE) - 1, EA_CASE_SENSITIVE_HASH);
         if (!NT_SUCCESS(Status)) {
             ERR("delete_xattr returned %08lx\n", Status);
-            goto end;
+            return Status;
         }
 
         fcb->case_sensitive_set = false;
@@ -5355,7 +5622,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                            sizeof(EA_CASE_SENSITIVE) - 1, EA_CASE_SENSITIVE_HASH, (uint8_t*)"1", 1);
         if (!NT_SUCCESS(Status)) {
             ERR("set_xattr returned %08lx\n", Status);
-            goto end;
+            return Status;
         }
 
         fcb->case_sensitive_set = true;
@@ -5366,15 +5633,16 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                         fcb->inode, NULL, 0, Batch_Insert);
         if (!NT_SUCCESS(Status)) {
             ERR("insert_tree_item_batch returned %08lx\n", Status);
-            goto end;
+            return Status;
         }
 
         fcb->marked_as_orphan = true;
     }
 
-    Status = STATUS_SUCCESS;
+    return STATUS_SUCCESS;
+}
 
-end:
+static void clear_fcb_dirty(fcb* fcb) {
     if (fcb->dirty) {
         bool lock = false;
 
@@ -5390,6 +5658,18 @@ end:
         if (lock)
             ExReleaseResourceLite(&fcb->Vcb->dirty_fcbs_lock);
     }
+}
+
+NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
+    NTSTATUS Status;
+    uint64_t ii_offset;
+
+    Status = flush_fcb_tree(fcb, cache, Irp, &ii_offset);
+
+    if (NT_SUCCESS(Status))
+        Status = flush_fcb_items(fcb, cache, batchlist, ii_offset);
+
+    clear_fcb_dirty(fcb);
 
     return Status;
 }
@@ -5427,6 +5707,9 @@ static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, LIST_ENTRY* batchlis
 
     TRACE("dropping chunk %I64x\n", c->offset);
 
+    if (c->chunk_item->type & (BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6))
+        stripe_cache_invalidate(Vcb, c->offset, c->chunk_item->size);
+
     if (c->chunk_item->type & BLOCK_FLAG_RAID0)
         factor = c->chunk_item->num_stripes;
     else if (c->chunk_item->type & BLOCK_FLAG_RAID10)
@@ -5644,6 +5927,7 @@ static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, LIST_ENTRY* batchlis
         remove_from_bootstrap(Vcb, 0x100, TYPE_CHUNK_ITEM, c->offset);
 
     RemoveEntryList(&c->list_entry);
+    update_chunk_map(Vcb);
 
     // clear raid56 incompat flag if dropping last RAID5/6 chunk
 
@@ -5715,8 +5999,9 @@ static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, LIST_ENTRY* batchlis
 
     release_chunk_lock(c, Vcb);
 
+    add_range_lock_stats(Vcb, c);
+
     ExDeleteResourceLite(&c->partial_stripes_lock);
-    ExDeleteResourceLite(&c->range_locks_lock);
     ExDeleteResourceLite(&c->lock);
     ExDeleteResourceLite(&c->changed_extents_lock);
 
@@ -5821,17 +6106,22 @@ static NTSTATUS partial_stripe_read(device_extension* Vcb, chunk* c, partial_str
             }
 
             if (num_errors == 0 || error_stripe == c->chunk_item->num_stripes - 1) {
+                uint8_t* srcs[XOR_MULTI_MAX];
+                uint32_t num_srcs = 0;
+
                 for (k = 0; k < c->chunk_item->num_stripes - 1; k++) {
                     if (k != logstripe) {
                         if (k == 0 || (k == 1 && logstripe == 0)) {
                             RtlCopyMemory(ps->data + (offset << Vcb->sector_shift), scratch + (k * readlen << Vcb->sector_shift),
                                           readlen << Vcb->sector_shift);
                         } else {
-                            do_xor(ps->data + (offset << Vcb->sector_shift), scratch + (k * readlen << Vcb->sector_shift),
-                                   readlen << Vcb->sector_shift);
+                            xor_multi_queue(ps->data + (offset << Vcb->sector_shift), srcs, &num_srcs, scratch + (k * readlen << Vcb->sector_shift),
+                                            readlen << Vcb->sector_shift);
                         }
                     }
                 }
+
+                xor_multi_queue(ps->data + (offset << Vcb->sector_shift), srcs, &num_srcs, NULL, readlen << Vcb->sector_shift);
             } else {
                 raid6_recover2(scratch, c->chunk_item->num_stripes, readlen << Vcb->sector_shift, logstripe,
                                error_stripe, scratch + (c->chunk_item->num_stripes * readlen << Vcb->sector_shift));
@@ -5850,6 +6140,18 @@ static NTSTATUS partial_stripe_read(device_extension* Vcb, chunk* c, partial_str
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS partial_stripe_fill(device_extension* Vcb, chunk* c, partial_stripe* ps, uint8_t* old, uint64_t startoff, uint16_t parity,
+                                    ULONG offset, ULONG len) {
+    if (!old)
+        return partial_stripe_read(Vcb, c, ps, startoff, parity, offset, len);
+
+    RtlCopyMemory(ps->data + (offset << Vcb->sector_shift), old + (offset << Vcb->sector_shift), len << Vcb->sector_shift);
+
+    InterlockedExchangeAdd64((LONG64*)&Vcb->stripe_cache_stats.bytes_not_read, len << Vcb->sector_shift);
+
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS flush_partial_stripe(device_extension* Vcb, chunk* c, partial_stripe* ps) {
     NTSTATUS Status;
     uint16_t parity2, stripe, startoffstripe;
@@ -5858,9 +6160,15 @@ NTSTATUS flush_partial_stripe(device_extension* Vcb, chunk* c, partial_stripe* p
     ULONG runlength, index, last1;
     CHUNK_ITEM_STRIPE* cis = (CHUNK_ITEM_STRIPE*)&c->chunk_item[1];
     LIST_ENTRY* le;
+    space* first_space;
     uint16_t k, num_data_stripes = c->chunk_item->num_stripes - (c->chunk_item->type & BLOCK_FLAG_RAID5 ? 1 : 2);
     uint64_t ps_length = num_data_stripes * c->chunk_item->stripe_length;
     ULONG stripe_length = (ULONG)c->chunk_item->stripe_length;
+    ULONG parity_length = stripe_length * (c->chunk_item->type & BLOCK_FLAG_RAID5 ? 1 : 2);
+    uint8_t* parity;
+    uint8_t* old = NULL;
+    uint8_t* srcs[XOR_MULTI_MAX];
+    uint32_t num_srcs = 0;
 
     // FIXME - do writes asynchronously?
 
@@ -5868,6 +6176,28 @@ NTSTATUS flush_partial_stripe(device_extension* Vcb, chunk* c, partial_stripe* p
 
     parity2 = (((ps->address - c->offset) / ps_length) + c->chunk_item->num_stripes - 1) % c->chunk_item->num_stripes;
 
+    parity = ExAllocatePoolWithTag(NonPagedPool, parity_length, ALLOC_TAG);
+    if (!parity) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // if we've not got the whole stripe, see if the stripe cache has the rest
+
+    if (!RtlAreBitsClear(&ps->bmp, 0, ps->bmplen)) {
+        old = ExAllocatePoolWithTag(NonPagedPool, (ULONG)ps_length + parity_length, ALLOC_TAG);
+        if (!old) {
+            ERR("out of memory\n");
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
+
+        if (!stripe_cache_lookup(Vcb, ps->address, old, (ULONG)ps_length, old + ps_length, parity_length)) {
+            ExFreePool(old);
+            old = NULL;
+        }
+    }
+
     // read data (or reconstruct if degraded)
 
     runlength = RtlFindFirstRunClear(&ps->bmp, &index);
@@ -5885,10 +6215,10 @@ NTSTATUS flush_partial_stripe(device_extension* Vcb, chunk* c, partial_stripe* p
         }
 
         if (index > last1) {
-            Status = partial_stripe_read(Vcb, c, ps, startoff, parity2, last1, index - last1);
+            Status = partial_stripe_fill(Vcb, c, ps, old, startoff, parity2, last1, index - last1);
             if (!NT_SUCCESS(Status)) {
-                ERR("partial_stripe_read returned %08lx\n", Status);
-                return Status;
+                ERR("partial_stripe_fill returned %08lx\n", Status);
+                goto end;
             }
         }
 
@@ -5898,15 +6228,17 @@ NTSTATUS flush_partial_stripe(device_extension* Vcb, chunk* c, partial_stripe* p
     }
 
     if (last1 < ps_length >> Vcb->sector_shift) {
-        Status = partial_stripe_read(Vcb, c, ps, startoff, parity2, last1, (ULONG)((ps_length >> Vcb->sector_shift) - last1));
+        Status = partial_stripe_fill(Vcb, c, ps, old, startoff, parity2, last1, (ULONG)((ps_length >> Vcb->sector_shift) - last1));
         if (!NT_SUCCESS(Status)) {
-            ERR("partial_stripe_read returned %08lx\n", Status);
-            return Status;
+            ERR("partial_stripe_fill returned %08lx\n", Status);
+            goto end;
         }
     }
 
     // set unallocated data to 0
-    le = c->space.Flink;
+    first_space = find_space_floor(c, ps->address);
+    le = first_space ? &first_space->list_entry : c->space.Flink;
+
     while (le != &c->space) {
         space* s = CONTAINING_RECORD(le, space, list_entry);
 
@@ -5944,7 +6276,7 @@ NTSTATUS flush_partial_stripe(device_extension* Vcb, chunk* c, partial_stripe* p
             Status = write_data_phys(c->devices[stripe]->devobj, c->devices[stripe]->fileobj, cis[stripe].offset + startoff, data, stripe_length);
             if (!NT_SUCCESS(Status)) {
                 ERR("write_data_phys returned %08lx\n", Status);
-                return Status;
+                goto end;
             }
         }
 
@@ -5952,77 +6284,110 @@ NTSTATUS flush_partial_stripe(device_extension* Vcb, chunk* c, partial_stripe* p
         stripe = (stripe + 1) % c->chunk_item->num_stripes;
     }
 
-    // write parity
-    if (c->chunk_item->type & BLOCK_FLAG_RAID5) {
-        if (c->devices[parity2]->devobj) {
-            uint16_t i;
+    // work out parity
 
-            for (i = 1; i < c->chunk_item->num_stripes - 1; i++) {
-                do_xor(ps->data, ps->data + (i * stripe_length), stripe_length);
-            }
+    if (old) {
+        // Patch up the old parity with the data stripes that have changed. P gets old ^ new XORed
+        // into it, and for RAID6 Q gets the same multiplied by 2^k.
 
-            Status = write_data_phys(c->devices[parity2]->devobj, c->devices[parity2]->fileobj, cis[parity2].offset + startoff, ps->data, stripe_length);
-            if (!NT_SUCCESS(Status)) {
-                ERR("write_data_phys returned %08lx\n", Status);
-                return Status;
+        RtlCopyMemory(parity, old + ps_length, parity_length);
+
+        for (k = 0; k < num_data_stripes; k++) {
+            uint8_t* olddata = old + (k * stripe_length);
+            uint8_t* newdata = ps->data + (k * stripe_length);
+
+            if (RtlCompareMemory(olddata, newdata, stripe_length) == stripe_length)
+                continue;
+
+            if (c->chunk_item->type & BLOCK_FLAG_RAID5) {
+                xor_multi_queue(parity, srcs, &num_srcs, olddata, stripe_length);
+                xor_multi_queue(parity, srcs, &num_srcs, newdata, stripe_length);
+            } else {
+                do_xor(olddata, newdata, stripe_length);
+
+                xor_multi_queue(parity, srcs, &num_srcs, olddata, stripe_length);
+                galois_mul2(parity + stripe_length, olddata, gpow2((uint8_t)k), 1, stripe_length);
             }
         }
+
+        xor_multi_queue(parity, srcs, &num_srcs, NULL, stripe_length);
+    } else if (c->chunk_item->type & BLOCK_FLAG_RAID5) {
+        RtlCopyMemory(parity, ps->data, stripe_length);
+
+        for (k = 1; k < num_data_stripes; k++) {
+            xor_multi_queue(parity, srcs, &num_srcs, ps->data + (k * stripe_length), stripe_length);
+        }
+
+        xor_multi_queue(parity, srcs, &num_srcs, NULL, stripe_length);
     } else {
-        uint16_t parity1 = (parity2 + c->chunk_item->num_stripes - 1) % c->chunk_item->num_stripes;
+        k = num_data_stripes - 1;
 
-        if (c->devices[parity1]->devobj || c->devices[parity2]->devobj) {
-            uint8_t* scratch;
-            uint16_t i;
+        while (true) {
+            if (k == num_data_stripes - 1) {
+                RtlCopyMemory(parity, ps->data + (k * stripe_length), stripe_length);
+                RtlCopyMemory(parity + stripe_length, ps->data + (k * stripe_length), stripe_length);
+            } else {
+                xor_multi_queue(parity, srcs, &num_srcs, ps->data + (k * stripe_length), stripe_length);
 
-            scratch = ExAllocatePoolWithTag(NonPagedPool, stripe_length * 2, ALLOC_TAG);
-            if (!scratch) {
-                ERR("out of memory\n");
-                return STATUS_INSUFFICIENT_RESOURCES;
+                galois_double(parity + stripe_length, stripe_length);
+                do_xor(parity + stripe_length, ps->data + (k * stripe_length), stripe_length);
             }
 
-            i = c->chunk_item->num_stripes - 3;
-
-            while (true) {
-                if (i == c->chunk_item->num_stripes - 3) {
-                    RtlCopyMemory(scratch, ps->data + (i * stripe_length), stripe_length);
-                    RtlCopyMemory(scratch + stripe_length, ps->data + (i * stripe_length), stripe_length);
-                } else {
-                    do_xor(scratch, ps->data + (i * stripe_length), stripe_length);
+            if (k == 0)
+                break;
 
-                    galois_double(scratch + stripe_length, stripe_length);
-                    do_xor(scratch + stripe_length, ps->data + (i * stripe_length), stripe_length);
-                }
+            k--;
+        }
 
-                if (i == 0)
-                    break;
+        xor_multi_queue(parity, srcs, &num_srcs, NULL, stripe_length);
+    }
 
-                i--;
-            }
+    // write parity
 
-            if (c->devices[parity1]->devobj) {
-                Status = write_data_phys(c->devices[parity1]->devobj, c->devices[parity1]->fileobj, cis[parity1].offset + startoff, scratch, stripe_length);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("write_data_phys returned %08lx\n", Status);
-                    ExFreePool(scratch);
-                    return Status;
-                }
+    if (c->chunk_item->type & BLOCK_FLAG_RAID5) {
+        if (c->devices[parity2]->devobj) {
+            Status = write_data_phys(c->devices[parity2]->devobj, c->devices[parity2]->fileobj, cis[parity2].offset + startoff, parity, stripe_length);
+            if (!NT_SUCCESS(Status)) {
+                ERR("write_data_phys returned %08lx\n", Status);
+                goto end;
             }
+        }
+    } else {
+        uint16_t parity1 = (parity2 + c->chunk_item->num_stripes - 1) % c->chunk_item->num_stripes;
 
-            if (c->devices[parity2]->devobj) {
-                Status = write_data_phys(c->devices[parity2]->devobj, c->devices[parity2]->fileobj, cis[parity2].offset + startoff,
-                                         scratch + stripe_length, stripe_length);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("write_data_phys returned %08lx\n", Status);
-                    ExFreePool(scratch);
-                    return Status;
-                }
+        if (c->devices[parity1]->devobj) {
+            Status = write_data_phys(c->devices[parity1]->devobj, c->devices[parity1]->fileobj, cis[parity1].offset + startoff, parity, stripe_length);
+            if (!NT_SUCCESS(Status)) {
+                ERR("write_data_phys returned %08lx\n", Status);
+                goto end;
             }
+        }
 
-            ExFreePool(scratch);
+        if (c->devices[parity2]->devobj) {
+            Status = write_data_phys(c->devices[parity2]->devobj, c->devices[parity2]->fileobj, cis[parity2].offset + startoff,
+                                     parity + stripe_length, stripe_length);
+            if (!NT_SUCCESS(Status)) {
+                ERR("write_data_phys returned %08lx\n", Status);
+                goto end;
+            }
         }
     }
 
-    return STATUS_SUCCESS;
+    stripe_cache_store(Vcb, ps->address, ps->data, (ULONG)ps_length, parity, parity_length);
+
+    Status = STATUS_SUCCESS;
+
+end:
+    // if we failed halfway through, we don't know what's on the disk any more
+    if (!NT_SUCCESS(Status))
+        stripe_cache_invalidate(Vcb, ps->address, ps_length);
+
+    if (old)
+        ExFreePool(old);
+
+    ExFreePool(parity);
+
+    return Status;
 }
 
 static NTSTATUS update_chunks(device_extension* Vcb, LIST_ENTRY* batchlist, PIRP Irp, LIST_ENTRY* rollback) {
@@ -6803,7 +7168,7 @@ static NTSTATUS flush_fileref(file_ref* fileref, LIST_ENTRY* batchlist, PIRP Irp
     return STATUS_SUCCESS;
 }
 
-static void flush_disk_caches(device_extension* Vcb) {
+void flush_disk_caches(device_extension* Vcb) {
     LIST_ENTRY* le;
     ioctl_context context;
     ULONG num;
@@ -7369,6 +7734,274 @@ static NTSTATUS check_for_orphans(device_extension* Vcb, PIRP Irp) {
     return STATUS_SUCCESS;
 }
 
+void flush_fcb_slice(flush_slice* fs) {
+    ULONG i;
+
+    for (i = 0; i < fs->count; i++) {
+        fcb* fcb = fs->items[i];
+
+        ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
+        fs->Status = flush_fcb_items(fcb, false, &fs->batchlist, fs->ii_offsets[i]);
+        ExReleaseResourceLite(fcb->Header.Resource);
+
+        if (!NT_SUCCESS(fs->Status)) {
+            ERR("flush_fcb_items returned %08lx\n", fs->Status);
+            return;
+        }
+    }
+}
+
+void flush_fileref_slice(flush_slice* fs) {
+    ULONG i;
+
+    for (i = 0; i < fs->count; i++) {
+        flush_fileref(fs->items[i], &fs->batchlist, NULL);
+    }
+}
+
+// Moves everything in batchlist2 into batchlist, keeping each root's items in order. Items
+// with the same key and operation go after the ones already there, as if they'd been added
+// with insert_tree_item_batch.
+static void merge_batch_lists(LIST_ENTRY* batchlist, LIST_ENTRY* batchlist2) {
+    while (!IsListEmpty(batchlist2)) {
+        batch_root* br2 = CONTAINING_RECORD(RemoveHeadList(batchlist2), batch_root, list_entry);
+        batch_root* br = NULL;
+        LIST_ENTRY* le;
+
+        le = batchlist->Flink;
+        while (le != batchlist) {
+            batch_root* br3 = CONTAINING_RECORD(le, batch_root, list_entry);
+
+            if (br3->r == br2->r) {
+                br = br3;
+                break;
+            }
+
+            le = le->Flink;
+        }
+
+        if (!br) {
+            InsertTailList(batchlist, &br2->list_entry);
+            continue;
+        }
+
+        le = br->items.Flink;
+
+        while (!IsListEmpty(&br2->items)) {
+            batch_item* bi2 = CONTAINING_RECORD(RemoveHeadList(&br2->items), batch_item, list_entry);
+
+            while (le != &br->items) {
+                batch_item* bi = CONTAINING_RECORD(le, batch_item, list_entry);
+                int cmp = keycmp(bi->key, bi2->key);
+
+                if (cmp == 1 || (cmp == 0 && bi->operation > bi2->operation))
+                    break;
+
+                le = le->Flink;
+            }
+
+            InsertTailList(le, &bi2->list_entry);
+        }
+
+        ExFreePool(br2);
+    }
+}
+
+// Splits items between the calc threads, each of which builds its own batch list, then merges
+// them into batchlist. The slices are merged in order, so the result is the same as if the
+// items had been done one after the other.
+static NTSTATUS flush_parallel(device_extension* Vcb, enum calc_thread_type type, void** items, uint64_t* ii_offsets,
+                               ULONG count, LIST_ENTRY* batchlist) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    flush_slice* slices;
+    ULONG num_slices, start, i;
+    calc_job cj;
+    KIRQL irql;
+
+    if (count == 0)
+        return STATUS_SUCCESS;
+
+    num_slices = min(Vcb->calcthreads.num_threads + 1, count / FLUSH_SLICE_MIN);
+
+    if (num_slices == 0)
+        num_slices = 1;
+
+    slices = ExAllocatePoolWithTag(PagedPool, sizeof(flush_slice) * num_slices, ALLOC_TAG);
+    if (!slices) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    start = 0;
+
+    for (i = 0; i < num_slices; i++) {
+        ULONG end = (ULONG)(((uint64_t)count * (i + 1)) / num_slices);
+
+        slices[i].items = &items[start];
+        slices[i].ii_offsets = ii_offsets ? &ii_offsets[start] : NULL;
+        slices[i].count = end - start;
+        InitializeListHead(&slices[i].batchlist);
+        slices[i].Status = STATUS_SUCCESS;
+
+        start = end;
+    }
+
+    cj.in = slices;
+    cj.out = NULL;
+    cj.left = cj.not_started = num_slices;
+    cj.type = type;
+
+    KeInitializeEvent(&cj.event, NotificationEvent, false);
+
+    KeAcquireSpinLock(&Vcb->calcthreads.spinlock, &irql);
+
+    InsertTailList(&Vcb->calcthreads.job_list, &cj.list_entry);
+
+    KeSetEvent(&Vcb->calcthreads.event, 0, false);
+    KeClearEvent(&Vcb->calcthreads.event);
+
+    KeReleaseSpinLock(&Vcb->calcthreads.spinlock, irql);
+
+    calc_thread_main(Vcb, &cj);
+
+    KeWaitForSingleObject(&cj.event, Executive, KernelMode, false, NULL);
+
+    for (i = 0; i < num_slices; i++) {
+        if (!NT_SUCCESS(slices[i].Status) && NT_SUCCESS(Status))
+            Status = slices[i].Status;
+
+        merge_batch_lists(batchlist, &slices[i].batchlist);
+    }
+
+    ExFreePool(slices);
+
+    return Status;
+}
+
+static NTSTATUS flush_dirty_filerefs(device_extension* Vcb, LIST_ENTRY* batchlist, PIRP Irp) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+    ULONG num_filerefs = 0, n = 0, i;
+    file_ref** filerefs;
+
+    le = Vcb->dirty_filerefs.Flink;
+    while (le != &Vcb->dirty_filerefs) {
+        num_filerefs++;
+        le = le->Flink;
+    }
+
+    if (num_filerefs == 0)
+        return STATUS_SUCCESS;
+
+    filerefs = ExAllocatePoolWithTag(PagedPool, sizeof(file_ref*) * num_filerefs, ALLOC_TAG);
+    if (!filerefs) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    while (!IsListEmpty(&Vcb->dirty_filerefs)) {
+        file_ref* fr = CONTAINING_RECORD(RemoveHeadList(&Vcb->dirty_filerefs), file_ref, list_entry_dirty);
+
+        // ROOT_REFs get changed in the root tree directly, so subvolumes have to be done here
+        if (!(fr->created && fr->deleted) && !fr->fcb->ads && fr->parent->fcb->subvol != fr->fcb->subvol && fr->fcb != Vcb->dummy_fcb) {
+            flush_fileref(fr, batchlist, Irp);
+            free_fileref(fr);
+        } else {
+            filerefs[n] = fr;
+            n++;
+        }
+    }
+
+    Status = flush_parallel(Vcb, calc_thread_flush_filerefs, (void**)filerefs, NULL, n, batchlist);
+    if (!NT_SUCCESS(Status))
+        ERR("flush_parallel returned %08lx\n", Status);
+
+    for (i = 0; i < n; i++) {
+        free_fileref(filerefs[i]);
+    }
+
+    ExFreePool(filerefs);
+
+    return Status;
+}
+
+// Flushes the dirty fcbs which have been deleted or, if deleted is false, all the others apart
+// from those in the root tree. The caller needs to hold dirty_fcbs_lock.
+static NTSTATUS flush_dirty_fcbs(device_extension* Vcb, bool deleted, LIST_ENTRY* batchlist, PIRP Irp) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    LIST_ENTRY* le;
+    ULONG num_fcbs = 0, num_done, i;
+    fcb** fcbs;
+    uint64_t* ii_offsets;
+
+    le = Vcb->dirty_fcbs.Flink;
+    while (le != &Vcb->dirty_fcbs) {
+        fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry_dirty);
+
+        if (deleted ? fcb->deleted : fcb->subvol != Vcb->root_root)
+            num_fcbs++;
+
+        le = le->Flink;
+    }
+
+    if (num_fcbs == 0)
+        return STATUS_SUCCESS;
+
+    ii_offsets = ExAllocatePoolWithTag(PagedPool, (sizeof(uint64_t) + sizeof(fcb*)) * num_fcbs, ALLOC_TAG);
+    if (!ii_offsets) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    fcbs = (fcb**)&ii_offsets[num_fcbs];
+
+    i = 0;
+
+    le = Vcb->dirty_fcbs.Flink;
+    while (le != &Vcb->dirty_fcbs) {
+        fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry_dirty);
+
+        if (deleted ? fcb->deleted : fcb->subvol != Vcb->root_root) {
+            fcbs[i] = fcb;
+            i++;
+        }
+
+        le = le->Flink;
+    }
+
+    // Anything that looks at the trees has to be done one fcb at a time. As we've got tree_lock
+    // exclusively, nothing else can change the fcbs before flush_fcb_items gets to them.
+
+    num_done = num_fcbs;
+
+    for (i = 0; i < num_fcbs; i++) {
+        ExAcquireResourceExclusiveLite(fcbs[i]->Header.Resource, true);
+        Status = flush_fcb_tree(fcbs[i], false, Irp, &ii_offsets[i]);
+        ExReleaseResourceLite(fcbs[i]->Header.Resource);
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("flush_fcb_tree returned %08lx\n", Status);
+            num_done = i + 1;
+            break;
+        }
+    }
+
+    if (NT_SUCCESS(Status)) {
+        Status = flush_parallel(Vcb, calc_thread_flush_fcbs, (void**)fcbs, ii_offsets, num_fcbs, batchlist);
+        if (!NT_SUCCESS(Status))
+            ERR("flush_parallel returned %08lx\n", Status);
+    }
+
+    for (i = 0; i < num_done; i++) {
+        clear_fcb_dirty(fcbs[i]);
+        free_fcb(fcbs[i]);
+    }
+
+    ExFreePool(ii_offsets);
+
+    return Status;
+}
+
 static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
     LIST_ENTRY *le, batchlist;
@@ -7376,7 +8009,6 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
     volume_device_extension* vde;
     bool no_cache = false;
 #ifdef DEBUG_FLUSH_TIMES
-    uint64_t filerefs = 0, fcbs = 0;
     LARGE_INTEGER freq, time1, time2;
 #endif
 #ifdef DEBUG_WRITE_LOOPS
@@ -7391,6 +8023,45 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
     time1 = KeQueryPerformanceCounter(&freq);
 #endif
 
+    // Once this commit's superblocks are written the tree log isn't needed any more, so its blocks
+    // can go back on the free list - they won't be reused until the commit is on disk.
+
+    drop_tree_log(Vcb);
+
+    // Allocate space for anything that's been waiting for it. This has to happen before the
+    // allocation clusters are released, so that the space they reserve isn't left counted as used.
+
+    ExAcquireResourceExclusiveLite(&Vcb->dirty_fcbs_lock, true);
+
+    le = Vcb->dirty_fcbs.Flink;
+    while (le != &Vcb->dirty_fcbs) {
+        fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry_dirty);
+
+        if (!IsListEmpty(&fcb->delalloc)) {
+            ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
+
+            if (fcb->deleted) {
+                delalloc_free_fcb(fcb);
+                Status = STATUS_SUCCESS;
+            } else
+                Status = delalloc_flush_fcb(fcb, Irp, rollback);
+
+            ExReleaseResourceLite(fcb->Header.Resource);
+
+            if (!NT_SUCCESS(Status)) {
+                ERR("delalloc_flush_fcb returned %08lx\n", Status);
+                ExReleaseResourceLite(&Vcb->dirty_fcbs_lock);
+                return Status;
+            }
+        }
+
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&Vcb->dirty_fcbs_lock);
+
+    release_alloc_clusters(Vcb);
+
     Status = check_for_orphans(Vcb, Irp);
     if (!NT_SUCCESS(Status)) {
         ERR("check_for_orphans returned %08lx\n", Status);
@@ -7399,19 +8070,16 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
 
     ExAcquireResourceExclusiveLite(&Vcb->dirty_filerefs_lock, true);
 
-    while (!IsListEmpty(&Vcb->dirty_filerefs)) {
-        file_ref* fr = CONTAINING_RECORD(RemoveHeadList(&Vcb->dirty_filerefs), file_ref, list_entry_dirty);
+    Status = flush_dirty_filerefs(Vcb, &batchlist, Irp);
 
-        flush_fileref(fr, &batchlist, Irp);
-        free_fileref(fr);
+    ExReleaseResourceLite(&Vcb->dirty_filerefs_lock);
 
-#ifdef DEBUG_FLUSH_TIMES
-        filerefs++;
-#endif
+    if (!NT_SUCCESS(Status)) {
+        ERR("flush_dirty_filerefs returned %08lx\n", Status);
+        clear_batch_list(Vcb, &batchlist);
+        return Status;
     }
 
-    ExReleaseResourceLite(&Vcb->dirty_filerefs_lock);
-
     Status = commit_batch_list(Vcb, &batchlist, Irp);
     if (!NT_SUCCESS(Status)) {
         ERR("commit_batch_list returned %08lx\n", Status);
@@ -7421,7 +8089,7 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
 #ifdef DEBUG_FLUSH_TIMES
     time2 = KeQueryPerformanceCounter(NULL);
 
-    ERR("flushed %I64u filerefs in %I64u (freq = %I64u)\n", filerefs, time2.QuadPart - time1.QuadPart, freq.QuadPart);
+    ERR("flushed filerefs in %I64u (freq = %I64u)\n", time2.QuadPart - time1.QuadPart, freq.QuadPart);
 
     time1 = KeQueryPerformanceCounter(&freq);
 #endif
@@ -7433,31 +8101,12 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
 
     ExAcquireResourceExclusiveLite(&Vcb->dirty_fcbs_lock, true);
 
-    le = Vcb->dirty_fcbs.Flink;
-    while (le != &Vcb->dirty_fcbs) {
-        fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry_dirty);
-        LIST_ENTRY* le2 = le->Flink;
-
-        if (fcb->deleted) {
-            ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
-            Status = flush_fcb(fcb, false, &batchlist, Irp);
-            ExReleaseResourceLite(fcb->Header.Resource);
-
-            free_fcb(fcb);
-
-            if (!NT_SUCCESS(Status)) {
-                ERR("flush_fcb returned %08lx\n", Status);
-                clear_batch_list(Vcb, &batchlist);
-                ExReleaseResourceLite(&Vcb->dirty_fcbs_lock);
-                return Status;
-            }
-
-#ifdef DEBUG_FLUSH_TIMES
-            fcbs++;
-#endif
-        }
-
-        le = le2;
+    Status = flush_dirty_fcbs(Vcb, true, &batchlist, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("flush_dirty_fcbs returned %08lx\n", Status);
+        clear_batch_list(Vcb, &batchlist);
+        ExReleaseResourceLite(&Vcb->dirty_fcbs_lock);
+        return Status;
     }
 
     Status = commit_batch_list(Vcb, &batchlist, Irp);
@@ -7467,29 +8116,11 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
         return Status;
     }
 
-    le = Vcb->dirty_fcbs.Flink;
-    while (le != &Vcb->dirty_fcbs) {
-        fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry_dirty);
-        LIST_ENTRY* le2 = le->Flink;
-
-        if (fcb->subvol != Vcb->root_root) {
-            ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
-            Status = flush_fcb(fcb, false, &batchlist, Irp);
-            ExReleaseResourceLite(fcb->Header.Resource);
-            free_fcb(fcb);
-
-            if (!NT_SUCCESS(Status)) {
-                ERR("flush_fcb returned %08lx\n", Status);
-                ExReleaseResourceLite(&Vcb->dirty_fcbs_lock);
-                return Status;
-            }
-
-#ifdef DEBUG_FLUSH_TIMES
-            fcbs++;
-#endif
-        }
-
-        le = le2;
+    Status = flush_dirty_fcbs(Vcb, false, &batchlist, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("flush_dirty_fcbs returned %08lx\n", Status);
+        ExReleaseResourceLite(&Vcb->dirty_fcbs_lock);
+        return Status;
     }
 
     ExReleaseResourceLite(&Vcb->dirty_fcbs_lock);
@@ -7503,7 +8134,7 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
 #ifdef DEBUG_FLUSH_TIMES
     time2 = KeQueryPerformanceCounter(NULL);
 
-    ERR("flushed %I64u fcbs in %I64u (freq = %I64u)\n", filerefs, time2.QuadPart - time1.QuadPart, freq.QuadPart);
+    ERR("flushed fcbs in %I64u (freq = %I64u)\n", time2.QuadPart - time1.QuadPart, freq.QuadPart);
 #endif
 
     // no need to get dirty_subvols_lock here, as we have tree_lock exclusively
@@ -7706,6 +8337,9 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
         goto end;
     }
 
+    // superblocks written by the tree log are based on this one
+    RtlCopyMemory(&Vcb->tree_log_sb, &Vcb->superblock, sizeof(superblock));
+
     vde = Vcb->vde;
 
     if (vde) {
@@ -7775,6 +8409,8 @@ NTSTATUS do_write(device_extension* Vcb, PIRP Irp) {
 
     InitializeListHead(&rollback);
 
+    throttle_commit_start(Vcb);
+
     Status = do_write2(Vcb, Irp, &rollback);
 
     if (!NT_SUCCESS(Status)) {
@@ -7782,8 +8418,10 @@ NTSTATUS do_write(device_extension* Vcb, PIRP Irp) {
         Vcb->readonly = true;
         FsRtlNotifyVolumeEvent(Vcb->root_file, FSRTL_VOLUME_FORCED_CLOSED);
         do_rollback(Vcb, &rollback);
-    } else
+    } else {
         clear_rollback(&rollback);
+        throttle_commit_end(Vcb);
+    }
 
     return Status;
 }
@@ -7798,6 +8436,8 @@ static void do_flush(device_extension* Vcb) {
     else
         Status = STATUS_SUCCESS;
 
+    trim_extent_windows(Vcb);
+
     free_trees(Vcb);
 
     if (!NT_SUCCESS(Status))
@@ -7826,10 +8466,24 @@ void __stdcall flush_thread(void* context) {
         if (!(devobj->Vpb->Flags & VPB_MOUNTED) || Vcb->removing)
             break;
 
-        if (!Vcb->locked)
+        if (!Vcb->locked) {
+            bool idle = !Vcb->need_write;
+
             do_flush(Vcb);
 
-        KeSetTimer(&Vcb->flush_thread_timer, due_time, NULL);
+            // only rewrite anything if nobody else has been writing
+            if (idle && Vcb->options.autodefrag && !Vcb->readonly)
+                do_autodefrag(Vcb);
+        }
+
+        // if we got to the dirty limit while we were busy, go round again straight away
+        if (Vcb->flush_kicked && Vcb->need_write && !Vcb->locked && !Vcb->readonly) {
+            LARGE_INTEGER now;
+
+            now.QuadPart = 0;
+            KeSetTimer(&Vcb->flush_thread_timer, now, NULL);
+        } else
+            KeSetTimer(&Vcb->flush_thread_timer, due_time, NULL);
     }
 
     ObDereferenceObject(devobj);
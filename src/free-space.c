@@ -187,6 +187,147 @@ NTSTATUS clear_free_space_cache(device_extension* Vcb, LIST_ENTRY* batchlist, PI
     return Status;
 }
 
+static void space_tree_update(avl_node* n) {
+    space* s = CONTAINING_RECORD(n, space, tree_node);
+
+    s->max_size = s->size;
+
+    if (n->left) {
+        space* s2 = CONTAINING_RECORD(n->left, space, tree_node);
+
+        if (s2->max_size > s->max_size)
+            s->max_size = s2->max_size;
+    }
+
+    if (n->right) {
+        space* s2 = CONTAINING_RECORD(n->right, space, tree_node);
+
+        if (s2->max_size > s->max_size)
+            s->max_size = s2->max_size;
+    }
+}
+
+void init_space_index(chunk* c) {
+    InitializeListHead(&c->space);
+    InitializeListHead(&c->space_size);
+
+    avl_init(&c->space_tree, space_tree_update);
+    avl_init(&c->space_size_tree, NULL);
+}
+
+// Only the free space lists of chunks are sorted by size as well as by address,
+// and it's only these which are indexed by the trees in the chunk.
+static __inline chunk* space_list_chunk(LIST_ENTRY* list_size) {
+    return CONTAINING_RECORD(list_size, chunk, space_size);
+}
+
+// returns the entry with the highest address not greater than address
+space* find_space_floor(chunk* c, uint64_t address) {
+    avl_node* n = c->space_tree.root;
+    space* ret = NULL;
+
+    while (n) {
+        space* s = CONTAINING_RECORD(n, space, tree_node);
+
+        if (s->address <= address) {
+            ret = s;
+            n = n->right;
+        } else
+            n = n->left;
+    }
+
+    return ret;
+}
+
+// returns the smallest entry of at least length, preferring lower addresses if there's a tie
+space* find_space_best_fit(chunk* c, uint64_t length) {
+    avl_node* n = c->space_size_tree.root;
+    space* ret = NULL;
+
+    while (n) {
+        space* s = CONTAINING_RECORD(n, space, tree_node_size);
+
+        if (s->size >= length) {
+            ret = s;
+            n = n->left;
+        } else
+            n = n->right;
+    }
+
+    return ret;
+}
+
+// returns the entry with the lowest address which is at least length
+space* find_space_first_fit(chunk* c, uint64_t length) {
+    avl_node* n = c->space_tree.root;
+
+    if (!n || CONTAINING_RECORD(n, space, tree_node)->max_size < length)
+        return NULL;
+
+    while (true) {
+        space* s = CONTAINING_RECORD(n, space, tree_node);
+
+        if (n->left && CONTAINING_RECORD(n->left, space, tree_node)->max_size >= length)
+            n = n->left;
+        else if (s->size >= length)
+            return s;
+        else
+            n = n->right;
+    }
+}
+
+// Adds s, which should already be in the address list, to the size list and to both trees.
+static void order_space_entry(space* s, LIST_ENTRY* list_size) {
+    chunk* c = space_list_chunk(list_size);
+    avl_node** link;
+    avl_node* parent = NULL;
+    avl_node* next;
+
+    link = &c->space_tree.root;
+    while (*link) {
+        parent = *link;
+
+        if (s->address < CONTAINING_RECORD(parent, space, tree_node)->address)
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+
+    avl_insert(&c->space_tree, &s->tree_node, parent, link);
+
+    parent = NULL;
+    link = &c->space_size_tree.root;
+    while (*link) {
+        space* s2 = CONTAINING_RECORD(*link, space, tree_node_size);
+
+        parent = *link;
+
+        if (s->size < s2->size || (s->size == s2->size && s->address < s2->address))
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+
+    avl_insert(&c->space_size_tree, &s->tree_node_size, parent, link);
+
+    // The size list is in descending order, so the new entry goes after the next largest one.
+    next = avl_next(&s->tree_node_size);
+
+    if (next)
+        InsertHeadList(&CONTAINING_RECORD(next, space, tree_node_size)->list_entry_size, &s->list_entry_size);
+    else
+        InsertHeadList(list_size, &s->list_entry_size);
+}
+
+static void remove_space_entry_size(space* s, LIST_ENTRY* list_size) {
+    chunk* c = space_list_chunk(list_size);
+
+    RemoveEntryList(&s->list_entry_size);
+
+    avl_remove(&c->space_size_tree, &s->tree_node_size);
+    avl_remove(&c->space_tree, &s->tree_node);
+}
+
 NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t offset, uint64_t size) {
     space* s;
 
@@ -200,6 +341,19 @@ NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t offse
     s->address = offset;
     s->size = size;
 
+    if (list_size) {
+        space* s2 = find_space_floor(space_list_chunk(list_size), offset);
+
+        if (s2)
+            InsertHeadList(&s2->list_entry, &s->list_entry);
+        else
+            InsertHeadList(list, &s->list_entry);
+
+        order_space_entry(s, list_size);
+
+        return STATUS_SUCCESS;
+    }
+
     if (IsListEmpty(list))
         InsertTailList(list, &s->list_entry);
     else {
@@ -216,34 +370,6 @@ NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t offse
 
                 if (s2->address > offset) {
                     InsertTailList(le, &s->list_entry);
-                    goto size;
-                }
-
-                le = le->Flink;
-            }
-        }
-    }
-
-size:
-    if (!list_size)
-        return STATUS_SUCCESS;
-
-    if (IsListEmpty(list_size))
-        InsertTailList(list_size, &s->list_entry_size);
-    else {
-        space* s2 = CONTAINING_RECORD(list_size->Blink, space, list_entry_size);
-
-        if (s2->size >= size)
-            InsertTailList(list_size, &s->list_entry_size);
-        else {
-            LIST_ENTRY* le;
-
-            le = list_size->Flink;
-            while (le != list_size) {
-                s2 = CONTAINING_RECORD(le, space, list_entry_size);
-
-                if (s2->size <= size) {
-                    InsertHeadList(le->Blink, &s->list_entry_size);
                     return STATUS_SUCCESS;
                 }
 
@@ -296,30 +422,6 @@ static void load_free_space_bitmap(device_extension* Vcb, chunk* c, uint64_t off
     }
 }
 
-static void order_space_entry(space* s, LIST_ENTRY* list_size) {
-    LIST_ENTRY* le;
-
-    if (IsListEmpty(list_size)) {
-        InsertHeadList(list_size, &s->list_entry_size);
-        return;
-    }
-
-    le = list_size->Flink;
-
-    while (le != list_size) {
-        space* s2 = CONTAINING_RECORD(le, space, list_entry_size);
-
-        if (s2->size <= s->size) {
-            InsertHeadList(le->Blink, &s->list_entry_size);
-            return;
-        }
-
-        le = le->Flink;
-    }
-
-    InsertTailList(list_size, &s->list_entry_size);
-}
-
 typedef struct {
     uint64_t stripe;
     LIST_ENTRY list_entry;
@@ -668,10 +770,10 @@ NTSTATUS load_stored_free_space_cache(device_extension* Vcb, chunk* c, bool load
                 s->size += s2->size;
 
                 RemoveEntryList(&s2->list_entry);
-                RemoveEntryList(&s2->list_entry_size);
+                remove_space_entry_size(s2, &c->space_size);
                 ExFreePool(s2);
 
-                RemoveEntryList(&s->list_entry_size);
+                remove_space_entry_size(s, &c->space_size);
                 order_space_entry(s, &c->space_size);
 
                 le2 = le;
@@ -717,7 +819,7 @@ clearcache:
         LIST_ENTRY* le2 = le->Flink;
 
         RemoveEntryList(&s->list_entry);
-        RemoveEntryList(&s->list_entry_size);
+        remove_space_entry_size(s, &c->space_size);
         ExFreePool(s);
 
         le = le2;
@@ -867,10 +969,10 @@ static NTSTATUS load_stored_free_space_tree(device_extension* Vcb, chunk* c, PIR
                 s->size += s2->size;
 
                 RemoveEntryList(&s2->list_entry);
-                RemoveEntryList(&s2->list_entry_size);
+                remove_space_entry_size(s2, &c->space_size);
                 ExFreePool(s2);
 
-                RemoveEntryList(&s->list_entry_size);
+                remove_space_entry_size(s, &c->space_size);
                 order_space_entry(s, &c->space_size);
 
                 le2 = le;
@@ -996,6 +1098,242 @@ NTSTATUS load_cache_chunk(device_extension* Vcb, chunk* c, PIRP Irp) {
     return STATUS_SUCCESS;
 }
 
+// If wait is false, we return STATUS_CANT_WAIT rather than blocking on the tree or chunk
+// locks. The calc threads have to do this, as whoever holds them might be waiting on a calc job.
+NTSTATUS preload_cache_chunk(device_extension* Vcb, uint64_t address, bool wait) {
+    NTSTATUS Status;
+    chunk* c;
+
+    if (Vcb->cache_preload.stopping)
+        return STATUS_SUCCESS;
+
+    if (!ExAcquireResourceSharedLite(&Vcb->tree_lock, wait))
+        return STATUS_CANT_WAIT;
+
+    c = get_chunk_from_address(Vcb, address);
+
+    if (!c || c->cache_loaded) { // chunk removed, or already loaded by a writer
+        ExReleaseResourceLite(&Vcb->tree_lock);
+        InterlockedIncrement(&Vcb->cache_preload.chunks_done);
+        return STATUS_SUCCESS;
+    }
+
+    if (!ExAcquireResourceExclusiveLite(&c->lock, wait)) {
+        ExReleaseResourceLite(&Vcb->tree_lock);
+        return STATUS_CANT_WAIT;
+    }
+
+#ifdef DEBUG_CHUNK_LOCKS
+    InterlockedIncrement(&Vcb->chunk_locks_held);
+#endif
+
+    Status = load_cache_chunk(Vcb, c, NULL);
+    if (!NT_SUCCESS(Status))
+        ERR("load_cache_chunk(%I64x) returned %08lx\n", c->offset, Status);
+
+    release_chunk_lock(c, Vcb);
+
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    TRACE("loaded free space for chunk %I64x (%li/%lu)\n", address, InterlockedIncrement(&Vcb->cache_preload.chunks_done),
+          Vcb->cache_preload.total_chunks);
+
+    return Status;
+}
+
+static bool preload_chunk_first(device_extension* Vcb, chunk* c) {
+    if (c->readonly || c->reloc || c->used == c->chunk_item->size)
+        return false;
+
+    return c->chunk_item->type == Vcb->data_flags || c->chunk_item->type == Vcb->metadata_flags;
+}
+
+_Function_class_(KSTART_ROUTINE)
+static void __stdcall cache_preload_thread(void* context) {
+    device_extension* Vcb = (device_extension*)context;
+    LIST_ENTRY* le;
+    uint64_t* addresses = NULL;
+    NTSTATUS* results = NULL;
+    ULONG num_chunks = 0, n, i;
+    unsigned int pass;
+    calc_job cj;
+    KIRQL irql;
+    LARGE_INTEGER start, end, freq;
+
+    start = KeQueryPerformanceCounter(&freq);
+
+    if (Vcb->cache_preload.stopping)
+        goto end;
+
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, true);
+    ExAcquireResourceSharedLite(&Vcb->chunk_lock, true);
+
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        num_chunks++;
+        le = le->Flink;
+    }
+
+    if (num_chunks > 0) {
+        addresses = ExAllocatePoolWithTag(PagedPool, num_chunks * (sizeof(uint64_t) + sizeof(NTSTATUS)), ALLOC_TAG);
+        if (!addresses) {
+            ERR("out of memory\n");
+            ExReleaseResourceLite(&Vcb->chunk_lock);
+            ExReleaseResourceLite(&Vcb->tree_lock);
+            goto end;
+        }
+
+        results = (NTSTATUS*)&addresses[num_chunks];
+
+        // The allocators go through the chunk list in order, looking for the first chunk of the
+        // right type with enough space, so load those chunks first and in the same order.
+
+        n = 0;
+
+        for (pass = 0; pass < 2; pass++) {
+            le = Vcb->chunks.Flink;
+            while (le != &Vcb->chunks) {
+                chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+
+                if (!c->cache_loaded && preload_chunk_first(Vcb, c) == (pass == 0)) {
+                    addresses[n] = c->offset;
+                    n++;
+                }
+
+                le = le->Flink;
+            }
+        }
+
+        num_chunks = n;
+    }
+
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    Vcb->cache_preload.total_chunks = num_chunks;
+
+    if (num_chunks == 0)
+        goto end;
+
+    cj.in = addresses;
+    cj.out = results;
+    cj.left = cj.not_started = num_chunks;
+    cj.type = calc_thread_load_cache;
+
+    KeInitializeEvent(&cj.event, NotificationEvent, false);
+
+    KeAcquireSpinLock(&Vcb->calcthreads.spinlock, &irql);
+
+    InsertTailList(&Vcb->calcthreads.job_list, &cj.list_entry);
+
+    KeSetEvent(&Vcb->calcthreads.event, 0, false);
+    KeClearEvent(&Vcb->calcthreads.event);
+
+    KeReleaseSpinLock(&Vcb->calcthreads.spinlock, irql);
+
+    calc_thread_main(Vcb, &cj);
+
+    KeWaitForSingleObject(&cj.event, Executive, KernelMode, false, NULL);
+
+    // do the chunks the calc threads couldn't get the locks for
+
+    for (i = 0; i < num_chunks && !Vcb->cache_preload.stopping; i++) {
+        if (results[i] == STATUS_CANT_WAIT) {
+            Vcb->cache_preload.chunks_deferred++;
+
+            preload_cache_chunk(Vcb, addresses[i], true);
+        }
+    }
+
+end:
+    end = KeQueryPerformanceCounter(NULL);
+
+    Vcb->cache_preload.duration = (end.QuadPart - start.QuadPart) * 1000 / freq.QuadPart;
+
+    TRACE("loaded free space for %li of %lu chunks in %I64u ms (%li deferred)\n", Vcb->cache_preload.chunks_done,
+          Vcb->cache_preload.total_chunks, Vcb->cache_preload.duration, Vcb->cache_preload.chunks_deferred);
+
+    if (addresses)
+        ExFreePool(addresses);
+
+    KeSetEvent(&Vcb->cache_preload.finished, 0, false);
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Loads the free space for all the chunks in the background after mounting, so that
+// the first writes don't have to wait for it.
+NTSTATUS start_cache_preload(device_extension* Vcb) {
+    NTSTATUS Status;
+    OBJECT_ATTRIBUTES oa;
+    HANDLE h;
+
+    Vcb->cache_preload.thread = NULL;
+    Vcb->cache_preload.total_chunks = 0;
+    Vcb->cache_preload.chunks_done = 0;
+    Vcb->cache_preload.chunks_deferred = 0;
+    Vcb->cache_preload.duration = 0;
+    Vcb->cache_preload.stopping = false;
+    KeInitializeEvent(&Vcb->cache_preload.finished, NotificationEvent, false);
+
+    InitializeObjectAttributes(&oa, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    Status = PsCreateSystemThread(&h, 0, &oa, NULL, NULL, cache_preload_thread, Vcb);
+    if (!NT_SUCCESS(Status)) {
+        ERR("PsCreateSystemThread returned %08lx\n", Status);
+        return Status;
+    }
+
+    // Keep a reference to the thread itself, so that stop_cache_preload can wait on it
+    // even once it's finished.
+
+    Status = ObReferenceObjectByHandle(h, THREAD_ALL_ACCESS, NULL, KernelMode, (void**)&Vcb->cache_preload.thread, NULL);
+
+    ZwClose(h);
+
+    if (!NT_SUCCESS(Status)) {
+        ERR("ObReferenceObjectByHandle returned %08lx\n", Status);
+
+        // we can't wait for it if we don't have the thread, so wait for it to finish now
+        Vcb->cache_preload.stopping = true;
+        KeWaitForSingleObject(&Vcb->cache_preload.finished, Executive, KernelMode, false, NULL);
+
+        return Status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Called when dismounting, before the trees and chunks get freed.
+void stop_cache_preload(device_extension* Vcb) {
+    if (!Vcb->cache_preload.thread)
+        return;
+
+    Vcb->cache_preload.stopping = true;
+
+    KeWaitForSingleObject(Vcb->cache_preload.thread, Executive, KernelMode, false, NULL);
+
+    ObDereferenceObject(Vcb->cache_preload.thread);
+    Vcb->cache_preload.thread = NULL;
+}
+
+NTSTATUS get_cache_preload_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen) {
+    btrfs_cache_preload_stats* bcps = data;
+
+    if (!data || length < sizeof(btrfs_cache_preload_stats))
+        return STATUS_BUFFER_TOO_SMALL;
+
+    bcps->total_chunks = Vcb->cache_preload.total_chunks;
+    bcps->chunks_done = Vcb->cache_preload.chunks_done;
+    bcps->chunks_deferred = Vcb->cache_preload.chunks_deferred;
+    bcps->running = Vcb->cache_preload.thread && !KeReadStateEvent(&Vcb->cache_preload.finished);
+    bcps->duration = bcps->running ? 0 : Vcb->cache_preload.duration;
+
+    *retlen = sizeof(btrfs_cache_preload_stats);
+
+    return STATUS_SUCCESS;
+}
+
 static NTSTATUS insert_cache_extent(fcb* fcb, uint64_t start, uint64_t length, LIST_ENTRY* rollback) {
     NTSTATUS Status;
     LIST_ENTRY* le = fcb->Vcb->chunks.Flink;
@@ -1425,7 +1763,7 @@ NTSTATUS allocate_cache(device_extension* Vcb, bool* changed, PIRP Irp, LIST_ENT
     return STATUS_SUCCESS;
 }
 
-static void add_rollback_space(LIST_ENTRY* rollback, bool add, LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address, uint64_t length, chunk* c) {
+void add_rollback_space(LIST_ENTRY* rollback, bool add, LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address, uint64_t length, chunk* c) {
     rollback_space* rs;
 
     rs = ExAllocatePoolWithTag(PagedPool, sizeof(rollback_space), ALLOC_TAG);
@@ -1460,7 +1798,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
         InsertTailList(list, &s->list_entry);
 
         if (list_size)
-            InsertTailList(list_size, &s->list_entry_size);
+            order_space_entry(s, list_size);
 
         if (rollback)
             add_rollback_space(rollback, true, list, list_size, address, length, c);
@@ -1469,6 +1807,18 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
     }
 
     le = list->Flink;
+
+    if (list_size) {
+        space* s3 = find_space_floor(space_list_chunk(list_size), address);
+
+        // skip over the entries which can't overlap or adjoin the new one
+        if (s3) {
+            avl_node* prev = avl_prev(&s3->tree_node);
+
+            le = prev ? &CONTAINING_RECORD(prev, space, tree_node)->list_entry : &s3->list_entry;
+        }
+    }
+
     do {
         s2 = CONTAINING_RECORD(le, space, list_entry);
 
@@ -1495,7 +1845,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
                         RemoveEntryList(&s3->list_entry);
 
                         if (list_size)
-                            RemoveEntryList(&s3->list_entry_size);
+                            remove_space_entry_size(s3, list_size);
 
                         ExFreePool(s3);
                     } else
@@ -1518,7 +1868,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
                         RemoveEntryList(&s3->list_entry);
 
                         if (list_size)
-                            RemoveEntryList(&s3->list_entry_size);
+                            remove_space_entry_size(s3, list_size);
 
                         ExFreePool(s3);
                     } else
@@ -1527,7 +1877,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
             }
 
             if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
+                remove_space_entry_size(s2, list_size);
                 order_space_entry(s2, list_size);
             }
 
@@ -1552,7 +1902,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
                     RemoveEntryList(&s3->list_entry);
 
                     if (list_size)
-                        RemoveEntryList(&s3->list_entry_size);
+                        remove_space_entry_size(s3, list_size);
 
                     ExFreePool(s3);
                 } else
@@ -1560,7 +1910,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
             }
 
             if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
+                remove_space_entry_size(s2, list_size);
                 order_space_entry(s2, list_size);
             }
 
@@ -1583,7 +1933,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
                     RemoveEntryList(&s3->list_entry);
 
                     if (list_size)
-                        RemoveEntryList(&s3->list_entry_size);
+                        remove_space_entry_size(s3, list_size);
 
                     ExFreePool(s3);
                 } else
@@ -1591,7 +1941,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
             }
 
             if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
+                remove_space_entry_size(s2, list_size);
                 order_space_entry(s2, list_size);
             }
 
@@ -1628,7 +1978,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
         s2->size += length;
 
         if (list_size) {
-            RemoveEntryList(&s2->list_entry_size);
+            remove_space_entry_size(s2, list_size);
             order_space_entry(s2, list_size);
         }
 
@@ -2160,6 +2510,14 @@ void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t addr
         return;
 
     le = list->Flink;
+
+    if (list_size) {
+        s2 = find_space_floor(space_list_chunk(list_size), address);
+
+        if (s2)
+            le = &s2->list_entry;
+    }
+
     while (le != list) {
         s2 = CONTAINING_RECORD(le, space, list_entry);
         le2 = le->Flink;
@@ -2174,7 +2532,7 @@ void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t addr
             RemoveEntryList(&s2->list_entry);
 
             if (list_size)
-                RemoveEntryList(&s2->list_entry_size);
+                remove_space_entry_size(s2, list_size);
 
             ExFreePool(s2);
         } else if (address + length > s2->address && address + length < s2->address + s2->size) {
@@ -2197,7 +2555,7 @@ void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t addr
                 s2->address = address + length;
 
                 if (list_size) {
-                    RemoveEntryList(&s2->list_entry_size);
+                    remove_space_entry_size(s2, list_size);
                     order_space_entry(s2, list_size);
                     order_space_entry(s, list_size);
                 }
@@ -2211,7 +2569,7 @@ void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t addr
                 s2->address = address + length;
 
                 if (list_size) {
-                    RemoveEntryList(&s2->list_entry_size);
+                    remove_space_entry_size(s2, list_size);
                     order_space_entry(s2, list_size);
                 }
             }
@@ -2222,7 +2580,7 @@ void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t addr
             s2->size = address - s2->address;
 
             if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
+                remove_space_entry_size(s2, list_size);
                 order_space_entry(s2, list_size);
             }
         }
@@ -205,7 +205,7 @@ static NTSTATUS snapshot_tree_copy(device_extension* Vcb, uint64_t addr, root* s
 
             if (stripe->status != WriteDataStatus_Ignore) {
                 need_wait = true;
-                IoCallDriver(stripe->device->devobj, stripe->Irp);
+                submit_write(stripe);
             }
 
             le = le->Flink;
@@ -1164,6 +1164,7 @@ static NTSTATUS get_inode_info(PFILE_OBJECT FileObject, void* data, ULONG length
     fcb* fcb;
     ccb* ccb;
     bool old_style;
+    NTSTATUS Status;
 
     if (length < offsetof(btrfs_inode_info, disk_size_zstd))
         return STATUS_BUFFER_OVERFLOW;
@@ -1191,7 +1192,11 @@ static NTSTATUS get_inode_info(PFILE_OBJECT FileObject, void* data, ULONG length
 
     old_style = length < offsetof(btrfs_inode_info, sparse_size) + sizeof(((btrfs_inode_info*)NULL)->sparse_size);
 
-    ExAcquireResourceSharedLite(fcb->Header.Resource, true);
+    Status = acquire_fcb_extents(fcb, 0, 0xffffffffffffffff, true, NULL);
+    if (!NT_SUCCESS(Status)) {
+        ERR("acquire_fcb_extents returned %08lx\n", Status);
+        return Status;
+    }
 
     bii->subvol = fcb->subvol->id;
     bii->inode = fcb->inode;
@@ -1980,6 +1985,12 @@ static NTSTATUS set_zero_data(device_extension* Vcb, PFILE_OBJECT FileObject, vo
         goto end;
     }
 
+    Status = load_fcb_extents(Vcb, fcb, fzdi->FileOffset.QuadPart, fzdi->BeyondFinalZero.QuadPart - fzdi->FileOffset.QuadPart, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("load_fcb_extents returned %08lx\n", Status);
+        goto end;
+    }
+
     ext = NULL;
     le = fcb->extents.Flink;
     while (le != &fcb->extents) {
@@ -2107,7 +2118,14 @@ static NTSTATUS query_ranges(PFILE_OBJECT FileObject, FILE_ALLOCATED_RANGE_BUFFE
         return STATUS_INVALID_PARAMETER;
     }
 
-    ExAcquireResourceSharedLite(fcb->Header.Resource, true);
+    if (fcb->atts & FILE_ATTRIBUTE_SPARSE_FILE) {
+        Status = acquire_fcb_extents(fcb, 0, 0xffffffffffffffff, true, NULL);
+        if (!NT_SUCCESS(Status)) {
+            ERR("acquire_fcb_extents returned %08lx\n", Status);
+            return Status;
+        }
+    } else
+        ExAcquireResourceSharedLite(fcb->Header.Resource, true);
 
     // If file is not marked as sparse, claim the whole thing as an allocated range
 
@@ -2420,6 +2438,8 @@ static NTSTATUS invalidate_volumes(PIRP Irp) {
 
                 ExReleaseResourceLite(&Vcb->tree_lock);
 
+                stop_cache_preload(Vcb);
+
                 CcWaitForCurrentLazyWriterActivity();
 
                 ExAcquireResourceExclusiveLite(&Vcb->tree_lock, true);
@@ -2598,6 +2618,8 @@ NTSTATUS dismount_volume(device_extension* Vcb, bool shutdown, PIRP Irp) {
         }
     }
 
+    stop_cache_preload(Vcb);
+
     ExAcquireResourceExclusiveLite(&Vcb->tree_lock, true);
 
     if (!Vcb->locked) {
@@ -3255,6 +3277,180 @@ bool fcb_is_inline(fcb* fcb) {
     return false;
 }
 
+// Makes [destoff, destoff + length) in fcb point to the same extents as [srcoff, srcoff + length)
+// in sourcefcb. Both fcbs need to be locked, and have their extents loaded.
+static NTSTATUS clone_extents(device_extension* Vcb, fcb* fcb, struct _fcb* sourcefcb, uint64_t srcoff, uint64_t destoff, uint64_t length,
+                              uint64_t* nbytes, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    LIST_ENTRY *le, *lastextle, newexts;
+
+    InitializeListHead(&newexts);
+
+    le = sourcefcb->extents.Flink;
+    while (le != &sourcefcb->extents) {
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+
+        if (!ext->ignore) {
+            if (ext->offset >= srcoff + length)
+                break;
+
+            if (ext->extent_data.type != EXTENT_TYPE_INLINE) {
+                ULONG extlen = offsetof(extent, extent_data) + sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2);
+                extent* ext2;
+                EXTENT_DATA2 *ed2s, *ed2d;
+                chunk* c;
+
+                ed2s = (EXTENT_DATA2*)ext->extent_data.data;
+
+                if (ext->offset + ed2s->num_bytes <= srcoff) {
+                    le = le->Flink;
+                    continue;
+                }
+
+                ext2 = ExAllocatePoolWithTag(PagedPool, extlen, ALLOC_TAG);
+                if (!ext2) {
+                    ERR("out of memory\n");
+                    Status = STATUS_INSUFFICIENT_RESOURCES;
+                    goto end;
+                }
+
+                if (ext->offset < srcoff)
+                    ext2->offset = destoff;
+                else
+                    ext2->offset = ext->offset - srcoff + destoff;
+
+                ext2->datalen = sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2);
+                ext2->unique = false;
+                ext2->ignore = false;
+                ext2->inserted = true;
+
+                ext2->extent_data.generation = Vcb->superblock.generation;
+                ext2->extent_data.decoded_size = ext->extent_data.decoded_size;
+                ext2->extent_data.compression = ext->extent_data.compression;
+                ext2->extent_data.encryption = ext->extent_data.encryption;
+                ext2->extent_data.encoding = ext->extent_data.encoding;
+                ext2->extent_data.type = ext->extent_data.type;
+
+                ed2d = (EXTENT_DATA2*)ext2->extent_data.data;
+
+                ed2d->address = ed2s->address;
+                ed2d->size = ed2s->size;
+
+                if (ext->offset < srcoff) {
+                    ed2d->offset = ed2s->offset + srcoff - ext->offset;
+                    ed2d->num_bytes = min(length, ed2s->num_bytes + ext->offset - srcoff);
+                } else {
+                    ed2d->offset = ed2s->offset;
+                    ed2d->num_bytes = min(srcoff + length - ext->offset, ed2s->num_bytes);
+                }
+
+                if (ext->csum) {
+                    if (ext->extent_data.compression == BTRFS_COMPRESSION_NONE) {
+                        ext2->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)((ed2d->num_bytes * Vcb->csum_size) >> Vcb->sector_shift), ALLOC_TAG);
+                        if (!ext2->csum) {
+                            ERR("out of memory\n");
+                            Status = STATUS_INSUFFICIENT_RESOURCES;
+                            ExFreePool(ext2);
+                            goto end;
+                        }
+
+                        RtlCopyMemory(ext2->csum, (uint8_t*)ext->csum + (((ed2d->offset - ed2s->offset) * Vcb->csum_size) >> Vcb->sector_shift),
+                                      (ULONG)((ed2d->num_bytes * Vcb->csum_size) >> Vcb->sector_shift));
+                    } else {
+                        ext2->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)((ed2d->size * Vcb->csum_size) >> Vcb->sector_shift), ALLOC_TAG);
+                        if (!ext2->csum) {
+                            ERR("out of memory\n");
+                            Status = STATUS_INSUFFICIENT_RESOURCES;
+                            ExFreePool(ext2);
+                            goto end;
+                        }
+
+                        RtlCopyMemory(ext2->csum, ext->csum, (ULONG)((ed2s->size * Vcb->csum_size) >> Vcb->sector_shift));
+                    }
+                } else
+                    ext2->csum = NULL;
+
+                InsertTailList(&newexts, &ext2->list_entry);
+
+                c = get_chunk_from_address(Vcb, ed2s->address);
+                if (!c) {
+                    ERR("get_chunk_from_address(%I64x) failed\n", ed2s->address);
+                    Status = STATUS_INTERNAL_ERROR;
+                    goto end;
+                }
+
+                Status = update_changed_extent_ref(Vcb, c, ed2s->address, ed2s->size, fcb->subvol->id, fcb->inode, ext2->offset - ed2d->offset,
+                                                1, fcb->inode_item.flags & BTRFS_INODE_NODATASUM, false, Irp);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("update_changed_extent_ref returned %08lx\n", Status);
+                    goto end;
+                }
+
+                *nbytes += ed2d->num_bytes;
+            }
+        }
+
+        le = le->Flink;
+    }
+
+    Status = excise_extents(Vcb, fcb, destoff, destoff + length, Irp, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("excise_extents returned %08lx\n", Status);
+        goto end;
+    }
+
+    // clear unique flags in source fcb
+    le = sourcefcb->extents.Flink;
+    while (le != &sourcefcb->extents) {
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+
+        if (!ext->ignore && ext->unique && (ext->extent_data.type == EXTENT_TYPE_REGULAR || ext->extent_data.type == EXTENT_TYPE_PREALLOC)) {
+            EXTENT_DATA2* ed2s = (EXTENT_DATA2*)ext->extent_data.data;
+            LIST_ENTRY* le2;
+
+            le2 = newexts.Flink;
+            while (le2 != &newexts) {
+                extent* ext2 = CONTAINING_RECORD(le2, extent, list_entry);
+
+                if (ext2->extent_data.type == EXTENT_TYPE_REGULAR || ext2->extent_data.type == EXTENT_TYPE_PREALLOC) {
+                    EXTENT_DATA2* ed2d = (EXTENT_DATA2*)ext2->extent_data.data;
+
+                    if (ed2d->address == ed2s->address && ed2d->size == ed2s->size) {
+                        ext->unique = false;
+                        break;
+                    }
+                }
+
+                le2 = le2->Flink;
+            }
+        }
+
+        le = le->Flink;
+    }
+
+    lastextle = &fcb->extents;
+    while (!IsListEmpty(&newexts)) {
+        extent* ext = CONTAINING_RECORD(RemoveHeadList(&newexts), extent, list_entry);
+
+        add_extent(fcb, lastextle, ext);
+        lastextle = &ext->list_entry;
+    }
+
+    Status = STATUS_SUCCESS;
+
+end:
+    while (!IsListEmpty(&newexts)) {
+        extent* ext = CONTAINING_RECORD(RemoveHeadList(&newexts), extent, list_entry);
+
+        if (ext->csum)
+            ExFreePool(ext->csum);
+
+        ExFreePool(ext);
+    }
+
+    return Status;
+}
+
 static NTSTATUS duplicate_extents(device_extension* Vcb, PFILE_OBJECT FileObject, void* data, ULONG datalen, PIRP Irp) {
     DUPLICATE_EXTENTS_DATA* ded = (DUPLICATE_EXTENTS_DATA*)data;
     fcb *fcb = FileObject ? FileObject->FsContext : NULL, *sourcefcb;
@@ -3262,7 +3458,7 @@ static NTSTATUS duplicate_extents(device_extension* Vcb, PFILE_OBJECT FileObject
     NTSTATUS Status;
     PFILE_OBJECT sourcefo;
     uint64_t sourcelen, nbytes = 0;
-    LIST_ENTRY rollback, *le, newexts;
+    LIST_ENTRY rollback;
     LARGE_INTEGER time;
     BTRFS_TIME now;
     bool make_inline;
@@ -3354,15 +3550,70 @@ static NTSTATUS duplicate_extents(device_extension* Vcb, PFILE_OBJECT FileObject
         return STATUS_INVALID_PARAMETER;
     }
 
+    // we only hold the source shared below, so it can't have anything waiting for
+    // delayed allocation written out then
+    if (!sourcefcb->ads) {
+        Status = delalloc_flush(sourcefcb, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("delalloc_flush returned %08lx\n", Status);
+            ObDereferenceObject(sourcefo);
+            return Status;
+        }
+    }
+
     InitializeListHead(&rollback);
-    InitializeListHead(&newexts);
 
+retry:
     ExAcquireResourceSharedLite(&Vcb->tree_lock, true);
 
     ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
 
-    if (fcb != sourcefcb)
-        ExAcquireResourceSharedLite(sourcefcb->Header.Resource, true);
+    if (fcb != sourcefcb) {
+        Status = acquire_fcb_extents(sourcefcb, ded->SourceFileOffset.QuadPart, ded->ByteCount.QuadPart, true, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("acquire_fcb_extents returned %08lx\n", Status);
+            ExReleaseResourceLite(fcb->Header.Resource);
+            ExReleaseResourceLite(&Vcb->tree_lock);
+            ObDereferenceObject(sourcefo);
+            return Status;
+        }
+
+        // a paging write may have got in before we took the lock
+        if (!sourcefcb->ads && !IsListEmpty(&sourcefcb->delalloc)) {
+            ExReleaseResourceLite(sourcefcb->Header.Resource);
+            ExReleaseResourceLite(fcb->Header.Resource);
+            ExReleaseResourceLite(&Vcb->tree_lock);
+
+            Status = delalloc_flush(sourcefcb, Irp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("delalloc_flush returned %08lx\n", Status);
+                ObDereferenceObject(sourcefo);
+                return Status;
+            }
+
+            goto retry;
+        }
+    } else if (!fcb->ads) {
+        Status = delalloc_flush_fcb(fcb, Irp, &rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("delalloc_flush_fcb returned %08lx\n", Status);
+            goto end;
+        }
+
+        Status = load_fcb_extents(Vcb, fcb, ded->SourceFileOffset.QuadPart, ded->ByteCount.QuadPart, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_fcb_extents returned %08lx\n", Status);
+            goto end;
+        }
+    }
+
+    if (!fcb->ads) {
+        Status = load_fcb_extents(Vcb, fcb, ded->TargetFileOffset.QuadPart, ded->ByteCount.QuadPart, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_fcb_extents returned %08lx\n", Status);
+            goto end;
+        }
+    }
 
     if (!FsRtlFastCheckLockForWrite(&fcb->lock, &ded->TargetFileOffset, &ded->ByteCount, 0, FileObject, PsGetCurrentProcess())) {
         Status = STATUS_FILE_LOCK_CONFLICT;
@@ -3483,196 +3734,403 @@ static NTSTATUS duplicate_extents(device_extension* Vcb, PFILE_OBJECT FileObject
 
         ExFreePool(data2);
     } else {
-        LIST_ENTRY* lastextle;
+        Status = clone_extents(Vcb, fcb, sourcefcb, ded->SourceFileOffset.QuadPart, ded->TargetFileOffset.QuadPart, ded->ByteCount.QuadPart, &nbytes, Irp, &rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("clone_extents returned %08lx\n", Status);
+            goto end;
+        }
+    }
 
-        le = sourcefcb->extents.Flink;
-        while (le != &sourcefcb->extents) {
-            extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+    KeQuerySystemTime(&time);
+    win_time_to_unix(time, &now);
 
-            if (!ext->ignore) {
-                if (ext->offset >= (uint64_t)ded->SourceFileOffset.QuadPart + (uint64_t)ded->ByteCount.QuadPart)
-                    break;
+    if (fcb->ads) {
+        ccb->fileref->parent->fcb->inode_item.sequence++;
 
-                if (ext->extent_data.type != EXTENT_TYPE_INLINE) {
-                    ULONG extlen = offsetof(extent, extent_data) + sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2);
-                    extent* ext2;
-                    EXTENT_DATA2 *ed2s, *ed2d;
-                    chunk* c;
+        if (!ccb->user_set_change_time)
+            ccb->fileref->parent->fcb->inode_item.st_ctime = now;
 
-                    ed2s = (EXTENT_DATA2*)ext->extent_data.data;
+        ccb->fileref->parent->fcb->inode_item_changed = true;
+        mark_fcb_dirty(ccb->fileref->parent->fcb);
+    } else {
+        fcb->inode_item.st_blocks += nbytes;
+        fcb->inode_item.sequence++;
 
-                    if (ext->offset + ed2s->num_bytes <= (uint64_t)ded->SourceFileOffset.QuadPart) {
-                        le = le->Flink;
-                        continue;
-                    }
+        if (!ccb->user_set_change_time)
+            fcb->inode_item.st_ctime = now;
 
-                    ext2 = ExAllocatePoolWithTag(PagedPool, extlen, ALLOC_TAG);
-                    if (!ext2) {
-                        ERR("out of memory\n");
-                        Status = STATUS_INSUFFICIENT_RESOURCES;
-                        goto end;
-                    }
+        if (!ccb->user_set_write_time) {
+            fcb->inode_item.st_mtime = now;
+            queue_notification_fcb(ccb->fileref, FILE_NOTIFY_CHANGE_LAST_WRITE, FILE_ACTION_MODIFIED, NULL);
+        }
 
-                    if (ext->offset < (uint64_t)ded->SourceFileOffset.QuadPart)
-                        ext2->offset = ded->TargetFileOffset.QuadPart;
-                    else
-                        ext2->offset = ext->offset - ded->SourceFileOffset.QuadPart + ded->TargetFileOffset.QuadPart;
+        fcb->inode_item_changed = true;
+        fcb->extents_changed = true;
+    }
 
-                    ext2->datalen = sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2);
-                    ext2->unique = false;
-                    ext2->ignore = false;
-                    ext2->inserted = true;
+    mark_fcb_dirty(fcb);
 
-                    ext2->extent_data.generation = Vcb->superblock.generation;
-                    ext2->extent_data.decoded_size = ext->extent_data.decoded_size;
-                    ext2->extent_data.compression = ext->extent_data.compression;
-                    ext2->extent_data.encryption = ext->extent_data.encryption;
-                    ext2->extent_data.encoding = ext->extent_data.encoding;
-                    ext2->extent_data.type = ext->extent_data.type;
+    if (FileObject->SectionObjectPointer->DataSectionObject)
+        CcPurgeCacheSection(FileObject->SectionObjectPointer, &ded->TargetFileOffset, (ULONG)ded->ByteCount.QuadPart, false);
 
-                    ed2d = (EXTENT_DATA2*)ext2->extent_data.data;
+    Status = STATUS_SUCCESS;
 
-                    ed2d->address = ed2s->address;
-                    ed2d->size = ed2s->size;
+end:
+    ObDereferenceObject(sourcefo);
 
-                    if (ext->offset < (uint64_t)ded->SourceFileOffset.QuadPart) {
-                        ed2d->offset = ed2s->offset + ded->SourceFileOffset.QuadPart - ext->offset;
-                        ed2d->num_bytes = min((uint64_t)ded->ByteCount.QuadPart, ed2s->num_bytes + ext->offset - ded->SourceFileOffset.QuadPart);
-                    } else {
-                        ed2d->offset = ed2s->offset;
-                        ed2d->num_bytes = min(ded->SourceFileOffset.QuadPart + ded->ByteCount.QuadPart - ext->offset, ed2s->num_bytes);
-                    }
+    if (NT_SUCCESS(Status))
+        clear_rollback(&rollback);
+    else
+        do_rollback(Vcb, &rollback);
 
-                    if (ext->csum) {
-                        if (ext->extent_data.compression == BTRFS_COMPRESSION_NONE) {
-                            ext2->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)((ed2d->num_bytes * Vcb->csum_size) >> Vcb->sector_shift), ALLOC_TAG);
-                            if (!ext2->csum) {
-                                ERR("out of memory\n");
-                                Status = STATUS_INSUFFICIENT_RESOURCES;
-                                ExFreePool(ext2);
-                                goto end;
-                            }
+    if (fcb != sourcefcb)
+        ExReleaseResourceLite(sourcefcb->Header.Resource);
 
-                            RtlCopyMemory(ext2->csum, (uint8_t*)ext->csum + (((ed2d->offset - ed2s->offset) * Vcb->csum_size) >> Vcb->sector_shift),
-                                          (ULONG)((ed2d->num_bytes * Vcb->csum_size) >> Vcb->sector_shift));
-                        } else {
-                            ext2->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)((ed2d->size * Vcb->csum_size) >> Vcb->sector_shift), ALLOC_TAG);
-                            if (!ext2->csum) {
-                                ERR("out of memory\n");
-                                Status = STATUS_INSUFFICIENT_RESOURCES;
-                                ExFreePool(ext2);
-                                goto end;
-                            }
+    ExReleaseResourceLite(fcb->Header.Resource);
 
-                            RtlCopyMemory(ext2->csum, ext->csum, (ULONG)((ed2s->size * Vcb->csum_size) >> Vcb->sector_shift));
-                        }
-                    } else
-                        ext2->csum = NULL;
+    ExReleaseResourceLite(&Vcb->tree_lock);
 
-                    InsertTailList(&newexts, &ext2->list_entry);
+    return Status;
+}
 
-                    c = get_chunk_from_address(Vcb, ed2s->address);
-                    if (!c) {
-                        ERR("get_chunk_from_address(%I64x) failed\n", ed2s->address);
-                        Status = STATUS_INTERNAL_ERROR;
-                        goto end;
-                    }
+// Returns the checksum stored for the sector at off, or NULL if there isn't one we can use -
+// for sparse, prealloc, compressed or nodatasum extents. le is a cursor into fcb->extents, so
+// that walking through a range only goes through the list once.
+static uint8_t* find_sector_csum(fcb* fcb, LIST_ENTRY** le, uint64_t off) {
+    device_extension* Vcb = fcb->Vcb;
 
-                    Status = update_changed_extent_ref(Vcb, c, ed2s->address, ed2s->size, fcb->subvol->id, fcb->inode, ext2->offset - ed2d->offset,
-                                                    1, fcb->inode_item.flags & BTRFS_INODE_NODATASUM, false, Irp);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("update_changed_extent_ref returned %08lx\n", Status);
-                        goto end;
-                    }
+    while (*le != &fcb->extents) {
+        extent* ext = CONTAINING_RECORD(*le, extent, list_entry);
 
-                    nbytes += ed2d->num_bytes;
-                }
-            }
+        if (!ext->ignore) {
+            EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ext->extent_data.data;
 
-            le = le->Flink;
-        }
+            if (ext->offset > off || ext->extent_data.type == EXTENT_TYPE_INLINE)
+                return NULL;
 
-        Status = excise_extents(Vcb, fcb, ded->TargetFileOffset.QuadPart, ded->TargetFileOffset.QuadPart + ded->ByteCount.QuadPart, Irp, &rollback);
-        if (!NT_SUCCESS(Status)) {
-            ERR("excise_extents returned %08lx\n", Status);
+            if (off < ext->offset + ed2->num_bytes) {
+                if (ext->extent_data.type != EXTENT_TYPE_REGULAR || ext->extent_data.compression != BTRFS_COMPRESSION_NONE ||
+                    !ext->csum || ed2->size == 0)
+                    return NULL;
 
-            while (!IsListEmpty(&newexts)) {
-                extent* ext = CONTAINING_RECORD(RemoveHeadList(&newexts), extent, list_entry);
-                ExFreePool(ext);
+                return (uint8_t*)ext->csum + (((off - ext->offset) * Vcb->csum_size) >> Vcb->sector_shift);
             }
+        }
 
+        *le = (*le)->Flink;
+    }
+
+    return NULL;
+}
+
+// Compares the checksums of the two ranges, where both have them. This tells us cheaply when
+// two ranges are different, but we still have to compare the data to know that they're the same.
+static bool csums_differ(fcb* fcb1, uint64_t off1, fcb* fcb2, uint64_t off2, uint64_t length) {
+    device_extension* Vcb = fcb1->Vcb;
+    LIST_ENTRY* le1 = find_extent_index(fcb1, off1);
+    LIST_ENTRY* le2 = find_extent_index(fcb2, off2);
+    uint64_t pos;
+
+    for (pos = 0; pos < length; pos += Vcb->superblock.sector_size) {
+        uint8_t* csum1 = find_sector_csum(fcb1, &le1, off1 + pos);
+        uint8_t* csum2 = find_sector_csum(fcb2, &le2, off2 + pos);
+
+        if (csum1 && csum2 && RtlCompareMemory(csum1, csum2, Vcb->csum_size) != Vcb->csum_size)
+            return true;
+    }
+
+    return false;
+}
+
+static NTSTATUS ranges_equal(fcb* fcb1, uint64_t off1, fcb* fcb2, uint64_t off2, uint64_t length, bool* equal, PIRP Irp) {
+    NTSTATUS Status;
+    uint8_t *data1, *data2;
+    uint64_t pos;
+
+    if (csums_differ(fcb1, off1, fcb2, off2, length)) {
+        *equal = false;
+        return STATUS_SUCCESS;
+    }
+
+    data1 = ExAllocatePoolWithTag(PagedPool, (ULONG)min(length, DEDUPE_CHUNK_SIZE), ALLOC_TAG);
+    if (!data1) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    data2 = ExAllocatePoolWithTag(PagedPool, (ULONG)min(length, DEDUPE_CHUNK_SIZE), ALLOC_TAG);
+    if (!data2) {
+        ERR("out of memory\n");
+        ExFreePool(data1);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    *equal = true;
+
+    for (pos = 0; pos < length; pos += DEDUPE_CHUNK_SIZE) {
+        ULONG len = (ULONG)min(length - pos, DEDUPE_CHUNK_SIZE);
+
+        Status = read_file(fcb1, data1, off1 + pos, len, NULL, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("read_file returned %08lx\n", Status);
             goto end;
         }
 
-        // clear unique flags in source fcb
-        le = sourcefcb->extents.Flink;
-        while (le != &sourcefcb->extents) {
-            extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+        Status = read_file(fcb2, data2, off2 + pos, len, NULL, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("read_file returned %08lx\n", Status);
+            goto end;
+        }
 
-            if (!ext->ignore && ext->unique && (ext->extent_data.type == EXTENT_TYPE_REGULAR || ext->extent_data.type == EXTENT_TYPE_PREALLOC)) {
-                EXTENT_DATA2* ed2s = (EXTENT_DATA2*)ext->extent_data.data;
-                LIST_ENTRY* le2;
+        if (RtlCompareMemory(data1, data2, len) != len) {
+            *equal = false;
+            break;
+        }
+    }
 
-                le2 = newexts.Flink;
-                while (le2 != &newexts) {
-                    extent* ext2 = CONTAINING_RECORD(le2, extent, list_entry);
+    Status = STATUS_SUCCESS;
 
-                    if (ext2->extent_data.type == EXTENT_TYPE_REGULAR || ext2->extent_data.type == EXTENT_TYPE_PREALLOC) {
-                        EXTENT_DATA2* ed2d = (EXTENT_DATA2*)ext2->extent_data.data;
+end:
+    ExFreePool(data2);
+    ExFreePool(data1);
 
-                        if (ed2d->address == ed2s->address && ed2d->size == ed2s->size) {
-                            ext->unique = false;
-                            break;
-                        }
-                    }
+    return Status;
+}
 
-                    le2 = le2->Flink;
-                }
-            }
+// Like duplicate_extents, except that it checks first that the two ranges have the same contents.
+// The target's data doesn't change, so there's no need to touch its cache or its timestamps.
+static NTSTATUS dedupe_extents(device_extension* Vcb, PFILE_OBJECT FileObject, void* data, ULONG length, ULONG outlen, PIRP Irp) {
+    btrfs_dedupe* bd = data;
+    fcb *fcb = FileObject ? FileObject->FsContext : NULL, *sourcefcb;
+    ccb *ccb = FileObject ? FileObject->FsContext2 : NULL, *sourceccb;
+    NTSTATUS Status;
+    HANDLE h;
+    PFILE_OBJECT sourcefo;
+    uint64_t srcoff, destoff, len, nbytes = 0;
+    LIST_ENTRY rollback;
+    LARGE_INTEGER off, len2;
+    bool equal = false;
 
-            le = le->Flink;
+#if defined(_WIN64)
+    if (IoIs32bitProcess(Irp)) {
+        btrfs_dedupe32* bd32 = data;
+
+        if (!data || length < sizeof(btrfs_dedupe32) || outlen < sizeof(btrfs_dedupe32))
+            return STATUS_BUFFER_TOO_SMALL;
+
+        h = Handle32ToHandle(bd32->source);
+        srcoff = bd32->source_offset;
+        destoff = bd32->target_offset;
+        len = bd32->length;
+    } else {
+#endif
+        if (!data || length < sizeof(btrfs_dedupe) || outlen < sizeof(btrfs_dedupe))
+            return STATUS_BUFFER_TOO_SMALL;
+
+        h = bd->source;
+        srcoff = bd->source_offset;
+        destoff = bd->target_offset;
+        len = bd->length;
+#if defined(_WIN64)
+    }
+#endif
+
+    if (Vcb->readonly)
+        return STATUS_MEDIA_WRITE_PROTECTED;
+
+    if (!fcb || !ccb || fcb == Vcb->volume_fcb)
+        return STATUS_INVALID_PARAMETER;
+
+    if (is_subvol_readonly(fcb->subvol, Irp))
+        return STATUS_ACCESS_DENIED;
+
+    if (Irp->RequestorMode == UserMode && !(ccb->access & FILE_WRITE_DATA)) {
+        WARN("insufficient privileges\n");
+        return STATUS_ACCESS_DENIED;
+    }
+
+    if (fcb->ads || fcb->type != BTRFS_TYPE_FILE)
+        return STATUS_INVALID_PARAMETER;
+
+    if (srcoff & (Vcb->superblock.sector_size - 1) || destoff & (Vcb->superblock.sector_size - 1))
+        return STATUS_INVALID_PARAMETER;
+
+    if (len > DEDUPE_MAX_LENGTH)
+        len = DEDUPE_MAX_LENGTH;
+
+    Status = ObReferenceObjectByHandle(h, 0, *IoFileObjectType, Irp->RequestorMode, (void**)&sourcefo, NULL);
+    if (!NT_SUCCESS(Status)) {
+        ERR("ObReferenceObjectByHandle returned %08lx\n", Status);
+        return Status;
+    }
+
+    if (sourcefo->DeviceObject != FileObject->DeviceObject) {
+        WARN("source and destination are on different volumes\n");
+        ObDereferenceObject(sourcefo);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    sourcefcb = sourcefo->FsContext;
+    sourceccb = sourcefo->FsContext2;
+
+    if (!sourcefcb || !sourceccb || sourcefcb == Vcb->volume_fcb || sourcefcb->ads || sourcefcb->type != BTRFS_TYPE_FILE) {
+        ObDereferenceObject(sourcefo);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (Irp->RequestorMode == UserMode && !(sourceccb->access & FILE_READ_DATA)) {
+        WARN("insufficient privileges\n");
+        ObDereferenceObject(sourcefo);
+        return STATUS_ACCESS_DENIED;
+    }
+
+    if (fcb == sourcefcb && srcoff < destoff + len && destoff < srcoff + len) {
+        WARN("source and destination are the same, and the ranges overlap\n");
+        ObDereferenceObject(sourcefo);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if ((fcb->inode_item.flags & BTRFS_INODE_NODATASUM) != (sourcefcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
+        ObDereferenceObject(sourcefo);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // compare what's actually on the disk
+    if (sourcefo->SectionObjectPointer->DataSectionObject)
+        CcFlushCache(sourcefo->SectionObjectPointer, NULL, 0, NULL);
+
+    if (FileObject->SectionObjectPointer->DataSectionObject)
+        CcFlushCache(FileObject->SectionObjectPointer, NULL, 0, NULL);
+
+    // we only hold the source shared below, so it can't have anything waiting for
+    // delayed allocation written out then
+    Status = delalloc_flush(sourcefcb, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("delalloc_flush returned %08lx\n", Status);
+        ObDereferenceObject(sourcefo);
+        return Status;
+    }
+
+    InitializeListHead(&rollback);
+
+retry:
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, true);
+
+    ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
+
+    if (fcb != sourcefcb) {
+        Status = acquire_fcb_extents(sourcefcb, srcoff, len, true, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("acquire_fcb_extents returned %08lx\n", Status);
+            ExReleaseResourceLite(fcb->Header.Resource);
+            ExReleaseResourceLite(&Vcb->tree_lock);
+            ObDereferenceObject(sourcefo);
+            return Status;
         }
 
-        lastextle = &fcb->extents;
-        while (!IsListEmpty(&newexts)) {
-            extent* ext = CONTAINING_RECORD(RemoveHeadList(&newexts), extent, list_entry);
+        // a paging write may have got in before we took the lock
+        if (!IsListEmpty(&sourcefcb->delalloc)) {
+            ExReleaseResourceLite(sourcefcb->Header.Resource);
+            ExReleaseResourceLite(fcb->Header.Resource);
+            ExReleaseResourceLite(&Vcb->tree_lock);
 
-            add_extent(fcb, lastextle, ext);
-            lastextle = &ext->list_entry;
+            Status = delalloc_flush(sourcefcb, Irp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("delalloc_flush returned %08lx\n", Status);
+                ObDereferenceObject(sourcefo);
+                return Status;
+            }
+
+            goto retry;
         }
     }
 
-    KeQuerySystemTime(&time);
-    win_time_to_unix(time, &now);
+    if (fcb->deleted || sourcefcb->deleted) {
+        Status = STATUS_FILE_DELETED;
+        goto end;
+    }
 
-    if (fcb->ads) {
-        ccb->fileref->parent->fcb->inode_item.sequence++;
+    // like on Linux, both ranges have to be inside their files, and only the last sector can be partial
+    if (srcoff + len > sourcefcb->inode_item.st_size || destoff + len > fcb->inode_item.st_size) {
+        Status = STATUS_INVALID_PARAMETER;
+        goto end;
+    }
 
-        if (!ccb->user_set_change_time)
-            ccb->fileref->parent->fcb->inode_item.st_ctime = now;
+    if (len & (Vcb->superblock.sector_size - 1) && (srcoff + len != sourcefcb->inode_item.st_size || destoff + len != fcb->inode_item.st_size)) {
+        Status = STATUS_INVALID_PARAMETER;
+        goto end;
+    }
 
-        ccb->fileref->parent->fcb->inode_item_changed = true;
-        mark_fcb_dirty(ccb->fileref->parent->fcb);
-    } else {
-        fcb->inode_item.st_blocks += nbytes;
-        fcb->inode_item.sequence++;
+    if (len == 0) {
+        equal = true;
+        Status = STATUS_SUCCESS;
+        goto end;
+    }
 
-        if (!ccb->user_set_change_time)
-            fcb->inode_item.st_ctime = now;
+    if (fcb == sourcefcb) {
+        Status = delalloc_flush_fcb(fcb, Irp, &rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("delalloc_flush_fcb returned %08lx\n", Status);
+            goto end;
+        }
 
-        if (!ccb->user_set_write_time) {
-            fcb->inode_item.st_mtime = now;
-            queue_notification_fcb(ccb->fileref, FILE_NOTIFY_CHANGE_LAST_WRITE, FILE_ACTION_MODIFIED, NULL);
+        Status = load_fcb_extents(Vcb, fcb, srcoff, len, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_fcb_extents returned %08lx\n", Status);
+            goto end;
         }
+    }
 
-        fcb->inode_item_changed = true;
-        fcb->extents_changed = true;
+    Status = load_fcb_extents(Vcb, fcb, destoff, len, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("load_fcb_extents returned %08lx\n", Status);
+        goto end;
     }
 
-    mark_fcb_dirty(fcb);
+    if (fcb_is_inline(fcb) || fcb_is_inline(sourcefcb)) {
+        Status = STATUS_NOT_SUPPORTED;
+        goto end;
+    }
 
-    if (FileObject->SectionObjectPointer->DataSectionObject)
-        CcPurgeCacheSection(FileObject->SectionObjectPointer, &ded->TargetFileOffset, (ULONG)ded->ByteCount.QuadPart, false);
+    off.QuadPart = destoff;
+    len2.QuadPart = len;
+
+    if (!FsRtlFastCheckLockForWrite(&fcb->lock, &off, &len2, 0, FileObject, PsGetCurrentProcess())) {
+        Status = STATUS_FILE_LOCK_CONFLICT;
+        goto end;
+    }
+
+    off.QuadPart = srcoff;
+
+    if (!FsRtlFastCheckLockForRead(&sourcefcb->lock, &off, &len2, 0, FileObject, PsGetCurrentProcess())) {
+        Status = STATUS_FILE_LOCK_CONFLICT;
+        goto end;
+    }
+
+    Status = ranges_equal(sourcefcb, srcoff, fcb, destoff, len, &equal, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("ranges_equal returned %08lx\n", Status);
+        goto end;
+    }
+
+    if (!equal) {
+        TRACE("ranges differ\n");
+        len = 0;
+        Status = STATUS_SUCCESS;
+        goto end;
+    }
+
+    Status = clone_extents(Vcb, fcb, sourcefcb, srcoff, destoff, sector_align(len, Vcb->superblock.sector_size), &nbytes, Irp, &rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("clone_extents returned %08lx\n", Status);
+        goto end;
+    }
+
+    fcb->inode_item.st_blocks += nbytes;
+    fcb->inode_item_changed = true;
+    fcb->extents_changed = true;
+
+    mark_fcb_dirty(fcb);
 
     Status = STATUS_SUCCESS;
 
@@ -3691,6 +4149,24 @@ end:
 
     ExReleaseResourceLite(&Vcb->tree_lock);
 
+    if (NT_SUCCESS(Status)) {
+#if defined(_WIN64)
+        if (IoIs32bitProcess(Irp)) {
+            btrfs_dedupe32* bd32 = data;
+
+            bd32->bytes_deduped = len;
+            bd32->status = equal ? BTRFS_DEDUPE_SAME : BTRFS_DEDUPE_DIFFERS;
+            Irp->IoStatus.Information = sizeof(btrfs_dedupe32);
+        } else {
+#endif
+            bd->bytes_deduped = len;
+            bd->status = equal ? BTRFS_DEDUPE_SAME : BTRFS_DEDUPE_DIFFERS;
+            Irp->IoStatus.Information = sizeof(btrfs_dedupe);
+#if defined(_WIN64)
+        }
+#endif
+    }
+
     return Status;
 }
 
@@ -5005,16 +5481,27 @@ static NTSTATUS get_retrieval_pointers(device_extension* Vcb, PFILE_OBJECT FileO
     if (outlen < offsetof(RETRIEVAL_POINTERS_BUFFER, Extents[0]))
         return STATUS_BUFFER_TOO_SMALL;
 
-    ExAcquireResourceSharedLite(fcb->Header.Resource, true);
+    Status = acquire_fcb_extents(fcb, 0, 0xffffffffffffffff, true, NULL);
+    if (!NT_SUCCESS(Status)) {
+        ERR("acquire_fcb_extents returned %08lx\n", Status);
+        return Status;
+    }
 
     try {
-        LIST_ENTRY* le = fcb->extents.Flink;
+        LIST_ENTRY* le;
         extent* first_ext = NULL;
-        unsigned int num_extents = 0, first_extent_num = 0, i;
-        uint64_t num_sectors, last_off = 0;
+        unsigned int num_extents = 0, i;
+        uint64_t num_sectors, last_off, vcn = in->StartingVcn.QuadPart;
 
         num_sectors = (fcb->inode_item.st_size + Vcb->superblock.sector_size - 1) >> Vcb->sector_shift;
 
+        // find the extent containing StartingVcn
+
+        if (vcn > 0xffffffffffffffff >> Vcb->sector_shift)
+            le = find_extent_index(fcb, 0xffffffffffffffff);
+        else
+            le = find_extent_index(fcb, vcn << Vcb->sector_shift);
+
         while (le != &fcb->extents) {
             extent* ext = CONTAINING_RECORD(le, extent, list_entry);
 
@@ -5023,15 +5510,36 @@ static NTSTATUS get_retrieval_pointers(device_extension* Vcb, PFILE_OBJECT FileO
                 continue;
             }
 
-            if (ext->offset > last_off)
-                num_extents++;
+            if (ext->offset >> Vcb->sector_shift > vcn)
+                break;
 
-            if ((ext->offset >> Vcb->sector_shift) <= (uint64_t)in->StartingVcn.QuadPart &&
-                (ext->offset + ext->extent_data.decoded_size) >> Vcb->sector_shift > (uint64_t)in->StartingVcn.QuadPart) {
+            if ((ext->offset + ext->extent_data.decoded_size) >> Vcb->sector_shift > vcn)
                 first_ext = ext;
-                first_extent_num = num_extents;
+
+            le = le->Flink;
+        }
+
+        if (!first_ext) {
+            Status = STATUS_END_OF_FILE;
+            leave;
+        }
+
+        // count the runs from there to the end of the file
+
+        le = &first_ext->list_entry;
+        last_off = first_ext->offset;
+
+        while (le != &fcb->extents) {
+            extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+
+            if (ext->ignore || ext->extent_data.type == EXTENT_TYPE_INLINE) {
+                le = le->Flink;
+                continue;
             }
 
+            if (ext->offset > last_off)
+                num_extents++;
+
             num_extents++;
 
             last_off = ext->offset + ext->extent_data.decoded_size;
@@ -5042,12 +5550,7 @@ static NTSTATUS get_retrieval_pointers(device_extension* Vcb, PFILE_OBJECT FileO
         if (num_sectors > last_off >> Vcb->sector_shift)
             num_extents++;
 
-        if (!first_ext) {
-            Status = STATUS_END_OF_FILE;
-            leave;
-        }
-
-        out->ExtentCount = num_extents - first_extent_num;
+        out->ExtentCount = num_extents;
         out->StartingVcn.QuadPart = first_ext->offset >> Vcb->sector_shift;
         outlen -= offsetof(RETRIEVAL_POINTERS_BUFFER, Extents[0]);
         *retlen = offsetof(RETRIEVAL_POINTERS_BUFFER, Extents[0]);
@@ -5210,7 +5713,11 @@ static NTSTATUS get_csum_info(device_extension* Vcb, PFILE_OBJECT FileObject, bt
         return STATUS_ACCESS_DENIED;
     }
 
-    ExAcquireResourceSharedLite(fcb->Header.Resource, true);
+    Status = acquire_fcb_extents(fcb, 0, 0xffffffffffffffff, true, NULL);
+    if (!NT_SUCCESS(Status)) {
+        ERR("acquire_fcb_extents returned %08lx\n", Status);
+        return Status;
+    }
 
     try {
         LIST_ENTRY* le;
@@ -5917,6 +6424,42 @@ NTSTATUS fsctl_request(PDEVICE_OBJECT DeviceObject, PIRP* Pirp, uint32_t type) {
                                    Irp->RequestorMode);
             break;
 
+        case FSCTL_BTRFS_DEFRAGMENT:
+            Status = defrag_file(DeviceObject->DeviceExtension, IrpSp->FileObject, Irp->AssociatedIrp.SystemBuffer,
+                                 IrpSp->Parameters.FileSystemControl.InputBufferLength, Irp);
+            break;
+
+        case FSCTL_BTRFS_DEDUPE:
+            Status = dedupe_extents(DeviceObject->DeviceExtension, IrpSp->FileObject, Irp->AssociatedIrp.SystemBuffer,
+                                    IrpSp->Parameters.FileSystemControl.InputBufferLength,
+                                    IrpSp->Parameters.FileSystemControl.OutputBufferLength, Irp);
+            break;
+
+        case FSCTL_BTRFS_GET_AUTODEFRAG_STATS:
+            Status = get_autodefrag_stats(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer,
+                                          IrpSp->Parameters.FileSystemControl.OutputBufferLength, &Irp->IoStatus.Information);
+            break;
+
+        case FSCTL_BTRFS_GET_READAHEAD_STATS:
+            Status = get_readahead_stats(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer,
+                                         IrpSp->Parameters.FileSystemControl.OutputBufferLength, &Irp->IoStatus.Information);
+            break;
+
+        case FSCTL_BTRFS_GET_STRIPE_CACHE_STATS:
+            Status = get_stripe_cache_stats(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer,
+                                            IrpSp->Parameters.FileSystemControl.OutputBufferLength, &Irp->IoStatus.Information);
+            break;
+
+        case FSCTL_BTRFS_GET_THROTTLE_STATS:
+            Status = get_throttle_stats(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer,
+                                        IrpSp->Parameters.FileSystemControl.OutputBufferLength, &Irp->IoStatus.Information);
+            break;
+
+        case FSCTL_BTRFS_GET_CACHE_PRELOAD_STATS:
+            Status = get_cache_preload_stats(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer,
+                                             IrpSp->Parameters.FileSystemControl.OutputBufferLength, &Irp->IoStatus.Information);
+            break;
+
         default:
             WARN("unknown control code %lx (DeviceType = %lx, Access = %lx, Function = %lx, Method = %lx)\n",
                           IrpSp->Parameters.FileSystemControl.FsControlCode, (IrpSp->Parameters.FileSystemControl.FsControlCode & 0xff0000) >> 16,
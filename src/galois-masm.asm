@@ -0,0 +1,630 @@
+; Copyright (c) Mark Harmstone 2020
+;
+; This file is part of WinBtrfs.
+;
+; WinBtrfs is free software: you can redistribute it and/or modify
+; it under the terms of the GNU Lesser General Public Licence as published by
+; the Free Software Foundation, either version 3 of the Licence, or
+; (at your option) any later version.
+;
+; WinBtrfs is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU Lesser General Public Licence for more details.
+;
+; You should have received a copy of the GNU Lesser General Public Licence
+; along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>.
+
+; See galois.c for the layout of the tables passed to galois_mul2.
+
+IFDEF RAX
+ELSE
+.686P
+.xmm
+ENDIF
+
+_TEXT  SEGMENT
+
+IFDEF RAX
+
+PUBLIC galois_double_sse2
+
+; void galois_double_sse2(uint8_t* data, uint32_t len);
+galois_double_sse2:
+    ; rcx = data
+    ; edx = len
+    ; al = tmp1
+    ; xmm0 = tmp2
+    ; xmm1 = tmp3
+    ; xmm2 = 0x1d in every byte
+    ; xmm3 = 0
+
+    mov eax, 1d1d1d1dh
+    movd xmm2, eax
+    pshufd xmm2, xmm2, 0
+    pxor xmm3, xmm3
+
+galois_double_sse2_loop:
+    cmp edx, 16
+    jl galois_double_stragglers
+
+    movdqu xmm0, XMMWORD PTR [rcx]
+    movdqa xmm1, xmm3
+    pcmpgtb xmm1, xmm0
+    paddb xmm0, xmm0
+    pand xmm1, xmm2
+    pxor xmm0, xmm1
+    movdqu XMMWORD PTR [rcx], xmm0
+
+    add rcx, 16
+    sub edx, 16
+
+    jmp galois_double_sse2_loop
+
+galois_double_stragglers:
+
+    cmp edx, 0
+    je galois_double_end
+
+    mov al, [rcx]
+    add al, al
+    jnc galois_double_nocarry
+    xor al, 1dh
+
+galois_double_nocarry:
+    mov [rcx], al
+
+    inc rcx
+    dec edx
+
+    jmp galois_double_stragglers
+
+galois_double_end:
+    ret
+
+PUBLIC galois_double_avx2
+
+; void galois_double_avx2(uint8_t* data, uint32_t len);
+galois_double_avx2:
+    ; rcx = data
+    ; edx = len
+    ; ymm0 = tmp1
+    ; ymm1 = tmp2
+    ; ymm2 = 0x1d in every byte
+    ; ymm3 = 0
+
+    mov eax, 1d1d1d1dh
+    vmovd xmm2, eax
+    vpbroadcastd ymm2, xmm2
+    vpxor ymm3, ymm3, ymm3
+
+galois_double_avx2_loop:
+    cmp edx, 32
+    jl galois_double_avx2_end
+
+    vmovdqu ymm0, YMMWORD PTR [rcx]
+    vpcmpgtb ymm1, ymm3, ymm0
+    vpaddb ymm0, ymm0, ymm0
+    vpand ymm1, ymm1, ymm2
+    vpxor ymm0, ymm0, ymm1
+    vmovdqu YMMWORD PTR [rcx], ymm0
+
+    add rcx, 32
+    sub edx, 32
+
+    jmp galois_double_avx2_loop
+
+galois_double_avx2_end:
+    vzeroupper
+    jmp galois_double_stragglers
+
+PUBLIC galois_mul2_ssse3
+
+; void galois_mul2_ssse3(uint8_t* dest, uint8_t* src, uint8_t* tables, uint32_t len);
+galois_mul2_ssse3:
+    ; rcx = dest
+    ; rdx = src
+    ; r8 = tables
+    ; r9d = len
+    ; xmm0 = low nibbles
+    ; xmm1 = high nibbles
+    ; xmm2 = result
+    ; xmm3 = tmp
+    ; xmm4 = 0x0f in every byte
+
+    mov eax, 0f0f0f0fh
+    movd xmm4, eax
+    pshufd xmm4, xmm4, 0
+
+galois_mul2_ssse3_loop:
+    cmp r9d, 16
+    jl galois_mul2_stragglers
+
+    movdqu xmm0, XMMWORD PTR [rdx]
+    movdqa xmm1, xmm0
+    psrlw xmm1, 4
+    pand xmm0, xmm4
+    pand xmm1, xmm4
+    movdqu xmm2, XMMWORD PTR [r8]
+    pshufb xmm2, xmm0
+    movdqu xmm3, XMMWORD PTR [r8+16]
+    pshufb xmm3, xmm1
+    pxor xmm2, xmm3
+
+    movdqu xmm0, XMMWORD PTR [rcx]
+    movdqa xmm1, xmm0
+    psrlw xmm1, 4
+    pand xmm0, xmm4
+    pand xmm1, xmm4
+    movdqu xmm3, XMMWORD PTR [r8+32]
+    pshufb xmm3, xmm0
+    pxor xmm2, xmm3
+    movdqu xmm3, XMMWORD PTR [r8+48]
+    pshufb xmm3, xmm1
+    pxor xmm2, xmm3
+
+    movdqu XMMWORD PTR [rcx], xmm2
+
+    add rcx, 16
+    add rdx, 16
+    sub r9d, 16
+
+    jmp galois_mul2_ssse3_loop
+
+galois_mul2_stragglers:
+
+    cmp r9d, 0
+    je galois_mul2_end
+
+    movzx eax, BYTE PTR [rdx]
+    mov r10d, eax
+    and eax, 15
+    shr r10d, 4
+    mov r11b, [r8+rax]
+    xor r11b, [r8+r10+16]
+
+    movzx eax, BYTE PTR [rcx]
+    mov r10d, eax
+    and eax, 15
+    shr r10d, 4
+    xor r11b, [r8+rax+32]
+    xor r11b, [r8+r10+48]
+
+    mov [rcx], r11b
+
+    inc rcx
+    inc rdx
+    dec r9d
+
+    jmp galois_mul2_stragglers
+
+galois_mul2_end:
+    ret
+
+PUBLIC galois_mul2_avx2
+
+; void galois_mul2_avx2(uint8_t* dest, uint8_t* src, uint8_t* tables, uint32_t len);
+galois_mul2_avx2:
+    ; rcx = dest
+    ; rdx = src
+    ; r8 = tables
+    ; r9d = len
+    ; ymm0 = low nibbles
+    ; ymm1 = high nibbles
+    ; ymm2 = tmp1
+    ; ymm3 = tmp2
+    ; ymm4 = result
+    ; ymm5 = 0x0f in every byte
+
+    mov eax, 0f0f0f0fh
+    vmovd xmm5, eax
+    vpbroadcastd ymm5, xmm5
+
+galois_mul2_avx2_loop:
+    cmp r9d, 32
+    jl galois_mul2_avx2_end
+
+    vmovdqu ymm0, YMMWORD PTR [rdx]
+    vpsrlw ymm1, ymm0, 4
+    vpand ymm0, ymm0, ymm5
+    vpand ymm1, ymm1, ymm5
+    vbroadcasti128 ymm2, XMMWORD PTR [r8]
+    vpshufb ymm2, ymm2, ymm0
+    vbroadcasti128 ymm3, XMMWORD PTR [r8+16]
+    vpshufb ymm3, ymm3, ymm1
+    vpxor ymm4, ymm2, ymm3
+
+    vmovdqu ymm0, YMMWORD PTR [rcx]
+    vpsrlw ymm1, ymm0, 4
+    vpand ymm0, ymm0, ymm5
+    vpand ymm1, ymm1, ymm5
+    vbroadcasti128 ymm2, XMMWORD PTR [r8+32]
+    vpshufb ymm2, ymm2, ymm0
+    vbroadcasti128 ymm3, XMMWORD PTR [r8+48]
+    vpshufb ymm3, ymm3, ymm1
+    vpxor ymm4, ymm4, ymm2
+    vpxor ymm4, ymm4, ymm3
+
+    vmovdqu YMMWORD PTR [rcx], ymm4
+
+    add rcx, 32
+    add rdx, 32
+    sub r9d, 32
+
+    jmp galois_mul2_avx2_loop
+
+galois_mul2_avx2_end:
+    vzeroupper
+    jmp galois_mul2_stragglers
+
+PUBLIC galois_mul2_gfni
+
+; void galois_mul2_gfni(uint8_t* dest, uint8_t* src, uint8_t* tables, uint32_t len);
+galois_mul2_gfni:
+    ; rcx = dest
+    ; rdx = src
+    ; r8 = tables
+    ; r9d = len
+    ; ymm0 = tmp1
+    ; ymm1 = tmp2
+    ; ymm2 = matrix for a
+    ; ymm3 = matrix for b
+
+    vpbroadcastq ymm2, QWORD PTR [r8+64]
+    vpbroadcastq ymm3, QWORD PTR [r8+72]
+
+galois_mul2_gfni_loop:
+    cmp r9d, 32
+    jl galois_mul2_gfni_end
+
+    vmovdqu ymm0, YMMWORD PTR [rdx]
+    vgf2p8affineqb ymm0, ymm0, ymm2, 0
+    vmovdqu ymm1, YMMWORD PTR [rcx]
+    vgf2p8affineqb ymm1, ymm1, ymm3, 0
+    vpxor ymm0, ymm0, ymm1
+    vmovdqu YMMWORD PTR [rcx], ymm0
+
+    add rcx, 32
+    add rdx, 32
+    sub r9d, 32
+
+    jmp galois_mul2_gfni_loop
+
+galois_mul2_gfni_end:
+    vzeroupper
+    jmp galois_mul2_stragglers
+
+ELSE
+
+PUBLIC galois_double_sse2@8
+
+; void __stdcall galois_double_sse2(uint8_t* data, uint32_t len);
+galois_double_sse2@8:
+    ; edx = data
+    ; ecx = len
+    ; al = tmp1
+    ; xmm0 = tmp2
+    ; xmm1 = tmp3
+    ; xmm2 = 0x1d in every byte
+    ; xmm3 = 0
+
+    push ebp
+    mov ebp, esp
+
+    mov edx, [ebp+8]
+    mov ecx, [ebp+12]
+
+    mov eax, 1d1d1d1dh
+    movd xmm2, eax
+    pshufd xmm2, xmm2, 0
+    pxor xmm3, xmm3
+
+galois_double_sse2_loop:
+    cmp ecx, 16
+    jl galois_double_stragglers
+
+    movdqu xmm0, XMMWORD PTR [edx]
+    movdqa xmm1, xmm3
+    pcmpgtb xmm1, xmm0
+    paddb xmm0, xmm0
+    pand xmm1, xmm2
+    pxor xmm0, xmm1
+    movdqu XMMWORD PTR [edx], xmm0
+
+    add edx, 16
+    sub ecx, 16
+
+    jmp galois_double_sse2_loop
+
+galois_double_stragglers:
+
+    cmp ecx, 0
+    je galois_double_end
+
+    mov al, [edx]
+    add al, al
+    jnc galois_double_nocarry
+    xor al, 1dh
+
+galois_double_nocarry:
+    mov [edx], al
+
+    inc edx
+    dec ecx
+
+    jmp galois_double_stragglers
+
+galois_double_end:
+    pop ebp
+
+    ret 8
+
+PUBLIC galois_double_avx2@8
+
+; void __stdcall galois_double_avx2(uint8_t* data, uint32_t len);
+galois_double_avx2@8:
+    ; edx = data
+    ; ecx = len
+    ; ymm0 = tmp1
+    ; ymm1 = tmp2
+    ; ymm2 = 0x1d in every byte
+    ; ymm3 = 0
+
+    push ebp
+    mov ebp, esp
+
+    mov edx, [ebp+8]
+    mov ecx, [ebp+12]
+
+    mov eax, 1d1d1d1dh
+    vmovd xmm2, eax
+    vpbroadcastd ymm2, xmm2
+    vpxor ymm3, ymm3, ymm3
+
+galois_double_avx2_loop:
+    cmp ecx, 32
+    jl galois_double_avx2_end
+
+    vmovdqu ymm0, YMMWORD PTR [edx]
+    vpcmpgtb ymm1, ymm3, ymm0
+    vpaddb ymm0, ymm0, ymm0
+    vpand ymm1, ymm1, ymm2
+    vpxor ymm0, ymm0, ymm1
+    vmovdqu YMMWORD PTR [edx], ymm0
+
+    add edx, 32
+    sub ecx, 32
+
+    jmp galois_double_avx2_loop
+
+galois_double_avx2_end:
+    vzeroupper
+    jmp galois_double_stragglers
+
+PUBLIC galois_mul2_ssse3@16
+
+; void __stdcall galois_mul2_ssse3(uint8_t* dest, uint8_t* src, uint8_t* tables, uint32_t len);
+galois_mul2_ssse3@16:
+    ; edi = dest
+    ; esi = src
+    ; edx = tables
+    ; ecx = len
+    ; eax = tmp1
+    ; ebx = tmp2
+    ; xmm0 = low nibbles
+    ; xmm1 = high nibbles
+    ; xmm2 = result
+    ; xmm3 = tmp3
+    ; xmm4 = 0x0f in every byte
+
+    push ebp
+    mov ebp, esp
+
+    push esi
+    push edi
+    push ebx
+
+    mov edi, [ebp+8]
+    mov esi, [ebp+12]
+    mov edx, [ebp+16]
+    mov ecx, [ebp+20]
+
+    mov eax, 0f0f0f0fh
+    movd xmm4, eax
+    pshufd xmm4, xmm4, 0
+
+galois_mul2_ssse3_loop:
+    cmp ecx, 16
+    jl galois_mul2_stragglers
+
+    movdqu xmm0, XMMWORD PTR [esi]
+    movdqa xmm1, xmm0
+    psrlw xmm1, 4
+    pand xmm0, xmm4
+    pand xmm1, xmm4
+    movdqu xmm2, XMMWORD PTR [edx]
+    pshufb xmm2, xmm0
+    movdqu xmm3, XMMWORD PTR [edx+16]
+    pshufb xmm3, xmm1
+    pxor xmm2, xmm3
+
+    movdqu xmm0, XMMWORD PTR [edi]
+    movdqa xmm1, xmm0
+    psrlw xmm1, 4
+    pand xmm0, xmm4
+    pand xmm1, xmm4
+    movdqu xmm3, XMMWORD PTR [edx+32]
+    pshufb xmm3, xmm0
+    pxor xmm2, xmm3
+    movdqu xmm3, XMMWORD PTR [edx+48]
+    pshufb xmm3, xmm1
+    pxor xmm2, xmm3
+
+    movdqu XMMWORD PTR [edi], xmm2
+
+    add edi, 16
+    add esi, 16
+    sub ecx, 16
+
+    jmp galois_mul2_ssse3_loop
+
+galois_mul2_stragglers:
+
+    cmp ecx, 0
+    je galois_mul2_end
+
+; b * dest goes into dest first, so that we only need two registers
+
+    movzx ebx, BYTE PTR [edi]
+    mov eax, ebx
+    and eax, 15
+    shr ebx, 4
+    mov al, [edx+eax+32]
+    xor al, [edx+ebx+48]
+
+    movzx ebx, BYTE PTR [esi]
+    mov [edi], al
+
+    mov eax, ebx
+    and eax, 15
+    shr ebx, 4
+    mov al, [edx+eax]
+    xor al, [edx+ebx+16]
+    xor [edi], al
+
+    inc edi
+    inc esi
+    dec ecx
+
+    jmp galois_mul2_stragglers
+
+galois_mul2_end:
+    pop ebx
+    pop edi
+    pop esi
+    pop ebp
+
+    ret 16
+
+PUBLIC galois_mul2_avx2@16
+
+; void __stdcall galois_mul2_avx2(uint8_t* dest, uint8_t* src, uint8_t* tables, uint32_t len);
+galois_mul2_avx2@16:
+    ; edi = dest
+    ; esi = src
+    ; edx = tables
+    ; ecx = len
+    ; ymm0 = low nibbles
+    ; ymm1 = high nibbles
+    ; ymm2 = tmp1
+    ; ymm3 = tmp2
+    ; ymm4 = result
+    ; ymm5 = 0x0f in every byte
+
+    push ebp
+    mov ebp, esp
+
+    push esi
+    push edi
+    push ebx
+
+    mov edi, [ebp+8]
+    mov esi, [ebp+12]
+    mov edx, [ebp+16]
+    mov ecx, [ebp+20]
+
+    mov eax, 0f0f0f0fh
+    vmovd xmm5, eax
+    vpbroadcastd ymm5, xmm5
+
+galois_mul2_avx2_loop:
+    cmp ecx, 32
+    jl galois_mul2_avx2_end
+
+    vmovdqu ymm0, YMMWORD PTR [esi]
+    vpsrlw ymm1, ymm0, 4
+    vpand ymm0, ymm0, ymm5
+    vpand ymm1, ymm1, ymm5
+    vbroadcasti128 ymm2, XMMWORD PTR [edx]
+    vpshufb ymm2, ymm2, ymm0
+    vbroadcasti128 ymm3, XMMWORD PTR [edx+16]
+    vpshufb ymm3, ymm3, ymm1
+    vpxor ymm4, ymm2, ymm3
+
+    vmovdqu ymm0, YMMWORD PTR [edi]
+    vpsrlw ymm1, ymm0, 4
+    vpand ymm0, ymm0, ymm5
+    vpand ymm1, ymm1, ymm5
+    vbroadcasti128 ymm2, XMMWORD PTR [edx+32]
+    vpshufb ymm2, ymm2, ymm0
+    vbroadcasti128 ymm3, XMMWORD PTR [edx+48]
+    vpshufb ymm3, ymm3, ymm1
+    vpxor ymm4, ymm4, ymm2
+    vpxor ymm4, ymm4, ymm3
+
+    vmovdqu YMMWORD PTR [edi], ymm4
+
+    add edi, 32
+    add esi, 32
+    sub ecx, 32
+
+    jmp galois_mul2_avx2_loop
+
+galois_mul2_avx2_end:
+    vzeroupper
+    jmp galois_mul2_stragglers
+
+PUBLIC galois_mul2_gfni@16
+
+; void __stdcall galois_mul2_gfni(uint8_t* dest, uint8_t* src, uint8_t* tables, uint32_t len);
+galois_mul2_gfni@16:
+    ; edi = dest
+    ; esi = src
+    ; edx = tables
+    ; ecx = len
+    ; ymm0 = tmp1
+    ; ymm1 = tmp2
+    ; ymm2 = matrix for a
+    ; ymm3 = matrix for b
+
+    push ebp
+    mov ebp, esp
+
+    push esi
+    push edi
+    push ebx
+
+    mov edi, [ebp+8]
+    mov esi, [ebp+12]
+    mov edx, [ebp+16]
+    mov ecx, [ebp+20]
+
+    vpbroadcastq ymm2, QWORD PTR [edx+64]
+    vpbroadcastq ymm3, QWORD PTR [edx+72]
+
+galois_mul2_gfni_loop:
+    cmp ecx, 32
+    jl galois_mul2_gfni_end
+
+    vmovdqu ymm0, YMMWORD PTR [esi]
+    vgf2p8affineqb ymm0, ymm0, ymm2, 0
+    vmovdqu ymm1, YMMWORD PTR [edi]
+    vgf2p8affineqb ymm1, ymm1, ymm3, 0
+    vpxor ymm0, ymm0, ymm1
+    vmovdqu YMMWORD PTR [edi], ymm0
+
+    add edi, 32
+    add esi, 32
+    sub ecx, 32
+
+    jmp galois_mul2_gfni_loop
+
+galois_mul2_gfni_end:
+    vzeroupper
+    jmp galois_mul2_stragglers
+
+ENDIF
+
+_TEXT  ENDS
+
+end
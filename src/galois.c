@@ -51,21 +51,6 @@ static const uint8_t gilog[] = {0x00, 0x00, 0x01, 0x19, 0x02, 0x32, 0x1a, 0xc6,
                               0xcb, 0x59, 0x5f, 0xb0, 0x9c, 0xa9, 0xa0, 0x51, 0x0b, 0xf5, 0x16, 0xeb, 0x7a, 0x75, 0x2c, 0xd7,
                               0x4f, 0xae, 0xd5, 0xe9, 0xe6, 0xe7, 0xad, 0xe8, 0x74, 0xd6, 0xf4, 0xea, 0xa8, 0x50, 0x58, 0xaf};
 
-// divides the bytes in data by 2^div
-void galois_divpower(uint8_t* data, uint8_t div, uint32_t len) {
-    while (len > 0) {
-        if (data[0] != 0) {
-            if (gilog[data[0]] <= div)
-                data[0] = glog[(gilog[data[0]] + (255 - div)) % 255];
-            else
-                data[0] = glog[(gilog[data[0]] - div) % 255];
-        }
-
-        data++;
-        len--;
-    }
-}
-
 uint8_t gpow2(uint8_t e) {
     return glog[e%255];
 }
@@ -106,9 +91,7 @@ __inline static uint32_t galois_double_mask32(uint32_t v) {
 }
 #endif
 
-void galois_double(uint8_t* data, uint32_t len) {
-    // FIXME - SIMD?
-
+static void __stdcall galois_double_basic(uint8_t* data, uint32_t len) {
 #if defined(_AMD64_) || defined(_ARM64_)
     while (len > sizeof(uint64_t)) {
         uint64_t v = *((uint64_t*)data), vv;
@@ -139,3 +122,86 @@ void galois_double(uint8_t* data, uint32_t len) {
         len--;
     }
 }
+
+// Multiplying by a constant is done by looking up the low and high nibbles of each byte
+// separately, which is what PSHUFB does 16 or 32 bytes at a time. With GFNI we use an 8x8
+// bit matrix for GF2P8AFFINEQB instead - we can't use GF2P8MULB, as it's hardwired to the
+// AES polynomial (0x11b) rather than RAID6's (0x11d). The assembly versions rely on this
+// layout, so don't change it.
+typedef struct {
+    uint8_t nibbles[4][16]; // a * low, a * high, b * low, b * high
+    uint64_t matrix[2]; // a, b
+} galois_tables;
+
+static void __stdcall galois_mul2_basic(uint8_t* dest, uint8_t* src, uint8_t* tables, uint32_t len) {
+    galois_tables* gt = (galois_tables*)tables;
+
+    while (len > 0) {
+        *dest = gt->nibbles[0][*src & 0xf] ^ gt->nibbles[1][*src >> 4] ^ gt->nibbles[2][*dest & 0xf] ^ gt->nibbles[3][*dest >> 4];
+
+        dest++;
+        src++;
+        len--;
+    }
+}
+
+galois_double_func galois_double = galois_double_basic;
+galois_mul2_func do_galois_mul2 = galois_mul2_basic;
+
+static uint64_t galois_matrix(uint8_t c) {
+    uint64_t m = 0;
+
+    // bit i of the result is the parity of byte 7-i of the matrix ANDed with the input
+    for (unsigned int j = 0; j < 8; j++) {
+        uint8_t col = gmul(c, (uint8_t)(1 << j));
+
+        for (unsigned int i = 0; i < 8; i++) {
+            if (col & (1 << i))
+                m |= (uint64_t)1 << (((7 - i) * 8) + j);
+        }
+    }
+
+    return m;
+}
+
+// dest = (a * src) ^ (b * dest)
+void galois_mul2(uint8_t* dest, uint8_t* src, uint8_t a, uint8_t b, uint32_t len) {
+    galois_tables gt;
+
+    for (unsigned int i = 0; i < 16; i++) {
+        gt.nibbles[0][i] = gmul(a, (uint8_t)i);
+        gt.nibbles[1][i] = gmul(a, (uint8_t)(i << 4));
+        gt.nibbles[2][i] = gmul(b, (uint8_t)i);
+        gt.nibbles[3][i] = gmul(b, (uint8_t)(i << 4));
+    }
+
+    gt.matrix[0] = galois_matrix(a);
+    gt.matrix[1] = galois_matrix(b);
+
+    do_galois_mul2(dest, src, (uint8_t*)&gt, len);
+}
+
+// divides the bytes in data by 2^div
+void galois_divpower(uint8_t* data, uint8_t div, uint32_t len) {
+    galois_mul2(data, data, 0, gpow2(255 - div), len);
+}
+
+// Recovers data stripes x and y from P and Q, where pxy and qxy are the P and Q of the other
+// data stripes. Afterwards qxy holds stripe x and pxy holds stripe y.
+void galois_recover2(uint8_t* p, uint8_t* q, uint8_t* pxy, uint8_t* qxy, uint16_t x, uint16_t y, uint32_t len) {
+    uint8_t gyx, gx, denom, a, b;
+
+    gyx = gpow2(y > x ? (y-x) : (255-x+y));
+    gx = gpow2(255-x);
+
+    denom = gdiv(1, gyx ^ 1);
+    a = gmul(gyx, denom);
+    b = gmul(gx, denom);
+
+    do_xor(pxy, p, len);
+    do_xor(qxy, q, len);
+
+    galois_mul2(qxy, pxy, a, b, len);
+
+    do_xor(pxy, qxy, len);
+}
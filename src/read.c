@@ -39,6 +39,8 @@ typedef struct {
     PMDL mdl;
     uint64_t stripestart;
     uint64_t stripeend;
+    device* dev;
+    uint64_t start_time;
 } read_data_stripe;
 
 typedef struct {
@@ -55,6 +57,18 @@ typedef struct {
     bool tree;
     read_data_stripe* stripes;
     uint8_t* va;
+    CHUNK_ITEM* ci;
+    device** devices;
+    uint64_t offset;
+    uint64_t generation;
+    uint8_t* buf;
+    bool file_read;
+    bool need_to_wait;
+    uint16_t missing_devices;
+    uint64_t total_reading;
+    uint64_t lockaddr, locklen;
+    uint8_t* dummypage;
+    PMDL dummy_mdl;
 } read_data_context;
 
 extern bool diskacc;
@@ -63,6 +77,8 @@ extern tCcCopyReadEx fCcCopyReadEx;
 extern tFsRtlUpdateDiskCounters fFsRtlUpdateDiskCounters;
 
 #define LZO_PAGE_SIZE 4096
+#define READ_QUEUE_DEPTH 16 // how many parts of a file read we have in flight at once
+#define READ_SPLIT_SIZE 0x100000 // 1 MB - with ReadPolicy=1, mirrored reads bigger than this get shared out between the copies
 
 _Function_class_(IO_COMPLETION_ROUTINE)
 static NTSTATUS __stdcall read_data_completion(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID conptr) {
@@ -78,12 +94,48 @@ static NTSTATUS __stdcall read_data_completion(PDEVICE_OBJECT DeviceObject, PIRP
     else
         stripe->status = ReadDataStatus_Error;
 
+    if (stripe->dev) {
+        LONG latency = (LONG)min(KeQueryInterruptTime() - stripe->start_time, MAXLONG);
+
+        // Exponentially-weighted, 1/8 per read. Two completions at once can lose an update,
+        // but this is only ever used as a hint.
+        stripe->dev->read_latency += (latency - stripe->dev->read_latency) / 8;
+
+        InterlockedDecrement(&stripe->dev->reads_in_flight);
+    }
+
     if (InterlockedDecrement(&context->stripes_left) == 0)
         KeSetEvent(&context->Event, 0, false);
 
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
+// Returns whichever of the num copies in devices we expect to get back soonest, going by how
+// many reads each device has outstanding and how long they've been taking lately, or num if
+// none of them are present. Ties go to the first one after start, so that identical devices
+// still get used in turn.
+static uint16_t pick_mirror(device** devices, uint16_t num, uint16_t start) {
+    uint16_t best = num;
+    uint64_t best_cost = 0;
+
+    for (uint16_t i = 0; i < num; i++) {
+        uint16_t j = (start + i) % num;
+        uint64_t cost;
+
+        if (!devices[j] || !devices[j]->devobj)
+            continue;
+
+        cost = (uint64_t)(devices[j]->reads_in_flight + 1) * (uint64_t)max(devices[j]->read_latency, 1);
+
+        if (best == num || cost < best_cost) {
+            best = j;
+            best_cost = cost;
+        }
+    }
+
+    return best;
+}
+
 NTSTATUS check_csum(device_extension* Vcb, uint8_t* data, uint32_t sectors, void* csum) {
     void* csum2;
 
@@ -942,8 +994,7 @@ void raid6_recover2(uint8_t* sectors, uint16_t num_stripes, ULONG sector_size, u
             galois_divpower(out, (uint8_t)missing, sector_size);
     } else { // reconstruct from p and q
         uint16_t x = missing1, y = missing2, stripe;
-        uint8_t gyx, gx, denom, a, b, *p, *q, *pxy, *qxy;
-        uint32_t j;
+        uint8_t *pxy, *qxy;
 
         stripe = num_stripes - 3;
 
@@ -969,27 +1020,7 @@ void raid6_recover2(uint8_t* sectors, uint16_t num_stripes, ULONG sector_size, u
             }
         } while (stripe > 0);
 
-        gyx = gpow2(y > x ? (y-x) : (255-x+y));
-        gx = gpow2(255-x);
-
-        denom = gdiv(1, gyx ^ 1);
-        a = gmul(gyx, denom);
-        b = gmul(gx, denom);
-
-        p = sectors + ((num_stripes - 2) * sector_size);
-        q = sectors + ((num_stripes - 1) * sector_size);
-
-        for (j = 0; j < sector_size; j++) {
-            *qxy = gmul(a, *p ^ *pxy) ^ gmul(b, *q ^ *qxy);
-
-            p++;
-            q++;
-            pxy++;
-            qxy++;
-        }
-
-        do_xor(out + sector_size, out, sector_size);
-        do_xor(out + sector_size, sectors + ((num_stripes - 2) * sector_size), sector_size);
+        galois_recover2(sectors + ((num_stripes - 2) * sector_size), sectors + ((num_stripes - 1) * sector_size), pxy, qxy, x, y, sector_size);
     }
 }
 
@@ -1144,14 +1175,19 @@ static NTSTATUS read_data_raid6(device_extension* Vcb, uint8_t* buf, uint64_t ad
             if (num_errors == 0) {
                 tree_header* th = (tree_header*)(sector + (stripe * Vcb->superblock.node_size));
 
+                uint8_t* srcs[XOR_MULTI_MAX];
+                uint32_t num_srcs = 0;
+
                 RtlCopyMemory(sector + (stripe * Vcb->superblock.node_size), sector + ((ci->num_stripes - 2) * Vcb->superblock.node_size),
                               Vcb->superblock.node_size);
 
                 for (j = 0; j < ci->num_stripes - 2; j++) {
                     if (j != stripe)
-                        do_xor(sector + (stripe * Vcb->superblock.node_size), sector + (j * Vcb->superblock.node_size), Vcb->superblock.node_size);
+                        xor_multi_queue(sector + (stripe * Vcb->superblock.node_size), srcs, &num_srcs, sector + (j * Vcb->superblock.node_size), Vcb->superblock.node_size);
                 }
 
+                xor_multi_queue(sector + (stripe * Vcb->superblock.node_size), srcs, &num_srcs, NULL, Vcb->superblock.node_size);
+
                 if (th->address == addr && check_tree_checksum(Vcb, th) && (generation == 0 || th->generation == generation)) {
                     RtlCopyMemory(buf, sector + (stripe * Vcb->superblock.node_size), Vcb->superblock.node_size);
 
@@ -1229,17 +1265,22 @@ static NTSTATUS read_data_raid6(device_extension* Vcb, uint8_t* buf, uint64_t ad
 
                             log_device_error(Vcb, devices[error_stripe_phys], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
 
+                            uint8_t* srcs[XOR_MULTI_MAX];
+                            uint32_t num_srcs = 0;
+
                             RtlZeroMemory(sector + ((ci->num_stripes - 2) * Vcb->superblock.node_size), Vcb->superblock.node_size);
 
                             for (j = 0; j < ci->num_stripes - 2; j++) {
                                 if (j == stripe) {
-                                    do_xor(sector + ((ci->num_stripes - 2) * Vcb->superblock.node_size), sector + (ci->num_stripes * Vcb->superblock.node_size),
-                                           Vcb->superblock.node_size);
+                                    xor_multi_queue(sector + ((ci->num_stripes - 2) * Vcb->superblock.node_size), srcs, &num_srcs,
+                                                    sector + (ci->num_stripes * Vcb->superblock.node_size), Vcb->superblock.node_size);
                                 } else {
-                                    do_xor(sector + ((ci->num_stripes - 2) * Vcb->superblock.node_size), sector + (j * Vcb->superblock.node_size),
-                                            Vcb->superblock.node_size);
+                                    xor_multi_queue(sector + ((ci->num_stripes - 2) * Vcb->superblock.node_size), srcs, &num_srcs,
+                                                    sector + (j * Vcb->superblock.node_size), Vcb->superblock.node_size);
                                 }
                             }
+
+                            xor_multi_queue(sector + ((ci->num_stripes - 2) * Vcb->superblock.node_size), srcs, &num_srcs, NULL, Vcb->superblock.node_size);
                         } else {
                             ERR("recovering from checksum error at %I64x, device %I64x\n", addr + ((error_stripe - stripe) * ci->stripe_length),
                                 devices[error_stripe_phys]->devitem.dev_id);
@@ -1335,13 +1376,18 @@ static NTSTATUS read_data_raid6(device_extension* Vcb, uint8_t* buf, uint64_t ad
 
                 if (!failed) {
                     if (num_errors == 0) {
+                        uint8_t* srcs[XOR_MULTI_MAX];
+                        uint32_t num_srcs = 0;
+
                         RtlCopyMemory(sector + ((unsigned int)stripe << Vcb->sector_shift), sector + ((unsigned int)(ci->num_stripes - 2) << Vcb->sector_shift), Vcb->superblock.sector_size);
 
                         for (j = 0; j < ci->num_stripes - 2; j++) {
                             if (j != stripe)
-                                do_xor(sector + ((unsigned int)stripe << Vcb->sector_shift), sector + ((unsigned int)j << Vcb->sector_shift), Vcb->superblock.sector_size);
+                                xor_multi_queue(sector + ((unsigned int)stripe << Vcb->sector_shift), srcs, &num_srcs, sector + ((unsigned int)j << Vcb->sector_shift), Vcb->superblock.sector_size);
                         }
 
+                        xor_multi_queue(sector + ((unsigned int)stripe << Vcb->sector_shift), srcs, &num_srcs, NULL, Vcb->superblock.sector_size);
+
                         if (!ptr || check_sector_csum(Vcb, sector + ((unsigned int)stripe << Vcb->sector_shift), ptr)) {
                             RtlCopyMemory(buf + (i << Vcb->sector_shift), sector + ((unsigned int)stripe << Vcb->sector_shift), Vcb->superblock.sector_size);
 
@@ -1423,17 +1469,23 @@ static NTSTATUS read_data_raid6(device_extension* Vcb, uint8_t* buf, uint64_t ad
 
                                     log_device_error(Vcb, devices[error_stripe_phys], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
 
+                                    uint8_t* srcs[XOR_MULTI_MAX];
+                                    uint32_t num_srcs = 0;
+
                                     RtlZeroMemory(sector + ((unsigned int)(ci->num_stripes - 2) << Vcb->sector_shift), Vcb->superblock.sector_size);
 
                                     for (j = 0; j < ci->num_stripes - 2; j++) {
                                         if (j == stripe) {
-                                            do_xor(sector + ((unsigned int)(ci->num_stripes - 2) << Vcb->sector_shift), sector + ((unsigned int)ci->num_stripes << Vcb->sector_shift),
-                                                   Vcb->superblock.sector_size);
+                                            xor_multi_queue(sector + ((unsigned int)(ci->num_stripes - 2) << Vcb->sector_shift), srcs, &num_srcs,
+                                                            sector + ((unsigned int)ci->num_stripes << Vcb->sector_shift), Vcb->superblock.sector_size);
                                         } else {
-                                            do_xor(sector + ((unsigned int)(ci->num_stripes - 2) << Vcb->sector_shift), sector + ((unsigned int)j << Vcb->sector_shift),
-                                                   Vcb->superblock.sector_size);
+                                            xor_multi_queue(sector + ((unsigned int)(ci->num_stripes - 2) << Vcb->sector_shift), srcs, &num_srcs,
+                                                            sector + ((unsigned int)j << Vcb->sector_shift), Vcb->superblock.sector_size);
                                         }
                                     }
+
+                                    xor_multi_queue(sector + ((unsigned int)(ci->num_stripes - 2) << Vcb->sector_shift), srcs, &num_srcs, NULL,
+                                                    Vcb->superblock.sector_size);
                                 } else {
                                     ERR("recovering from checksum error at %I64x, device %I64x\n",
                                         addr + ((uint64_t)i << Vcb->sector_shift) + ((error_stripe - stripe) * ci->stripe_length),
@@ -1475,20 +1527,53 @@ static NTSTATUS read_data_raid6(device_extension* Vcb, uint8_t* buf, uint64_t ad
     return STATUS_SUCCESS;
 }
 
-NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t length, _In_reads_bytes_opt_(length*sizeof(uint32_t)/Vcb->superblock.sector_size) void* csum,
-                   _In_ bool is_tree, _Out_writes_bytes_(length) uint8_t* buf, _In_opt_ chunk* c, _Out_opt_ chunk** pc, _In_opt_ PIRP Irp, _In_ uint64_t generation, _In_ bool file_read,
-                   _In_ ULONG priority) {
+static void free_read_data_context(device_extension* Vcb, read_data_context* context) {
+    uint16_t i;
+
+    if (context->c && (context->type == BLOCK_FLAG_RAID5 || context->type == BLOCK_FLAG_RAID6))
+        chunk_unlock_range(Vcb, context->c, context->lockaddr, context->locklen);
+
+    if (context->dummy_mdl)
+        IoFreeMdl(context->dummy_mdl);
+
+    if (context->dummypage)
+        ExFreePool(context->dummypage);
+
+    for (i = 0; i < context->ci->num_stripes; i++) {
+        if (context->stripes[i].mdl) {
+            if (context->stripes[i].mdl->MdlFlags & MDL_PAGES_LOCKED)
+                MmUnlockPages(context->stripes[i].mdl);
+
+            IoFreeMdl(context->stripes[i].mdl);
+        }
+
+        if (context->stripes[i].Irp)
+            IoFreeIrp(context->stripes[i].Irp);
+    }
+
+    if (context->file_read && context->va)
+        ExFreePool(context->va);
+
+    ExFreePool(context->stripes);
+
+    if (!Vcb->log_to_phys_loaded)
+        ExFreePool(context->devices);
+
+    ExFreePool(context);
+}
+
+// Sends off the IRPs for a read, without waiting for them. The caller has to pass the context
+// returned to read_data_finish, which waits for them and checks the data.
+static NTSTATUS read_data_start(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t length, _In_reads_bytes_opt_(length*sizeof(uint32_t)/Vcb->superblock.sector_size) void* csum,
+                                _In_ bool is_tree, _Out_writes_bytes_(length) uint8_t* buf, _In_opt_ chunk* c, _Out_opt_ chunk** pc, _In_opt_ PIRP Irp, _In_ uint64_t generation,
+                                _In_ bool file_read, _In_ ULONG priority, _Out_ read_data_context** pcontext) {
     CHUNK_ITEM* ci;
     CHUNK_ITEM_STRIPE* cis;
-    read_data_context context;
-    uint64_t type, offset, total_reading = 0;
+    read_data_context* context;
+    uint64_t type, offset;
     NTSTATUS Status;
     device** devices = NULL;
-    uint16_t i, startoffstripe, allowed_missing, missing_devices = 0;
-    uint8_t* dummypage = NULL;
-    PMDL dummy_mdl = NULL;
-    bool need_to_wait;
-    uint64_t lockaddr, locklen;
+    uint16_t i, startoffstripe, allowed_missing;
 
     if (Vcb->log_to_phys_loaded) {
         if (!c) {
@@ -1580,29 +1665,53 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
 
     cis = (CHUNK_ITEM_STRIPE*)&ci[1];
 
-    RtlZeroMemory(&context, sizeof(read_data_context));
-    KeInitializeEvent(&context.Event, NotificationEvent, false);
+    // this needs to be in non-paged memory, as the completion routine uses it
+    context = ExAllocatePoolWithTag(NonPagedPool, sizeof(read_data_context), ALLOC_TAG);
+    if (!context) {
+        ERR("out of memory\n");
+
+        if (!Vcb->log_to_phys_loaded)
+            ExFreePool(devices);
 
-    context.stripes = ExAllocatePoolWithTag(NonPagedPool, sizeof(read_data_stripe) * ci->num_stripes, ALLOC_TAG);
-    if (!context.stripes) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(context, sizeof(read_data_context));
+    KeInitializeEvent(&context->Event, NotificationEvent, false);
+
+    context->stripes = ExAllocatePoolWithTag(NonPagedPool, sizeof(read_data_stripe) * ci->num_stripes, ALLOC_TAG);
+    if (!context->stripes) {
         ERR("out of memory\n");
+
+        if (!Vcb->log_to_phys_loaded)
+            ExFreePool(devices);
+
+        ExFreePool(context);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
+    RtlZeroMemory(context->stripes, sizeof(read_data_stripe) * ci->num_stripes);
+
+    context->c = c;
+    context->ci = ci;
+    context->devices = devices;
+    context->offset = offset;
+    context->buf = buf;
+    context->generation = generation;
+    context->file_read = file_read;
+
     if (c && (type == BLOCK_FLAG_RAID5 || type == BLOCK_FLAG_RAID6)) {
-        get_raid56_lock_range(c, addr, length, &lockaddr, &locklen);
-        chunk_lock_range(Vcb, c, lockaddr, locklen);
+        get_raid56_lock_range(c, addr, length, &context->lockaddr, &context->locklen);
+        chunk_lock_range(Vcb, c, context->lockaddr, context->locklen);
     }
 
-    RtlZeroMemory(context.stripes, sizeof(read_data_stripe) * ci->num_stripes);
-
-    context.buflen = length;
-    context.num_stripes = ci->num_stripes;
-    context.stripes_left = context.num_stripes;
-    context.sector_size = Vcb->superblock.sector_size;
-    context.csum = csum;
-    context.tree = is_tree;
-    context.type = type;
+    context->buflen = length;
+    context->num_stripes = ci->num_stripes;
+    context->stripes_left = context->num_stripes;
+    context->sector_size = Vcb->superblock.sector_size;
+    context->csum = csum;
+    context->tree = is_tree;
+    context->type = type;
 
     if (type == BLOCK_FLAG_RAID0) {
         uint64_t startoff, endoff;
@@ -1626,17 +1735,17 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
             // with duplicated dummy PFNs, which confuse check_csum. Ah well.
             // See https://msdn.microsoft.com/en-us/library/windows/hardware/Dn614012.aspx if you're interested.
 
-            context.va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+            context->va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
 
-            if (!context.va) {
+            if (!context->va) {
                 ERR("out of memory\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto exit;
             }
         } else
-            context.va = buf;
+            context->va = buf;
 
-        master_mdl = IoAllocateMdl(context.va, length, false, false, NULL);
+        master_mdl = IoAllocateMdl(context->va, length, false, false, NULL);
         if (!master_mdl) {
             ERR("out of memory\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -1661,23 +1770,23 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
 
         for (i = 0; i < ci->num_stripes; i++) {
             if (startoffstripe > i)
-                context.stripes[i].stripestart = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
+                context->stripes[i].stripestart = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
             else if (startoffstripe == i)
-                context.stripes[i].stripestart = startoff;
+                context->stripes[i].stripestart = startoff;
             else
-                context.stripes[i].stripestart = startoff - (startoff % ci->stripe_length);
+                context->stripes[i].stripestart = startoff - (startoff % ci->stripe_length);
 
             if (endoffstripe > i)
-                context.stripes[i].stripeend = endoff - (endoff % ci->stripe_length) + ci->stripe_length;
+                context->stripes[i].stripeend = endoff - (endoff % ci->stripe_length) + ci->stripe_length;
             else if (endoffstripe == i)
-                context.stripes[i].stripeend = endoff + 1;
+                context->stripes[i].stripeend = endoff + 1;
             else
-                context.stripes[i].stripeend = endoff - (endoff % ci->stripe_length);
+                context->stripes[i].stripeend = endoff - (endoff % ci->stripe_length);
 
-            if (context.stripes[i].stripestart != context.stripes[i].stripeend) {
-                context.stripes[i].mdl = IoAllocateMdl(context.va, (ULONG)(context.stripes[i].stripeend - context.stripes[i].stripestart), false, false, NULL);
+            if (context->stripes[i].stripestart != context->stripes[i].stripeend) {
+                context->stripes[i].mdl = IoAllocateMdl(context->va, (ULONG)(context->stripes[i].stripeend - context->stripes[i].stripestart), false, false, NULL);
 
-                if (!context.stripes[i].mdl) {
+                if (!context->stripes[i].mdl) {
                     ERR("IoAllocateMdl failed\n");
                     MmUnlockPages(master_mdl);
                     IoFreeMdl(master_mdl);
@@ -1701,10 +1810,10 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         pos = 0;
         stripe = startoffstripe;
         while (pos < length) {
-            PFN_NUMBER* stripe_pfns = (PFN_NUMBER*)(context.stripes[stripe].mdl + 1);
+            PFN_NUMBER* stripe_pfns = (PFN_NUMBER*)(context->stripes[stripe].mdl + 1);
 
             if (pos == 0) {
-                uint32_t readlen = (uint32_t)min(context.stripes[stripe].stripeend - context.stripes[stripe].stripestart, ci->stripe_length - (context.stripes[stripe].stripestart % ci->stripe_length));
+                uint32_t readlen = (uint32_t)min(context->stripes[stripe].stripeend - context->stripes[stripe].stripestart, ci->stripe_length - (context->stripes[stripe].stripestart % ci->stripe_length));
 
                 RtlCopyMemory(stripe_pfns, pfns, readlen * sizeof(PFN_NUMBER) >> PAGE_SHIFT);
 
@@ -1752,19 +1861,19 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         }
 
         if (file_read) {
-            context.va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+            context->va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
 
-            if (!context.va) {
+            if (!context->va) {
                 ERR("out of memory\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto exit;
             }
         } else
-            context.va = buf;
+            context->va = buf;
 
-        context.firstoff = (uint16_t)((startoff % ci->stripe_length) >> Vcb->sector_shift);
-        context.startoffstripe = startoffstripe;
-        context.sectors_per_stripe = (uint16_t)(ci->stripe_length >> Vcb->sector_shift);
+        context->firstoff = (uint16_t)((startoff % ci->stripe_length) >> Vcb->sector_shift);
+        context->startoffstripe = startoffstripe;
+        context->sectors_per_stripe = (uint16_t)(ci->stripe_length >> Vcb->sector_shift);
 
         startoffstripe *= ci->sub_stripes;
         endoffstripe *= ci->sub_stripes;
@@ -1772,7 +1881,7 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         if (c)
             c->last_stripe = (orig_ls + 1) % ci->sub_stripes;
 
-        master_mdl = IoAllocateMdl(context.va, length, false, false, NULL);
+        master_mdl = IoAllocateMdl(context->va, length, false, false, NULL);
         if (!master_mdl) {
             ERR("out of memory\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -1809,6 +1918,7 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         for (i = 0; i < ci->num_stripes; i += ci->sub_stripes) {
             uint64_t sstart, send;
             bool stripeset = false;
+            uint16_t pref;
 
             if (startoffstripe > i)
                 sstart = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
@@ -1824,16 +1934,21 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
             else
                 send = endoff - (endoff % ci->stripe_length);
 
+            if (Vcb->options.read_policy == READ_POLICY_LATENCY)
+                pref = pick_mirror(&devices[i], ci->sub_stripes, (uint16_t)orig_ls);
+            else
+                pref = (uint16_t)orig_ls;
+
             for (j = 0; j < ci->sub_stripes; j++) {
-                if (j == orig_ls && devices[i+j] && devices[i+j]->devobj) {
-                    context.stripes[i+j].stripestart = sstart;
-                    context.stripes[i+j].stripeend = send;
-                    stripes[i / ci->sub_stripes] = &context.stripes[i+j];
+                if (j == pref && devices[i+j] && devices[i+j]->devobj) {
+                    context->stripes[i+j].stripestart = sstart;
+                    context->stripes[i+j].stripeend = send;
+                    stripes[i / ci->sub_stripes] = &context->stripes[i+j];
 
                     if (sstart != send) {
-                        context.stripes[i+j].mdl = IoAllocateMdl(context.va, (ULONG)(send - sstart), false, false, NULL);
+                        context->stripes[i+j].mdl = IoAllocateMdl(context->va, (ULONG)(send - sstart), false, false, NULL);
 
-                        if (!context.stripes[i+j].mdl) {
+                        if (!context->stripes[i+j].mdl) {
                             ERR("IoAllocateMdl failed\n");
                             MmUnlockPages(master_mdl);
                             IoFreeMdl(master_mdl);
@@ -1844,21 +1959,21 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
 
                     stripeset = true;
                 } else
-                    context.stripes[i+j].status = ReadDataStatus_Skip;
+                    context->stripes[i+j].status = ReadDataStatus_Skip;
             }
 
             if (!stripeset) {
                 for (j = 0; j < ci->sub_stripes; j++) {
                     if (devices[i+j] && devices[i+j]->devobj) {
-                        context.stripes[i+j].stripestart = sstart;
-                        context.stripes[i+j].stripeend = send;
-                        context.stripes[i+j].status = ReadDataStatus_Pending;
-                        stripes[i / ci->sub_stripes] = &context.stripes[i+j];
+                        context->stripes[i+j].stripestart = sstart;
+                        context->stripes[i+j].stripeend = send;
+                        context->stripes[i+j].status = ReadDataStatus_Pending;
+                        stripes[i / ci->sub_stripes] = &context->stripes[i+j];
 
                         if (sstart != send) {
-                            context.stripes[i+j].mdl = IoAllocateMdl(context.va, (ULONG)(send - sstart), false, false, NULL);
+                            context->stripes[i+j].mdl = IoAllocateMdl(context->va, (ULONG)(send - sstart), false, false, NULL);
 
-                            if (!context.stripes[i+j].mdl) {
+                            if (!context->stripes[i+j].mdl) {
                                 ERR("IoAllocateMdl failed\n");
                                 MmUnlockPages(master_mdl);
                                 IoFreeMdl(master_mdl);
@@ -1944,30 +2059,33 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         if (c)
             c->last_stripe = (i + 1) % ci->num_stripes;
 
-        context.stripes[i].stripestart = addr - offset;
-        context.stripes[i].stripeend = context.stripes[i].stripestart + length;
+        if (Vcb->options.read_policy == READ_POLICY_LATENCY && ci->num_stripes > 1)
+            i = pick_mirror(devices, ci->num_stripes, i);
+
+        context->stripes[i].stripestart = addr - offset;
+        context->stripes[i].stripeend = context->stripes[i].stripestart + length;
 
         if (file_read) {
-            context.va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+            context->va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
 
-            if (!context.va) {
+            if (!context->va) {
                 ERR("out of memory\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto exit;
             }
 
-            context.stripes[i].mdl = IoAllocateMdl(context.va, length, false, false, NULL);
-            if (!context.stripes[i].mdl) {
+            context->stripes[i].mdl = IoAllocateMdl(context->va, length, false, false, NULL);
+            if (!context->stripes[i].mdl) {
                 ERR("IoAllocateMdl failed\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto exit;
             }
 
-            MmBuildMdlForNonPagedPool(context.stripes[i].mdl);
+            MmBuildMdlForNonPagedPool(context->stripes[i].mdl);
         } else {
-            context.stripes[i].mdl = IoAllocateMdl(buf, length, false, false, NULL);
+            context->stripes[i].mdl = IoAllocateMdl(buf, length, false, false, NULL);
 
-            if (!context.stripes[i].mdl) {
+            if (!context->stripes[i].mdl) {
                 ERR("IoAllocateMdl failed\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto exit;
@@ -1976,7 +2094,7 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
             Status = STATUS_SUCCESS;
 
             try {
-                MmProbeAndLockPages(context.stripes[i].mdl, KernelMode, IoWriteAccess);
+                MmProbeAndLockPages(context->stripes[i].mdl, KernelMode, IoWriteAccess);
             } except (EXCEPTION_EXECUTE_HANDLER) {
                 Status = GetExceptionCode();
             }
@@ -1998,17 +2116,17 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         get_raid0_offset(addr + length - offset - 1, ci->stripe_length, ci->num_stripes - 1, &endoff, &endoffstripe);
 
         if (file_read) {
-            context.va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+            context->va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
 
-            if (!context.va) {
+            if (!context->va) {
                 ERR("out of memory\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto exit;
             }
         } else
-            context.va = buf;
+            context->va = buf;
 
-        master_mdl = IoAllocateMdl(context.va, length, false, false, NULL);
+        master_mdl = IoAllocateMdl(context->va, length, false, false, NULL);
         if (!master_mdl) {
             ERR("out of memory\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -2044,8 +2162,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                     if (i == startoffstripe) {
                         readlen = min(length, (ULONG)(ci->stripe_length - (startoff % ci->stripe_length)));
 
-                        context.stripes[stripe].stripestart = startoff;
-                        context.stripes[stripe].stripeend = startoff + readlen;
+                        context->stripes[stripe].stripestart = startoff;
+                        context->stripes[stripe].stripeend = startoff + readlen;
 
                         pos += readlen;
 
@@ -2054,8 +2172,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                     } else {
                         readlen = min(length - pos, (ULONG)ci->stripe_length);
 
-                        context.stripes[stripe].stripestart = startoff - (startoff % ci->stripe_length);
-                        context.stripes[stripe].stripeend = context.stripes[stripe].stripestart + readlen;
+                        context->stripes[stripe].stripestart = startoff - (startoff % ci->stripe_length);
+                        context->stripes[stripe].stripeend = context->stripes[stripe].stripestart + readlen;
 
                         pos += readlen;
 
@@ -2073,16 +2191,16 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 for (i = 0; i < startoffstripe; i++) {
                     uint16_t stripe2 = (parity + i + 1) % ci->num_stripes;
 
-                    context.stripes[stripe2].stripestart = context.stripes[stripe2].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
+                    context->stripes[stripe2].stripestart = context->stripes[stripe2].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
                 }
 
-                context.stripes[parity].stripestart = context.stripes[parity].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
+                context->stripes[parity].stripestart = context->stripes[parity].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
 
                 if (length - pos > ci->num_stripes * (ci->num_stripes - 1) * ci->stripe_length) {
                     skip = (ULONG)(((length - pos) / (ci->num_stripes * (ci->num_stripes - 1) * ci->stripe_length)) - 1);
 
                     for (i = 0; i < ci->num_stripes; i++) {
-                        context.stripes[i].stripeend += skip * ci->num_stripes * ci->stripe_length;
+                        context->stripes[i].stripeend += skip * ci->num_stripes * ci->stripe_length;
                     }
 
                     pos += (uint32_t)(skip * (ci->num_stripes - 1) * ci->num_stripes * ci->stripe_length);
@@ -2090,7 +2208,7 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 }
             } else if (length - pos >= ci->stripe_length * (ci->num_stripes - 1)) {
                 for (i = 0; i < ci->num_stripes; i++) {
-                    context.stripes[i].stripeend += ci->stripe_length;
+                    context->stripes[i].stripeend += ci->stripe_length;
                 }
 
                 pos += (uint32_t)(ci->stripe_length * (ci->num_stripes - 1));
@@ -2101,10 +2219,10 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 i = 0;
                 while (stripe != parity) {
                     if (endoffstripe == i) {
-                        context.stripes[stripe].stripeend = endoff + 1;
+                        context->stripes[stripe].stripeend = endoff + 1;
                         break;
                     } else if (endoffstripe > i)
-                        context.stripes[stripe].stripeend = endoff - (endoff % ci->stripe_length) + ci->stripe_length;
+                        context->stripes[stripe].stripeend = endoff - (endoff % ci->stripe_length) + ci->stripe_length;
 
                     i++;
                     stripe = (stripe + 1) % ci->num_stripes;
@@ -2115,11 +2233,11 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         }
 
         for (i = 0; i < ci->num_stripes; i++) {
-            if (context.stripes[i].stripestart != context.stripes[i].stripeend) {
-                context.stripes[i].mdl = IoAllocateMdl(context.va, (ULONG)(context.stripes[i].stripeend - context.stripes[i].stripestart),
+            if (context->stripes[i].stripestart != context->stripes[i].stripeend) {
+                context->stripes[i].mdl = IoAllocateMdl(context->va, (ULONG)(context->stripes[i].stripeend - context->stripes[i].stripestart),
                                                        false, false, NULL);
 
-                if (!context.stripes[i].mdl) {
+                if (!context->stripes[i].mdl) {
                     ERR("IoAllocateMdl failed\n");
                     MmUnlockPages(master_mdl);
                     IoFreeMdl(master_mdl);
@@ -2130,8 +2248,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         }
 
         if (need_dummy) {
-            dummypage = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, ALLOC_TAG);
-            if (!dummypage) {
+            context->dummypage = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, ALLOC_TAG);
+            if (!context->dummypage) {
                 ERR("out of memory\n");
                 MmUnlockPages(master_mdl);
                 IoFreeMdl(master_mdl);
@@ -2139,8 +2257,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 goto exit;
             }
 
-            dummy_mdl = IoAllocateMdl(dummypage, PAGE_SIZE, false, false, NULL);
-            if (!dummy_mdl) {
+            context->dummy_mdl = IoAllocateMdl(context->dummypage, PAGE_SIZE, false, false, NULL);
+            if (!context->dummy_mdl) {
                 ERR("IoAllocateMdl failed\n");
                 MmUnlockPages(master_mdl);
                 IoFreeMdl(master_mdl);
@@ -2148,9 +2266,9 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 goto exit;
             }
 
-            MmBuildMdlForNonPagedPool(dummy_mdl);
+            MmBuildMdlForNonPagedPool(context->dummy_mdl);
 
-            dummy = *(PFN_NUMBER*)(dummy_mdl + 1);
+            dummy = *(PFN_NUMBER*)(context->dummy_mdl + 1);
         }
 
         stripeoff = ExAllocatePoolWithTag(NonPagedPool, sizeof(uint32_t) * ci->num_stripes, ALLOC_TAG);
@@ -2173,10 +2291,10 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
 
             if (pos == 0) {
                 uint16_t stripe = (parity + startoffstripe + 1) % ci->num_stripes;
-                uint32_t readlen = min(length - pos, (uint32_t)min(context.stripes[stripe].stripeend - context.stripes[stripe].stripestart,
-                                                       ci->stripe_length - (context.stripes[stripe].stripestart % ci->stripe_length)));
+                uint32_t readlen = min(length - pos, (uint32_t)min(context->stripes[stripe].stripeend - context->stripes[stripe].stripestart,
+                                                       ci->stripe_length - (context->stripes[stripe].stripestart % ci->stripe_length)));
 
-                stripe_pfns = (PFN_NUMBER*)(context.stripes[stripe].mdl + 1);
+                stripe_pfns = (PFN_NUMBER*)(context->stripes[stripe].mdl + 1);
 
                 RtlCopyMemory(stripe_pfns, pfns, readlen * sizeof(PFN_NUMBER) >> PAGE_SHIFT);
 
@@ -2186,8 +2304,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 stripe = (stripe + 1) % ci->num_stripes;
 
                 while (stripe != parity) {
-                    stripe_pfns = (PFN_NUMBER*)(context.stripes[stripe].mdl + 1);
-                    readlen = min(length - pos, (uint32_t)min(context.stripes[stripe].stripeend - context.stripes[stripe].stripestart, ci->stripe_length));
+                    stripe_pfns = (PFN_NUMBER*)(context->stripes[stripe].mdl + 1);
+                    readlen = min(length - pos, (uint32_t)min(context->stripes[stripe].stripeend - context->stripes[stripe].stripestart, ci->stripe_length));
 
                     if (readlen == 0)
                         break;
@@ -2204,7 +2322,7 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 ULONG k;
 
                 while (stripe != parity) {
-                    stripe_pfns = (PFN_NUMBER*)(context.stripes[stripe].mdl + 1);
+                    stripe_pfns = (PFN_NUMBER*)(context->stripes[stripe].mdl + 1);
 
                     RtlCopyMemory(&stripe_pfns[stripeoff[stripe] >> PAGE_SHIFT], &pfns[pos >> PAGE_SHIFT], (ULONG)(ci->stripe_length * sizeof(PFN_NUMBER) >> PAGE_SHIFT));
 
@@ -2214,7 +2332,7 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                     stripe = (stripe + 1) % ci->num_stripes;
                 }
 
-                stripe_pfns = (PFN_NUMBER*)(context.stripes[parity].mdl + 1);
+                stripe_pfns = (PFN_NUMBER*)(context->stripes[parity].mdl + 1);
 
                 for (k = 0; k < ci->stripe_length >> PAGE_SHIFT; k++) {
                     stripe_pfns[stripeoff[parity] >> PAGE_SHIFT] = dummy;
@@ -2225,8 +2343,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 uint32_t readlen;
 
                 while (pos < length) {
-                    stripe_pfns = (PFN_NUMBER*)(context.stripes[stripe].mdl + 1);
-                    readlen = min(length - pos, (ULONG)min(context.stripes[stripe].stripeend - context.stripes[stripe].stripestart, ci->stripe_length));
+                    stripe_pfns = (PFN_NUMBER*)(context->stripes[stripe].mdl + 1);
+                    readlen = min(length - pos, (ULONG)min(context->stripes[stripe].stripeend - context->stripes[stripe].stripestart, ci->stripe_length));
 
                     if (readlen == 0)
                         break;
@@ -2257,17 +2375,17 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         get_raid0_offset(addr + length - offset - 1, ci->stripe_length, ci->num_stripes - 2, &endoff, &endoffstripe);
 
         if (file_read) {
-            context.va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+            context->va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
 
-            if (!context.va) {
+            if (!context->va) {
                 ERR("out of memory\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto exit;
             }
         } else
-            context.va = buf;
+            context->va = buf;
 
-        master_mdl = IoAllocateMdl(context.va, length, false, false, NULL);
+        master_mdl = IoAllocateMdl(context->va, length, false, false, NULL);
         if (!master_mdl) {
             ERR("out of memory\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -2303,8 +2421,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                     if (i == startoffstripe) {
                         readlen = (ULONG)min(length, ci->stripe_length - (startoff % ci->stripe_length));
 
-                        context.stripes[stripe].stripestart = startoff;
-                        context.stripes[stripe].stripeend = startoff + readlen;
+                        context->stripes[stripe].stripestart = startoff;
+                        context->stripes[stripe].stripeend = startoff + readlen;
 
                         pos += readlen;
 
@@ -2313,8 +2431,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                     } else {
                         readlen = min(length - pos, (ULONG)ci->stripe_length);
 
-                        context.stripes[stripe].stripestart = startoff - (startoff % ci->stripe_length);
-                        context.stripes[stripe].stripeend = context.stripes[stripe].stripestart + readlen;
+                        context->stripes[stripe].stripestart = startoff - (startoff % ci->stripe_length);
+                        context->stripes[stripe].stripeend = context->stripes[stripe].stripestart + readlen;
 
                         pos += readlen;
 
@@ -2332,19 +2450,19 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 for (i = 0; i < startoffstripe; i++) {
                     uint16_t stripe2 = (parity1 + i + 2) % ci->num_stripes;
 
-                    context.stripes[stripe2].stripestart = context.stripes[stripe2].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
+                    context->stripes[stripe2].stripestart = context->stripes[stripe2].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
                 }
 
-                context.stripes[parity1].stripestart = context.stripes[parity1].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
+                context->stripes[parity1].stripestart = context->stripes[parity1].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
 
                 parity2 = (parity1 + 1) % ci->num_stripes;
-                context.stripes[parity2].stripestart = context.stripes[parity2].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
+                context->stripes[parity2].stripestart = context->stripes[parity2].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
 
                 if (length - pos > ci->num_stripes * (ci->num_stripes - 2) * ci->stripe_length) {
                     skip = (ULONG)(((length - pos) / (ci->num_stripes * (ci->num_stripes - 2) * ci->stripe_length)) - 1);
 
                     for (i = 0; i < ci->num_stripes; i++) {
-                        context.stripes[i].stripeend += skip * ci->num_stripes * ci->stripe_length;
+                        context->stripes[i].stripeend += skip * ci->num_stripes * ci->stripe_length;
                     }
 
                     pos += (uint32_t)(skip * (ci->num_stripes - 2) * ci->num_stripes * ci->stripe_length);
@@ -2352,7 +2470,7 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 }
             } else if (length - pos >= ci->stripe_length * (ci->num_stripes - 2)) {
                 for (i = 0; i < ci->num_stripes; i++) {
-                    context.stripes[i].stripeend += ci->stripe_length;
+                    context->stripes[i].stripeend += ci->stripe_length;
                 }
 
                 pos += (uint32_t)(ci->stripe_length * (ci->num_stripes - 2));
@@ -2363,10 +2481,10 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 i = 0;
                 while (stripe != parity1) {
                     if (endoffstripe == i) {
-                        context.stripes[stripe].stripeend = endoff + 1;
+                        context->stripes[stripe].stripeend = endoff + 1;
                         break;
                     } else if (endoffstripe > i)
-                        context.stripes[stripe].stripeend = endoff - (endoff % ci->stripe_length) + ci->stripe_length;
+                        context->stripes[stripe].stripeend = endoff - (endoff % ci->stripe_length) + ci->stripe_length;
 
                     i++;
                     stripe = (stripe + 1) % ci->num_stripes;
@@ -2377,10 +2495,10 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         }
 
         for (i = 0; i < ci->num_stripes; i++) {
-            if (context.stripes[i].stripestart != context.stripes[i].stripeend) {
-                context.stripes[i].mdl = IoAllocateMdl(context.va, (ULONG)(context.stripes[i].stripeend - context.stripes[i].stripestart), false, false, NULL);
+            if (context->stripes[i].stripestart != context->stripes[i].stripeend) {
+                context->stripes[i].mdl = IoAllocateMdl(context->va, (ULONG)(context->stripes[i].stripeend - context->stripes[i].stripestart), false, false, NULL);
 
-                if (!context.stripes[i].mdl) {
+                if (!context->stripes[i].mdl) {
                     ERR("IoAllocateMdl failed\n");
                     MmUnlockPages(master_mdl);
                     IoFreeMdl(master_mdl);
@@ -2391,8 +2509,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         }
 
         if (need_dummy) {
-            dummypage = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, ALLOC_TAG);
-            if (!dummypage) {
+            context->dummypage = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, ALLOC_TAG);
+            if (!context->dummypage) {
                 ERR("out of memory\n");
                 MmUnlockPages(master_mdl);
                 IoFreeMdl(master_mdl);
@@ -2400,8 +2518,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 goto exit;
             }
 
-            dummy_mdl = IoAllocateMdl(dummypage, PAGE_SIZE, false, false, NULL);
-            if (!dummy_mdl) {
+            context->dummy_mdl = IoAllocateMdl(context->dummypage, PAGE_SIZE, false, false, NULL);
+            if (!context->dummy_mdl) {
                 ERR("IoAllocateMdl failed\n");
                 MmUnlockPages(master_mdl);
                 IoFreeMdl(master_mdl);
@@ -2409,9 +2527,9 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 goto exit;
             }
 
-            MmBuildMdlForNonPagedPool(dummy_mdl);
+            MmBuildMdlForNonPagedPool(context->dummy_mdl);
 
-            dummy = *(PFN_NUMBER*)(dummy_mdl + 1);
+            dummy = *(PFN_NUMBER*)(context->dummy_mdl + 1);
         }
 
         stripeoff = ExAllocatePoolWithTag(NonPagedPool, sizeof(uint32_t) * ci->num_stripes, ALLOC_TAG);
@@ -2434,10 +2552,10 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
 
             if (pos == 0) {
                 uint16_t stripe = (parity1 + startoffstripe + 2) % ci->num_stripes;
-                uint32_t readlen = min(length - pos, (uint32_t)min(context.stripes[stripe].stripeend - context.stripes[stripe].stripestart,
-                                                       ci->stripe_length - (context.stripes[stripe].stripestart % ci->stripe_length)));
+                uint32_t readlen = min(length - pos, (uint32_t)min(context->stripes[stripe].stripeend - context->stripes[stripe].stripestart,
+                                                       ci->stripe_length - (context->stripes[stripe].stripestart % ci->stripe_length)));
 
-                stripe_pfns = (PFN_NUMBER*)(context.stripes[stripe].mdl + 1);
+                stripe_pfns = (PFN_NUMBER*)(context->stripes[stripe].mdl + 1);
 
                 RtlCopyMemory(stripe_pfns, pfns, readlen * sizeof(PFN_NUMBER) >> PAGE_SHIFT);
 
@@ -2447,8 +2565,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 stripe = (stripe + 1) % ci->num_stripes;
 
                 while (stripe != parity1) {
-                    stripe_pfns = (PFN_NUMBER*)(context.stripes[stripe].mdl + 1);
-                    readlen = (uint32_t)min(length - pos, min(context.stripes[stripe].stripeend - context.stripes[stripe].stripestart, ci->stripe_length));
+                    stripe_pfns = (PFN_NUMBER*)(context->stripes[stripe].mdl + 1);
+                    readlen = (uint32_t)min(length - pos, min(context->stripes[stripe].stripeend - context->stripes[stripe].stripestart, ci->stripe_length));
 
                     if (readlen == 0)
                         break;
@@ -2466,7 +2584,7 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 ULONG k;
 
                 while (stripe != parity1) {
-                    stripe_pfns = (PFN_NUMBER*)(context.stripes[stripe].mdl + 1);
+                    stripe_pfns = (PFN_NUMBER*)(context->stripes[stripe].mdl + 1);
 
                     RtlCopyMemory(&stripe_pfns[stripeoff[stripe] >> PAGE_SHIFT], &pfns[pos >> PAGE_SHIFT], (ULONG)(ci->stripe_length * sizeof(PFN_NUMBER) >> PAGE_SHIFT));
 
@@ -2476,14 +2594,14 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                     stripe = (stripe + 1) % ci->num_stripes;
                 }
 
-                stripe_pfns = (PFN_NUMBER*)(context.stripes[parity1].mdl + 1);
+                stripe_pfns = (PFN_NUMBER*)(context->stripes[parity1].mdl + 1);
 
                 for (k = 0; k < ci->stripe_length >> PAGE_SHIFT; k++) {
                     stripe_pfns[stripeoff[parity1] >> PAGE_SHIFT] = dummy;
                     stripeoff[parity1] += PAGE_SIZE;
                 }
 
-                stripe_pfns = (PFN_NUMBER*)(context.stripes[parity2].mdl + 1);
+                stripe_pfns = (PFN_NUMBER*)(context->stripes[parity2].mdl + 1);
 
                 for (k = 0; k < ci->stripe_length >> PAGE_SHIFT; k++) {
                     stripe_pfns[stripeoff[parity2] >> PAGE_SHIFT] = dummy;
@@ -2494,8 +2612,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 uint32_t readlen;
 
                 while (pos < length) {
-                    stripe_pfns = (PFN_NUMBER*)(context.stripes[stripe].mdl + 1);
-                    readlen = (uint32_t)min(length - pos, min(context.stripes[stripe].stripeend - context.stripes[stripe].stripestart, ci->stripe_length));
+                    stripe_pfns = (PFN_NUMBER*)(context->stripes[stripe].mdl + 1);
+                    readlen = (uint32_t)min(length - pos, min(context->stripes[stripe].stripeend - context->stripes[stripe].stripestart, ci->stripe_length));
 
                     if (readlen == 0)
                         break;
@@ -2516,20 +2634,20 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         ExFreePool(stripeoff);
     }
 
-    context.address = addr;
+    context->address = addr;
 
     for (i = 0; i < ci->num_stripes; i++) {
-        if (!devices[i] || !devices[i]->devobj || context.stripes[i].stripestart == context.stripes[i].stripeend) {
-            context.stripes[i].status = ReadDataStatus_MissingDevice;
-            context.stripes_left--;
+        if (!devices[i] || !devices[i]->devobj || context->stripes[i].stripestart == context->stripes[i].stripeend) {
+            context->stripes[i].status = ReadDataStatus_MissingDevice;
+            context->stripes_left--;
 
             if (!devices[i] || !devices[i]->devobj)
-                missing_devices++;
+                context->missing_devices++;
         }
     }
 
-    if (missing_devices > allowed_missing) {
-        ERR("not enough devices to service request (%u missing)\n", missing_devices);
+    if (context->missing_devices > allowed_missing) {
+        ERR("not enough devices to service request (%u missing)\n", context->missing_devices);
         Status = STATUS_UNEXPECTED_IO_ERROR;
         goto exit;
     }
@@ -2537,194 +2655,171 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
     for (i = 0; i < ci->num_stripes; i++) {
         PIO_STACK_LOCATION IrpSp;
 
-        if (devices[i] && devices[i]->devobj && context.stripes[i].stripestart != context.stripes[i].stripeend && context.stripes[i].status != ReadDataStatus_Skip) {
-            context.stripes[i].context = (struct read_data_context*)&context;
+        if (devices[i] && devices[i]->devobj && context->stripes[i].stripestart != context->stripes[i].stripeend && context->stripes[i].status != ReadDataStatus_Skip) {
+            context->stripes[i].context = (struct read_data_context*)context;
 
             if (type == BLOCK_FLAG_RAID10) {
-                context.stripes[i].stripenum = i / ci->sub_stripes;
+                context->stripes[i].stripenum = i / ci->sub_stripes;
             }
 
             if (!Irp) {
-                context.stripes[i].Irp = IoAllocateIrp(devices[i]->devobj->StackSize, false);
+                context->stripes[i].Irp = IoAllocateIrp(devices[i]->devobj->StackSize, false);
 
-                if (!context.stripes[i].Irp) {
+                if (!context->stripes[i].Irp) {
                     ERR("IoAllocateIrp failed\n");
                     Status = STATUS_INSUFFICIENT_RESOURCES;
                     goto exit;
                 }
             } else {
-                context.stripes[i].Irp = IoMakeAssociatedIrp(Irp, devices[i]->devobj->StackSize);
+                context->stripes[i].Irp = IoMakeAssociatedIrp(Irp, devices[i]->devobj->StackSize);
 
-                if (!context.stripes[i].Irp) {
+                if (!context->stripes[i].Irp) {
                     ERR("IoMakeAssociatedIrp failed\n");
                     Status = STATUS_INSUFFICIENT_RESOURCES;
                     goto exit;
                 }
             }
 
-            IrpSp = IoGetNextIrpStackLocation(context.stripes[i].Irp);
+            IrpSp = IoGetNextIrpStackLocation(context->stripes[i].Irp);
             IrpSp->MajorFunction = IRP_MJ_READ;
             IrpSp->MinorFunction = IRP_MN_NORMAL;
             IrpSp->FileObject = devices[i]->fileobj;
 
             if (devices[i]->devobj->Flags & DO_BUFFERED_IO) {
-                context.stripes[i].Irp->AssociatedIrp.SystemBuffer = ExAllocatePoolWithTag(NonPagedPool, (ULONG)(context.stripes[i].stripeend - context.stripes[i].stripestart), ALLOC_TAG);
-                if (!context.stripes[i].Irp->AssociatedIrp.SystemBuffer) {
+                context->stripes[i].Irp->AssociatedIrp.SystemBuffer = ExAllocatePoolWithTag(NonPagedPool, (ULONG)(context->stripes[i].stripeend - context->stripes[i].stripestart), ALLOC_TAG);
+                if (!context->stripes[i].Irp->AssociatedIrp.SystemBuffer) {
                     ERR("out of memory\n");
                     Status = STATUS_INSUFFICIENT_RESOURCES;
                     goto exit;
                 }
 
-                context.stripes[i].Irp->Flags |= IRP_BUFFERED_IO | IRP_DEALLOCATE_BUFFER | IRP_INPUT_OPERATION;
+                context->stripes[i].Irp->Flags |= IRP_BUFFERED_IO | IRP_DEALLOCATE_BUFFER | IRP_INPUT_OPERATION;
 
-                context.stripes[i].Irp->UserBuffer = MmGetSystemAddressForMdlSafe(context.stripes[i].mdl, priority);
+                context->stripes[i].Irp->UserBuffer = MmGetSystemAddressForMdlSafe(context->stripes[i].mdl, priority);
             } else if (devices[i]->devobj->Flags & DO_DIRECT_IO)
-                context.stripes[i].Irp->MdlAddress = context.stripes[i].mdl;
+                context->stripes[i].Irp->MdlAddress = context->stripes[i].mdl;
             else
-                context.stripes[i].Irp->UserBuffer = MmGetSystemAddressForMdlSafe(context.stripes[i].mdl, priority);
+                context->stripes[i].Irp->UserBuffer = MmGetSystemAddressForMdlSafe(context->stripes[i].mdl, priority);
 
-            IrpSp->Parameters.Read.Length = (ULONG)(context.stripes[i].stripeend - context.stripes[i].stripestart);
-            IrpSp->Parameters.Read.ByteOffset.QuadPart = context.stripes[i].stripestart + cis[i].offset;
+            IrpSp->Parameters.Read.Length = (ULONG)(context->stripes[i].stripeend - context->stripes[i].stripestart);
+            IrpSp->Parameters.Read.ByteOffset.QuadPart = context->stripes[i].stripestart + cis[i].offset;
 
-            total_reading += IrpSp->Parameters.Read.Length;
+            context->total_reading += IrpSp->Parameters.Read.Length;
 
-            context.stripes[i].Irp->UserIosb = &context.stripes[i].iosb;
+            context->stripes[i].Irp->UserIosb = &context->stripes[i].iosb;
 
-            IoSetCompletionRoutine(context.stripes[i].Irp, read_data_completion, &context.stripes[i], true, true, true);
+            IoSetCompletionRoutine(context->stripes[i].Irp, read_data_completion, &context->stripes[i], true, true, true);
 
-            context.stripes[i].status = ReadDataStatus_Pending;
+            context->stripes[i].status = ReadDataStatus_Pending;
         }
     }
 
-    need_to_wait = false;
+    context->need_to_wait = false;
     for (i = 0; i < ci->num_stripes; i++) {
-        if (context.stripes[i].status != ReadDataStatus_MissingDevice && context.stripes[i].status != ReadDataStatus_Skip) {
-            IoCallDriver(devices[i]->devobj, context.stripes[i].Irp);
-            need_to_wait = true;
+        if (context->stripes[i].status != ReadDataStatus_MissingDevice && context->stripes[i].status != ReadDataStatus_Skip) {
+            context->stripes[i].dev = devices[i];
+            context->stripes[i].start_time = KeQueryInterruptTime();
+            InterlockedIncrement(&devices[i]->reads_in_flight);
+
+            IoCallDriver(devices[i]->devobj, context->stripes[i].Irp);
+            context->need_to_wait = true;
         }
     }
 
-    if (need_to_wait)
-        KeWaitForSingleObject(&context.Event, Executive, KernelMode, false, NULL);
+
+    *pcontext = context;
+
+    return STATUS_SUCCESS;
+
+exit:
+    free_read_data_context(Vcb, context);
+
+    return Status;
+}
+
+static NTSTATUS read_data_finish(_In_ device_extension* Vcb, _In_ read_data_context* context) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    CHUNK_ITEM* ci = context->ci;
+    uint8_t* buf = context->file_read ? context->va : context->buf;
+    uint16_t i;
+
+    if (context->need_to_wait)
+        KeWaitForSingleObject(&context->Event, Executive, KernelMode, false, NULL);
 
     if (diskacc)
-        fFsRtlUpdateDiskCounters(total_reading, 0);
+        fFsRtlUpdateDiskCounters(context->total_reading, 0);
 
     // check if any of the devices return a "user-induced" error
 
     for (i = 0; i < ci->num_stripes; i++) {
-        if (context.stripes[i].status == ReadDataStatus_Error && IoIsErrorUserInduced(context.stripes[i].iosb.Status)) {
-            Status = context.stripes[i].iosb.Status;
+        if (context->stripes[i].status == ReadDataStatus_Error && IoIsErrorUserInduced(context->stripes[i].iosb.Status)) {
+            Status = context->stripes[i].iosb.Status;
             goto exit;
         }
     }
 
-    if (type == BLOCK_FLAG_RAID0) {
-        Status = read_data_raid0(Vcb, file_read ? context.va : buf, addr, length, &context, ci, devices, generation, offset);
+    if (context->type == BLOCK_FLAG_RAID0) {
+        Status = read_data_raid0(Vcb, buf, context->address, context->buflen, context, ci, context->devices, context->generation, context->offset);
         if (!NT_SUCCESS(Status)) {
             ERR("read_data_raid0 returned %08lx\n", Status);
-
-            if (file_read)
-                ExFreePool(context.va);
-
             goto exit;
         }
-
-        if (file_read) {
-            RtlCopyMemory(buf, context.va, length);
-            ExFreePool(context.va);
-        }
-    } else if (type == BLOCK_FLAG_RAID10) {
-        Status = read_data_raid10(Vcb, file_read ? context.va : buf, addr, length, &context, ci, devices, generation, offset);
-
+    } else if (context->type == BLOCK_FLAG_RAID10) {
+        Status = read_data_raid10(Vcb, buf, context->address, context->buflen, context, ci, context->devices, context->generation, context->offset);
         if (!NT_SUCCESS(Status)) {
             ERR("read_data_raid10 returned %08lx\n", Status);
-
-            if (file_read)
-                ExFreePool(context.va);
-
             goto exit;
         }
-
-        if (file_read) {
-            RtlCopyMemory(buf, context.va, length);
-            ExFreePool(context.va);
-        }
-    } else if (type == BLOCK_FLAG_DUPLICATE) {
-        Status = read_data_dup(Vcb, file_read ? context.va : buf, addr, &context, ci, devices, generation);
+    } else if (context->type == BLOCK_FLAG_DUPLICATE) {
+        Status = read_data_dup(Vcb, buf, context->address, context, ci, context->devices, context->generation);
         if (!NT_SUCCESS(Status)) {
             ERR("read_data_dup returned %08lx\n", Status);
-
-            if (file_read)
-                ExFreePool(context.va);
-
             goto exit;
         }
-
-        if (file_read) {
-            RtlCopyMemory(buf, context.va, length);
-            ExFreePool(context.va);
-        }
-    } else if (type == BLOCK_FLAG_RAID5) {
-        Status = read_data_raid5(Vcb, file_read ? context.va : buf, addr, length, &context, ci, devices, offset, generation, c, missing_devices > 0 ? true : false);
+    } else if (context->type == BLOCK_FLAG_RAID5) {
+        Status = read_data_raid5(Vcb, buf, context->address, context->buflen, context, ci, context->devices, context->offset, context->generation, context->c,
+                                 context->missing_devices > 0 ? true : false);
         if (!NT_SUCCESS(Status)) {
             ERR("read_data_raid5 returned %08lx\n", Status);
-
-            if (file_read)
-                ExFreePool(context.va);
-
             goto exit;
         }
-
-        if (file_read) {
-            RtlCopyMemory(buf, context.va, length);
-            ExFreePool(context.va);
-        }
-    } else if (type == BLOCK_FLAG_RAID6) {
-        Status = read_data_raid6(Vcb, file_read ? context.va : buf, addr, length, &context, ci, devices, offset, generation, c, missing_devices > 0 ? true : false);
+    } else if (context->type == BLOCK_FLAG_RAID6) {
+        Status = read_data_raid6(Vcb, buf, context->address, context->buflen, context, ci, context->devices, context->offset, context->generation, context->c,
+                                 context->missing_devices > 0 ? true : false);
         if (!NT_SUCCESS(Status)) {
             ERR("read_data_raid6 returned %08lx\n", Status);
-
-            if (file_read)
-                ExFreePool(context.va);
-
             goto exit;
         }
-
-        if (file_read) {
-            RtlCopyMemory(buf, context.va, length);
-            ExFreePool(context.va);
-        }
     }
 
-exit:
-    if (c && (type == BLOCK_FLAG_RAID5 || type == BLOCK_FLAG_RAID6))
-        chunk_unlock_range(Vcb, c, lockaddr, locklen);
-
-    if (dummy_mdl)
-        IoFreeMdl(dummy_mdl);
+    if (context->file_read)
+        RtlCopyMemory(context->buf, context->va, context->buflen);
 
-    if (dummypage)
-        ExFreePool(dummypage);
+exit:
+    free_read_data_context(Vcb, context);
 
-    for (i = 0; i < ci->num_stripes; i++) {
-        if (context.stripes[i].mdl) {
-            if (context.stripes[i].mdl->MdlFlags & MDL_PAGES_LOCKED)
-                MmUnlockPages(context.stripes[i].mdl);
+    return Status;
+}
 
-            IoFreeMdl(context.stripes[i].mdl);
-        }
+// For when a read has been started, but we're not interested in the result any more.
+static void read_data_abandon(_In_ device_extension* Vcb, _In_ read_data_context* context) {
+    if (context->need_to_wait)
+        KeWaitForSingleObject(&context->Event, Executive, KernelMode, false, NULL);
 
-        if (context.stripes[i].Irp)
-            IoFreeIrp(context.stripes[i].Irp);
-    }
+    free_read_data_context(Vcb, context);
+}
 
-    ExFreePool(context.stripes);
+NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t length, _In_reads_bytes_opt_(length*sizeof(uint32_t)/Vcb->superblock.sector_size) void* csum,
+                   _In_ bool is_tree, _Out_writes_bytes_(length) uint8_t* buf, _In_opt_ chunk* c, _Out_opt_ chunk** pc, _In_opt_ PIRP Irp, _In_ uint64_t generation, _In_ bool file_read,
+                   _In_ ULONG priority) {
+    NTSTATUS Status;
+    read_data_context* context;
 
-    if (!Vcb->log_to_phys_loaded)
-        ExFreePool(devices);
+    Status = read_data_start(Vcb, addr, length, csum, is_tree, buf, c, pc, Irp, generation, file_read, priority, &context);
+    if (!NT_SUCCESS(Status))
+        return Status;
 
-    return Status;
+    return read_data_finish(Vcb, context);
 }
 
 __attribute__((nonnull(1, 2)))
@@ -2779,6 +2874,7 @@ typedef struct {
     bool mdl;
     void* data;
     uint8_t compression;
+    read_data_context* context;
     unsigned int num_extents;
     read_part_extent extents[1];
 } read_part;
@@ -2792,14 +2888,59 @@ typedef struct {
     size_t length;
 } comp_calc_job;
 
+// Breaks up big uncompressed reads from mirrored chunks into READ_SPLIT_SIZE pieces, so that
+// read_data_start can send each one to whichever copy is least busy. The original part keeps
+// the first piece, and the others are put in front of it - they read straight into its buffer,
+// so by the time it's finished and gets copied to the destination, they will have been too.
+static NTSTATUS split_read_parts(device_extension* Vcb, LIST_ENTRY* read_parts, POOL_TYPE pool_type) {
+    LIST_ENTRY* le = read_parts->Flink;
+
+    while (le != read_parts) {
+        read_part* rp = CONTAINING_RECORD(le, read_part, list_entry);
+
+        if (rp->compression == BTRFS_COMPRESSION_NONE && rp->to_read > READ_SPLIT_SIZE && rp->c->chunk_item->num_stripes > 1 &&
+            rp->c->chunk_item->type & (BLOCK_FLAG_RAID1 | BLOCK_FLAG_RAID1C3 | BLOCK_FLAG_RAID1C4 | BLOCK_FLAG_RAID10)) {
+            uint32_t off;
+
+            for (off = READ_SPLIT_SIZE; off < rp->to_read; off += READ_SPLIT_SIZE) {
+                read_part* piece = ExAllocatePoolWithTag(pool_type, sizeof(read_part), ALLOC_TAG);
+
+                if (!piece) {
+                    ERR("out of memory\n");
+                    return STATUS_INSUFFICIENT_RESOURCES;
+                }
+
+                RtlZeroMemory(piece, sizeof(read_part));
+
+                piece->addr = rp->addr + off;
+                piece->c = rp->c;
+                piece->to_read = min(READ_SPLIT_SIZE, rp->to_read - off);
+                piece->csum = rp->csum ? (uint8_t*)rp->csum + ((off >> Vcb->sector_shift) * Vcb->csum_size) : NULL;
+                piece->buf = rp->buf + off;
+                piece->mdl = rp->mdl;
+                piece->compression = BTRFS_COMPRESSION_NONE;
+
+                InsertTailList(&rp->list_entry, &piece->list_entry);
+            }
+
+            rp->to_read = READ_SPLIT_SIZE;
+        }
+
+        le = le->Flink;
+    }
+
+    return STATUS_SUCCESS;
+}
+
 __attribute__((nonnull(1, 2)))
 NTSTATUS read_file(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length, ULONG* pbr, PIRP Irp) {
     NTSTATUS Status;
     uint32_t bytes_read = 0;
     uint64_t last_end;
-    LIST_ENTRY* le;
+    LIST_ENTRY *le, *issue_le;
     POOL_TYPE pool_type;
     LIST_ENTRY read_parts, calc_jobs;
+    unsigned int in_flight = 0;
 
     TRACE("(%p, %p, %I64x, %I64x, %p)\n", fcb, data, start, length, pbr);
 
@@ -2811,12 +2952,33 @@ NTSTATUS read_file(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length, ULO
         return STATUS_END_OF_FILE;
     }
 
+    if (!fcb_extents_loaded(fcb, start, length)) {
+        // We can only load more extents if we've got the tree lock, and the fcb exclusively -
+        // see acquire_fcb_extents for callers which don't.
+        if (!ExIsResourceAcquiredExclusiveLite(fcb->Header.Resource) || !ExIsResourceAcquiredSharedLite(&fcb->Vcb->tree_lock)) {
+            // Read-ahead going further than acquire_for_read_ahead expected doesn't matter - the
+            // pages will get read properly when something actually asks for them.
+            if (IoGetTopLevelIrp() == (PIRP)FSRTL_CACHE_TOP_LEVEL_IRP)
+                WARN("extents of inode %I64x in subvol %I64x not loaded for read-ahead\n", fcb->inode, fcb->subvol->id);
+            else
+                ERR("extents of inode %I64x in subvol %I64x not loaded\n", fcb->inode, fcb->subvol->id);
+
+            return STATUS_INTERNAL_ERROR;
+        }
+
+        Status = load_fcb_extents(fcb->Vcb, fcb, start, length, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_fcb_extents returned %08lx\n", Status);
+            return Status;
+        }
+    }
+
     InitializeListHead(&read_parts);
     InitializeListHead(&calc_jobs);
 
     pool_type = fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE ? NonPagedPool : PagedPool;
 
-    le = fcb->extents.Flink;
+    le = find_extent_index(fcb, start);
 
     last_end = start;
 
@@ -2961,6 +3123,7 @@ NTSTATUS read_file(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length, ULO
                     rp->bumpoff = 0;
                     rp->num_extents = 1;
                     rp->csum_free = false;
+                    rp->context = NULL;
 
                     rp->read = (uint32_t)(len - rp->extents[0].off);
                     if (rp->read > length) rp->read = (uint32_t)length;
@@ -3121,6 +3284,7 @@ nextitem:
                 rp2->mdl = false;
                 rp2->data = last_rp->data;
                 rp2->compression = last_rp->compression;
+                rp2->context = NULL;
                 rp2->num_extents = last_rp->num_extents + 1;
 
                 RtlCopyMemory(rp2->extents, last_rp->extents, last_rp->num_extents * sizeof(read_part_extent));
@@ -3156,14 +3320,60 @@ nextitem:
         }
     }
 
-    le = read_parts.Flink;
+    if (fcb->Vcb->options.read_policy == READ_POLICY_LATENCY) {
+        Status = split_read_parts(fcb->Vcb, &read_parts, pool_type);
+        if (!NT_SUCCESS(Status)) {
+            ERR("split_read_parts returned %08lx\n", Status);
+            goto exit;
+        }
+    }
+
+    // Keep up to READ_QUEUE_DEPTH parts in flight, so that a fragmented file doesn't get read one
+    // extent at a time. Each part gets checked and its decompression queued while the ones after
+    // it are still being read.
+
+    le = issue_le = read_parts.Flink;
     while (le != &read_parts) {
         read_part* rp = CONTAINING_RECORD(le, read_part, list_entry);
 
-        Status = read_data(fcb->Vcb, rp->addr, rp->to_read, rp->csum, false, rp->buf, rp->c, NULL, Irp, 0, rp->mdl,
-                           fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE ? HighPagePriority : NormalPagePriority);
+        while (issue_le != &read_parts && in_flight < READ_QUEUE_DEPTH) {
+            read_part* rp2 = CONTAINING_RECORD(issue_le, read_part, list_entry);
+
+            // RAID5 and 6 reads lock a range of the chunk, which might overlap one we already have
+            if (rp2->c->chunk_item->type & (BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6)) {
+                LIST_ENTRY* le2 = le;
+                bool conflict = false;
+
+                while (le2 != issue_le) {
+                    if (CONTAINING_RECORD(le2, read_part, list_entry)->c == rp2->c) {
+                        conflict = true;
+                        break;
+                    }
+
+                    le2 = le2->Flink;
+                }
+
+                if (conflict)
+                    break;
+            }
+
+            Status = read_data_start(fcb->Vcb, rp2->addr, rp2->to_read, rp2->csum, false, rp2->buf, rp2->c, NULL, Irp, 0, rp2->mdl,
+                                     fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE ? HighPagePriority : NormalPagePriority, &rp2->context);
+            if (!NT_SUCCESS(Status)) {
+                ERR("read_data_start returned %08lx\n", Status);
+                goto exit;
+            }
+
+            in_flight++;
+            issue_le = issue_le->Flink;
+        }
+
+        Status = read_data_finish(fcb->Vcb, rp->context);
+        rp->context = NULL;
+        in_flight--;
+
         if (!NT_SUCCESS(Status)) {
-            ERR("read_data returned %08lx\n", Status);
+            ERR("read_data_finish returned %08lx\n", Status);
             goto exit;
         }
 
@@ -3293,6 +3503,9 @@ nextitem:
         ExFreePool(ccj);
     }
 
+    if (!IsListEmpty(&fcb->delalloc))
+        delalloc_read(fcb, data, start, bytes_read);
+
     if (pbr)
         *pbr = bytes_read;
 
@@ -3300,6 +3513,9 @@ exit:
     while (!IsListEmpty(&read_parts)) {
         read_part* rp = CONTAINING_RECORD(RemoveHeadList(&read_parts), read_part, list_entry);
 
+        if (rp->context)
+            read_data_abandon(fcb->Vcb, rp->context);
+
         if (rp->buf_free)
             ExFreePool(rp->buf);
 
@@ -3325,6 +3541,72 @@ exit:
     return Status;
 }
 
+// Called after each successful cached read. The Cache Manager does the actual reading ahead, but
+// it only ever reads READ_AHEAD_GRANULARITY at a time unless we tell it otherwise, so we watch the
+// reads on each handle: while they keep going forwards, either sequentially or with a fixed stride,
+// the granularity doubles up to READ_AHEAD_MAX_WINDOW, and as soon as they stop it drops back down.
+// This also means that compressed files get decompressed in bigger batches ahead of the reader.
+void readahead_read_done(PFILE_OBJECT FileObject, PLARGE_INTEGER offset, ULONG length) {
+    fcb* fcb = FileObject->FsContext;
+    ccb* ccb = FileObject->FsContext2;
+    device_extension* Vcb;
+    uint64_t start = offset->QuadPart;
+    int64_t stride;
+    ULONG max_window;
+
+    if (!fcb || !ccb || !FileObject->PrivateCacheMap || FileObject->Flags & FO_RANDOM_ACCESS || length == 0)
+        return;
+
+    Vcb = fcb->Vcb;
+    stride = (int64_t)(start - ccb->ra_last_start);
+    max_window = Vcb->trim ? READ_AHEAD_MAX_WINDOW : READ_AHEAD_MAX_WINDOW_HDD;
+
+    if (ccb->ra_window == 0) // first read on this handle
+        ccb->ra_window = READ_AHEAD_GRANULARITY;
+    else if (start == ccb->ra_last_end || (stride > 0 && stride == ccb->ra_stride)) {
+        if (start == ccb->ra_last_end)
+            InterlockedIncrement64((LONG64*)&Vcb->readahead_stats.sequential_reads);
+        else
+            InterlockedIncrement64((LONG64*)&Vcb->readahead_stats.strided_reads);
+
+        if (ccb->ra_window > READ_AHEAD_GRANULARITY)
+            InterlockedExchangeAdd64((LONG64*)&Vcb->readahead_stats.hit_bytes, length);
+
+        if (ccb->ra_window < max_window) {
+            ccb->ra_window = min(ccb->ra_window * 2, max_window);
+            CcSetReadAheadGranularity(FileObject, ccb->ra_window);
+            InterlockedIncrement64((LONG64*)&Vcb->readahead_stats.window_increases);
+        }
+
+        CcScheduleReadAhead(FileObject, offset, length);
+    } else {
+        InterlockedIncrement64((LONG64*)&Vcb->readahead_stats.random_reads);
+
+        if (ccb->ra_window > READ_AHEAD_GRANULARITY) {
+            InterlockedExchangeAdd64((LONG64*)&Vcb->readahead_stats.wasted_bytes, ccb->ra_window);
+            InterlockedIncrement64((LONG64*)&Vcb->readahead_stats.window_resets);
+
+            ccb->ra_window = READ_AHEAD_GRANULARITY;
+            CcSetReadAheadGranularity(FileObject, ccb->ra_window);
+        }
+    }
+
+    ccb->ra_stride = stride;
+    ccb->ra_last_start = start;
+    ccb->ra_last_end = start + length;
+}
+
+NTSTATUS get_readahead_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen) {
+    if (!data || length < sizeof(btrfs_readahead_stats))
+        return STATUS_BUFFER_TOO_SMALL;
+
+    RtlCopyMemory(data, &Vcb->readahead_stats, sizeof(btrfs_readahead_stats));
+
+    *retlen = sizeof(btrfs_readahead_stats);
+
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS do_read(PIRP Irp, bool wait, ULONG* bytes_read) {
     PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
     PFILE_OBJECT FileObject = IrpSp->FileObject;
@@ -3385,6 +3667,9 @@ NTSTATUS do_read(PIRP Irp, bool wait, ULONG* bytes_read) {
             Status = Irp->IoStatus.Status;
             Irp->IoStatus.Information += addon;
             *bytes_read = (ULONG)Irp->IoStatus.Information;
+
+            if (NT_SUCCESS(Status))
+                readahead_read_done(FileObject, &IrpSp->Parameters.Read.ByteOffset, length);
         } else
             ERR("EXCEPTION - %08lx\n", Status);
 
@@ -3455,6 +3740,9 @@ NTSTATUS do_read(PIRP Irp, bool wait, ULONG* bytes_read) {
             Status = Irp->IoStatus.Status;
             Irp->IoStatus.Information += addon;
             *bytes_read = (ULONG)Irp->IoStatus.Information;
+
+            if (NT_SUCCESS(Status))
+                readahead_read_done(FileObject, &IrpSp->Parameters.Read.ByteOffset, length);
         } else
             ERR("EXCEPTION - %08lx\n", Status);
 
@@ -3482,6 +3770,9 @@ NTSTATUS do_read(PIRP Irp, bool wait, ULONG* bytes_read) {
         *bytes_read += addon;
         TRACE("read %lu bytes\n", *bytes_read);
 
+        if (NT_SUCCESS(Status) && Irp->Flags & IRP_PAGING_IO && IoGetTopLevelIrp() == (PIRP)FSRTL_CACHE_TOP_LEVEL_IRP)
+            InterlockedExchangeAdd64((LONG64*)&fcb->Vcb->readahead_stats.readahead_bytes, *bytes_read);
+
         Irp->IoStatus.Information = *bytes_read;
 
         if (diskacc && Status != STATUS_PENDING) {
@@ -3593,10 +3884,13 @@ NTSTATUS __stdcall drv_read(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     }
 
     if (!ExIsResourceAcquiredSharedLite(fcb->Header.Resource)) {
-        if (!ExAcquireResourceSharedLite(fcb->Header.Resource, wait)) {
-            Status = STATUS_PENDING;
+        Status = acquire_fcb_extents(fcb, IrpSp->Parameters.Read.ByteOffset.QuadPart, IrpSp->Parameters.Read.Length, wait, Irp);
+        if (Status == STATUS_PENDING) {
             IoMarkIrpPending(Irp);
             goto exit;
+        } else if (!NT_SUCCESS(Status)) {
+            ERR("acquire_fcb_extents returned %08lx\n", Status);
+            goto exit;
         }
 
         acquired_fcb_lock = true;
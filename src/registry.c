@@ -38,7 +38,8 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     mount_options* options = &Vcb->options;
     UNICODE_STRING path, ignoreus, compressus, compressforceus, compresstypeus, readonlyus, zliblevelus, flushintervalus,
                    maxinlineus, subvolidus, skipbalanceus, nobarrierus, notrimus, clearcacheus, allowdegradedus, zstdlevelus,
-                   norootdirus;
+                   norootdirus, allocclustersus, autodefragus, readpolicyus, stripealignus, delallocus, dirtylimitus,
+                   treelogus;
     OBJECT_ATTRIBUTES oa;
     NTSTATUS Status;
     ULONG i, j, kvfilen, index, retlen;
@@ -58,6 +59,13 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     options->no_trim = mount_no_trim;
     options->clear_cache = mount_clear_cache;
     options->allow_degraded = mount_allow_degraded;
+    options->alloc_clusters = mount_alloc_clusters;
+    options->autodefrag = mount_autodefrag;
+    options->read_policy = mount_read_policy > READ_POLICY_LATENCY ? READ_POLICY_ROUND_ROBIN : mount_read_policy;
+    options->stripe_align = mount_stripe_align;
+    options->delalloc = mount_delalloc;
+    options->dirty_limit = mount_dirty_limit;
+    options->tree_log = mount_tree_log;
     options->subvol_id = 0;
 
     path.Length = path.MaximumLength = registry_path.Length + (37 * sizeof(WCHAR));
@@ -123,6 +131,13 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     RtlInitUnicodeString(&allowdegradedus, L"AllowDegraded");
     RtlInitUnicodeString(&zstdlevelus, L"ZstdLevel");
     RtlInitUnicodeString(&norootdirus, L"NoRootDir");
+    RtlInitUnicodeString(&allocclustersus, L"AllocClusters");
+    RtlInitUnicodeString(&autodefragus, L"AutoDefrag");
+    RtlInitUnicodeString(&readpolicyus, L"ReadPolicy");
+    RtlInitUnicodeString(&stripealignus, L"StripeAlign");
+    RtlInitUnicodeString(&delallocus, L"DelayedAlloc");
+    RtlInitUnicodeString(&dirtylimitus, L"DirtyLimit");
+    RtlInitUnicodeString(&treelogus, L"TreeLog");
 
     do {
         Status = ZwEnumerateValueKey(h, index, KeyValueFullInformation, kvfi, kvfilen, &retlen);
@@ -199,6 +214,34 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
                 DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
 
                 options->no_root_dir = *val;
+            } else if (FsRtlAreNamesEqual(&allocclustersus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->alloc_clusters = *val;
+            } else if (FsRtlAreNamesEqual(&autodefragus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->autodefrag = *val;
+            } else if (FsRtlAreNamesEqual(&readpolicyus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->read_policy = *val > READ_POLICY_LATENCY ? READ_POLICY_ROUND_ROBIN : *val;
+            } else if (FsRtlAreNamesEqual(&stripealignus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->stripe_align = *val;
+            } else if (FsRtlAreNamesEqual(&delallocus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->delalloc = *val;
+            } else if (FsRtlAreNamesEqual(&dirtylimitus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->dirty_limit = *val;
+            } else if (FsRtlAreNamesEqual(&treelogus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->tree_log = *val;
             }
         } else if (Status != STATUS_NO_MORE_ENTRIES) {
             ERR("ZwEnumerateValueKey returned %08lx\n", Status);
@@ -813,6 +856,13 @@ void read_registry(PUNICODE_STRING regpath, bool refresh) {
     get_registry_value(h, L"Readonly", REG_DWORD, &mount_readonly, sizeof(mount_readonly));
     get_registry_value(h, L"ZstdLevel", REG_DWORD, &mount_zstd_level, sizeof(mount_zstd_level));
     get_registry_value(h, L"NoRootDir", REG_DWORD, &mount_no_root_dir, sizeof(mount_no_root_dir));
+    get_registry_value(h, L"AllocClusters", REG_DWORD, &mount_alloc_clusters, sizeof(mount_alloc_clusters));
+    get_registry_value(h, L"AutoDefrag", REG_DWORD, &mount_autodefrag, sizeof(mount_autodefrag));
+    get_registry_value(h, L"ReadPolicy", REG_DWORD, &mount_read_policy, sizeof(mount_read_policy));
+    get_registry_value(h, L"StripeAlign", REG_DWORD, &mount_stripe_align, sizeof(mount_stripe_align));
+    get_registry_value(h, L"DelayedAlloc", REG_DWORD, &mount_delalloc, sizeof(mount_delalloc));
+    get_registry_value(h, L"DirtyLimit", REG_DWORD, &mount_dirty_limit, sizeof(mount_dirty_limit));
+    get_registry_value(h, L"TreeLog", REG_DWORD, &mount_tree_log, sizeof(mount_tree_log));
 
     if (!refresh)
         get_registry_value(h, L"NoPNP", REG_DWORD, &no_pnp, sizeof(no_pnp));
@@ -1708,6 +1708,8 @@ static void scrub_raid5_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
     ULONG sectors_per_stripe = (ULONG)(c->chunk_item->stripe_length >> Vcb->sector_shift), off;
     uint16_t stripe, parity = (bit_start + num + c->chunk_item->num_stripes - 1) % c->chunk_item->num_stripes;
     uint64_t stripeoff;
+    uint8_t* srcs[XOR_MULTI_MAX];
+    uint32_t num_srcs = 0;
 
     stripe = (parity + 1) % c->chunk_item->num_stripes;
     off = (ULONG)(bit_start + num - stripe_start) * sectors_per_stripe * (c->chunk_item->num_stripes - 1);
@@ -1757,7 +1759,7 @@ static void scrub_raid5_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
         }
 
         if (missing_devices == 0)
-            do_xor(context->parity_scratch, &context->stripes[stripe].buf[num * c->chunk_item->stripe_length], (ULONG)c->chunk_item->stripe_length);
+            xor_multi_queue(context->parity_scratch, srcs, &num_srcs, &context->stripes[stripe].buf[num * c->chunk_item->stripe_length], (ULONG)c->chunk_item->stripe_length);
 
         stripe = (stripe + 1) % c->chunk_item->num_stripes;
         stripeoff = num * sectors_per_stripe;
@@ -1766,6 +1768,8 @@ static void scrub_raid5_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
     // check parity
 
     if (missing_devices == 0) {
+        xor_multi_queue(context->parity_scratch, srcs, &num_srcs, NULL, (ULONG)c->chunk_item->stripe_length);
+
         RtlClearAllBits(&context->stripes[parity].error);
 
         for (ULONG i = 0; i < sectors_per_stripe; i++) {
@@ -1898,6 +1902,8 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
     uint16_t stripe, parity1 = (bit_start + num + c->chunk_item->num_stripes - 2) % c->chunk_item->num_stripes;
     uint16_t parity2 = (parity1 + 1) % c->chunk_item->num_stripes;
     uint64_t stripeoff;
+    uint8_t* srcs[XOR_MULTI_MAX];
+    uint32_t num_srcs = 0;
 
     stripe = (parity1 + 2) % c->chunk_item->num_stripes;
     off = (ULONG)(bit_start + num - stripe_start) * sectors_per_stripe * (c->chunk_item->num_stripes - 2);
@@ -1953,12 +1959,15 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
         }
 
         if (c->devices[parity1]->devobj)
-            do_xor(context->parity_scratch, &context->stripes[stripe].buf[num * c->chunk_item->stripe_length], (uint32_t)c->chunk_item->stripe_length);
+            xor_multi_queue(context->parity_scratch, srcs, &num_srcs, &context->stripes[stripe].buf[num * c->chunk_item->stripe_length], (uint32_t)c->chunk_item->stripe_length);
 
         stripe = (stripe + 1) % c->chunk_item->num_stripes;
         stripeoff = num * sectors_per_stripe;
     }
 
+    if (c->devices[parity1]->devobj)
+        xor_multi_queue(context->parity_scratch, srcs, &num_srcs, NULL, (uint32_t)c->chunk_item->stripe_length);
+
     RtlClearAllBits(&context->stripes[parity1].error);
 
     if (missing_devices == 0 || (missing_devices == 1 && !c->devices[parity2]->devobj)) {
@@ -2279,8 +2288,6 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             uint16_t x = 0, y = 0, k;
             uint64_t addr;
             uint32_t len = (RtlCheckBit(&context->is_tree, bad_off1) || RtlCheckBit(&context->is_tree, bad_off2)) ? Vcb->superblock.node_size : Vcb->superblock.sector_size;
-            uint8_t gyx, gx, denom, a, b, *p, *q, *pxy, *qxy;
-            uint32_t j;
 
             stripe = parity1 == 0 ? (c->chunk_item->num_stripes - 1) : (parity1 - 1);
 
@@ -2323,29 +2330,9 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                 k--;
             } while (stripe != parity2);
 
-            gyx = gpow2(y > x ? (y-x) : (255-x+y));
-            gx = gpow2(255-x);
-
-            denom = gdiv(1, gyx ^ 1);
-            a = gmul(gyx, denom);
-            b = gmul(gx, denom);
-
-            p = &context->stripes[parity1].buf[(num * c->chunk_item->stripe_length) + (i << Vcb->sector_shift)];
-            q = &context->stripes[parity2].buf[(num * c->chunk_item->stripe_length) + (i << Vcb->sector_shift)];
-            pxy = &context->parity_scratch2[i << Vcb->sector_shift];
-            qxy = &context->parity_scratch[i << Vcb->sector_shift];
-
-            for (j = 0; j < len; j++) {
-                *qxy = gmul(a, *p ^ *pxy) ^ gmul(b, *q ^ *qxy);
-
-                p++;
-                q++;
-                pxy++;
-                qxy++;
-            }
-
-            do_xor(&context->parity_scratch2[i << Vcb->sector_shift], &context->parity_scratch[i << Vcb->sector_shift], len);
-            do_xor(&context->parity_scratch2[i << Vcb->sector_shift], &context->stripes[parity1].buf[(num * c->chunk_item->stripe_length) + (i << Vcb->sector_shift)], len);
+            galois_recover2(&context->stripes[parity1].buf[(num * c->chunk_item->stripe_length) + (i << Vcb->sector_shift)],
+                            &context->stripes[parity2].buf[(num * c->chunk_item->stripe_length) + (i << Vcb->sector_shift)],
+                            &context->parity_scratch2[i << Vcb->sector_shift], &context->parity_scratch[i << Vcb->sector_shift], x, y, len);
 
             addr = c->offset + (stripe_start * (c->chunk_item->num_stripes - 2) * c->chunk_item->stripe_length) + (bad_off1 << Vcb->sector_shift);
 
@@ -2792,6 +2779,8 @@ end3:
                 context.stripes[i].Irp = NULL;
 
                 if (context.stripes[i].rewrite) {
+                    stripe_cache_invalidate(Vcb, run_start, run_end - run_start);
+
                     Status = write_data_phys(c->devices[i]->devobj, c->devices[i]->fileobj, cis[i].offset + context.stripes[i].offset,
                                              context.stripes[i].buf, (uint32_t)(read_stripes * c->chunk_item->stripe_length));
 
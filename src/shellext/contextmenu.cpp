@@ -1679,3 +1679,49 @@ extern "C" void CALLBACK ReflinkCopyW(HWND hwnd, HINSTANCE hinst, LPWSTR lpszCmd
         }
     }
 }
+
+static void defragment(const wstring& fn, const btrfs_defrag& bd) {
+    win_handle h;
+    IO_STATUS_BLOCK iosb;
+    NTSTATUS Status;
+
+    h = CreateFileW(fn.c_str(), FILE_READ_DATA | FILE_WRITE_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+    if (h == INVALID_HANDLE_VALUE)
+        throw last_error(GetLastError());
+
+    Status = NtFsControlFile(h, nullptr, nullptr, nullptr, &iosb, FSCTL_BTRFS_DEFRAGMENT, (void*)&bd, sizeof(btrfs_defrag), nullptr, 0);
+    if (!NT_SUCCESS(Status))
+        throw ntstatus_error(Status);
+}
+
+// DefragmentW [-c] [-s] [-t extent size] [-r bytes per second] file...
+extern "C" void CALLBACK DefragmentW(HWND hwnd, HINSTANCE hinst, LPWSTR lpszCmdLine, int nCmdShow) {
+    vector<wstring> args;
+    btrfs_defrag bd;
+
+    command_line_to_args(lpszCmdLine, args);
+
+    memset(&bd, 0, sizeof(btrfs_defrag));
+
+    for (unsigned int i = 0; i < args.size(); i++) {
+        if (args[i][0] == '-' && args[i].length() == 2) {
+            if (args[i][1] == 'c')
+                bd.flags |= BTRFS_DEFRAG_COMPRESS;
+            else if (args[i][1] == 's')
+                bd.flags |= BTRFS_DEFRAG_SKIP_SHARED;
+            else if (args[i][1] == 't' && i < args.size() - 1) {
+                bd.extent_size = _wcstoui64(args[i+1].c_str(), nullptr, 10);
+                i++;
+            } else if (args[i][1] == 'r' && i < args.size() - 1) {
+                bd.max_rate = wcstoul(args[i+1].c_str(), nullptr, 10);
+                i++;
+            }
+        } else {
+            try {
+                defragment(args[i], bd);
+            } catch (const exception& e) {
+                cerr << "Error: " << e.what() << endl;
+            }
+        }
+    }
+}
@@ -0,0 +1,206 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+
+// Cache of RAID5 and RAID6 stripes, keyed by logical address. Before flush_partial_stripe
+// can work out the parity, it has to fill in the parts of the stripe that weren't written
+// to, which normally means reading them from disk. If we've still got the stripe from the
+// last time it was flushed, we can use that instead, and patch up the parity from whichever
+// data stripes have changed. Anything else that writes to a RAID5 or RAID6 chunk has to call
+// stripe_cache_invalidate. When we go over STRIPE_CACHE_SIZE, the oldest stripes get thrown out.
+
+typedef struct {
+    uint64_t address;
+    ULONG length;
+    ULONG parity_length;
+    avl_node tree_node;
+    LIST_ENTRY list_entry;
+    uint8_t data[1]; // data, followed by parity
+} stripe_cache_entry;
+
+void init_stripe_cache(device_extension* Vcb) {
+    avl_init(&Vcb->stripe_cache, NULL);
+    InitializeListHead(&Vcb->stripe_cache_list);
+    RtlZeroMemory(&Vcb->stripe_cache_stats, sizeof(btrfs_stripe_cache_stats));
+    ExInitializeResourceLite(&Vcb->stripe_cache_lock);
+}
+
+void free_stripe_cache(device_extension* Vcb) {
+    while (!IsListEmpty(&Vcb->stripe_cache_list)) {
+        stripe_cache_entry* sce = CONTAINING_RECORD(RemoveHeadList(&Vcb->stripe_cache_list), stripe_cache_entry, list_entry);
+
+        ExFreePool(sce);
+    }
+
+    avl_init(&Vcb->stripe_cache, NULL);
+
+    ExDeleteResourceLite(&Vcb->stripe_cache_lock);
+}
+
+// Returns the last entry starting before address, or NULL if there isn't one.
+static stripe_cache_entry* find_stripe_cache_entry(device_extension* Vcb, uint64_t address) {
+    avl_node* n = Vcb->stripe_cache.root;
+    stripe_cache_entry* ret = NULL;
+
+    while (n) {
+        stripe_cache_entry* sce = CONTAINING_RECORD(n, stripe_cache_entry, tree_node);
+
+        if (sce->address < address) {
+            ret = sce;
+            n = n->right;
+        } else
+            n = n->left;
+    }
+
+    return ret;
+}
+
+static void remove_stripe_cache_entry(device_extension* Vcb, stripe_cache_entry* sce) {
+    avl_remove(&Vcb->stripe_cache, &sce->tree_node);
+    RemoveEntryList(&sce->list_entry);
+
+    Vcb->stripe_cache_stats.size -= sce->length + sce->parity_length;
+    Vcb->stripe_cache_stats.entries--;
+
+    ExFreePool(sce);
+}
+
+// If we have the stripe at address, copies its data and parity and returns true.
+bool stripe_cache_lookup(device_extension* Vcb, uint64_t address, uint8_t* data, ULONG length, uint8_t* parity, ULONG parity_length) {
+    stripe_cache_entry* sce;
+    bool ret = false;
+
+    ExAcquireResourceExclusiveLite(&Vcb->stripe_cache_lock, true);
+
+    sce = find_stripe_cache_entry(Vcb, address + 1);
+
+    if (sce && sce->address == address && sce->length == length && sce->parity_length == parity_length) {
+        RtlCopyMemory(data, sce->data, length);
+        RtlCopyMemory(parity, sce->data + length, parity_length);
+
+        // move to end of LRU list
+        RemoveEntryList(&sce->list_entry);
+        InsertTailList(&Vcb->stripe_cache_list, &sce->list_entry);
+
+        Vcb->stripe_cache_stats.hits++;
+        ret = true;
+    } else
+        Vcb->stripe_cache_stats.misses++;
+
+    ExReleaseResourceLite(&Vcb->stripe_cache_lock);
+
+    return ret;
+}
+
+// Remembers the stripe at address, as it's just been written to disk.
+void stripe_cache_store(device_extension* Vcb, uint64_t address, uint8_t* data, ULONG length, uint8_t* parity, ULONG parity_length) {
+    stripe_cache_entry* sce;
+    avl_node* parent = NULL;
+    avl_node** link = &Vcb->stripe_cache.root;
+
+    if ((uint64_t)length + parity_length > STRIPE_CACHE_SIZE)
+        return;
+
+    ExAcquireResourceExclusiveLite(&Vcb->stripe_cache_lock, true);
+
+    sce = find_stripe_cache_entry(Vcb, address + 1);
+
+    if (sce && sce->address == address) {
+        if (sce->length == length && sce->parity_length == parity_length) {
+            RtlCopyMemory(sce->data, data, length);
+            RtlCopyMemory(sce->data + length, parity, parity_length);
+
+            RemoveEntryList(&sce->list_entry);
+            InsertTailList(&Vcb->stripe_cache_list, &sce->list_entry);
+
+            goto end;
+        }
+
+        remove_stripe_cache_entry(Vcb, sce);
+    }
+
+    sce = ExAllocatePoolWithTag(PagedPool, offsetof(stripe_cache_entry, data[0]) + length + parity_length, ALLOC_TAG);
+    if (!sce) {
+        ERR("out of memory\n");
+        goto end;
+    }
+
+    sce->address = address;
+    sce->length = length;
+    sce->parity_length = parity_length;
+    RtlCopyMemory(sce->data, data, length);
+    RtlCopyMemory(sce->data + length, parity, parity_length);
+
+    while (*link) {
+        stripe_cache_entry* sce2 = CONTAINING_RECORD(*link, stripe_cache_entry, tree_node);
+
+        parent = *link;
+
+        if (sce->address < sce2->address)
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+
+    avl_insert(&Vcb->stripe_cache, &sce->tree_node, parent, link);
+    InsertTailList(&Vcb->stripe_cache_list, &sce->list_entry);
+
+    Vcb->stripe_cache_stats.size += length + parity_length;
+    Vcb->stripe_cache_stats.entries++;
+
+    while (Vcb->stripe_cache_stats.size > STRIPE_CACHE_SIZE && !IsListEmpty(&Vcb->stripe_cache_list)) {
+        remove_stripe_cache_entry(Vcb, CONTAINING_RECORD(Vcb->stripe_cache_list.Flink, stripe_cache_entry, list_entry));
+        Vcb->stripe_cache_stats.evictions++;
+    }
+
+end:
+    ExReleaseResourceLite(&Vcb->stripe_cache_lock);
+}
+
+// Drops every stripe overlapping [address, address + length).
+void stripe_cache_invalidate(device_extension* Vcb, uint64_t address, uint64_t length) {
+    stripe_cache_entry* sce;
+
+    ExAcquireResourceExclusiveLite(&Vcb->stripe_cache_lock, true);
+
+    sce = find_stripe_cache_entry(Vcb, address + length);
+
+    while (sce && sce->address + sce->length > address) {
+        avl_node* n = avl_prev(&sce->tree_node);
+
+        remove_stripe_cache_entry(Vcb, sce);
+        Vcb->stripe_cache_stats.invalidations++;
+
+        sce = n ? CONTAINING_RECORD(n, stripe_cache_entry, tree_node) : NULL;
+    }
+
+    ExReleaseResourceLite(&Vcb->stripe_cache_lock);
+}
+
+NTSTATUS get_stripe_cache_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen) {
+    if (!data || length < sizeof(btrfs_stripe_cache_stats))
+        return STATUS_BUFFER_TOO_SMALL;
+
+    ExAcquireResourceSharedLite(&Vcb->stripe_cache_lock, true);
+    RtlCopyMemory(data, &Vcb->stripe_cache_stats, sizeof(btrfs_stripe_cache_stats));
+    ExReleaseResourceLite(&Vcb->stripe_cache_lock);
+
+    *retlen = sizeof(btrfs_stripe_cache_stats);
+
+    return STATUS_SUCCESS;
+}
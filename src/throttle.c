@@ -0,0 +1,120 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+
+// Write throttling. If data gets written faster than the flush thread can commit it, the next
+// commit ends up with gigabytes to get through, and everybody waiting for the tree lock stalls
+// for seconds. So we count how much has been written since the last commit, and time each commit
+// to get an idea of how fast we can write. Once we get to dirty_limit - either the DirtyLimit
+// registry value, or however much we reckon we can write in THROTTLE_TARGET_TIME - we wake the
+// flush thread early, and writers start getting held up: hardly at all to begin with, and then
+// more the further past the limit we are, up to THROTTLE_MAX_DELAY for each write.
+
+static void update_dirty_limit(device_extension* Vcb) {
+    if (Vcb->options.dirty_limit != 0)
+        Vcb->dirty_limit = (uint64_t)Vcb->options.dirty_limit * 0x100000;
+    else
+        Vcb->dirty_limit = min(max((Vcb->commit_bandwidth * THROTTLE_TARGET_TIME) / 10000000, THROTTLE_MIN_LIMIT), THROTTLE_MAX_LIMIT);
+}
+
+void init_throttle(device_extension* Vcb) {
+    Vcb->dirty_bytes = 0;
+    Vcb->commit_bandwidth = THROTTLE_DEFAULT_BANDWIDTH;
+    Vcb->flush_kicked = 0;
+    RtlZeroMemory(&Vcb->throttle_stats, sizeof(btrfs_throttle_stats));
+
+    update_dirty_limit(Vcb);
+}
+
+// Called by write_file2 after it's written length bytes without going through the cache.
+void throttle_dirty(device_extension* Vcb, uint64_t length) {
+    uint64_t dirty = (uint64_t)InterlockedExchangeAdd64((LONG64*)&Vcb->dirty_bytes, length) + length;
+
+    if (dirty >= Vcb->dirty_limit && InterlockedCompareExchange(&Vcb->flush_kicked, 1, 0) == 0) {
+        LARGE_INTEGER due_time;
+
+        due_time.QuadPart = 0;
+        KeSetTimer(&Vcb->flush_thread_timer, due_time, NULL); // trigger the timer early
+
+        InterlockedIncrement64((LONG64*)&Vcb->throttle_stats.early_commits);
+    }
+}
+
+// Called before a write of length bytes, without any locks held.
+void throttle_write(device_extension* Vcb, ULONG length) {
+    uint64_t dirty = Vcb->dirty_bytes, limit = Vcb->dirty_limit, delay;
+    LARGE_INTEGER time;
+
+    if (dirty <= limit || limit == 0)
+        return;
+
+    // how long the flush would take to write this, scaled by how far over the limit we are
+    delay = min(((uint64_t)length * 10000000) / Vcb->commit_bandwidth, THROTTLE_MAX_DELAY);
+    delay = min((delay * (dirty - limit)) / limit, THROTTLE_MAX_DELAY);
+
+    if (delay == 0)
+        return;
+
+    InterlockedIncrement64((LONG64*)&Vcb->throttle_stats.throttled_writes);
+    InterlockedExchangeAdd64((LONG64*)&Vcb->throttle_stats.throttle_time, delay);
+
+    time.QuadPart = -(LONGLONG)delay;
+    KeDelayExecutionThread(KernelMode, false, &time);
+}
+
+// do_write calls these with the tree lock held exclusively, so there's only ever one commit going on.
+void throttle_commit_start(device_extension* Vcb) {
+    Vcb->commit_dirty = (uint64_t)InterlockedExchange64((LONG64*)&Vcb->dirty_bytes, 0);
+    Vcb->commit_start_time = KeQueryInterruptTime();
+    InterlockedExchange(&Vcb->flush_kicked, 0);
+}
+
+void throttle_commit_end(device_extension* Vcb) {
+    uint64_t duration = KeQueryInterruptTime() - Vcb->commit_start_time;
+
+    Vcb->throttle_stats.commits++;
+    Vcb->throttle_stats.last_commit_time = duration;
+
+    if (duration > Vcb->throttle_stats.max_commit_time)
+        Vcb->throttle_stats.max_commit_time = duration;
+
+    // Commits with hardly any data are mostly metadata, and would make us think we're slower than we are.
+    if (Vcb->commit_dirty >= THROTTLE_MIN_SAMPLE && duration > 0) {
+        uint64_t bandwidth = (Vcb->commit_dirty * 10000000) / duration;
+
+        Vcb->commit_bandwidth = max(((Vcb->commit_bandwidth * 3) + bandwidth) / 4, 1);
+    }
+
+    update_dirty_limit(Vcb);
+}
+
+NTSTATUS get_throttle_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen) {
+    btrfs_throttle_stats* bts = data;
+
+    if (!data || length < sizeof(btrfs_throttle_stats))
+        return STATUS_BUFFER_TOO_SMALL;
+
+    RtlCopyMemory(bts, &Vcb->throttle_stats, sizeof(btrfs_throttle_stats));
+    bts->dirty_bytes = Vcb->dirty_bytes;
+    bts->dirty_limit = Vcb->dirty_limit;
+    bts->bandwidth = Vcb->commit_bandwidth;
+
+    *retlen = sizeof(btrfs_throttle_stats);
+
+    return STATUS_SUCCESS;
+}
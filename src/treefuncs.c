@@ -1058,6 +1058,7 @@ void clear_rollback(LIST_ENTRY* rollback) {
             case ROLLBACK_SUBTRACT_SPACE:
             case ROLLBACK_INSERT_EXTENT:
             case ROLLBACK_DELETE_EXTENT:
+            case ROLLBACK_DELETE_DELALLOC:
                 ExFreePool(ri->ptr);
                 break;
 
@@ -1083,7 +1084,10 @@ void do_rollback(device_extension* Vcb, LIST_ENTRY* rollback) {
             {
                 rollback_extent* re = ri->ptr;
 
-                re->ext->ignore = true;
+                if (!re->ext->ignore) {
+                    re->ext->ignore = true;
+                    remove_extent_index(re->fcb, re->ext);
+                }
 
                 switch (re->ext->extent_data.type) {
                     case EXTENT_TYPE_REGULAR:
@@ -1121,7 +1125,10 @@ void do_rollback(device_extension* Vcb, LIST_ENTRY* rollback) {
             {
                 rollback_extent* re = ri->ptr;
 
-                re->ext->ignore = false;
+                if (re->ext->ignore) {
+                    re->ext->ignore = false;
+                    insert_extent_index(re->fcb, re->ext);
+                }
 
                 switch (re->ext->extent_data.type) {
                     case EXTENT_TYPE_REGULAR:
@@ -1210,6 +1217,11 @@ void do_rollback(device_extension* Vcb, LIST_ENTRY* rollback) {
 
                 break;
             }
+
+            case ROLLBACK_INSERT_DELALLOC:
+            case ROLLBACK_DELETE_DELALLOC:
+                delalloc_rollback(ri->ptr, ri->type == ROLLBACK_INSERT_DELALLOC);
+                break;
         }
 
         ExFreePool(ri);
@@ -0,0 +1,1690 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+
+// The tree log, which is how FlushFileBuffers gets a file's metadata onto disk without having to
+// wait for a full commit. When a file gets flushed, tree_log_fsync writes out its INODE_ITEM, its
+// EXTENT_DATAs, and the checksums for any data written since the last commit, into a little tree
+// belonging to its subvolume. The log root tree has a ROOT_ITEM pointing to each of these, and we
+// write a copy of the last committed superblock with log_tree_addr pointing to that. The blocks
+// don't show up in the extent tree - they come from the free space list, and go back on it at the
+// start of the next commit, which makes the log redundant. If we crash before then, replay_tree_log
+// puts everything back at mount time. This is the same format as Linux uses, so either can replay
+// the other's log, though we only know how to replay the items we write ourselves. Anything more
+// complicated than a file's data changing, such as a rename or a change to its xattrs, gets a full
+// commit instead.
+//
+// We keep each subvolume's log in memory as a list of leaves. Flushing a file only swaps out its own
+// items, so it's only the leaves these are in that get written again, along with the nodes above
+// them and the log root tree. Commits take the tree lock exclusively, so we only need it shared to
+// stop the log being superseded while we're writing it; tree_log_lock stops two flushes from
+// changing the log at the same time.
+
+typedef struct {
+    uint64_t address;
+    LIST_ENTRY list_entry;
+} log_block;
+
+typedef struct {
+    KEY key;
+    uint64_t inode; // checksum items don't say whose they are, so we keep track here
+    uint16_t size;
+    LIST_ENTRY list_entry;
+    uint8_t data[1];
+} log_item;
+
+typedef struct {
+    LIST_ENTRY items; // log_items, in key order
+    ULONG size; // how much of the leaf the items take up, including their leaf_nodes
+    log_block* block; // NULL if the leaf has changed since it was last written
+    LIST_ENTRY list_entry;
+} log_leaf;
+
+typedef struct {
+    root* subvol;
+    LIST_ENTRY leaves; // log_leafs, in key order
+    LIST_ENTRY nodes; // log_blocks for the internal nodes above the leaves
+    uint64_t address;
+    uint8_t level;
+    LIST_ENTRY list_entry;
+} log_root;
+
+typedef struct {
+    root* subvol;
+    LIST_ENTRY items; // everything in this subvolume's log
+    LIST_ENTRY list_entry;
+} replay_root;
+
+typedef struct {
+    KEY key;
+    uint64_t address;
+} log_node;
+
+typedef struct {
+    device_extension* Vcb;
+    BTRFS_UUID chunk_tree_uuid;
+    LIST_ENTRY tree_writes;
+} log_writer;
+
+void init_tree_log(device_extension* Vcb) {
+    InitializeListHead(&Vcb->tree_log_roots);
+    InitializeListHead(&Vcb->tree_log_blocks);
+    ExInitializeResourceLite(&Vcb->tree_log_lock);
+    Vcb->tree_log_failed = false;
+}
+
+static log_item* add_log_item(LIST_ENTRY* list, uint64_t obj_id, uint8_t obj_type, uint64_t offset, void* data, uint16_t size) {
+    log_item* li;
+
+    li = ExAllocatePoolWithTag(PagedPool, offsetof(log_item, data[0]) + size, ALLOC_TAG);
+    if (!li) {
+        ERR("out of memory\n");
+        return NULL;
+    }
+
+    li->key.obj_id = obj_id;
+    li->key.obj_type = obj_type;
+    li->key.offset = offset;
+    li->inode = obj_id;
+    li->size = size;
+
+    if (size > 0)
+        RtlCopyMemory(li->data, data, size);
+
+    InsertTailList(list, &li->list_entry);
+
+    return li;
+}
+
+static void free_log_items(LIST_ENTRY* list) {
+    while (!IsListEmpty(list)) {
+        log_item* li = CONTAINING_RECORD(RemoveHeadList(list), log_item, list_entry);
+
+        ExFreePool(li);
+    }
+}
+
+static void move_list(LIST_ENTRY* dest, LIST_ENTRY* src) {
+    while (!IsListEmpty(src)) {
+        InsertTailList(dest, RemoveHeadList(src));
+    }
+}
+
+static log_leaf* alloc_log_leaf() {
+    log_leaf* ll;
+
+    ll = ExAllocatePoolWithTag(PagedPool, sizeof(log_leaf), ALLOC_TAG);
+    if (!ll) {
+        ERR("out of memory\n");
+        return NULL;
+    }
+
+    InitializeListHead(&ll->items);
+    ll->size = 0;
+    ll->block = NULL;
+
+    return ll;
+}
+
+// Frees a leaf, putting its block on blocks, or freeing that too if blocks is NULL.
+static void free_log_leaf(log_leaf* ll, LIST_ENTRY* blocks) {
+    free_log_items(&ll->items);
+
+    if (ll->block) {
+        if (blocks)
+            InsertTailList(blocks, &ll->block->list_entry);
+        else
+            ExFreePool(ll->block);
+    }
+
+    ExFreePool(ll);
+}
+
+static void free_log_root(log_root* lr, LIST_ENTRY* blocks) {
+    while (!IsListEmpty(&lr->leaves)) {
+        free_log_leaf(CONTAINING_RECORD(RemoveHeadList(&lr->leaves), log_leaf, list_entry), blocks);
+    }
+
+    if (blocks)
+        move_list(blocks, &lr->nodes);
+    else {
+        while (!IsListEmpty(&lr->nodes)) {
+            ExFreePool(CONTAINING_RECORD(RemoveHeadList(&lr->nodes), log_block, list_entry));
+        }
+    }
+
+    ExFreePool(lr);
+}
+
+// Puts the blocks back on the free list. They go on c->deleting, so nothing else gets to use them
+// until the next commit has been written, by which point the log's been superseded.
+static void free_log_blocks(device_extension* Vcb, LIST_ENTRY* blocks) {
+    while (!IsListEmpty(blocks)) {
+        log_block* lb = CONTAINING_RECORD(RemoveHeadList(blocks), log_block, list_entry);
+        chunk* c = get_chunk_from_address(Vcb, lb->address);
+
+        if (c) {
+            acquire_chunk_lock(c, Vcb);
+            space_list_add(c, lb->address, Vcb->superblock.node_size, NULL);
+            release_chunk_lock(c, Vcb);
+        } else
+            ERR("get_chunk_from_address(%I64x) failed\n", lb->address);
+
+        ExFreePool(lb);
+    }
+}
+
+// Frees our copy of the log, without touching the free space - for when we're unmounting.
+void free_tree_log(device_extension* Vcb) {
+    while (!IsListEmpty(&Vcb->tree_log_roots)) {
+        free_log_root(CONTAINING_RECORD(RemoveHeadList(&Vcb->tree_log_roots), log_root, list_entry), NULL);
+    }
+
+    while (!IsListEmpty(&Vcb->tree_log_blocks)) {
+        ExFreePool(CONTAINING_RECORD(RemoveHeadList(&Vcb->tree_log_blocks), log_block, list_entry));
+    }
+
+    ExDeleteResourceLite(&Vcb->tree_log_lock);
+}
+
+// Called at the start of a commit, with the tree lock held exclusively.
+void drop_tree_log(device_extension* Vcb) {
+    Vcb->tree_log_failed = false;
+
+    if (IsListEmpty(&Vcb->tree_log_roots) && IsListEmpty(&Vcb->tree_log_blocks))
+        return;
+
+    while (!IsListEmpty(&Vcb->tree_log_roots)) {
+        free_log_root(CONTAINING_RECORD(RemoveHeadList(&Vcb->tree_log_roots), log_root, list_entry), &Vcb->tree_log_blocks);
+    }
+
+    ExAcquireResourceSharedLite(&Vcb->chunk_lock, true);
+
+    free_log_blocks(Vcb, &Vcb->tree_log_blocks);
+
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+}
+
+// Log blocks have to be somewhere the last commit knows about, so we avoid chunks that have only
+// just been created, as well as anything that's being balanced.
+static NTSTATUS alloc_log_block(device_extension* Vcb, log_block** plb) {
+    LIST_ENTRY* le;
+    log_block* lb;
+
+    lb = ExAllocatePoolWithTag(PagedPool, sizeof(log_block), ALLOC_TAG);
+    if (!lb) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ExAcquireResourceSharedLite(&Vcb->chunk_lock, true);
+
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+
+        if (c->chunk_item->type & BLOCK_FLAG_METADATA && !c->created && !c->readonly && !c->reloc) {
+            acquire_chunk_lock(c, Vcb);
+
+            if (find_metadata_address_in_chunk(Vcb, c, &lb->address)) {
+                space_list_subtract(c, lb->address, Vcb->superblock.node_size, NULL);
+
+                release_chunk_lock(c, Vcb);
+                ExReleaseResourceLite(&Vcb->chunk_lock);
+
+                *plb = lb;
+
+                return STATUS_SUCCESS;
+            }
+
+            release_chunk_lock(c, Vcb);
+        }
+
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+
+    ExFreePool(lb);
+
+    WARN("could not find space for tree log\n");
+
+    return STATUS_DISK_FULL;
+}
+
+// If we manage to allocate a block, *plb gets set even if something goes wrong afterwards, so that
+// the caller can keep track of it.
+static NTSTATUS finish_log_block(log_writer* lw, uint8_t* data, uint32_t num_items, uint8_t level, log_block** plb) {
+    NTSTATUS Status;
+    device_extension* Vcb = lw->Vcb;
+    tree_header* th = (tree_header*)data;
+    tree_write* tw;
+    LIST_ENTRY* le;
+
+    Status = alloc_log_block(Vcb, plb);
+    if (!NT_SUCCESS(Status)) {
+        ExFreePool(data);
+        return Status;
+    }
+
+    th->fs_uuid = Vcb->superblock.metadata_uuid;
+    th->address = (*plb)->address;
+    th->flags = HEADER_FLAG_WRITTEN | HEADER_FLAG_MIXED_BACKREF;
+    th->chunk_tree_uuid = lw->chunk_tree_uuid;
+    th->generation = Vcb->superblock.generation;
+    th->tree_id = BTRFS_ROOT_TREE_LOG;
+    th->num_items = num_items;
+    th->level = level;
+
+    calc_tree_checksum(Vcb, th);
+
+    tw = ExAllocatePoolWithTag(PagedPool, sizeof(tree_write), ALLOC_TAG);
+    if (!tw) {
+        ERR("out of memory\n");
+        ExFreePool(data);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    tw->address = (*plb)->address;
+    tw->length = Vcb->superblock.node_size;
+    tw->data = data;
+    tw->allocated = false;
+
+    le = lw->tree_writes.Flink;
+    while (le != &lw->tree_writes) {
+        tree_write* tw2 = CONTAINING_RECORD(le, tree_write, list_entry);
+
+        if (tw2->address > tw->address)
+            break;
+
+        le = le->Flink;
+    }
+
+    InsertHeadList(le->Blink, &tw->list_entry);
+
+    return STATUS_SUCCESS;
+}
+
+// Writes out a leaf that's changed, to somewhere new.
+static NTSTATUS write_log_leaf(log_writer* lw, log_leaf* ll) {
+    device_extension* Vcb = lw->Vcb;
+    uint8_t* data;
+    uint8_t* body;
+    uint8_t* dataptr;
+    leaf_node* itemptr;
+    uint32_t n = 0;
+    LIST_ENTRY* le;
+
+    data = ExAllocatePoolWithTag(NonPagedPool, Vcb->superblock.node_size, ALLOC_TAG);
+    if (!data) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(data, Vcb->superblock.node_size);
+
+    body = data + sizeof(tree_header);
+    itemptr = (leaf_node*)body;
+    dataptr = data + Vcb->superblock.node_size;
+
+    le = ll->items.Flink;
+    while (le != &ll->items) {
+        log_item* li = CONTAINING_RECORD(le, log_item, list_entry);
+
+        dataptr -= li->size;
+
+        itemptr[n].key = li->key;
+        itemptr[n].offset = (uint32_t)(dataptr - body);
+        itemptr[n].size = li->size;
+
+        if (li->size > 0)
+            RtlCopyMemory(dataptr, li->data, li->size);
+
+        n++;
+
+        le = le->Flink;
+    }
+
+    return finish_log_block(lw, data, n, 0, &ll->block);
+}
+
+// Builds nodes on top of the blocks in nodes, which get overwritten, until there's only one block
+// left, which becomes the root. The new blocks go on blocks.
+static NTSTATUS write_log_nodes(log_writer* lw, log_node* nodes, ULONG num_nodes, LIST_ENTRY* blocks, uint64_t* address, uint8_t* level) {
+    NTSTATUS Status;
+    device_extension* Vcb = lw->Vcb;
+    ULONG per_node = (Vcb->superblock.node_size - sizeof(tree_header)) / sizeof(internal_node);
+    uint8_t lvl = 0;
+
+    while (num_nodes > 1) {
+        ULONG i = 0, j = 0;
+
+        lvl++;
+
+        while (i < num_nodes) {
+            uint8_t* data;
+            internal_node* itemptr;
+            KEY firstkey = nodes[i].key;
+            log_block* lb = NULL;
+            uint32_t n = 0;
+
+            data = ExAllocatePoolWithTag(NonPagedPool, Vcb->superblock.node_size, ALLOC_TAG);
+            if (!data) {
+                ERR("out of memory\n");
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            RtlZeroMemory(data, Vcb->superblock.node_size);
+
+            itemptr = (internal_node*)(data + sizeof(tree_header));
+
+            while (i < num_nodes && n < per_node) {
+                itemptr[n].key = nodes[i].key;
+                itemptr[n].address = nodes[i].address;
+                itemptr[n].generation = Vcb->superblock.generation;
+
+                n++;
+                i++;
+            }
+
+            Status = finish_log_block(lw, data, n, lvl, &lb);
+
+            if (lb)
+                InsertTailList(blocks, &lb->list_entry);
+
+            if (!NT_SUCCESS(Status))
+                return Status;
+
+            // j is always behind i, so this doesn't trample anything we still need
+            nodes[j].key = firstkey;
+            nodes[j].address = lb->address;
+
+            j++;
+        }
+
+        num_nodes = j;
+    }
+
+    *address = nodes[0].address;
+    *level = lvl;
+
+    return STATUS_SUCCESS;
+}
+
+// Writes any leaves in the list that have changed, and new nodes above them.
+static NTSTATUS write_log_leaves(log_writer* lw, LIST_ENTRY* leaves, LIST_ENTRY* blocks, uint64_t* address, uint8_t* level) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+    log_node* nodes;
+    ULONG num_nodes = 0;
+
+    le = leaves->Flink;
+    while (le != leaves) {
+        log_leaf* ll = CONTAINING_RECORD(le, log_leaf, list_entry);
+
+        if (!ll->block) {
+            Status = write_log_leaf(lw, ll);
+            if (!NT_SUCCESS(Status))
+                return Status;
+        }
+
+        num_nodes++;
+
+        le = le->Flink;
+    }
+
+    if (num_nodes == 0) {
+        ERR("no leaves in log tree\n");
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    nodes = ExAllocatePoolWithTag(PagedPool, sizeof(log_node) * num_nodes, ALLOC_TAG);
+    if (!nodes) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    num_nodes = 0;
+
+    le = leaves->Flink;
+    while (le != leaves) {
+        log_leaf* ll = CONTAINING_RECORD(le, log_leaf, list_entry);
+
+        nodes[num_nodes].key = CONTAINING_RECORD(ll->items.Flink, log_item, list_entry)->key;
+        nodes[num_nodes].address = ll->block->address;
+        num_nodes++;
+
+        le = le->Flink;
+    }
+
+    Status = write_log_nodes(lw, nodes, num_nodes, blocks, address, level);
+
+    ExFreePool(nodes);
+
+    return Status;
+}
+
+// Writes the log root tree, which has a ROOT_ITEM for each of the subvolumes' logs. It's small
+// enough that we don't bother keeping it around, and write the whole thing each time.
+static NTSTATUS write_log_root_tree(log_writer* lw, LIST_ENTRY* old_blocks, uint64_t* address, uint8_t* level) {
+    NTSTATUS Status;
+    device_extension* Vcb = lw->Vcb;
+    ULONG space = Vcb->superblock.node_size - sizeof(tree_header);
+    LIST_ENTRY leaves, *le;
+    log_leaf* ll = NULL;
+
+    move_list(old_blocks, &Vcb->tree_log_blocks);
+
+    InitializeListHead(&leaves);
+
+    le = Vcb->tree_log_roots.Flink;
+    while (le != &Vcb->tree_log_roots) {
+        log_root* lr = CONTAINING_RECORD(le, log_root, list_entry);
+        log_item* li;
+        ROOT_ITEM* ri;
+        LIST_ENTRY* le2;
+        uint64_t num_blocks = 0;
+
+        if (!ll || ll->size + sizeof(leaf_node) + sizeof(ROOT_ITEM) > space) {
+            ll = alloc_log_leaf();
+            if (!ll) {
+                Status = STATUS_INSUFFICIENT_RESOURCES;
+                goto end;
+            }
+
+            InsertTailList(&leaves, &ll->list_entry);
+        }
+
+        li = add_log_item(&ll->items, BTRFS_ROOT_TREE_LOG, TYPE_ROOT_ITEM, lr->subvol->id, NULL, sizeof(ROOT_ITEM));
+        if (!li) {
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
+
+        ll->size += sizeof(leaf_node) + sizeof(ROOT_ITEM);
+
+        le2 = lr->leaves.Flink;
+        while (le2 != &lr->leaves) {
+            num_blocks++;
+            le2 = le2->Flink;
+        }
+
+        le2 = lr->nodes.Flink;
+        while (le2 != &lr->nodes) {
+            num_blocks++;
+            le2 = le2->Flink;
+        }
+
+        ri = (ROOT_ITEM*)li->data;
+        RtlZeroMemory(ri, sizeof(ROOT_ITEM));
+
+        // the same as Linux puts in
+        ri->inode.generation = 1;
+        ri->inode.st_size = 3;
+        ri->inode.st_blocks = Vcb->superblock.node_size;
+        ri->inode.st_nlink = 1;
+        ri->inode.st_mode = 040755;
+        ri->generation = Vcb->superblock.generation;
+        ri->objid = SUBVOL_ROOT_INODE;
+        ri->block_number = lr->address;
+        ri->bytes_used = num_blocks * Vcb->superblock.node_size;
+        ri->num_references = 1;
+        ri->root_level = lr->level;
+        ri->generation2 = Vcb->superblock.generation;
+
+        le = le->Flink;
+    }
+
+    Status = write_log_leaves(lw, &leaves, &Vcb->tree_log_blocks, address, level);
+
+end:
+    while (!IsListEmpty(&leaves)) {
+        free_log_leaf(CONTAINING_RECORD(RemoveHeadList(&leaves), log_leaf, list_entry), &Vcb->tree_log_blocks);
+    }
+
+    return Status;
+}
+
+static void dirty_log_leaf(log_leaf* ll, LIST_ENTRY* old_blocks) {
+    if (ll->block) {
+        InsertTailList(old_blocks, &ll->block->list_entry);
+        ll->block = NULL;
+    }
+}
+
+// Moves the end of a leaf that's got too big into a new leaf after it.
+static NTSTATUS split_log_leaf(device_extension* Vcb, log_leaf* ll) {
+    ULONG space = Vcb->superblock.node_size - sizeof(tree_header);
+    log_leaf* ll2;
+
+    ll2 = alloc_log_leaf();
+    if (!ll2)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    InsertHeadList(&ll->list_entry, &ll2->list_entry);
+
+    while (ll->size > ll2->size && ll->items.Flink != ll->items.Blink) {
+        log_item* li = CONTAINING_RECORD(ll->items.Blink, log_item, list_entry);
+
+        if (ll2->size + sizeof(leaf_node) + li->size > space)
+            break;
+
+        RemoveEntryList(&li->list_entry);
+        InsertHeadList(&ll2->items, &li->list_entry);
+
+        ll->size -= sizeof(leaf_node) + li->size;
+        ll2->size += sizeof(leaf_node) + li->size;
+    }
+
+    if (ll->size > space) {
+        WARN("could not split log leaf\n");
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Replaces whatever the subvolume's log had for inode with items. Any leaves that change have their
+// blocks moved to old_blocks, to be freed once the new log has been written.
+static NTSTATUS update_log_root(device_extension* Vcb, log_root* lr, uint64_t inode, LIST_ENTRY* items, LIST_ENTRY* old_blocks) {
+    NTSTATUS Status;
+    ULONG space = Vcb->superblock.node_size - sizeof(tree_header);
+    LIST_ENTRY* le;
+    log_item* last_csum = NULL;
+
+    le = lr->leaves.Flink;
+    while (le != &lr->leaves) {
+        log_leaf* ll = CONTAINING_RECORD(le, log_leaf, list_entry);
+        LIST_ENTRY* le2 = ll->items.Flink;
+
+        le = le->Flink;
+
+        while (le2 != &ll->items) {
+            log_item* li = CONTAINING_RECORD(le2, log_item, list_entry);
+
+            le2 = le2->Flink;
+
+            if (li->inode == inode) {
+                RemoveEntryList(&li->list_entry);
+                ll->size -= sizeof(leaf_node) + li->size;
+                ExFreePool(li);
+
+                dirty_log_leaf(ll, old_blocks);
+            }
+        }
+
+        if (IsListEmpty(&ll->items)) {
+            RemoveEntryList(&ll->list_entry);
+            free_log_leaf(ll, old_blocks);
+        }
+    }
+
+    while (!IsListEmpty(items)) {
+        log_item* li = CONTAINING_RECORD(RemoveHeadList(items), log_item, list_entry);
+        log_leaf* ll = NULL;
+
+        if (sizeof(leaf_node) + li->size > space) {
+            ERR("item (%I64x,%x,%I64x) too large for leaf\n", li->key.obj_id, li->key.obj_type, li->key.offset);
+            ExFreePool(li);
+            return STATUS_INTERNAL_ERROR;
+        }
+
+        // the last leaf that starts before the key, or the first leaf if there isn't one
+
+        le = lr->leaves.Blink;
+        while (le != &lr->leaves) {
+            ll = CONTAINING_RECORD(le, log_leaf, list_entry);
+
+            if (keycmp(CONTAINING_RECORD(ll->items.Flink, log_item, list_entry)->key, li->key) <= 0)
+                break;
+
+            le = le->Blink;
+        }
+
+        if (!ll) {
+            ll = alloc_log_leaf();
+            if (!ll) {
+                ExFreePool(li);
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            InsertTailList(&lr->leaves, &ll->list_entry);
+        }
+
+        le = ll->items.Blink;
+        while (le != &ll->items) {
+            log_item* li2 = CONTAINING_RECORD(le, log_item, list_entry);
+            int cmp = keycmp(li2->key, li->key);
+
+            // If two files share new data, we'd end up with the same checksum item twice.
+            if (cmp == 0) {
+                TRACE("duplicate key (%I64x,%x,%I64x)\n", li->key.obj_id, li->key.obj_type, li->key.offset);
+                ExFreePool(li);
+                return STATUS_NOT_SUPPORTED;
+            } else if (cmp < 0)
+                break;
+
+            le = le->Blink;
+        }
+
+        InsertHeadList(le, &li->list_entry);
+        ll->size += sizeof(leaf_node) + li->size;
+
+        dirty_log_leaf(ll, old_blocks);
+
+        if (ll->size > space) {
+            Status = split_log_leaf(Vcb, ll);
+            if (!NT_SUCCESS(Status))
+                return Status;
+        }
+    }
+
+    // Likewise, checksums for shared data mustn't overlap.
+
+    le = lr->leaves.Flink;
+    while (le != &lr->leaves) {
+        log_leaf* ll = CONTAINING_RECORD(le, log_leaf, list_entry);
+        LIST_ENTRY* le2 = ll->items.Flink;
+
+        while (le2 != &ll->items) {
+            log_item* li = CONTAINING_RECORD(le2, log_item, list_entry);
+
+            if (li->key.obj_id == EXTENT_CSUM_ID && li->key.obj_type == TYPE_EXTENT_CSUM) {
+                if (last_csum && last_csum->key.offset + (((uint64_t)last_csum->size / Vcb->csum_size) << Vcb->sector_shift) > li->key.offset) {
+                    TRACE("overlapping checksums at %I64x\n", li->key.offset);
+                    return STATUS_NOT_SUPPORTED;
+                }
+
+                last_csum = li;
+            }
+
+            le2 = le2->Flink;
+        }
+
+        le = le->Flink;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS log_hole(LIST_ENTRY* items, uint64_t inode, uint64_t start, uint64_t length, uint64_t generation) {
+    uint8_t buf[offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2)];
+    EXTENT_DATA* ed = (EXTENT_DATA*)buf;
+    EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
+
+    ed->generation = generation;
+    ed->decoded_size = length;
+    ed->compression = BTRFS_COMPRESSION_NONE;
+    ed->encryption = BTRFS_ENCRYPTION_NONE;
+    ed->encoding = BTRFS_ENCODING_NONE;
+    ed->type = EXTENT_TYPE_REGULAR;
+
+    ed2->address = 0;
+    ed2->size = 0;
+    ed2->offset = 0;
+    ed2->num_bytes = length;
+
+    if (!add_log_item(items, inode, TYPE_EXTENT_DATA, start, ed, sizeof(buf)))
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS log_csums(device_extension* Vcb, LIST_ENTRY* items, uint64_t inode, uint64_t address, ULONG length, uint8_t* csum) {
+    while (length > 0) {
+        ULONG il = min(length, MAX_CSUM_SIZE / Vcb->csum_size);
+        log_item* li;
+
+        li = add_log_item(items, EXTENT_CSUM_ID, TYPE_EXTENT_CSUM, address, csum, (uint16_t)(il * Vcb->csum_size));
+        if (!li)
+            return STATUS_INSUFFICIENT_RESOURCES;
+
+        li->inode = inode;
+
+        address += (uint64_t)il << Vcb->sector_shift;
+        csum += il * Vcb->csum_size;
+        length -= il;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Turns fcb into log items, the same way flush_fcb would write it to its subvolume. The caller needs
+// to hold the fcb exclusively, with any delayed allocations already flushed.
+static NTSTATUS log_fcb(fcb* fcb, LIST_ENTRY* items) {
+    NTSTATUS Status;
+    device_extension* Vcb = fcb->Vcb;
+    LIST_ENTRY* le;
+    uint64_t last_end = 0;
+    bool extents_inline = false;
+    bool no_holes = Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_NO_HOLES;
+
+    if (!add_log_item(items, fcb->inode, TYPE_INODE_ITEM, 0, &fcb->inode_item, sizeof(INODE_ITEM))) {
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    le = fcb->extents.Flink;
+    while (le != &fcb->extents) {
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+
+        if (!ext->ignore) {
+            EXTENT_DATA* ed = &ext->extent_data;
+
+            if (!no_holes && ext->offset > last_end) {
+                Status = log_hole(items, fcb->inode, last_end, ext->offset - last_end, Vcb->superblock.generation);
+                if (!NT_SUCCESS(Status))
+                    goto end;
+            }
+
+            if (!add_log_item(items, fcb->inode, TYPE_EXTENT_DATA, ext->offset, ed, ext->datalen)) {
+                Status = STATUS_INSUFFICIENT_RESOURCES;
+                goto end;
+            }
+
+            if (ed->type == EXTENT_TYPE_INLINE) {
+                extents_inline = true;
+                last_end = ext->offset + ed->decoded_size;
+            } else {
+                EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
+
+                last_end = ext->offset + ed2->num_bytes;
+
+                if (ext->inserted && ed2->size != 0) {
+                    chunk* c = get_chunk_from_address(Vcb, ed2->address);
+
+                    // The last commit needs to know about the chunk, and RAID5 and RAID6
+                    // data might still be sitting in a partial stripe.
+                    if (!c || c->created || c->chunk_item->type & (BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6)) {
+                        Status = STATUS_NOT_SUPPORTED;
+                        goto end;
+                    }
+
+                    if (ext->csum && ed->type == EXTENT_TYPE_REGULAR) {
+                        if (ed->compression == BTRFS_COMPRESSION_NONE)
+                            Status = log_csums(Vcb, items, fcb->inode, ed2->address + ed2->offset, (ULONG)(ed2->num_bytes >> Vcb->sector_shift), ext->csum);
+                        else
+                            Status = log_csums(Vcb, items, fcb->inode, ed2->address, (ULONG)(ed2->size >> Vcb->sector_shift), ext->csum);
+
+                        if (!NT_SUCCESS(Status))
+                            goto end;
+                    }
+                }
+            }
+        }
+
+        le = le->Flink;
+    }
+
+    if (!no_holes && !extents_inline && sector_align(fcb->inode_item.st_size, Vcb->superblock.sector_size) > last_end) {
+        Status = log_hole(items, fcb->inode, last_end, sector_align(fcb->inode_item.st_size, Vcb->superblock.sector_size) - last_end, Vcb->superblock.generation);
+        if (!NT_SUCCESS(Status))
+            goto end;
+    }
+
+    return STATUS_SUCCESS;
+
+end:
+    free_log_items(items);
+
+    return Status;
+}
+
+// Puts items in the log in place of anything we had for the inode before, and writes out the leaves
+// that have changed, the log root tree, and a superblock pointing to them. The caller needs to hold
+// the tree lock shared and tree_log_lock exclusively.
+static NTSTATUS write_tree_log(device_extension* Vcb, root* subvol, uint64_t inode, LIST_ENTRY* items, PIRP Irp) {
+    NTSTATUS Status;
+    log_writer lw;
+    log_root* lr = NULL;
+    LIST_ENTRY *le, old_blocks;
+    uint64_t root_address;
+    uint8_t root_level;
+    KEY searchkey;
+    traverse_ptr tp;
+    superblock* sb;
+
+    // If we couldn't write the log last time, the superblock might still point to blocks we've
+    // forgotten about, so we have to wait for the commit.
+    if (Vcb->tree_log_failed) {
+        free_log_items(items);
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    lw.Vcb = Vcb;
+    InitializeListHead(&lw.tree_writes);
+
+    // Our headers need the chunk tree's UUID, which we can get from any of its nodes.
+
+    searchkey.obj_id = 0;
+    searchkey.obj_type = 0;
+    searchkey.offset = 0;
+
+    Status = find_item(Vcb, Vcb->chunk_root, &tp, &searchkey, false, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08lx\n", Status);
+        free_log_items(items);
+        return Status;
+    }
+
+    lw.chunk_tree_uuid = tp.tree->header.chunk_tree_uuid;
+
+    le = Vcb->tree_log_roots.Flink;
+    while (le != &Vcb->tree_log_roots) {
+        log_root* lr2 = CONTAINING_RECORD(le, log_root, list_entry);
+
+        if (lr2->subvol->id == subvol->id) {
+            lr = lr2;
+            break;
+        } else if (lr2->subvol->id > subvol->id)
+            break;
+
+        le = le->Flink;
+    }
+
+    if (!lr) {
+        lr = ExAllocatePoolWithTag(PagedPool, sizeof(log_root), ALLOC_TAG);
+        if (!lr) {
+            ERR("out of memory\n");
+            free_log_items(items);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        lr->subvol = subvol;
+        InitializeListHead(&lr->leaves);
+        InitializeListHead(&lr->nodes);
+        lr->address = 0;
+        lr->level = 0;
+
+        InsertHeadList(le->Blink, &lr->list_entry);
+    }
+
+    // Anything we replace stays where it is until the superblocks have been written, so that what's
+    // on disk stays valid.
+
+    InitializeListHead(&old_blocks);
+
+    Status = update_log_root(Vcb, lr, inode, items, &old_blocks);
+    free_log_items(items);
+
+    if (!NT_SUCCESS(Status)) {
+        if (Status != STATUS_NOT_SUPPORTED)
+            ERR("update_log_root returned %08lx\n", Status);
+
+        goto end;
+    }
+
+    move_list(&old_blocks, &lr->nodes);
+
+    Status = write_log_leaves(&lw, &lr->leaves, &lr->nodes, &lr->address, &lr->level);
+    if (!NT_SUCCESS(Status)) {
+        ERR("write_log_leaves returned %08lx\n", Status);
+        goto end;
+    }
+
+    Status = write_log_root_tree(&lw, &old_blocks, &root_address, &root_level);
+    if (!NT_SUCCESS(Status)) {
+        ERR("write_log_root_tree returned %08lx\n", Status);
+        goto end;
+    }
+
+    Status = do_tree_writes(Vcb, &lw.tree_writes, false);
+    if (!NT_SUCCESS(Status)) {
+        ERR("do_tree_writes returned %08lx\n", Status);
+        goto end;
+    }
+
+    // The file's data and the log both have to be on disk before the superblocks are.
+
+    if (!Vcb->options.no_barrier)
+        flush_disk_caches(Vcb);
+
+    sb = ExAllocatePoolWithTag(PagedPool, sizeof(superblock), ALLOC_TAG);
+    if (!sb) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    RtlCopyMemory(sb, &Vcb->tree_log_sb, sizeof(superblock));
+    sb->log_tree_addr = root_address;
+    sb->log_root_level = root_level;
+
+    Status = write_superblocks2(Vcb, sb);
+
+    ExFreePool(sb);
+
+    if (!NT_SUCCESS(Status))
+        ERR("write_superblocks2 returned %08lx\n", Status);
+
+end:
+    while (!IsListEmpty(&lw.tree_writes)) {
+        tree_write* tw = CONTAINING_RECORD(RemoveHeadList(&lw.tree_writes), tree_write, list_entry);
+
+        if (tw->data)
+            ExFreePool(tw->data);
+
+        ExFreePool(tw);
+    }
+
+    if (NT_SUCCESS(Status)) {
+        ExAcquireResourceSharedLite(&Vcb->chunk_lock, true);
+        free_log_blocks(Vcb, &old_blocks);
+        ExReleaseResourceLite(&Vcb->chunk_lock);
+    } else {
+        // Our copy of the log no longer matches what's on disk, so we throw it away. The blocks
+        // stay allocated until the next commit, as the superblock could be pointing to any of them.
+
+        while (!IsListEmpty(&Vcb->tree_log_roots)) {
+            free_log_root(CONTAINING_RECORD(RemoveHeadList(&Vcb->tree_log_roots), log_root, list_entry), &Vcb->tree_log_blocks);
+        }
+
+        move_list(&Vcb->tree_log_blocks, &old_blocks);
+
+        Vcb->tree_log_failed = true;
+    }
+
+    return Status;
+}
+
+// Whether everything that's changed about fcb will fit in the log - if not, we have to commit.
+static bool can_log_fcb(fcb* fcb, PIRP Irp) {
+    NTSTATUS Status;
+    device_extension* Vcb = fcb->Vcb;
+    LIST_ENTRY* le;
+    bool dirty_fileref = false;
+    KEY searchkey;
+    traverse_ptr tp;
+
+    if (fcb->ads || fcb->deleted || fcb->created || fcb->type != BTRFS_TYPE_FILE || fcb->subvol == Vcb->root_root)
+        return false;
+
+    if (fcb->inode_item.st_nlink == 0 || fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE)
+        return false;
+
+    if (fcb->sd_dirty || fcb->atts_changed || fcb->reparse_xattr_changed || fcb->ea_changed || fcb->prop_compression_changed ||
+        fcb->xattrs_changed || fcb->case_sensitive_set != fcb->case_sensitive)
+        return false;
+
+    // a subvolume created since the last commit
+    if (fcb->subvol->root_item.otransid == Vcb->superblock.generation)
+        return false;
+
+    // We don't log INODE_REFs or DIR_ITEMs, so none of the file's names can have changed.
+
+    ExAcquireResourceSharedLite(&Vcb->dirty_filerefs_lock, true);
+
+    le = Vcb->dirty_filerefs.Flink;
+    while (le != &Vcb->dirty_filerefs) {
+        file_ref* fr = CONTAINING_RECORD(le, file_ref, list_entry_dirty);
+
+        if (fr->fcb == fcb) {
+            dirty_fileref = true;
+            break;
+        }
+
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&Vcb->dirty_filerefs_lock);
+
+    if (dirty_fileref)
+        return false;
+
+    // Nor can the link count, or replaying would leave it not matching the file's names.
+
+    searchkey.obj_id = fcb->inode;
+    searchkey.obj_type = TYPE_INODE_ITEM;
+    searchkey.offset = 0;
+
+    Status = find_item(Vcb, fcb->subvol, &tp, &searchkey, false, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08lx\n", Status);
+        return false;
+    }
+
+    if (keycmp(tp.item->key, searchkey) || tp.item->size < sizeof(INODE_ITEM))
+        return false;
+
+    if (((INODE_ITEM*)tp.item->data)->st_nlink != fcb->inode_item.st_nlink)
+        return false;
+
+    return true;
+}
+
+// Called from drv_flush_buffers, once the cache has been flushed.
+NTSTATUS tree_log_fsync(fcb* fcb, file_ref* fileref, PIRP Irp) {
+    NTSTATUS Status;
+    device_extension* Vcb = fcb->Vcb;
+    LIST_ENTRY rollback, items;
+
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, true);
+
+    ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
+
+    if (!fcb->dirty && IsListEmpty(&fcb->delalloc) && (!fileref || !fileref->dirty)) { // nothing to do
+        ExReleaseResourceLite(fcb->Header.Resource);
+        Status = STATUS_SUCCESS;
+        goto end;
+    }
+
+    if (!can_log_fcb(fcb, Irp)) {
+        ExReleaseResourceLite(fcb->Header.Resource);
+        goto commit;
+    }
+
+    InitializeListHead(&rollback);
+
+    Status = delalloc_flush_fcb(fcb, Irp, &rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("delalloc_flush_fcb returned %08lx\n", Status);
+        do_rollback(Vcb, &rollback);
+        ExReleaseResourceLite(fcb->Header.Resource);
+        goto end;
+    }
+
+    clear_rollback(&rollback);
+
+    Status = load_fcb_extents(Vcb, fcb, 0, 0xffffffffffffffff, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("load_fcb_extents returned %08lx\n", Status);
+        ExReleaseResourceLite(fcb->Header.Resource);
+        goto end;
+    }
+
+    InitializeListHead(&items);
+
+    Status = log_fcb(fcb, &items);
+
+    ExReleaseResourceLite(fcb->Header.Resource);
+
+    if (!NT_SUCCESS(Status)) {
+        if (Status != STATUS_NOT_SUPPORTED)
+            ERR("log_fcb returned %08lx\n", Status);
+
+        goto commit;
+    }
+
+    ExAcquireResourceExclusiveLite(&Vcb->tree_log_lock, true);
+
+    Status = write_tree_log(Vcb, fcb->subvol, fcb->inode, &items, Irp);
+
+    ExReleaseResourceLite(&Vcb->tree_log_lock);
+
+    if (NT_SUCCESS(Status))
+        goto end;
+
+    if (Status != STATUS_NOT_SUPPORTED)
+        WARN("write_tree_log returned %08lx, doing full commit instead\n", Status);
+
+commit:
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    ExAcquireResourceExclusiveLite(&Vcb->tree_lock, true);
+
+    if (Vcb->need_write || Vcb->tree_log_failed)
+        Status = do_write(Vcb, Irp);
+    else
+        Status = STATUS_SUCCESS;
+
+    free_trees(Vcb);
+
+    if (!NT_SUCCESS(Status))
+        ERR("do_write returned %08lx\n", Status);
+
+end:
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    return Status;
+}
+
+// Reads a log tree, adding its blocks to blocks and the items in its leaves to items.
+static NTSTATUS read_log_tree(device_extension* Vcb, uint64_t address, uint64_t generation, uint8_t level, LIST_ENTRY* items,
+                              LIST_ENTRY* blocks, PIRP Irp) {
+    NTSTATUS Status;
+    uint8_t* buf;
+    tree_header* th;
+    log_block* lb;
+    ULONG i;
+
+    if (level > 7) {
+        ERR("tree log level %u is too deep\n", level);
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    buf = ExAllocatePoolWithTag(NonPagedPool, Vcb->superblock.node_size, ALLOC_TAG);
+    if (!buf) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Status = read_data(Vcb, address, Vcb->superblock.node_size, NULL, true, buf, NULL, NULL, Irp, generation, false, NormalPagePriority);
+    if (!NT_SUCCESS(Status)) {
+        ERR("read_data returned %08lx\n", Status);
+        goto end;
+    }
+
+    th = (tree_header*)buf;
+
+    if (th->level != level || th->tree_id != BTRFS_ROOT_TREE_LOG) {
+        ERR("tree log block %I64x had level %u and owner %I64x, expected %u and %I64x\n", address, th->level, th->tree_id, level, BTRFS_ROOT_TREE_LOG);
+        Status = STATUS_INTERNAL_ERROR;
+        goto end;
+    }
+
+    lb = ExAllocatePoolWithTag(PagedPool, sizeof(log_block), ALLOC_TAG);
+    if (!lb) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    lb->address = address;
+    InsertTailList(blocks, &lb->list_entry);
+
+    if (level == 0) {
+        leaf_node* ln = (leaf_node*)(buf + sizeof(tree_header));
+
+        if (th->num_items > (Vcb->superblock.node_size - sizeof(tree_header)) / sizeof(leaf_node)) {
+            ERR("tree log block %I64x had %u items\n", address, th->num_items);
+            Status = STATUS_INTERNAL_ERROR;
+            goto end;
+        }
+
+        for (i = 0; i < th->num_items; i++) {
+            if (ln[i].offset + ln[i].size > Vcb->superblock.node_size - sizeof(tree_header) || ln[i].size > 0xffff) {
+                ERR("tree log block %I64x: item %lu was out of bounds\n", address, i);
+                Status = STATUS_INTERNAL_ERROR;
+                goto end;
+            }
+
+            if (!add_log_item(items, ln[i].key.obj_id, ln[i].key.obj_type, ln[i].key.offset, buf + sizeof(tree_header) + ln[i].offset, (uint16_t)ln[i].size)) {
+                Status = STATUS_INSUFFICIENT_RESOURCES;
+                goto end;
+            }
+        }
+    } else {
+        internal_node* in = (internal_node*)(buf + sizeof(tree_header));
+
+        if (th->num_items > (Vcb->superblock.node_size - sizeof(tree_header)) / sizeof(internal_node)) {
+            ERR("tree log block %I64x had %u items\n", address, th->num_items);
+            Status = STATUS_INTERNAL_ERROR;
+            goto end;
+        }
+
+        for (i = 0; i < th->num_items; i++) {
+            Status = read_log_tree(Vcb, in[i].address, in[i].generation, level - 1, items, blocks, Irp);
+            if (!NT_SUCCESS(Status))
+                goto end;
+        }
+    }
+
+    Status = STATUS_SUCCESS;
+
+end:
+    ExFreePool(buf);
+
+    return Status;
+}
+
+// Checks that everything in the log is something we know how to replay. Linux logs things like
+// renames and new directory entries too - if it's left one of those, we leave it for Linux.
+static bool check_log_items(device_extension* Vcb, LIST_ENTRY* items) {
+    LIST_ENTRY* le;
+    uint64_t last_inode = 0;
+
+    le = items->Flink;
+    while (le != items) {
+        log_item* li = CONTAINING_RECORD(le, log_item, list_entry);
+
+        if (li->key.obj_id == EXTENT_CSUM_ID) {
+            if (li->key.obj_type != TYPE_EXTENT_CSUM || li->size % Vcb->csum_size != 0)
+                return false;
+        } else if (li->key.obj_type == TYPE_INODE_ITEM) {
+            if (li->size < sizeof(INODE_ITEM))
+                return false;
+
+            last_inode = li->key.obj_id;
+        } else if (li->key.obj_type == TYPE_EXTENT_DATA) {
+            EXTENT_DATA* ed = (EXTENT_DATA*)li->data;
+
+            if (li->key.obj_id != last_inode || li->size < offsetof(EXTENT_DATA, data[0]))
+                return false;
+
+            if (ed->type != EXTENT_TYPE_INLINE && li->size < offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2))
+                return false;
+        } else
+            return false;
+
+        le = le->Flink;
+    }
+
+    return true;
+}
+
+// Returns the checksums for [address, address + length) if the log has all of them, or NULL if not.
+static void* get_log_csum(device_extension* Vcb, LIST_ENTRY* items, uint64_t address, uint64_t length) {
+    LIST_ENTRY* le;
+    uint8_t* csum;
+    uint64_t found = 0;
+
+    csum = ExAllocatePoolWithTag(PagedPool, (ULONG)((length >> Vcb->sector_shift) * Vcb->csum_size), ALLOC_TAG);
+    if (!csum) {
+        ERR("out of memory\n");
+        return NULL;
+    }
+
+    le = items->Blink;
+    while (le != items) {
+        log_item* li = CONTAINING_RECORD(le, log_item, list_entry);
+        uint64_t end;
+
+        if (li->key.obj_id != EXTENT_CSUM_ID)
+            break;
+
+        end = li->key.offset + (((uint64_t)li->size / Vcb->csum_size) << Vcb->sector_shift);
+
+        if (li->key.offset < address + length && end > address) {
+            uint64_t s = max(li->key.offset, address);
+            uint64_t e = min(end, address + length);
+
+            RtlCopyMemory(csum + (((s - address) >> Vcb->sector_shift) * Vcb->csum_size),
+                          li->data + (((s - li->key.offset) >> Vcb->sector_shift) * Vcb->csum_size),
+                          (ULONG)(((e - s) >> Vcb->sector_shift) * Vcb->csum_size));
+
+            found += e - s;
+        }
+
+        le = le->Blink;
+    }
+
+    if (found < length) {
+        ExFreePool(csum);
+        return NULL;
+    }
+
+    return csum;
+}
+
+// Takes a reference to a data extent that the log points to. If the extent was allocated after the
+// last commit, the extent tree won't know about it, so we have to claim the space ourselves.
+static NTSTATUS replay_extent_ref(device_extension* Vcb, root* r, uint64_t inode, uint64_t offset, EXTENT_DATA2* ed2, bool no_csum,
+                                  LIST_ENTRY* claimed, PIRP Irp) {
+    NTSTATUS Status;
+    KEY searchkey;
+    traverse_ptr tp;
+    chunk* c;
+    LIST_ENTRY* le;
+    bool found = false;
+
+    c = get_chunk_from_address(Vcb, ed2->address);
+    if (!c) {
+        ERR("get_chunk_from_address(%I64x) failed\n", ed2->address);
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    searchkey.obj_id = ed2->address;
+    searchkey.obj_type = TYPE_EXTENT_ITEM;
+    searchkey.offset = ed2->size;
+
+    Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, false, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08lx\n", Status);
+        return Status;
+    }
+
+    if (!keycmp(tp.item->key, searchkey)) {
+        Status = update_changed_extent_ref(Vcb, c, ed2->address, ed2->size, r->id, inode, offset - ed2->offset, 1, no_csum, false, Irp);
+        if (!NT_SUCCESS(Status))
+            ERR("update_changed_extent_ref returned %08lx\n", Status);
+
+        return Status;
+    }
+
+    le = claimed->Flink;
+    while (le != claimed) {
+        log_block* lb = CONTAINING_RECORD(le, log_block, list_entry);
+
+        if (lb->address == ed2->address) {
+            found = true;
+            break;
+        }
+
+        le = le->Flink;
+    }
+
+    if (!found) {
+        log_block* lb = ExAllocatePoolWithTag(PagedPool, sizeof(log_block), ALLOC_TAG);
+
+        if (!lb) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        lb->address = ed2->address;
+        InsertTailList(claimed, &lb->list_entry);
+
+        acquire_chunk_lock(c, Vcb);
+
+        if (!c->cache_loaded) {
+            Status = load_cache_chunk(Vcb, c, NULL);
+
+            if (!NT_SUCCESS(Status)) {
+                ERR("load_cache_chunk returned %08lx\n", Status);
+                release_chunk_lock(c, Vcb);
+                return Status;
+            }
+        }
+
+        c->used += ed2->size;
+        space_list_subtract(c, ed2->address, ed2->size, NULL);
+
+        release_chunk_lock(c, Vcb);
+    }
+
+    ExAcquireResourceExclusiveLite(&c->changed_extents_lock, true);
+
+    add_changed_extent_ref(c, ed2->address, ed2->size, r->id, inode, offset - ed2->offset, 1, no_csum);
+
+    ExReleaseResourceLite(&c->changed_extents_lock);
+
+    return STATUS_SUCCESS;
+}
+
+// Replaces the extents and inode item of one inode with what's in the log. *ple points to its
+// INODE_ITEM, and gets moved on past its EXTENT_DATAs.
+static NTSTATUS replay_log_inode(device_extension* Vcb, replay_root* rr, LIST_ENTRY** ple, LIST_ENTRY* claimed, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    log_item* ii_item = CONTAINING_RECORD(*ple, log_item, list_entry);
+    INODE_ITEM* ii = (INODE_ITEM*)ii_item->data;
+    uint64_t inode = ii_item->key.obj_id, end = 0;
+    bool no_csum = ii->flags & BTRFS_INODE_NODATASUM, is_inline = false;
+    LIST_ENTRY* le;
+    fcb* fcb;
+
+    TRACE("replaying inode %I64x in subvol %I64x\n", inode, rr->subvol->id);
+
+    acquire_fcb_lock_exclusive(Vcb);
+    Status = open_fcb(Vcb, rr->subvol, inode, 0, NULL, false, NULL, &fcb, PagedPool, Irp);
+    release_fcb_lock(Vcb);
+
+    if (!NT_SUCCESS(Status)) {
+        ERR("open_fcb returned %08lx\n", Status);
+        return Status;
+    }
+
+    Status = load_fcb_extents(Vcb, fcb, 0, 0xffffffffffffffff, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("load_fcb_extents returned %08lx\n", Status);
+        goto end;
+    }
+
+    // The log has all the file's extents, so get rid of everything that's there already.
+
+    le = fcb->extents.Flink;
+    while (le != &fcb->extents) {
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+
+        if (!ext->ignore) {
+            if (ext->extent_data.type == EXTENT_TYPE_INLINE)
+                end = max(end, ext->offset + ext->extent_data.decoded_size);
+            else
+                end = max(end, ext->offset + ((EXTENT_DATA2*)ext->extent_data.data)->num_bytes);
+        }
+
+        le = le->Flink;
+    }
+
+    if (end > 0) {
+        Status = excise_extents(Vcb, fcb, 0, end, Irp, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("excise_extents returned %08lx\n", Status);
+            goto end;
+        }
+    }
+
+    le = (*ple)->Flink;
+    while (le != &rr->items) {
+        log_item* li = CONTAINING_RECORD(le, log_item, list_entry);
+        EXTENT_DATA* ed = (EXTENT_DATA*)li->data;
+        void* csum = NULL;
+
+        if (li->key.obj_id != inode)
+            break;
+
+        if (ed->type == EXTENT_TYPE_INLINE)
+            is_inline = true;
+        else {
+            EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
+
+            if (ed2->size != 0) {
+                Status = replay_extent_ref(Vcb, rr->subvol, inode, li->key.offset, ed2, no_csum, claimed, Irp);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("replay_extent_ref returned %08lx\n", Status);
+                    goto end;
+                }
+
+                if (ed->type == EXTENT_TYPE_REGULAR && !no_csum) {
+                    if (ed->compression == BTRFS_COMPRESSION_NONE)
+                        csum = get_log_csum(Vcb, &rr->items, ed2->address + ed2->offset, ed2->num_bytes);
+                    else
+                        csum = get_log_csum(Vcb, &rr->items, ed2->address, ed2->size);
+                }
+            }
+        }
+
+        Status = add_extent_to_fcb(fcb, li->key.offset, ed, li->size, false, csum, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("add_extent_to_fcb returned %08lx\n", Status);
+            if (csum) ExFreePool(csum);
+            goto end;
+        }
+
+        le = le->Flink;
+    }
+
+    *ple = le;
+
+    RtlCopyMemory(&fcb->inode_item, ii, sizeof(INODE_ITEM));
+
+    if (is_inline)
+        fcb->Header.AllocationSize.QuadPart = fcb->inode_item.st_size;
+    else
+        fcb->Header.AllocationSize.QuadPart = sector_align(fcb->inode_item.st_size, Vcb->superblock.sector_size);
+
+    fcb->Header.FileSize.QuadPart = fcb->inode_item.st_size;
+    fcb->Header.ValidDataLength.QuadPart = fcb->inode_item.st_size;
+
+    fcb->extents_changed = true;
+    fcb->inode_item_changed = true;
+    mark_fcb_dirty(fcb);
+
+    Status = STATUS_SUCCESS;
+
+end:
+    free_fcb(fcb);
+
+    return Status;
+}
+
+// Called while mounting, with the tree lock held exclusively, if the superblock has a log in it.
+// We put everything in the log back, and then commit straight away.
+NTSTATUS replay_tree_log(device_extension* Vcb, PIRP Irp) {
+    NTSTATUS Status;
+    LIST_ENTRY rootitems, blocks, roots, claimed, rollback, *le;
+
+    InitializeListHead(&rootitems);
+    InitializeListHead(&blocks);
+    InitializeListHead(&roots);
+    InitializeListHead(&claimed);
+    InitializeListHead(&rollback);
+
+    Status = read_log_tree(Vcb, Vcb->superblock.log_tree_addr, Vcb->superblock.generation, Vcb->superblock.log_root_level, &rootitems, &blocks, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("read_log_tree returned %08lx\n", Status);
+        goto end;
+    }
+
+    le = rootitems.Flink;
+    while (le != &rootitems) {
+        log_item* li = CONTAINING_RECORD(le, log_item, list_entry);
+        ROOT_ITEM* ri = (ROOT_ITEM*)li->data;
+        replay_root* rr;
+        LIST_ENTRY* le2;
+
+        if (li->key.obj_id != BTRFS_ROOT_TREE_LOG || li->key.obj_type != TYPE_ROOT_ITEM || li->size < offsetof(ROOT_ITEM, root_level) + sizeof(uint8_t)) {
+            ERR("unexpected item (%I64x,%x,%I64x) in log root tree\n", li->key.obj_id, li->key.obj_type, li->key.offset);
+            Status = STATUS_INTERNAL_ERROR;
+            goto end;
+        }
+
+        rr = ExAllocatePoolWithTag(PagedPool, sizeof(replay_root), ALLOC_TAG);
+        if (!rr) {
+            ERR("out of memory\n");
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
+
+        rr->subvol = NULL;
+        InitializeListHead(&rr->items);
+        InsertTailList(&roots, &rr->list_entry);
+
+        le2 = Vcb->roots.Flink;
+        while (le2 != &Vcb->roots) {
+            root* r = CONTAINING_RECORD(le2, root, list_entry);
+
+            if (r->id == li->key.offset) {
+                rr->subvol = r;
+                break;
+            }
+
+            le2 = le2->Flink;
+        }
+
+        if (!rr->subvol) {
+            ERR("tree log refers to unknown subvol %I64x\n", li->key.offset);
+            Status = STATUS_INTERNAL_ERROR;
+            goto end;
+        }
+
+        Status = read_log_tree(Vcb, ri->block_number, ri->generation, ri->root_level, &rr->items, &blocks, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("read_log_tree returned %08lx\n", Status);
+            goto end;
+        }
+
+        if (!check_log_items(Vcb, &rr->items)) {
+            ERR("tree log for subvol %I64x has items we don't know how to replay\n", rr->subvol->id);
+            Status = STATUS_NOT_SUPPORTED;
+            goto end;
+        }
+
+        le = le->Flink;
+    }
+
+    // Make sure nothing gets allocated on top of the log before we've committed.
+
+    le = blocks.Flink;
+    while (le != &blocks) {
+        log_block* lb = CONTAINING_RECORD(le, log_block, list_entry);
+        chunk* c = get_chunk_from_address(Vcb, lb->address);
+
+        if (!c) {
+            ERR("get_chunk_from_address(%I64x) failed\n", lb->address);
+            Status = STATUS_INTERNAL_ERROR;
+            goto end;
+        }
+
+        acquire_chunk_lock(c, Vcb);
+
+        if (!c->cache_loaded) {
+            Status = load_cache_chunk(Vcb, c, NULL);
+
+            if (!NT_SUCCESS(Status)) {
+                ERR("load_cache_chunk returned %08lx\n", Status);
+                release_chunk_lock(c, Vcb);
+                goto end;
+            }
+        }
+
+        space_list_subtract(c, lb->address, Vcb->superblock.node_size, NULL);
+
+        release_chunk_lock(c, Vcb);
+
+        le = le->Flink;
+    }
+
+    // the commit gives these back
+    move_list(&Vcb->tree_log_blocks, &blocks);
+
+    le = roots.Flink;
+    while (le != &roots) {
+        replay_root* rr = CONTAINING_RECORD(le, replay_root, list_entry);
+        LIST_ENTRY* le2 = rr->items.Flink;
+
+        while (le2 != &rr->items) {
+            log_item* li = CONTAINING_RECORD(le2, log_item, list_entry);
+
+            if (li->key.obj_id == EXTENT_CSUM_ID)
+                break;
+
+            Status = replay_log_inode(Vcb, rr, &le2, &claimed, Irp, &rollback);
+            if (!NT_SUCCESS(Status)) {
+                ERR("replay_log_inode returned %08lx\n", Status);
+                goto end;
+            }
+        }
+
+        le = le->Flink;
+    }
+
+    clear_rollback(&rollback);
+
+    Vcb->superblock.log_tree_addr = 0;
+    Vcb->superblock.log_root_level = 0;
+
+    Status = do_write(Vcb, Irp);
+
+    free_trees(Vcb);
+
+    if (!NT_SUCCESS(Status))
+        ERR("do_write returned %08lx\n", Status);
+
+end:
+    if (!NT_SUCCESS(Status))
+        do_rollback(Vcb, &rollback);
+
+    free_log_items(&rootitems);
+
+    while (!IsListEmpty(&blocks)) {
+        ExFreePool(CONTAINING_RECORD(RemoveHeadList(&blocks), log_block, list_entry));
+    }
+
+    while (!IsListEmpty(&claimed)) {
+        ExFreePool(CONTAINING_RECORD(RemoveHeadList(&claimed), log_block, list_entry));
+    }
+
+    while (!IsListEmpty(&roots)) {
+        replay_root* rr = CONTAINING_RECORD(RemoveHeadList(&roots), replay_root, list_entry);
+
+        free_log_items(&rr->items);
+        ExFreePool(rr);
+    }
+
+    return Status;
+}
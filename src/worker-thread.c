@@ -35,7 +35,12 @@ NTSTATUS do_read_job(PIRP Irp) {
     Irp->IoStatus.Information = 0;
 
     if (!ExIsResourceAcquiredSharedLite(fcb->Header.Resource)) {
-        ExAcquireResourceSharedLite(fcb->Header.Resource, true);
+        Status = acquire_fcb_extents(fcb, IrpSp->Parameters.Read.ByteOffset.QuadPart, IrpSp->Parameters.Read.Length, true, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("acquire_fcb_extents returned %08lx\n", Status);
+            goto end;
+        }
+
         acquired_fcb_lock = true;
     }
 
@@ -51,6 +56,7 @@ NTSTATUS do_read_job(PIRP Irp) {
     if (!NT_SUCCESS(Status))
         ERR("do_read returned %08lx\n", Status);
 
+end:
     Irp->IoStatus.Status = Status;
 
     TRACE("read %Iu bytes\n", Irp->IoStatus.Information);
@@ -27,6 +27,7 @@ typedef struct {
 
 _Function_class_(IO_COMPLETION_ROUTINE)
 static NTSTATUS __stdcall write_data_completion(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID conptr);
+static void write_queue_done(device* dev);
 
 static void remove_fcb_extent(fcb* fcb, extent* ext, LIST_ENTRY* rollback) __attribute__((nonnull(1, 2, 3)));
 
@@ -35,10 +36,31 @@ extern tCcCopyWriteEx fCcCopyWriteEx;
 extern tFsRtlUpdateDiskCounters fFsRtlUpdateDiskCounters;
 extern bool diskacc;
 
+// On RAID5 and RAID6, returns the amount of data in each full stripe, or 0 if we're not aligning to them.
+__attribute__((nonnull(1, 2)))
+static uint64_t full_stripe_width(device_extension* Vcb, chunk* c) {
+    if (!Vcb->options.stripe_align)
+        return 0;
+
+    if (c->chunk_item->type & BLOCK_FLAG_RAID5)
+        return (c->chunk_item->num_stripes - 1) * c->chunk_item->stripe_length;
+    else if (c->chunk_item->type & BLOCK_FLAG_RAID6)
+        return (c->chunk_item->num_stripes - 2) * c->chunk_item->stripe_length;
+    else
+        return 0;
+}
+
+__attribute__((nonnull(1)))
+static uint64_t full_stripe_align(chunk* c, uint64_t address, uint64_t width) {
+    uint64_t off = (address - c->offset) % width;
+
+    return off == 0 ? address : address + width - off;
+}
+
 __attribute__((nonnull(1, 2, 4)))
 bool find_data_address_in_chunk(device_extension* Vcb, chunk* c, uint64_t length, uint64_t* address) {
-    LIST_ENTRY* le;
     space* s;
+    uint64_t width;
 
     TRACE("(%p, %I64x, %I64x, %p)\n", Vcb, c->offset, length, address);
 
@@ -54,41 +76,30 @@ bool find_data_address_in_chunk(device_extension* Vcb, chunk* c, uint64_t length
         }
     }
 
-    if (IsListEmpty(&c->space_size))
-        return false;
-
-    le = c->space_size.Flink;
-    while (le != &c->space_size) {
-        s = CONTAINING_RECORD(le, space, list_entry_size);
-
-        if (s->size == length) {
-            *address = s->address;
-            return true;
-        } else if (s->size < length) {
-            if (le == c->space_size.Flink)
-                return false;
+    width = full_stripe_width(Vcb, c);
 
-            s = CONTAINING_RECORD(le->Blink, space, list_entry_size);
+    // If we're writing at least a whole stripe's worth, try to start at the beginning of one,
+    // so that we don't end up with partial stripes at both ends.
+    if (width != 0 && length >= width) {
+        s = find_space_best_fit(c, length + width - Vcb->superblock.sector_size);
 
-            *address = s->address;
+        if (s) {
+            *address = full_stripe_align(c, s->address, width);
             return true;
         }
-
-        le = le->Flink;
     }
 
-    s = CONTAINING_RECORD(c->space_size.Blink, space, list_entry_size);
+    s = find_space_best_fit(c, length);
+    if (!s)
+        return false;
 
-    if (s->size > length) {
-        *address = s->address;
-        return true;
-    }
+    *address = s->address;
 
-    return false;
+    return true;
 }
 
 __attribute__((nonnull(1)))
-chunk* get_chunk_from_address(device_extension* Vcb, uint64_t address) {
+static chunk* get_chunk_from_list(device_extension* Vcb, uint64_t address) {
     LIST_ENTRY* le2;
 
     ExAcquireResourceSharedLite(&Vcb->chunk_lock, true);
@@ -110,6 +121,125 @@ chunk* get_chunk_from_address(device_extension* Vcb, uint64_t address) {
     return NULL;
 }
 
+__attribute__((nonnull(1)))
+chunk* get_chunk_from_address(device_extension* Vcb, uint64_t address) {
+    chunk_map* map;
+    chunk* c = NULL;
+    ULONG slot = KeGetCurrentProcessorNumber() % CHUNK_MAP_READER_SLOTS;
+
+    // The increment has to happen before we read the pointer, so that
+    // update_chunk_map can't free the map from under us.
+    InterlockedIncrement(&Vcb->chunk_map_readers[slot].readers);
+
+    map = Vcb->chunk_map;
+
+    if (map) {
+        ULONG lo = 0, hi = map->num_entries;
+
+        // find the last chunk starting at or before address
+        while (lo < hi) {
+            ULONG mid = lo + ((hi - lo) / 2);
+
+            if (map->entries[mid].offset <= address)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        if (lo > 0 && address < map->entries[lo - 1].offset + map->entries[lo - 1].size)
+            c = map->entries[lo - 1].c;
+    }
+
+    InterlockedDecrement(&Vcb->chunk_map_readers[slot].readers);
+
+    if (!map)
+        return get_chunk_from_list(Vcb, address);
+
+    return c;
+}
+
+__attribute__((nonnull(1)))
+static void free_old_chunk_maps(device_extension* Vcb) {
+    unsigned int i;
+
+    for (i = 0; i < CHUNK_MAP_READER_SLOTS; i++) {
+        if (Vcb->chunk_map_readers[i].readers != 0)
+            return;
+    }
+
+    while (!IsListEmpty(&Vcb->old_chunk_maps)) {
+        chunk_map* map = CONTAINING_RECORD(RemoveHeadList(&Vcb->old_chunk_maps), chunk_map, list_entry);
+
+        ExFreePool(map);
+    }
+}
+
+// Called whenever Vcb->chunks changes, with the caller holding chunk_lock exclusively
+// or being the only thread with access to the volume. If we can't allocate the new map,
+// we clear it and get_chunk_from_address falls back to walking the list.
+__attribute__((nonnull(1)))
+void update_chunk_map(device_extension* Vcb) {
+    chunk_map *map, *old;
+    ULONG num_entries = 0;
+    LIST_ENTRY* le;
+
+    ExAcquireFastMutex(&Vcb->chunk_map_mutex);
+
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        num_entries++;
+        le = le->Flink;
+    }
+
+    map = ExAllocatePoolWithTag(NonPagedPool, offsetof(chunk_map, entries[0]) + (max(num_entries, 1) * sizeof(chunk_map_entry)), ALLOC_TAG);
+
+    if (!map)
+        ERR("out of memory\n");
+    else {
+        ULONG i = 0;
+
+        map->num_entries = num_entries;
+
+        // Vcb->chunks is kept sorted by offset
+        le = Vcb->chunks.Flink;
+        while (le != &Vcb->chunks) {
+            chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+
+            map->entries[i].offset = c->offset;
+            map->entries[i].size = c->chunk_item->size;
+            map->entries[i].c = c;
+            i++;
+
+            le = le->Flink;
+        }
+    }
+
+    old = InterlockedExchangePointer((void**)&Vcb->chunk_map, map);
+
+    if (old)
+        InsertTailList(&Vcb->old_chunk_maps, &old->list_entry);
+
+    free_old_chunk_maps(Vcb);
+
+    ExReleaseFastMutex(&Vcb->chunk_map_mutex);
+}
+
+__attribute__((nonnull(1)))
+void free_chunk_maps(device_extension* Vcb) {
+    if (Vcb->chunk_map) {
+        ExFreePool(Vcb->chunk_map);
+        Vcb->chunk_map = NULL;
+    }
+
+    if (Vcb->old_chunk_maps.Flink) {
+        while (!IsListEmpty(&Vcb->old_chunk_maps)) {
+            chunk_map* map = CONTAINING_RECORD(RemoveHeadList(&Vcb->old_chunk_maps), chunk_map, list_entry);
+
+            ExFreePool(map);
+        }
+    }
+}
+
 typedef struct {
     space* dh;
     device* device;
@@ -373,7 +503,6 @@ NTSTATUS alloc_chunk(device_extension* Vcb, uint64_t flags, chunk** pc, bool ful
     uint16_t cisize;
     CHUNK_ITEM_STRIPE* cis;
     chunk* c = NULL;
-    space* s = NULL;
     LIST_ENTRY* le;
 
     le = Vcb->devices.Flink;
@@ -623,33 +752,26 @@ NTSTATUS alloc_chunk(device_extension* Vcb, uint64_t flags, chunk** pc, bool ful
     c->space_changed = false;
     c->balance_num = 0;
 
-    InitializeListHead(&c->space);
-    InitializeListHead(&c->space_size);
+    init_space_index(c);
     InitializeListHead(&c->deleting);
     InitializeListHead(&c->changed_extents);
 
-    InitializeListHead(&c->range_locks);
-    ExInitializeResourceLite(&c->range_locks_lock);
-    KeInitializeEvent(&c->range_locks_event, NotificationEvent, false);
+    init_range_locks(c);
 
     InitializeListHead(&c->partial_stripes);
     ExInitializeResourceLite(&c->partial_stripes_lock);
 
+    InitializeListHead(&c->clusters);
+
     ExInitializeResourceLite(&c->lock);
     ExInitializeResourceLite(&c->changed_extents_lock);
 
-    s = ExAllocatePoolWithTag(NonPagedPool, sizeof(space), ALLOC_TAG);
-    if (!s) {
-        ERR("out of memory\n");
-        Status = STATUS_INSUFFICIENT_RESOURCES;
+    Status = add_space_entry(&c->space, &c->space_size, c->offset, c->chunk_item->size);
+    if (!NT_SUCCESS(Status)) {
+        ERR("add_space_entry returned %08lx\n", Status);
         goto end;
     }
 
-    s->address = c->offset;
-    s->size = c->chunk_item->size;
-    InsertTailList(&c->space, &s->list_entry);
-    InsertTailList(&c->space_size, &s->list_entry_size);
-
     protect_superblocks(c);
 
     for (i = 0; i < num_stripes; i++) {
@@ -677,8 +799,6 @@ end:
 
             ExFreePool(c);
         }
-
-        if (s) ExFreePool(s);
     } else {
         bool done = false;
 
@@ -698,6 +818,8 @@ end:
         if (!done)
             InsertTailList(&Vcb->chunks, &c->list_entry);
 
+        update_chunk_map(Vcb);
+
         c->created = true;
         c->changed = true;
         c->space_changed = true;
@@ -1079,6 +1201,8 @@ static NTSTATUS prepare_raid5_write(device_extension* Vcb, chunk* c, uint64_t ad
     NTSTATUS Status;
     PFN_NUMBER *pfns, *parity_pfns;
     log_stripe* log_stripes = NULL;
+    uint8_t* srcs[XOR_MULTI_MAX];
+    uint32_t num_srcs = 0;
 
     if ((address + length - c->offset) % (num_data_stripes * c->chunk_item->stripe_length) > 0) {
         uint64_t delta = (address + length - c->offset) % (num_data_stripes * c->chunk_item->stripe_length);
@@ -1113,6 +1237,9 @@ static NTSTATUS prepare_raid5_write(device_extension* Vcb, chunk* c, uint64_t ad
         goto exit;
     }
 
+    // we're writing whole stripes, so anything we've cached for them is out of date
+    stripe_cache_invalidate(Vcb, address, length);
+
     get_raid0_offset(address - c->offset, c->chunk_item->stripe_length, num_data_stripes, &startoff, &startoffstripe);
     get_raid0_offset(address + length - c->offset - 1, c->chunk_item->stripe_length, num_data_stripes, &endoff, &endoffstripe);
 
@@ -1445,9 +1572,11 @@ static NTSTATUS prepare_raid5_write(device_extension* Vcb, chunk* c, uint64_t ad
         if (i == 0)
             RtlCopyMemory(wtc->parity1, ss, (uint32_t)(parity_end - parity_start));
         else
-            do_xor(wtc->parity1, ss, (uint32_t)(parity_end - parity_start));
+            xor_multi_queue(wtc->parity1, srcs, &num_srcs, ss, (uint32_t)(parity_end - parity_start));
     }
 
+    xor_multi_queue(wtc->parity1, srcs, &num_srcs, NULL, (uint32_t)(parity_end - parity_start));
+
     Status = STATUS_SUCCESS;
 
 exit:
@@ -1478,6 +1607,8 @@ static NTSTATUS prepare_raid6_write(device_extension* Vcb, chunk* c, uint64_t ad
     NTSTATUS Status;
     PFN_NUMBER *pfns, *parity1_pfns, *parity2_pfns;
     log_stripe* log_stripes = NULL;
+    uint8_t* srcs[XOR_MULTI_MAX];
+    uint32_t num_srcs = 0;
 
     if ((address + length - c->offset) % (num_data_stripes * c->chunk_item->stripe_length) > 0) {
         uint64_t delta = (address + length - c->offset) % (num_data_stripes * c->chunk_item->stripe_length);
@@ -1512,6 +1643,9 @@ static NTSTATUS prepare_raid6_write(device_extension* Vcb, chunk* c, uint64_t ad
         goto exit;
     }
 
+    // we're writing whole stripes, so anything we've cached for them is out of date
+    stripe_cache_invalidate(Vcb, address, length);
+
     get_raid0_offset(address - c->offset, c->chunk_item->stripe_length, num_data_stripes, &startoff, &startoffstripe);
     get_raid0_offset(address + length - c->offset - 1, c->chunk_item->stripe_length, num_data_stripes, &endoff, &endoffstripe);
 
@@ -1880,13 +2014,15 @@ static NTSTATUS prepare_raid6_write(device_extension* Vcb, chunk* c, uint64_t ad
             RtlCopyMemory(wtc->parity1, ss, (ULONG)(parity_end - parity_start));
             RtlCopyMemory(wtc->parity2, ss, (ULONG)(parity_end - parity_start));
         } else {
-            do_xor(wtc->parity1, ss, (uint32_t)(parity_end - parity_start));
+            xor_multi_queue(wtc->parity1, srcs, &num_srcs, ss, (uint32_t)(parity_end - parity_start));
 
             galois_double(wtc->parity2, (uint32_t)(parity_end - parity_start));
             do_xor(wtc->parity2, ss, (uint32_t)(parity_end - parity_start));
         }
     }
 
+    xor_multi_queue(wtc->parity1, srcs, &num_srcs, NULL, (uint32_t)(parity_end - parity_start));
+
     Status = STATUS_SUCCESS;
 
 exit:
@@ -2097,6 +2233,9 @@ NTSTATUS write_data(_In_ device_extension* Vcb, _In_ uint64_t address, _In_reads
             IrpSp->Parameters.Write.Length = (ULONG)(stripes[i].end - stripes[i].start);
             IrpSp->Parameters.Write.ByteOffset.QuadPart = stripes[i].start + cis[i].offset;
 
+            stripe->offset = IrpSp->Parameters.Write.ByteOffset.QuadPart;
+            stripe->length = IrpSp->Parameters.Write.Length;
+
             total_writing += IrpSp->Parameters.Write.Length;
 
             stripe->Irp->UserIosb = &stripe->iosb;
@@ -2242,7 +2381,7 @@ NTSTATUS write_data_complete(device_extension* Vcb, uint64_t address, void* data
             write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
 
             if (stripe->status != WriteDataStatus_Ignore) {
-                IoCallDriver(stripe->device->devobj, stripe->Irp);
+                submit_write(stripe);
                 no_wait = false;
             }
 
@@ -2275,15 +2414,11 @@ NTSTATUS write_data_complete(device_extension* Vcb, uint64_t address, void* data
     return Status;
 }
 
-__attribute__((nonnull(2,3)))
-_Function_class_(IO_COMPLETION_ROUTINE)
-static NTSTATUS __stdcall write_data_completion(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID conptr) {
-    write_data_stripe* stripe = conptr;
+__attribute__((nonnull(1,2)))
+static void write_data_stripe_done(write_data_stripe* stripe, IO_STATUS_BLOCK* iosb) {
     write_data_context* context = (write_data_context*)stripe->context;
     LIST_ENTRY* le;
 
-    UNUSED(DeviceObject);
-
     // FIXME - we need a lock here
 
     if (stripe->status == WriteDataStatus_Cancelling) {
@@ -2291,9 +2426,9 @@ static NTSTATUS __stdcall write_data_completion(PDEVICE_OBJECT DeviceObject, PIR
         goto end;
     }
 
-    stripe->iosb = Irp->IoStatus;
+    stripe->iosb = *iosb;
 
-    if (NT_SUCCESS(Irp->IoStatus.Status)) {
+    if (NT_SUCCESS(iosb->Status)) {
         stripe->status = WriteDataStatus_Success;
     } else {
         le = context->stripes.Flink;
@@ -2315,10 +2450,362 @@ static NTSTATUS __stdcall write_data_completion(PDEVICE_OBJECT DeviceObject, PIR
 end:
     if (InterlockedDecrement(&context->stripes_left) == 0)
         KeSetEvent(&context->Event, 0, false);
+}
+
+__attribute__((nonnull(2,3)))
+_Function_class_(IO_COMPLETION_ROUTINE)
+static NTSTATUS __stdcall write_data_completion(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID conptr) {
+    write_data_stripe* stripe = conptr;
+    device* dev = stripe->device;
+
+    UNUSED(DeviceObject);
+
+    // Do this before completing the stripe - once the caller's been woken up, it might go on to free dev.
+    write_queue_done(dev);
+
+    write_data_stripe_done(stripe, &Irp->IoStatus);
 
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
+// Writes are queued on their device, rather than being sent straight away, so that no device
+// has more than DEVICE_MAX_WRITES outstanding, and so that writes from different callers to
+// adjacent areas of the disk can be sent as one. The queue is kept sorted by offset. Whichever
+// thread finds the queue idle sends writes until it's empty or the device is full. Completion
+// routines can run at DISPATCH_LEVEL, so they don't send anything themselves - if there's more
+// waiting, they queue dev->write_queue_work_item to carry on.
+
+typedef struct {
+    device* dev;
+    PIRP Irp;
+    PMDL mdl;
+    uint8_t* buf;
+    LIST_ENTRY stripes;
+} write_merge;
+
+_Function_class_(WORKER_THREAD_ROUTINE)
+static void __stdcall write_queue_work(void* context);
+
+__attribute__((nonnull(1)))
+void init_write_queue(device* dev) {
+    KeInitializeSpinLock(&dev->write_queue_lock);
+    InitializeListHead(&dev->write_queue);
+    dev->writes_in_flight = 0;
+    dev->write_queue_running = false;
+    ExInitializeWorkItem(&dev->write_queue_work_item, write_queue_work, dev);
+}
+
+// Called before dev gets freed. Callers only wait for their own writes, so the worker sending
+// the queue might still be finishing off, even though everything it sent has completed.
+__attribute__((nonnull(1)))
+void wait_for_write_queue(device* dev) {
+    LARGE_INTEGER delay;
+
+    delay.QuadPart = -10000; // 1 ms
+
+    while (true) {
+        KIRQL irql;
+        bool idle;
+
+        KeAcquireSpinLock(&dev->write_queue_lock, &irql);
+        idle = !dev->write_queue_running && dev->writes_in_flight == 0;
+        KeReleaseSpinLock(&dev->write_queue_lock, irql);
+
+        if (idle)
+            break;
+
+        KeDelayExecutionThread(KernelMode, false, &delay);
+    }
+}
+
+// Associated IRPs have to go down as they are, as their master IRP is waiting on them. Stripes
+// from a merged write that failed get sent again on their own, so that each caller gets its own status.
+__attribute__((nonnull(1)))
+static bool can_merge_write(write_data_stripe* stripe) {
+    return !stripe->no_merge && !(stripe->Irp->Flags & IRP_ASSOCIATED_IRP) && stripe->length < WRITE_MERGE_MAX;
+}
+
+__attribute__((nonnull(1)))
+static uint8_t* write_stripe_buffer(write_data_stripe* stripe) {
+    if (stripe->Irp->MdlAddress)
+        return MmGetSystemAddressForMdlSafe(stripe->Irp->MdlAddress, HighPagePriority);
+    else if (stripe->Irp->Flags & IRP_BUFFERED_IO)
+        return stripe->Irp->AssociatedIrp.SystemBuffer;
+    else
+        return stripe->Irp->UserBuffer;
+}
+
+__attribute__((nonnull(2,3)))
+_Function_class_(IO_COMPLETION_ROUTINE)
+static NTSTATUS __stdcall write_merge_completion(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID conptr) {
+    write_merge* wm = conptr;
+    device* dev = wm->dev;
+
+    UNUSED(DeviceObject);
+
+    if (!NT_SUCCESS(Irp->IoStatus.Status)) {
+        KIRQL irql;
+
+        // The stripes might belong to several different callers, so rather than failing them all,
+        // put them back at the front of the queue to be sent one by one through their own IRPs.
+
+        KeAcquireSpinLock(&dev->write_queue_lock, &irql);
+
+        while (!IsListEmpty(&wm->stripes)) {
+            write_data_stripe* stripe = CONTAINING_RECORD(RemoveTailList(&wm->stripes), write_data_stripe, list_entry_queue);
+
+            stripe->no_merge = true;
+            InsertHeadList(&dev->write_queue, &stripe->list_entry_queue);
+        }
+
+        KeReleaseSpinLock(&dev->write_queue_lock, irql);
+    }
+
+    // As in write_data_completion, this has to come before the stripes are completed.
+    write_queue_done(dev);
+
+    while (!IsListEmpty(&wm->stripes)) {
+        write_data_stripe* stripe = CONTAINING_RECORD(RemoveHeadList(&wm->stripes), write_data_stripe, list_entry_queue);
+        IO_STATUS_BLOCK iosb;
+
+        iosb.Status = Irp->IoStatus.Status;
+        iosb.Information = stripe->length;
+
+        write_data_stripe_done(stripe, &iosb);
+    }
+
+    IoFreeMdl(wm->mdl);
+    IoFreeIrp(wm->Irp);
+    ExFreePool(wm->buf);
+    ExFreePool(wm);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+// Copies the writes in batch into one buffer, and sends them as a single IRP. If we can't, they get sent separately.
+__attribute__((nonnull(1,2)))
+static void send_merged_write(device* dev, LIST_ENTRY* batch, ULONG length) {
+    write_merge* wm;
+    write_data_stripe* first = CONTAINING_RECORD(batch->Flink, write_data_stripe, list_entry_queue);
+    PIO_STACK_LOCATION IrpSp;
+    LIST_ENTRY* le;
+    ULONG off = 0, num_stripes = 0;
+    KIRQL irql;
+
+    wm = ExAllocatePoolWithTag(NonPagedPool, sizeof(write_merge), ALLOC_TAG);
+    if (!wm)
+        goto fail;
+
+    wm->dev = dev;
+    wm->Irp = NULL;
+    wm->mdl = NULL;
+
+    wm->buf = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+    if (!wm->buf)
+        goto fail2;
+
+    le = batch->Flink;
+    while (le != batch) {
+        write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry_queue);
+        uint8_t* data = write_stripe_buffer(stripe);
+
+        if (!data)
+            goto fail2;
+
+        RtlCopyMemory(wm->buf + off, data, stripe->length);
+        off += stripe->length;
+
+        le = le->Flink;
+    }
+
+    wm->mdl = IoAllocateMdl(wm->buf, length, false, false, NULL);
+    if (!wm->mdl)
+        goto fail2;
+
+    MmBuildMdlForNonPagedPool(wm->mdl);
+
+    wm->Irp = IoAllocateIrp(dev->devobj->StackSize, false);
+    if (!wm->Irp)
+        goto fail2;
+
+    IrpSp = IoGetNextIrpStackLocation(wm->Irp);
+    IrpSp->MajorFunction = IRP_MJ_WRITE;
+    IrpSp->FileObject = dev->fileobj;
+
+    if (dev->devobj->Flags & DO_BUFFERED_IO) {
+        wm->Irp->AssociatedIrp.SystemBuffer = wm->buf;
+        wm->Irp->Flags = IRP_BUFFERED_IO;
+    } else if (dev->devobj->Flags & DO_DIRECT_IO)
+        wm->Irp->MdlAddress = wm->mdl;
+    else
+        wm->Irp->UserBuffer = wm->buf;
+
+    IrpSp->Parameters.Write.Length = length;
+    IrpSp->Parameters.Write.ByteOffset.QuadPart = first->offset;
+
+    // move the list over, now that nothing else can go wrong
+    wm->stripes.Flink = batch->Flink;
+    wm->stripes.Blink = batch->Blink;
+    wm->stripes.Flink->Blink = &wm->stripes;
+    wm->stripes.Blink->Flink = &wm->stripes;
+
+    IoSetCompletionRoutine(wm->Irp, write_merge_completion, wm, true, true, true);
+
+    IoCallDriver(dev->devobj, wm->Irp);
+
+    return;
+
+fail2:
+    if (wm->mdl)
+        IoFreeMdl(wm->mdl);
+
+    if (wm->buf)
+        ExFreePool(wm->buf);
+
+    ExFreePool(wm);
+
+fail:
+    ERR("could not merge writes, sending them separately\n");
+
+    le = batch->Flink;
+    while (le != batch) {
+        num_stripes++;
+        le = le->Flink;
+    }
+
+    // we've only counted one write in flight so far
+    KeAcquireSpinLock(&dev->write_queue_lock, &irql);
+    dev->writes_in_flight += num_stripes - 1;
+    KeReleaseSpinLock(&dev->write_queue_lock, irql);
+
+    while (!IsListEmpty(batch)) {
+        write_data_stripe* stripe = CONTAINING_RECORD(RemoveHeadList(batch), write_data_stripe, list_entry_queue);
+
+        IoCallDriver(dev->devobj, stripe->Irp);
+    }
+}
+
+// Sends writes until the queue is empty or the device is full. The caller has to have set
+// write_queue_running, and be at PASSIVE_LEVEL.
+__attribute__((nonnull(1)))
+static void write_queue_send(device* dev) {
+    KIRQL irql;
+
+    KeAcquireSpinLock(&dev->write_queue_lock, &irql);
+
+    while (dev->writes_in_flight < DEVICE_MAX_WRITES && !IsListEmpty(&dev->write_queue)) {
+        write_data_stripe* stripe = CONTAINING_RECORD(RemoveHeadList(&dev->write_queue), write_data_stripe, list_entry_queue);
+        LIST_ENTRY batch;
+        ULONG length = stripe->length;
+
+        InitializeListHead(&batch);
+        InsertTailList(&batch, &stripe->list_entry_queue);
+
+        // pull in anything which follows on directly from this
+        if (can_merge_write(stripe)) {
+            while (!IsListEmpty(&dev->write_queue)) {
+                write_data_stripe* next = CONTAINING_RECORD(dev->write_queue.Flink, write_data_stripe, list_entry_queue);
+
+                if (next->offset != stripe->offset + length || !can_merge_write(next) || length + next->length > WRITE_MERGE_MAX)
+                    break;
+
+                RemoveEntryList(&next->list_entry_queue);
+                InsertTailList(&batch, &next->list_entry_queue);
+                length += next->length;
+            }
+        }
+
+        dev->writes_in_flight++;
+
+        KeReleaseSpinLock(&dev->write_queue_lock, irql);
+
+        if (batch.Flink == batch.Blink)
+            IoCallDriver(dev->devobj, stripe->Irp);
+        else
+            send_merged_write(dev, &batch, length);
+
+        KeAcquireSpinLock(&dev->write_queue_lock, &irql);
+    }
+
+    dev->write_queue_running = false;
+
+    KeReleaseSpinLock(&dev->write_queue_lock, irql);
+}
+
+_Function_class_(WORKER_THREAD_ROUTINE)
+static void __stdcall write_queue_work(void* context) {
+    write_queue_send((device*)context);
+}
+
+__attribute__((nonnull(1)))
+static void write_queue_run(device* dev) {
+    KIRQL irql;
+
+    KeAcquireSpinLock(&dev->write_queue_lock, &irql);
+
+    // if someone else is already sending writes, they'll pick up ours
+    if (dev->write_queue_running) {
+        KeReleaseSpinLock(&dev->write_queue_lock, irql);
+        return;
+    }
+
+    dev->write_queue_running = true;
+
+    KeReleaseSpinLock(&dev->write_queue_lock, irql);
+
+    write_queue_send(dev);
+}
+
+// Called from the completion routines, so this mustn't send anything itself.
+__attribute__((nonnull(1)))
+static void write_queue_done(device* dev) {
+    KIRQL irql;
+    bool queue_work = false;
+
+    KeAcquireSpinLock(&dev->write_queue_lock, &irql);
+
+    dev->writes_in_flight--;
+
+    if (!dev->write_queue_running && !IsListEmpty(&dev->write_queue)) {
+        dev->write_queue_running = true;
+        queue_work = true;
+    }
+
+    KeReleaseSpinLock(&dev->write_queue_lock, irql);
+
+    // The critical queue, as the delayed queue's threads might themselves be waiting on these writes.
+    if (queue_work)
+        ExQueueWorkItem(&dev->write_queue_work_item, CriticalWorkQueue);
+}
+
+// Queues a write on its device. The caller still waits on the stripe's context as before.
+__attribute__((nonnull(1)))
+void submit_write(write_data_stripe* stripe) {
+    device* dev = stripe->device;
+    LIST_ENTRY* le;
+    KIRQL irql;
+
+    stripe->no_merge = false;
+
+    KeAcquireSpinLock(&dev->write_queue_lock, &irql);
+
+    le = dev->write_queue.Blink;
+    while (le != &dev->write_queue) {
+        write_data_stripe* s2 = CONTAINING_RECORD(le, write_data_stripe, list_entry_queue);
+
+        if (s2->offset <= stripe->offset)
+            break;
+
+        le = le->Blink;
+    }
+
+    InsertHeadList(le, &stripe->list_entry_queue);
+
+    KeReleaseSpinLock(&dev->write_queue_lock, irql);
+
+    write_queue_run(dev);
+}
+
 __attribute__((nonnull(1)))
 void free_write_data_stripes(write_data_context* wtc) {
     LIST_ENTRY* le;
@@ -2380,6 +2867,55 @@ void free_write_data_stripes(write_data_context* wtc) {
     }
 }
 
+// fcb->extents_tree indexes the extents in fcb->extents which aren't ignored, so that
+// we don't have to walk the whole list to find the extent at a given offset. Anything
+// adding an extent to the list or changing its ignore flag needs to keep it up to date.
+
+__attribute__((nonnull(1,2)))
+void insert_extent_index(fcb* fcb, extent* ext) {
+    avl_node* parent = NULL;
+    avl_node** link = &fcb->extents_tree.root;
+
+    while (*link) {
+        extent* ext2 = CONTAINING_RECORD(*link, extent, tree_node);
+
+        parent = *link;
+
+        if (ext->offset < ext2->offset || (ext->offset == ext2->offset && ext < ext2))
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+
+    avl_insert(&fcb->extents_tree, &ext->tree_node, parent, link);
+}
+
+__attribute__((nonnull(1,2)))
+void remove_extent_index(fcb* fcb, extent* ext) {
+    avl_remove(&fcb->extents_tree, &ext->tree_node);
+}
+
+// Returns the list entry to start walking fcb->extents from, when looking for offset.
+// This is the last extent starting at or before offset, so everything before it in
+// the list either finishes before offset or is ignored.
+__attribute__((nonnull(1)))
+LIST_ENTRY* find_extent_index(fcb* fcb, uint64_t offset) {
+    avl_node* n = fcb->extents_tree.root;
+    extent* ret = NULL;
+
+    while (n) {
+        extent* ext = CONTAINING_RECORD(n, extent, tree_node);
+
+        if (ext->offset <= offset) {
+            ret = ext;
+            n = n->right;
+        } else
+            n = n->left;
+    }
+
+    return ret ? &ret->list_entry : fcb->extents.Flink;
+}
+
 __attribute__((nonnull(1,2,3)))
 void add_extent(_In_ fcb* fcb, _In_ LIST_ENTRY* prevextle, _In_ __drv_aliasesMem extent* newext) {
     LIST_ENTRY* le = prevextle->Flink;
@@ -2389,6 +2925,7 @@ void add_extent(_In_ fcb* fcb, _In_ LIST_ENTRY* prevextle, _In_ __drv_aliasesMem
 
         if (ext->offset >= newext->offset) {
             InsertHeadList(ext->list_entry.Blink, &newext->list_entry);
+            insert_extent_index(fcb, newext);
             return;
         }
 
@@ -2396,6 +2933,7 @@ void add_extent(_In_ fcb* fcb, _In_ LIST_ENTRY* prevextle, _In_ __drv_aliasesMem
     }
 
     InsertTailList(&fcb->extents, &newext->list_entry);
+    insert_extent_index(fcb, newext);
 }
 
 __attribute__((nonnull(1,2,6)))
@@ -2403,7 +2941,21 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, ui
     NTSTATUS Status;
     LIST_ENTRY* le;
 
-    le = fcb->extents.Flink;
+    Status = load_fcb_extents(Vcb, fcb, start_data, end_data - start_data, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("load_fcb_extents returned %08lx\n", Status);
+        return Status;
+    }
+
+    if (!IsListEmpty(&fcb->delalloc)) {
+        Status = delalloc_drop(fcb, start_data, end_data, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("delalloc_drop returned %08lx\n", Status);
+            return Status;
+        }
+    }
+
+    le = find_extent_index(fcb, start_data);
 
     while (le != &fcb->extents) {
         LIST_ENTRY* le2 = le->Flink;
@@ -2418,6 +2970,9 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, ui
             else
                 len = ((EXTENT_DATA2*)ed->data)->num_bytes;
 
+            if (ext->offset >= end_data)
+                break;
+
             if (ext->offset < end_data && ext->offset + len > start_data) {
                 if (ed->type == EXTENT_TYPE_INLINE) {
                     if (start_data <= ext->offset && end_data >= ext->offset + len) { // remove all
@@ -2583,6 +3138,8 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, ui
 
                         InsertHeadList(&ext->list_entry, &newext->list_entry);
 
+                        insert_extent_index(fcb, newext);
+
                         remove_fcb_extent(fcb, ext, rollback);
                     } else if (start_data > ext->offset && end_data < ext->offset + len) { // remove middle
                         EXTENT_DATA2 *neda2, *nedb2;
@@ -2714,6 +3271,8 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, ui
                         }
 
                         InsertHeadList(&ext->list_entry, &newext1->list_entry);
+
+                        insert_extent_index(fcb, newext1);
                         add_extent(fcb, &newext1->list_entry, newext2);
 
                         remove_fcb_extent(fcb, ext, rollback);
@@ -2775,7 +3334,8 @@ NTSTATUS add_extent_to_fcb(_In_ fcb* fcb, _In_ uint64_t offset, _In_reads_bytes_
 
     RtlCopyMemory(&ext->extent_data, ed, edsize);
 
-    le = fcb->extents.Flink;
+    // start from the last extent before offset
+    le = offset > 0 ? find_extent_index(fcb, offset - 1) : fcb->extents.Flink;
     while (le != &fcb->extents) {
         extent* oldext = CONTAINING_RECORD(le, extent, list_entry);
 
@@ -2790,6 +3350,8 @@ NTSTATUS add_extent_to_fcb(_In_ fcb* fcb, _In_ uint64_t offset, _In_reads_bytes_
     InsertTailList(&fcb->extents, &ext->list_entry);
 
 end:
+    insert_extent_index(fcb, ext);
+
     add_insert_extent_rollback(rollback, fcb, ext);
 
     return STATUS_SUCCESS;
@@ -2804,6 +3366,7 @@ static void remove_fcb_extent(fcb* fcb, extent* ext, LIST_ENTRY* rollback) {
         rollback_extent* re;
 
         ext->ignore = true;
+        remove_extent_index(fcb, ext);
 
         re = ExAllocatePoolWithTag(NonPagedPool, sizeof(rollback_extent), ALLOC_TAG);
         if (!re) {
@@ -2818,23 +3381,15 @@ static void remove_fcb_extent(fcb* fcb, extent* ext, LIST_ENTRY* rollback) {
     }
 }
 
-_Requires_lock_held_(c->lock)
-_When_(return != 0, _Releases_lock_(c->lock))
-__attribute__((nonnull(1,2,3,9)))
-bool insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk* c, _In_ uint64_t start_data, _In_ uint64_t length, _In_ bool prealloc, _In_opt_ void* data,
-                         _In_opt_ PIRP Irp, _In_ LIST_ENTRY* rollback, _In_ uint8_t compression, _In_ uint64_t decoded_size, _In_ bool file_write, _In_ uint64_t irp_offset) {
-    uint64_t address;
+__attribute__((nonnull(1,2,3)))
+static bool add_data_extent(device_extension* Vcb, fcb* fcb, chunk* c, uint64_t address, uint64_t start_data, uint64_t length, bool prealloc,
+                            void* data, LIST_ENTRY* rollback, uint8_t compression, uint64_t decoded_size) {
     NTSTATUS Status;
     EXTENT_DATA* ed;
     EXTENT_DATA2* ed2;
     uint16_t edsize = (uint16_t)(offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2));
     void* csum = NULL;
 
-    TRACE("(%p, (%I64x, %I64x), %I64x, %I64x, %I64x, %u, %p, %p)\n", Vcb, fcb->subvol->id, fcb->inode, c->offset, start_data, length, prealloc, data, rollback);
-
-    if (!find_data_address_in_chunk(Vcb, c, length, &address))
-        return false;
-
     // add extent data to inode
     ed = ExAllocatePoolWithTag(PagedPool, edsize, ALLOC_TAG);
     if (!ed) {
@@ -2878,9 +3433,6 @@ bool insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk*
 
     ExFreePool(ed);
 
-    c->used += length;
-    space_list_subtract(c, address, length, rollback);
-
     fcb->inode_item.st_blocks += decoded_size;
 
     fcb->extents_changed = true;
@@ -2893,6 +3445,28 @@ bool insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk*
 
     ExReleaseResourceLite(&c->changed_extents_lock);
 
+    return true;
+}
+
+_Requires_lock_held_(c->lock)
+_When_(return != 0, _Releases_lock_(c->lock))
+__attribute__((nonnull(1,2,3,9)))
+bool insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk* c, _In_ uint64_t start_data, _In_ uint64_t length, _In_ bool prealloc, _In_opt_ void* data,
+                         _In_opt_ PIRP Irp, _In_ LIST_ENTRY* rollback, _In_ uint8_t compression, _In_ uint64_t decoded_size, _In_ bool file_write, _In_ uint64_t irp_offset) {
+    uint64_t address;
+    NTSTATUS Status;
+
+    TRACE("(%p, (%I64x, %I64x), %I64x, %I64x, %I64x, %u, %p, %p)\n", Vcb, fcb->subvol->id, fcb->inode, c->offset, start_data, length, prealloc, data, rollback);
+
+    if (!find_data_address_in_chunk(Vcb, c, length, &address))
+        return false;
+
+    if (!add_data_extent(Vcb, fcb, c, address, start_data, length, prealloc, data, rollback, compression, decoded_size))
+        return false;
+
+    c->used += length;
+    space_list_subtract(c, address, length, rollback);
+
     release_chunk_lock(c, Vcb);
 
     if (data) {
@@ -2905,6 +3479,199 @@ bool insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk*
     return true;
 }
 
+static void release_alloc_cluster(device_extension* Vcb, fcb* fcb) {
+    chunk* c = fcb->cluster_chunk;
+
+    acquire_chunk_lock(c, Vcb);
+
+    if (fcb->cluster_length > 0) {
+        space_list_add2(&c->space, &c->space_size, fcb->cluster_address, fcb->cluster_length, NULL, NULL);
+        c->used -= fcb->cluster_length;
+    }
+
+    RemoveEntryList(&fcb->list_entry_cluster);
+
+    release_chunk_lock(c, Vcb);
+
+    fcb->cluster_chunk = NULL;
+    fcb->cluster_address = 0;
+    fcb->cluster_length = 0;
+}
+
+// Called at the start of a flush, with the tree lock held exclusively, so that the reserved
+// but unused space is free again by the time we write out the chunk usage and free space caches.
+void release_alloc_clusters(device_extension* Vcb) {
+    LIST_ENTRY* le;
+
+    ExAcquireResourceSharedLite(&Vcb->chunk_lock, true);
+
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+
+        while (!IsListEmpty(&c->clusters)) {
+            fcb* fcb = CONTAINING_RECORD(c->clusters.Flink, struct _fcb, list_entry_cluster);
+
+            release_alloc_cluster(Vcb, fcb);
+        }
+
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+}
+
+// Reserve a contiguous area of free space for fcb, which it can allocate from without having to take the
+// chunk lock. The whole area counts as used until it gets released, so nobody else can allocate from it.
+__attribute__((nonnull(1,2)))
+static bool get_alloc_cluster(device_extension* Vcb, fcb* fcb, uint64_t length) {
+    LIST_ENTRY* le;
+    uint64_t want = max(length, ALLOC_CLUSTER_SIZE);
+
+    if (fcb->cluster_chunk)
+        release_alloc_cluster(Vcb, fcb);
+
+    ExAcquireResourceSharedLite(&Vcb->chunk_lock, true);
+
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+
+        if (!c->readonly && !c->reloc && c->chunk_item->type == Vcb->data_flags && c->chunk_item->size - c->used >= length) {
+            space* s = NULL;
+            uint64_t width, address = 0, size = 0, want2 = want;
+
+            acquire_chunk_lock(c, Vcb);
+
+            if (!c->cache_loaded) {
+                NTSTATUS Status = load_cache_chunk(Vcb, c, NULL);
+
+                if (!NT_SUCCESS(Status)) {
+                    ERR("load_cache_chunk returned %08lx\n", Status);
+                    release_chunk_lock(c, Vcb);
+                    le = le->Flink;
+                    continue;
+                }
+            }
+
+            width = full_stripe_width(Vcb, c);
+
+            // On RAID5 and RAID6, make the cluster whole stripes, so that a file being written
+            // sequentially fills each stripe before moving on to the next one.
+            if (width != 0) {
+                want2 = ((want + width - 1) / width) * width;
+
+                s = find_space_best_fit(c, want2 + width - Vcb->superblock.sector_size);
+
+                if (s) {
+                    address = full_stripe_align(c, s->address, width);
+                    size = s->address + s->size - address;
+                }
+            }
+
+            if (!s) {
+                s = find_space_best_fit(c, want2);
+
+                // otherwise, settle for the largest entry
+                if (!s && !IsListEmpty(&c->space_size)) {
+                    s = CONTAINING_RECORD(c->space_size.Flink, space, list_entry_size);
+
+                    if (s->size < length)
+                        s = NULL;
+                }
+
+                if (s) {
+                    address = s->address;
+                    size = s->size;
+                }
+            }
+
+            if (s) {
+                fcb->cluster_chunk = c;
+                fcb->cluster_address = address;
+                fcb->cluster_length = min(size, want2);
+
+                c->used += fcb->cluster_length;
+                space_list_subtract(c, fcb->cluster_address, fcb->cluster_length, NULL);
+
+                InsertTailList(&c->clusters, &fcb->list_entry_cluster);
+
+                release_chunk_lock(c, Vcb);
+                ExReleaseResourceLite(&Vcb->chunk_lock);
+
+                TRACE("fcb %p: reserved cluster %I64x, %I64x\n", fcb, fcb->cluster_address, fcb->cluster_length);
+
+                return true;
+            }
+
+            release_chunk_lock(c, Vcb);
+        }
+
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+
+    return false;
+}
+
+// The fcb's cluster is protected by its own lock, which we have exclusively, so this doesn't need
+// to take the chunk lock. Returns the number of bytes written, which may be less than length
+// if we couldn't get a cluster; the caller falls back to the normal allocator for the rest.
+__attribute__((nonnull(1,2,5,9)))
+static uint64_t insert_extents_cluster(device_extension* Vcb, fcb* fcb, uint64_t start_data, uint64_t length, void* data,
+                                       PIRP Irp, bool file_write, uint64_t irp_offset, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    uint64_t written = 0;
+
+    // don't bother for small files
+    if (!fcb->cluster_chunk && start_data + length < ALLOC_CLUSTER_THRESHOLD)
+        return 0;
+
+    while (written < length) {
+        uint64_t newlen = min(length - written, MAX_EXTENT_SIZE);
+        uint64_t address;
+        chunk* c = fcb->cluster_chunk;
+
+        if (!c || c->readonly || c->reloc || c->chunk_item->type != Vcb->data_flags || fcb->cluster_length < newlen) {
+            if (!get_alloc_cluster(Vcb, fcb, newlen))
+                break;
+
+            c = fcb->cluster_chunk;
+        }
+
+        address = fcb->cluster_address;
+
+        if (!add_data_extent(Vcb, fcb, c, address, start_data + written, newlen, false, (uint8_t*)data + written, rollback,
+                             BTRFS_COMPRESSION_NONE, newlen))
+            break;
+
+        fcb->cluster_address += newlen;
+        fcb->cluster_length -= newlen;
+
+        // if we have to roll back, the space goes back to the chunk rather than to the cluster
+        add_rollback_space(rollback, false, &c->space, &c->space_size, address, newlen, c);
+
+        Status = write_data_complete(Vcb, address, (uint8_t*)data + written, (uint32_t)newlen, Irp, NULL, file_write, irp_offset + written,
+                                     NormalPagePriority);
+        if (!NT_SUCCESS(Status))
+            ERR("write_data_complete returned %08lx\n", Status);
+
+        written += newlen;
+    }
+
+    // If nothing got written, fcb might not be dirty, and so won't be around at the next flush to give the space back.
+    // If something did, our caller would mark it dirty anyway, but do it now in case it fails before then.
+    if (fcb->cluster_chunk && !fcb->dirty) {
+        if (written == 0)
+            release_alloc_cluster(Vcb, fcb);
+        else
+            mark_fcb_dirty(fcb);
+    }
+
+    return written;
+}
+
 __attribute__((nonnull(1,2,5,7,10)))
 static bool try_extend_data(device_extension* Vcb, fcb* fcb, uint64_t start_data, uint64_t length, void* data,
                             PIRP Irp, uint64_t* written, bool file_write, uint64_t irp_offset, LIST_ENTRY* rollback) {
@@ -2912,6 +3679,7 @@ static bool try_extend_data(device_extension* Vcb, fcb* fcb, uint64_t start_data
     EXTENT_DATA* ed;
     EXTENT_DATA2* ed2;
     chunk* c;
+    space* s;
     LIST_ENTRY* le;
     extent* ext = NULL;
 
@@ -2972,25 +3740,19 @@ static bool try_extend_data(device_extension* Vcb, fcb* fcb, uint64_t start_data
         }
     }
 
-    le = c->space.Flink;
-    while (le != &c->space) {
-        space* s = CONTAINING_RECORD(le, space, list_entry);
+    s = find_space_floor(c, ed2->address + ed2->size);
 
-        if (s->address == ed2->address + ed2->size) {
-            uint64_t newlen = min(min(s->size, length), MAX_EXTENT_SIZE);
+    if (s && s->address == ed2->address + ed2->size) {
+        uint64_t newlen = min(min(s->size, length), MAX_EXTENT_SIZE);
 
-            success = insert_extent_chunk(Vcb, fcb, c, start_data, newlen, false, data, Irp, rollback, BTRFS_COMPRESSION_NONE, newlen, file_write, irp_offset);
+        success = insert_extent_chunk(Vcb, fcb, c, start_data, newlen, false, data, Irp, rollback, BTRFS_COMPRESSION_NONE, newlen, file_write, irp_offset);
 
-            if (success)
-                *written += newlen;
-            else
-                release_chunk_lock(c, Vcb);
-
-            return success;
-        } else if (s->address > ed2->address + ed2->size)
-            break;
+        if (success)
+            *written += newlen;
+        else
+            release_chunk_lock(c, Vcb);
 
-        le = le->Flink;
+        return success;
     }
 
     release_chunk_lock(c, Vcb);
@@ -3139,6 +3901,22 @@ static NTSTATUS insert_extent(device_extension* Vcb, fcb* fcb, uint64_t start_da
 
     TRACE("(%p, (%I64x, %I64x), %I64x, %I64x, %p)\n", Vcb, fcb->subvol->id, fcb->inode, start_data, length, data);
 
+    if (Vcb->options.alloc_clusters && !(fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE)) {
+        written = insert_extents_cluster(Vcb, fcb, start_data, length, data, Irp, file_write, irp_offset, rollback);
+
+        if (written == length)
+            return STATUS_SUCCESS;
+        else if (written > 0) {
+            start_data += written;
+            irp_offset += written;
+            length -= written;
+            data = &((uint8_t*)data)[written];
+
+            orig_length = length;
+            written = 0;
+        }
+    }
+
     if (start_data > 0) {
         try_extend_data(Vcb, fcb, start_data, length, data, Irp, &written, file_write, irp_offset, rollback);
 
@@ -3350,6 +4128,12 @@ NTSTATUS extend_file(fcb* fcb, file_ref* fileref, uint64_t end, bool prealloc, P
         extent* ext = NULL;
         LIST_ENTRY* le;
 
+        Status = load_fcb_extents_tail(fcb->Vcb, fcb, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_fcb_extents_tail returned %08lx\n", Status);
+            return Status;
+        }
+
         le = fcb->extents.Blink;
         while (le != &fcb->extents) {
             extent* ext2 = CONTAINING_RECORD(le, extent, list_entry);
@@ -3474,6 +4258,12 @@ NTSTATUS extend_file(fcb* fcb, file_ref* fileref, uint64_t end, bool prealloc, P
                     if (prealloc) {
                         // FIXME - try and extend previous extent first
 
+                        Status = load_fcb_extents(fcb->Vcb, fcb, oldalloc, newalloc - oldalloc, Irp);
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("load_fcb_extents returned %08lx\n", Status);
+                            return Status;
+                        }
+
                         Status = insert_prealloc_extent(fcb, oldalloc, newalloc - oldalloc, rollback);
 
                         if (!NT_SUCCESS(Status) && Status != STATUS_DISK_FULL) {
@@ -3501,6 +4291,12 @@ NTSTATUS extend_file(fcb* fcb, file_ref* fileref, uint64_t end, bool prealloc, P
                 newalloc = sector_align(end, fcb->Vcb->superblock.sector_size);
 
                 if (prealloc) {
+                    Status = load_fcb_extents(fcb->Vcb, fcb, 0, newalloc, Irp);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("load_fcb_extents returned %08lx\n", Status);
+                        return Status;
+                    }
+
                     Status = insert_prealloc_extent(fcb, 0, newalloc, rollback);
 
                     if (!NT_SUCCESS(Status) && Status != STATUS_DISK_FULL) {
@@ -3619,6 +4415,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
         newext->ignore = false;
         newext->inserted = true;
         InsertHeadList(&ext->list_entry, &newext->list_entry);
+        insert_extent_index(fcb, newext);
 
         add_insert_extent_rollback(rollback, fcb, newext);
 
@@ -3686,6 +4483,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
         newext1->ignore = false;
         newext1->inserted = true;
         InsertHeadList(&ext->list_entry, &newext1->list_entry);
+        insert_extent_index(fcb, newext1);
 
         add_insert_extent_rollback(rollback, fcb, newext1);
 
@@ -3777,6 +4575,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
         newext1->inserted = true;
         newext1->csum = NULL;
         InsertHeadList(&ext->list_entry, &newext1->list_entry);
+        insert_extent_index(fcb, newext1);
 
         add_insert_extent_rollback(rollback, fcb, newext1);
 
@@ -3882,6 +4681,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
         newext1->inserted = true;
         newext1->csum = NULL;
         InsertHeadList(&ext->list_entry, &newext1->list_entry);
+        insert_extent_index(fcb, newext1);
 
         add_insert_extent_rollback(rollback, fcb, newext1);
 
@@ -3939,9 +4739,24 @@ NTSTATUS do_write_file(fcb* fcb, uint64_t start, uint64_t end_data, void* data,
 #endif
     bool extents_changed = false;
 
+    Status = load_fcb_extents(fcb->Vcb, fcb, start, end_data - start, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("load_fcb_extents returned %08lx\n", Status);
+        return Status;
+    }
+
+    // anything still waiting for delayed allocation is about to be out of date
+    if (!IsListEmpty(&fcb->delalloc)) {
+        Status = delalloc_drop(fcb, start, end_data, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("delalloc_drop returned %08lx\n", Status);
+            return Status;
+        }
+    }
+
     last_cow_start = 0;
 
-    le = fcb->extents.Flink;
+    le = find_extent_index(fcb, start);
     while (le != &fcb->extents) {
         extent* ext = CONTAINING_RECORD(le, extent, list_entry);
 
@@ -4143,6 +4958,10 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
 
     TRACE("fcb->Header.Flags = %x\n", fcb->Header.Flags);
 
+    // hold up the writer if the flush thread is falling behind - but not if we're holding any locks
+    if (!paging_io && wait && write_irp && !(fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE) && !ExIsResourceAcquiredSharedLite(&Vcb->tree_lock))
+        throttle_write(Vcb, *length);
+
     if (!no_cache && !CcCanIWrite(FileObject, *length, wait, deferred_write))
         return STATUS_PENDING;
 
@@ -4199,6 +5018,14 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
             acquired_fcb_lock = true;
     }
 
+    if (!pagefile) {
+        Status = load_fcb_extents(Vcb, fcb, off64, *length, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_fcb_extents returned %08lx\n", Status);
+            goto end;
+        }
+    }
+
     newlength = fcb->ads ? fcb->adsdata.Length : fcb->inode_item.st_size;
 
     if (fcb->deleted)
@@ -4454,7 +5281,26 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
                 goto end;
             }
         } else {
-            if (write_irp && Irp->MdlAddress && no_buf) {
+            bool delayed = false;
+
+            // Paging writes get held on to until the next flush, so that we can allocate them together.
+            if (paging_io && !pagefile) {
+                try {
+                    Status = delalloc_add(fcb, start_data, end_data, data, Irp, &delayed, rollback);
+                } except (EXCEPTION_EXECUTE_HANDLER) {
+                    Status = GetExceptionCode();
+                }
+
+                if (!NT_SUCCESS(Status)) {
+                    ERR("delalloc_add returned %08lx\n", Status);
+                    if (!no_buf) ExFreePool(data);
+                    goto end;
+                }
+            }
+
+            if (delayed)
+                Status = STATUS_SUCCESS;
+            else if (write_irp && Irp->MdlAddress && no_buf) {
                 bool locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
 
                 if (!locked) {
@@ -4493,6 +5339,9 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
                 if (!no_buf) ExFreePool(data);
                 goto end;
             }
+
+            if (Vcb->options.autodefrag && !changed_length && !pagefile)
+                autodefrag_add(fcb, start_data, end_data);
         }
 
         if (!no_buf)
@@ -4566,6 +5415,9 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
     Status = STATUS_SUCCESS;
     Irp->IoStatus.Information = *length;
 
+    if (!pagefile)
+        throttle_dirty(Vcb, *length);
+
     if (filter != 0)
         queue_notification_fcb(fcb->ads ? fileref->parent : fileref, filter, fcb->ads ? FILE_ACTION_MODIFIED_STREAM : FILE_ACTION_MODIFIED,
                                fcb->ads && fileref->dc ? &fileref->dc->name : NULL);
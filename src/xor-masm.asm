@@ -169,6 +169,199 @@ stragglers3:
 do_xor_avx2_end:
     ret
 
+PUBLIC do_xor_multi_sse2
+
+; void do_xor_multi_sse2(uint8_t* dest, uint8_t** srcs, uint32_t num_srcs, uint32_t len);
+do_xor_multi_sse2:
+    ; rcx = dest
+    ; rdx = srcs
+    ; r8d = num_srcs
+    ; r9d = len
+    ; r10 = offset
+    ; r11 = source number
+    ; rax = source
+    ; xmm0-xmm3 = accumulators
+    ; xmm4 = tmp
+
+    xor r10, r10
+
+do_xor_multi_sse2_loop:
+    mov eax, r9d
+    sub eax, r10d
+    cmp eax, 64
+    jl do_xor_multi_stragglers
+
+    movdqu xmm0, XMMWORD PTR [rcx+r10]
+    movdqu xmm1, XMMWORD PTR [rcx+r10+16]
+    movdqu xmm2, XMMWORD PTR [rcx+r10+32]
+    movdqu xmm3, XMMWORD PTR [rcx+r10+48]
+
+    xor r11, r11
+
+do_xor_multi_sse2_src:
+    cmp r11d, r8d
+    jge do_xor_multi_sse2_store
+
+    mov rax, [rdx+r11*8]
+    add rax, r10
+
+    movdqu xmm4, XMMWORD PTR [rax]
+    pxor xmm0, xmm4
+    movdqu xmm4, XMMWORD PTR [rax+16]
+    pxor xmm1, xmm4
+    movdqu xmm4, XMMWORD PTR [rax+32]
+    pxor xmm2, xmm4
+    movdqu xmm4, XMMWORD PTR [rax+48]
+    pxor xmm3, xmm4
+
+    inc r11
+    jmp do_xor_multi_sse2_src
+
+do_xor_multi_sse2_store:
+    movdqu XMMWORD PTR [rcx+r10], xmm0
+    movdqu XMMWORD PTR [rcx+r10+16], xmm1
+    movdqu XMMWORD PTR [rcx+r10+32], xmm2
+    movdqu XMMWORD PTR [rcx+r10+48], xmm3
+
+    add r10, 64
+    jmp do_xor_multi_sse2_loop
+
+do_xor_multi_stragglers:
+    cmp r10d, r9d
+    jge do_xor_multi_end
+
+    xor r11, r11
+
+do_xor_multi_stragglers_src:
+    cmp r11d, r8d
+    jge do_xor_multi_stragglers_next
+
+    mov rax, [rdx+r11*8]
+    mov al, [rax+r10]
+    xor [rcx+r10], al
+
+    inc r11
+    jmp do_xor_multi_stragglers_src
+
+do_xor_multi_stragglers_next:
+    inc r10
+    jmp do_xor_multi_stragglers
+
+do_xor_multi_end:
+    ret
+
+PUBLIC do_xor_multi_avx2
+
+; void do_xor_multi_avx2(uint8_t* dest, uint8_t** srcs, uint32_t num_srcs, uint32_t len);
+do_xor_multi_avx2:
+    ; rcx = dest
+    ; rdx = srcs
+    ; r8d = num_srcs
+    ; r9d = len
+    ; r10 = offset
+    ; r11 = source number
+    ; rax = source
+    ; ymm0-ymm3 = accumulators
+
+    xor r10, r10
+
+do_xor_multi_avx2_loop:
+    mov eax, r9d
+    sub eax, r10d
+    cmp eax, 128
+    jl do_xor_multi_avx2_end
+
+    vmovdqu ymm0, YMMWORD PTR [rcx+r10]
+    vmovdqu ymm1, YMMWORD PTR [rcx+r10+32]
+    vmovdqu ymm2, YMMWORD PTR [rcx+r10+64]
+    vmovdqu ymm3, YMMWORD PTR [rcx+r10+96]
+
+    xor r11, r11
+
+do_xor_multi_avx2_src:
+    cmp r11d, r8d
+    jge do_xor_multi_avx2_store
+
+    mov rax, [rdx+r11*8]
+    add rax, r10
+
+    vpxor ymm0, ymm0, YMMWORD PTR [rax]
+    vpxor ymm1, ymm1, YMMWORD PTR [rax+32]
+    vpxor ymm2, ymm2, YMMWORD PTR [rax+64]
+    vpxor ymm3, ymm3, YMMWORD PTR [rax+96]
+
+    inc r11
+    jmp do_xor_multi_avx2_src
+
+do_xor_multi_avx2_store:
+    vmovdqu YMMWORD PTR [rcx+r10], ymm0
+    vmovdqu YMMWORD PTR [rcx+r10+32], ymm1
+    vmovdqu YMMWORD PTR [rcx+r10+64], ymm2
+    vmovdqu YMMWORD PTR [rcx+r10+96], ymm3
+
+    add r10, 128
+    jmp do_xor_multi_avx2_loop
+
+do_xor_multi_avx2_end:
+    vzeroupper
+    jmp do_xor_multi_stragglers
+
+PUBLIC do_xor_multi_avx512
+
+; void do_xor_multi_avx512(uint8_t* dest, uint8_t** srcs, uint32_t num_srcs, uint32_t len);
+do_xor_multi_avx512:
+    ; rcx = dest
+    ; rdx = srcs
+    ; r8d = num_srcs
+    ; r9d = len
+    ; r10 = offset
+    ; r11 = source number
+    ; rax = source
+    ; zmm0-zmm3 = accumulators
+
+    xor r10, r10
+
+do_xor_multi_avx512_loop:
+    mov eax, r9d
+    sub eax, r10d
+    cmp eax, 256
+    jl do_xor_multi_avx512_end
+
+    vmovdqu64 zmm0, ZMMWORD PTR [rcx+r10]
+    vmovdqu64 zmm1, ZMMWORD PTR [rcx+r10+64]
+    vmovdqu64 zmm2, ZMMWORD PTR [rcx+r10+128]
+    vmovdqu64 zmm3, ZMMWORD PTR [rcx+r10+192]
+
+    xor r11, r11
+
+do_xor_multi_avx512_src:
+    cmp r11d, r8d
+    jge do_xor_multi_avx512_store
+
+    mov rax, [rdx+r11*8]
+    add rax, r10
+
+    vpxorq zmm0, zmm0, ZMMWORD PTR [rax]
+    vpxorq zmm1, zmm1, ZMMWORD PTR [rax+64]
+    vpxorq zmm2, zmm2, ZMMWORD PTR [rax+128]
+    vpxorq zmm3, zmm3, ZMMWORD PTR [rax+192]
+
+    inc r11
+    jmp do_xor_multi_avx512_src
+
+do_xor_multi_avx512_store:
+    vmovdqu64 ZMMWORD PTR [rcx+r10], zmm0
+    vmovdqu64 ZMMWORD PTR [rcx+r10+64], zmm1
+    vmovdqu64 ZMMWORD PTR [rcx+r10+128], zmm2
+    vmovdqu64 ZMMWORD PTR [rcx+r10+192], zmm3
+
+    add r10, 256
+    jmp do_xor_multi_avx512_loop
+
+do_xor_multi_avx512_end:
+    vzeroupper
+    jmp do_xor_multi_stragglers
+
 ELSE
 
 PUBLIC do_xor_sse2@12
@@ -343,6 +536,231 @@ do_xor_avx2_end:
 
     ret 12
 
+PUBLIC do_xor_multi_sse2@16
+
+; void __stdcall do_xor_multi_sse2(uint8_t* dest, uint8_t** srcs, uint32_t num_srcs, uint32_t len);
+do_xor_multi_sse2@16:
+    ; edi = dest
+    ; esi = srcs
+    ; edx = offset
+    ; ecx = source number
+    ; eax = source
+    ; ebx = tmp
+    ; xmm0-xmm3 = accumulators
+    ; xmm4 = tmp
+
+    push ebp
+    mov ebp, esp
+
+    push esi
+    push edi
+    push ebx
+
+    mov edi, [ebp+8]
+    mov esi, [ebp+12]
+
+    xor edx, edx
+
+do_xor_multi_sse2_loop:
+    mov eax, DWORD PTR [ebp+20]
+    sub eax, edx
+    cmp eax, 64
+    jl do_xor_multi_stragglers
+
+    movdqu xmm0, XMMWORD PTR [edi+edx]
+    movdqu xmm1, XMMWORD PTR [edi+edx+16]
+    movdqu xmm2, XMMWORD PTR [edi+edx+32]
+    movdqu xmm3, XMMWORD PTR [edi+edx+48]
+
+    xor ecx, ecx
+
+do_xor_multi_sse2_src:
+    cmp ecx, DWORD PTR [ebp+16]
+    jge do_xor_multi_sse2_store
+
+    mov eax, [esi+ecx*4]
+    add eax, edx
+
+    movdqu xmm4, XMMWORD PTR [eax]
+    pxor xmm0, xmm4
+    movdqu xmm4, XMMWORD PTR [eax+16]
+    pxor xmm1, xmm4
+    movdqu xmm4, XMMWORD PTR [eax+32]
+    pxor xmm2, xmm4
+    movdqu xmm4, XMMWORD PTR [eax+48]
+    pxor xmm3, xmm4
+
+    inc ecx
+    jmp do_xor_multi_sse2_src
+
+do_xor_multi_sse2_store:
+    movdqu XMMWORD PTR [edi+edx], xmm0
+    movdqu XMMWORD PTR [edi+edx+16], xmm1
+    movdqu XMMWORD PTR [edi+edx+32], xmm2
+    movdqu XMMWORD PTR [edi+edx+48], xmm3
+
+    add edx, 64
+    jmp do_xor_multi_sse2_loop
+
+do_xor_multi_stragglers:
+    cmp edx, DWORD PTR [ebp+20]
+    jge do_xor_multi_end
+
+    xor ecx, ecx
+
+do_xor_multi_stragglers_src:
+    cmp ecx, DWORD PTR [ebp+16]
+    jge do_xor_multi_stragglers_next
+
+    mov eax, [esi+ecx*4]
+    mov bl, [eax+edx]
+    xor [edi+edx], bl
+
+    inc ecx
+    jmp do_xor_multi_stragglers_src
+
+do_xor_multi_stragglers_next:
+    inc edx
+    jmp do_xor_multi_stragglers
+
+do_xor_multi_end:
+    pop ebx
+    pop edi
+    pop esi
+    pop ebp
+
+    ret 16
+
+PUBLIC do_xor_multi_avx2@16
+
+; void __stdcall do_xor_multi_avx2(uint8_t* dest, uint8_t** srcs, uint32_t num_srcs, uint32_t len);
+do_xor_multi_avx2@16:
+    ; edi = dest
+    ; esi = srcs
+    ; edx = offset
+    ; ecx = source number
+    ; eax = source
+    ; ebx = tmp
+    ; ymm0-ymm3 = accumulators
+
+    push ebp
+    mov ebp, esp
+
+    push esi
+    push edi
+    push ebx
+
+    mov edi, [ebp+8]
+    mov esi, [ebp+12]
+
+    xor edx, edx
+
+do_xor_multi_avx2_loop:
+    mov eax, DWORD PTR [ebp+20]
+    sub eax, edx
+    cmp eax, 128
+    jl do_xor_multi_avx2_end
+
+    vmovdqu ymm0, YMMWORD PTR [edi+edx]
+    vmovdqu ymm1, YMMWORD PTR [edi+edx+32]
+    vmovdqu ymm2, YMMWORD PTR [edi+edx+64]
+    vmovdqu ymm3, YMMWORD PTR [edi+edx+96]
+
+    xor ecx, ecx
+
+do_xor_multi_avx2_src:
+    cmp ecx, DWORD PTR [ebp+16]
+    jge do_xor_multi_avx2_store
+
+    mov eax, [esi+ecx*4]
+    add eax, edx
+
+    vpxor ymm0, ymm0, YMMWORD PTR [eax]
+    vpxor ymm1, ymm1, YMMWORD PTR [eax+32]
+    vpxor ymm2, ymm2, YMMWORD PTR [eax+64]
+    vpxor ymm3, ymm3, YMMWORD PTR [eax+96]
+
+    inc ecx
+    jmp do_xor_multi_avx2_src
+
+do_xor_multi_avx2_store:
+    vmovdqu YMMWORD PTR [edi+edx], ymm0
+    vmovdqu YMMWORD PTR [edi+edx+32], ymm1
+    vmovdqu YMMWORD PTR [edi+edx+64], ymm2
+    vmovdqu YMMWORD PTR [edi+edx+96], ymm3
+
+    add edx, 128
+    jmp do_xor_multi_avx2_loop
+
+do_xor_multi_avx2_end:
+    vzeroupper
+    jmp do_xor_multi_stragglers
+
+PUBLIC do_xor_multi_avx512@16
+
+; void __stdcall do_xor_multi_avx512(uint8_t* dest, uint8_t** srcs, uint32_t num_srcs, uint32_t len);
+do_xor_multi_avx512@16:
+    ; edi = dest
+    ; esi = srcs
+    ; edx = offset
+    ; ecx = source number
+    ; eax = source
+    ; ebx = tmp
+    ; zmm0-zmm3 = accumulators
+
+    push ebp
+    mov ebp, esp
+
+    push esi
+    push edi
+    push ebx
+
+    mov edi, [ebp+8]
+    mov esi, [ebp+12]
+
+    xor edx, edx
+
+do_xor_multi_avx512_loop:
+    mov eax, DWORD PTR [ebp+20]
+    sub eax, edx
+    cmp eax, 256
+    jl do_xor_multi_avx512_end
+
+    vmovdqu64 zmm0, ZMMWORD PTR [edi+edx]
+    vmovdqu64 zmm1, ZMMWORD PTR [edi+edx+64]
+    vmovdqu64 zmm2, ZMMWORD PTR [edi+edx+128]
+    vmovdqu64 zmm3, ZMMWORD PTR [edi+edx+192]
+
+    xor ecx, ecx
+
+do_xor_multi_avx512_src:
+    cmp ecx, DWORD PTR [ebp+16]
+    jge do_xor_multi_avx512_store
+
+    mov eax, [esi+ecx*4]
+    add eax, edx
+
+    vpxorq zmm0, zmm0, ZMMWORD PTR [eax]
+    vpxorq zmm1, zmm1, ZMMWORD PTR [eax+64]
+    vpxorq zmm2, zmm2, ZMMWORD PTR [eax+128]
+    vpxorq zmm3, zmm3, ZMMWORD PTR [eax+192]
+
+    inc ecx
+    jmp do_xor_multi_avx512_src
+
+do_xor_multi_avx512_store:
+    vmovdqu64 ZMMWORD PTR [edi+edx], zmm0
+    vmovdqu64 ZMMWORD PTR [edi+edx+64], zmm1
+    vmovdqu64 ZMMWORD PTR [edi+edx+128], zmm2
+    vmovdqu64 ZMMWORD PTR [edi+edx+192], zmm3
+
+    add edx, 256
+    jmp do_xor_multi_avx512_loop
+
+do_xor_multi_avx512_end:
+    vzeroupper
+    jmp do_xor_multi_stragglers
+
 ENDIF
 
 _TEXT  ENDS